@@ -0,0 +1,410 @@
+#include "server.h"  // auth.h 以及读写密码哈希的 db_get_password / db_set_password
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/random.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/sha.h>
+
+// 凭据缓存和会话凭据表中的一项
+typedef struct auth_entry {
+    unsigned char key[SESSION_TOKEN_SIZE];      // 会话凭据；凭据缓存中不使用
+    char username[128];
+    unsigned char digest[SHA256_DIGEST_LENGTH]; // 密码摘要；会话凭据表中不使用
+    long long expires;
+    struct auth_entry *next;
+} auth_entry;
+
+typedef struct {
+    pthread_mutex_t lock;
+    auth_entry *buckets[AUTH_SHARD_BUCKETS];
+    int count;
+} auth_shard;
+
+typedef struct {
+    auth_shard shards[AUTH_SHARDS];
+} auth_table;
+
+static auth_table creds;    // 按用户名
+static auth_table tokens;   // 按会话凭据
+static unsigned char secret[32];  // 密码摘要的密钥，每次启动随机生成
+
+static long long auth_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+static void table_init(auth_table *t) {
+    for (int i = 0; i < AUTH_SHARDS; i++) {
+        pthread_mutex_init(&t->shards[i].lock, NULL);
+    }
+}
+
+int auth_init(void) {
+    if (getrandom(secret, sizeof(secret), 0) != sizeof(secret)) {
+        perror("getrandom");
+        return -1;
+    }
+    table_init(&creds);
+    table_init(&tokens);
+    return 0;
+}
+
+// 按哈希值选出分片和桶，返回时持有分片的锁
+static auth_entry **table_lock(auth_table *t, uint64_t h, auth_shard **shard) {
+    auth_shard *sh = &t->shards[h % AUTH_SHARDS];
+    pthread_mutex_lock(&sh->lock);
+    *shard = sh;
+    return &sh->buckets[(h / AUTH_SHARDS) % AUTH_SHARD_BUCKETS];
+}
+
+static void shard_remove(auth_shard *sh, auth_entry **pp) {
+    auth_entry *e = *pp;
+    *pp = e->next;
+    free(e);
+    sh->count--;
+}
+
+// 分片已满时先清理过期的条目，仍然满时去掉最早过期的一条；调用方持有分片的锁
+static void shard_make_room(auth_shard *sh, long long now) {
+    if (sh->count < AUTH_SHARD_MAX) return;
+    auth_entry **oldest = NULL;
+    for (int i = 0; i < AUTH_SHARD_BUCKETS; i++) {
+        auth_entry **pp = &sh->buckets[i];
+        while (*pp) {
+            if ((*pp)->expires <= now) {
+                shard_remove(sh, pp);
+                continue;
+            }
+            if (!oldest || (*pp)->expires < (*oldest)->expires) oldest = pp;
+            pp = &(*pp)->next;
+        }
+    }
+    if (sh->count >= AUTH_SHARD_MAX && oldest) shard_remove(sh, oldest);
+}
+
+static uint64_t name_hash(const char *name) {
+    uint64_t h = 1469598103934665603ULL;  // FNV-1a
+    for (; *name; name++) h = (h ^ (unsigned char)*name) * 1099511628211ULL;
+    return h;
+}
+
+// 会话凭据本身是随机数，直接取前 8 字节作为哈希值
+static uint64_t token_hash(const unsigned char *token) {
+    uint64_t h;
+    memcpy(&h, token, sizeof(h));
+    return h;
+}
+
+// HMAC-SHA256(secret, 用户名 \0 密码)：进程内存中也不保留可以直接比较的密码
+static void password_digest(const char *username, const char *password, unsigned char *out) {
+    unsigned char msg[128 + 1024];
+    size_t ulen = strnlen(username, 127), plen = strnlen(password, sizeof(msg) - 128);
+    memcpy(msg, username, ulen);
+    msg[ulen] = '\0';
+    memcpy(msg + ulen + 1, password, plen);
+    HMAC(EVP_sha256(), secret, sizeof(secret), msg, ulen + 1 + plen, out, NULL);
+    OPENSSL_cleanse(msg, sizeof(msg));
+}
+
+int auth_cache_check(const char *username, const char *password) {
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    password_digest(username, password, digest);
+
+    long long now = auth_now();
+    auth_shard *sh;
+    auth_entry **pp = table_lock(&creds, name_hash(username), &sh);
+    int hit = 0;
+    while (*pp) {
+        auth_entry *e = *pp;
+        if (strcmp(e->username, username) == 0) {
+            if (e->expires <= now) {
+                shard_remove(sh, pp);
+            } else {
+                hit = CRYPTO_memcmp(e->digest, digest, sizeof(digest)) == 0;
+            }
+            break;
+        }
+        pp = &e->next;
+    }
+    pthread_mutex_unlock(&sh->lock);
+    return hit;
+}
+
+void auth_cache_put(const char *username, const char *password) {
+    if (strlen(username) >= sizeof(((auth_entry *)0)->username)) return;
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    password_digest(username, password, digest);
+
+    long long now = auth_now();
+    auth_shard *sh;
+    auth_entry **head = table_lock(&creds, name_hash(username), &sh);
+    auth_entry *e;
+    for (e = *head; e; e = e->next) {
+        if (strcmp(e->username, username) == 0) break;
+    }
+    if (!e) {
+        shard_make_room(sh, now);
+        if ((e = calloc(1, sizeof(*e))) != NULL) {
+            strcpy(e->username, username);
+            e->next = *head;
+            *head = e;
+            sh->count++;
+        }
+    }
+    if (e) {
+        memcpy(e->digest, digest, sizeof(digest));
+        e->expires = now + AUTH_CACHE_TTL;
+    }
+    pthread_mutex_unlock(&sh->lock);
+}
+
+int auth_token_issue(const char *username, unsigned char token[SESSION_TOKEN_SIZE]) {
+    if (strlen(username) >= sizeof(((auth_entry *)0)->username)) return -1;
+    auth_entry *e = calloc(1, sizeof(*e));
+    if (!e) return -1;
+    if (getrandom(e->key, SESSION_TOKEN_SIZE, 0) != SESSION_TOKEN_SIZE) {
+        free(e);
+        return -1;
+    }
+    strcpy(e->username, username);
+
+    long long now = auth_now();
+    e->expires = now + AUTH_TOKEN_TTL;
+    auth_shard *sh;
+    auth_entry **head = table_lock(&tokens, token_hash(e->key), &sh);
+    shard_make_room(sh, now);
+    e->next = *head;
+    *head = e;
+    sh->count++;
+    pthread_mutex_unlock(&sh->lock);
+
+    memcpy(token, e->key, SESSION_TOKEN_SIZE);
+    return 0;
+}
+
+int auth_token_take(const unsigned char token[SESSION_TOKEN_SIZE], char *username, size_t size) {
+    long long now = auth_now();
+    auth_shard *sh;
+    auth_entry **pp = table_lock(&tokens, token_hash(token), &sh);
+    int rc = -1;
+    while (*pp) {
+        auth_entry *e = *pp;
+        if (CRYPTO_memcmp(e->key, token, SESSION_TOKEN_SIZE) == 0) {
+            if (e->expires > now) {
+                snprintf(username, size, "%s", e->username);
+                rc = 0;
+            }
+            shard_remove(sh, pp);
+            break;
+        }
+        pp = &e->next;
+    }
+    pthread_mutex_unlock(&sh->lock);
+    return rc;
+}
+
+void auth_token_revoke(const unsigned char token[SESSION_TOKEN_SIZE]) {
+    auth_shard *sh;
+    auth_entry **pp = table_lock(&tokens, token_hash(token), &sh);
+    for (; *pp; pp = &(*pp)->next) {
+        if (CRYPTO_memcmp((*pp)->key, token, SESSION_TOKEN_SIZE) == 0) {
+            shard_remove(sh, pp);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&sh->lock);
+}
+
+// ---------------- 密码哈希 ----------------
+
+static void hex_encode(const unsigned char *in, size_t len, char *out) {
+    static const char digits[] = "0123456789abcdef";
+    for (size_t i = 0; i < len; i++) {
+        out[2 * i] = digits[in[i] >> 4];
+        out[2 * i + 1] = digits[in[i] & 0xf];
+    }
+    out[2 * len] = '\0';
+}
+
+static int hex_decode(const char *in, unsigned char *out, size_t len) {
+    if (strlen(in) != 2 * len) return -1;
+    for (size_t i = 0; i < len; i++) {
+        unsigned int v;
+        if (sscanf(in + 2 * i, "%2x", &v) != 1) return -1;
+        out[i] = (unsigned char)v;
+    }
+    return 0;
+}
+
+static int scrypt_derive(const char *password, const unsigned char *salt, int log_n, int r, int p,
+                         unsigned char *key, size_t keylen) {
+    return EVP_PBE_scrypt(password, strlen(password), salt, AUTH_SALT_SIZE, 1ULL << log_n, r, p,
+                          AUTH_SCRYPT_MAXMEM, key, keylen) == 1 ? 0 : -1;
+}
+
+// 生成 "$scrypt$ln=14,r=8,p=1$<salt>$<key>" 形式的哈希字符串，参数随哈希一起保存，以后可以调整
+static int password_hash(const char *password, char *out, size_t size) {
+    unsigned char salt[AUTH_SALT_SIZE], key[AUTH_KEY_SIZE];
+    char salt_hex[2 * AUTH_SALT_SIZE + 1], key_hex[2 * AUTH_KEY_SIZE + 1];
+    if (getrandom(salt, sizeof(salt), 0) != sizeof(salt)) return -1;
+    if (scrypt_derive(password, salt, AUTH_SCRYPT_LOG_N, AUTH_SCRYPT_R, AUTH_SCRYPT_P, key, sizeof(key)) < 0) {
+        return -1;
+    }
+    hex_encode(salt, sizeof(salt), salt_hex);
+    hex_encode(key, sizeof(key), key_hex);
+    OPENSSL_cleanse(key, sizeof(key));
+    int n = snprintf(out, size, "$scrypt$ln=%d,r=%d,p=%d$%s$%s", AUTH_SCRYPT_LOG_N, AUTH_SCRYPT_R, AUTH_SCRYPT_P,
+                     salt_hex, key_hex);
+    return n > 0 && (size_t)n < size ? 0 : -1;
+}
+
+// 按保存的哈希验证密码，一致返回 1；stored 不是 scrypt 哈希时返回 -1
+static int password_verify(const char *stored, const char *password) {
+    int log_n, r, p;
+    char salt_hex[2 * AUTH_SALT_SIZE + 1], key_hex[2 * AUTH_KEY_SIZE + 1];
+    unsigned char salt[AUTH_SALT_SIZE], key[AUTH_KEY_SIZE], expect[AUTH_KEY_SIZE];
+    if (sscanf(stored, "$scrypt$ln=%d,r=%d,p=%d$%32[0-9a-f]$%64[0-9a-f]", &log_n, &r, &p, salt_hex, key_hex) != 5 ||
+        log_n < 1 || log_n > 20 || r < 1 || r > 32 || p < 1 || p > 16 ||
+        hex_decode(salt_hex, salt, sizeof(salt)) < 0 || hex_decode(key_hex, expect, sizeof(expect)) < 0) {
+        return -1;
+    }
+    if (scrypt_derive(password, salt, log_n, r, p, key, sizeof(key)) < 0) return 0;
+    int ok = CRYPTO_memcmp(key, expect, sizeof(key)) == 0;
+    OPENSSL_cleanse(key, sizeof(key));
+    return ok;
+}
+
+// 登录：用户不存在时也计算一次哈希，响应时间不暴露用户名是否存在；
+// 旧版本保存的明文密码验证通过后改存为哈希
+static int auth_login(const char *username, const char *password) {
+    char stored[AUTH_HASH_MAX];
+    int found = db_get_password(username, stored, sizeof(stored));
+    if (found <= 0) {
+        password_hash(password, stored, sizeof(stored));
+        return 0;
+    }
+
+    int ok = password_verify(stored, password);
+    if (ok < 0) {
+        ok = strlen(stored) == strlen(password) && CRYPTO_memcmp(stored, password, strlen(stored)) == 0;
+        if (ok && password_hash(password, stored, sizeof(stored)) == 0 && db_set_password(username, stored) == 0) {
+            log_info("Upgraded stored password of %s to scrypt", username);
+        }
+    }
+    OPENSSL_cleanse(stored, sizeof(stored));
+    if (ok) auth_cache_put(username, password);
+    return ok;
+}
+
+static int auth_register(const char *username, const char *password) {
+    char hash[AUTH_HASH_MAX];
+    if (password_hash(password, hash, sizeof(hash)) < 0) return 0;
+    return db_add_user(username, hash) == 0;
+}
+
+// ---------------- 认证线程 ----------------
+
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_ready = PTHREAD_COND_INITIALIZER;
+static auth_job *queue_head, *queue_tail;
+static int queue_len;
+static int pool_stopping;
+static pthread_t *pool_tids;
+static int pool_count;
+static void (*pool_done)(auth_job *job);
+
+auth_job *auth_job_new(int kind, const char *username, const char *password) {
+    auth_job *job = calloc(1, sizeof(*job));
+    if (!job) return NULL;
+    job->kind = kind;
+    snprintf(job->username, sizeof(job->username), "%s", username);
+    snprintf(job->password, sizeof(job->password), "%s", password);
+    return job;
+}
+
+void auth_job_free(auth_job *job) {
+    if (!job) return;
+    OPENSSL_cleanse(job->password, sizeof(job->password));
+    free(job);
+}
+
+int auth_submit(auth_job *job) {
+    pthread_mutex_lock(&queue_lock);
+    if (pool_stopping || pool_count == 0 || queue_len >= AUTH_QUEUE_MAX) {
+        pthread_mutex_unlock(&queue_lock);
+        return -1;
+    }
+    job->next = NULL;
+    if (queue_tail) queue_tail->next = job;
+    else queue_head = job;
+    queue_tail = job;
+    queue_len++;
+    pthread_cond_signal(&queue_ready);
+    pthread_mutex_unlock(&queue_lock);
+    return 0;
+}
+
+static void *auth_thread_main(void *arg) {
+    (void)arg;
+    for (;;) {
+        pthread_mutex_lock(&queue_lock);
+        while (!queue_head && !pool_stopping) {
+            pthread_cond_wait(&queue_ready, &queue_lock);
+        }
+        auth_job *job = queue_head;
+        if (!job) {
+            pthread_mutex_unlock(&queue_lock);
+            break;
+        }
+        queue_head = job->next;
+        if (!queue_head) queue_tail = NULL;
+        queue_len--;
+        int stopping = pool_stopping;
+        pthread_mutex_unlock(&queue_lock);
+
+        if (!stopping) {
+            job->ok = job->kind == AUTH_JOB_LOGIN ? auth_login(job->username, job->password)
+                                                  : auth_register(job->username, job->password);
+        }
+        OPENSSL_cleanse(job->password, sizeof(job->password));
+        job->next = NULL;
+        pool_done(job);
+    }
+    return NULL;
+}
+
+int auth_pool_start(int nthreads, void (*done)(auth_job *job)) {
+    pool_tids = calloc(nthreads, sizeof(pthread_t));
+    if (!pool_tids) return -1;
+    pool_done = done;
+    for (int i = 0; i < nthreads; i++) {
+        if (pthread_create(&pool_tids[i], NULL, auth_thread_main, NULL) != 0) {
+            perror("pthread_create auth");
+            return -1;
+        }
+        pool_count++;
+    }
+    log_info("Started %d authentication threads", pool_count);
+    return 0;
+}
+
+void auth_pool_stop(void) {
+    pthread_mutex_lock(&queue_lock);
+    pool_stopping = 1;
+    pthread_cond_broadcast(&queue_ready);
+    pthread_mutex_unlock(&queue_lock);
+
+    for (int i = 0; i < pool_count; i++) {
+        pthread_join(pool_tids[i], NULL);
+    }
+    free(pool_tids);
+    pool_tids = NULL;
+    pool_count = 0;
+}
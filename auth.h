@@ -0,0 +1,69 @@
+#ifndef AUTH_H
+#define AUTH_H
+
+// 登录状态的内存缓存，按哈希分片，每片一把锁，所有工作线程共用：
+// - 凭据缓存：最近登录成功的用户名和密码摘要（带进程随机密钥的 SHA-256，不保存明文），
+//   再次登录时命中缓存就不查询数据库；
+// - 会话凭据：登录成功后发给客户端的随机凭据，连接断开后客户端在新连接上用 OP_SESSION 出示，
+//   直接恢复登录，不需要再输入用户名和密码。
+// 服务器重启后两者都失效，客户端回到正常的登录流程。
+//
+// 数据库中的密码保存为 scrypt 哈希。计算哈希需要几十毫秒和十几 MB 内存，放在专门的认证线程中：
+// 工作线程提交任务后会话进入等待状态，继续服务其他连接；认证线程完成后通过回调把任务交回
+// 会话所在的工作线程。认证线程数和排队的任务数都有上限，大量同时登录不会占满工作线程。
+
+#include <stddef.h>
+#include "proto.h"
+
+#define AUTH_SHARDS 64                  // 哈希表分片数
+#define AUTH_SHARD_BUCKETS 64           // 每片的桶数
+#define AUTH_SHARD_MAX 1024             // 每片最多的条目数
+#define AUTH_CACHE_TTL 600              // 凭据缓存的有效期（秒）
+#define AUTH_TOKEN_TTL (12 * 3600)      // 会话凭据的有效期（秒），每次恢复后重新计算
+
+#define AUTH_THREADS_DEFAULT 2          // 默认的认证线程数，即同时计算的哈希数
+#define AUTH_QUEUE_MAX 256              // 排队等待认证线程的任务数上限，超过时拒绝登录
+#define AUTH_INPUT_MAX 1024             // 用户名和密码的最大长度（与 BUF_SIZE 一致）
+#define AUTH_HASH_MAX 160               // 保存到数据库的哈希字符串的长度上限
+#define AUTH_SCRYPT_LOG_N 14            // scrypt 参数：N = 2^14，r = 8，p = 1，约 16MB 内存
+#define AUTH_SCRYPT_R 8
+#define AUTH_SCRYPT_P 1
+#define AUTH_SCRYPT_MAXMEM (64 * 1024 * 1024)  // 验证保存的哈希时允许使用的内存上限
+#define AUTH_SALT_SIZE 16
+#define AUTH_KEY_SIZE 32
+
+enum { AUTH_JOB_LOGIN, AUTH_JOB_REGISTER };
+
+// 认证任务：登录时验证密码，注册时计算哈希并添加用户
+typedef struct auth_job {
+    int kind;
+    char username[AUTH_INPUT_MAX];
+    char password[AUTH_INPUT_MAX];  // 认证线程用完后清零
+    int ok;                         // 验证通过或注册成功
+    void *owner;                    // 提交任务的会话，会话先关闭时置为 NULL
+    void *worker;                   // 会话所在的工作线程，完成回调据此交回任务
+    struct auth_job *next;
+} auth_job;
+
+int auth_init(void);
+
+// 缓存中有该用户且密码一致时返回 1，没有记录或不一致时返回 0，由调用方查询数据库
+int auth_cache_check(const char *username, const char *password);
+void auth_cache_put(const char *username, const char *password);
+
+// 为登录成功的用户生成会话凭据，成功返回 0
+int auth_token_issue(const char *username, unsigned char token[SESSION_TOKEN_SIZE]);
+// 凭据有效时写入用户名、删除凭据并返回 0：检查和删除在同一把锁下完成，一个凭据只能使用一次
+int auth_token_take(const unsigned char token[SESSION_TOKEN_SIZE], char *username, size_t size);
+void auth_token_revoke(const unsigned char token[SESSION_TOKEN_SIZE]);
+
+// 启动 nthreads 个认证线程；每个任务完成后在认证线程上调用 done
+int auth_pool_start(int nthreads, void (*done)(auth_job *job));
+// 停止认证线程：尚未开始的任务不再计算，以失败结果交给 done
+void auth_pool_stop(void);
+auth_job *auth_job_new(int kind, const char *username, const char *password);
+void auth_job_free(auth_job *job);
+// 队列已满或认证线程已停止时返回 -1，任务仍归调用方所有
+int auth_submit(auth_job *job);
+
+#endif
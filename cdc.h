@@ -0,0 +1,58 @@
+#ifndef CDC_H
+#define CDC_H
+
+// FastCDC 风格的内容定义分块：用 gear 滚动哈希在内容中寻找切点，
+// 文件中插入或删除一段数据只会改变附近的块，其余块的哈希不变，可以在块存储中去重。
+// 切点之前的 CDC_MIN_SIZE 字节直接跳过；平均长度之前用更严格的掩码，之后用更宽松的掩码，
+// 使块长度集中在 CDC_AVG_SIZE 附近。
+
+#include <stdint.h>
+#include <stddef.h>
+#include "proto.h"
+
+#define CDC_MIN_SIZE (16 * 1024)
+#define CDC_AVG_SIZE (64 * 1024)
+
+static uint64_t cdc_gear[256];
+static uint64_t cdc_mask_s;  // 18 位：平均长度之前
+static uint64_t cdc_mask_l;  // 14 位：平均长度之后
+
+// 在哈希的高位中均匀取 bits 位作为掩码
+static inline uint64_t cdc_make_mask(int bits) {
+    uint64_t mask = 0;
+    for (int i = 0; i < bits; i++) mask |= 1ULL << (63 - i * 3);
+    return mask;
+}
+
+// gear 表由固定种子生成，所有客户端切出的块一致
+static inline void cdc_init(void) {
+    uint64_t x = 0x5048cdc0ULL;
+    for (int i = 0; i < 256; i++) {
+        uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        cdc_gear[i] = z ^ (z >> 31);
+    }
+    cdc_mask_s = cdc_make_mask(18);
+    cdc_mask_l = cdc_make_mask(14);
+}
+
+// 返回从 data 开始的第一个块的长度，调用前需要 cdc_init
+static inline size_t cdc_cut(const unsigned char *data, size_t len) {
+    if (len <= CDC_MIN_SIZE) return len;
+    if (len > CDC_MAX_SIZE) len = CDC_MAX_SIZE;
+    size_t normal = len < CDC_AVG_SIZE ? len : CDC_AVG_SIZE;
+    uint64_t h = 0;
+    size_t i = CDC_MIN_SIZE;
+    for (; i < normal; i++) {
+        h = (h << 1) + cdc_gear[data[i]];
+        if (!(h & cdc_mask_s)) return i + 1;
+    }
+    for (; i < len; i++) {
+        h = (h << 1) + cdc_gear[data[i]];
+        if (!(h & cdc_mask_l)) return i + 1;
+    }
+    return len;
+}
+
+#endif
@@ -1,30 +1,596 @@
 #include "client.h"
-#include <sys/select.h>
+#include <poll.h>
+#include <sys/sendfile.h>
+#include <openssl/sha.h>
 
-int has_input() {
-    fd_set fds;
-    struct timeval tv = {0, 0};  // 非阻塞检查
-    FD_ZERO(&fds);
-    FD_SET(STDIN_FILENO, &fds);
-    return select(STDIN_FILENO + 1, &fds, NULL, NULL, &tv) == 1;
-}
-pthread_mutex_t stdin_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t next_request_id = 1;   // 每个请求帧分配一个递增的 id
+static int pending_upload = -1;        // 服务器请求上传的类型（UPLOAD_KIND_*），-1 表示没有
+
+// 接收缓冲区：最大的帧是 OP_ZDATA
+static unsigned char recv_buf[PROTO_HEADER_SIZE + CODEC_FRAME_MAX];
+static size_t recv_len = 0;
+
+// 下载状态：内容先写入 <文件>.part，收完后改名；每 CHECKPOINT_INTERVAL 字节同步一次，
+// 已经落盘的偏移记录在检查点索引中，下次连接时告诉服务器从这里继续
+static char download_root[PATH_MAX] = ".";  // 下载内容保存到的本地目录
+static char download_path[PATH_MAX];         // 正在接收的文件
+static int download_fd = -1;
+static uint64_t download_remaining = 0;      // 当前 OP_FILE 帧中还未收到的文件内容
+static uint64_t download_total = 0;          // 文件的完整大小
+static uint64_t download_written = 0;        // 已经写入 .part 的末尾偏移
+static uint64_t download_durable = 0;        // 最近一次检查点的偏移
+static int download_compressed = 0;          // 当前文件的内容以 OP_ZDATA 帧到达
+
+// 压缩传输：-z 指定提出的编码，服务器在 OP_CODECS 中回复选中的编码
+static int codec_request = -1;               // -1 表示提出所有支持的编码
+static int codec_request_level = 0;
+static int transfer_codec = CODEC_NONE;
+static int transfer_level = 0;
+
+// 会话凭据：登录成功后服务器在 OP_SESSION 中发出，连接意外断开后重新连接时用它恢复登录
+static unsigned char session_token[SESSION_TOKEN_SIZE];
+static int has_session_token = 0;
+static int connection_lost = 0;              // 连接不是由服务器的 OP_BYE 结束的
+
+// 上传续传：服务器在 OP_RESUME 中告知的检查点
+static unsigned char upload_resume[PROTO_MAX_CONTROL];
+static size_t upload_resume_len = 0;
+static int upload_resume_received = 0;
+
+// 并行上传：数据连接连到同一个服务器地址，凭据由 OP_PARALLEL_READY 告知
+static struct sockaddr_in server_addr;
+static int parallel_streams = 0;             // -j 指定的连接数，0 表示按文件大小自动选择，1 表示不并行
+static unsigned char parallel_token[PARALLEL_TOKEN_SIZE];
+static int parallel_accepted = 0;            // 服务器接受的连接数
+static int parallel_ready = 0;
+
+// 去重上传：服务器在 OP_CHUNK_NEED 中告知缺少的块
+static unsigned char chunk_need[PROTO_MAX_CONTROL];
+static size_t chunk_need_len = 0;
+static int chunk_need_ready = 0;
+
+// 增量上传：服务器在 OP_SIGNATURES 中发送的当前文件的块签名
+static uint32_t sig_block_size = 0;
+static uint32_t sig_count = 0;
+static uint32_t sig_last_len = 0;            // 最后一块的长度
+static uint32_t sig_received = 0;
+static unsigned char *sigs = NULL;           // sig_count 个签名
+static int sig_ready = 0;
+
+// 增量同步：服务器在 OP_SYNC_MANIFEST 中发送的项目清单，收完后按路径排序
+typedef struct {
+    char *path;
+    int kind;                    // ARCHIVE_DIR / ARCHIVE_FILE
+    uint64_t size;
+    uint64_t mtime;
+    uint64_t hash;
+    int seen;                    // 本地仍有这个路径，遍历线程各自只标记自己找到的项
+} sync_item;
+static sync_item *sync_items = NULL;
+static size_t sync_count = 0;
+static size_t sync_cap = 0;
+static int sync_ready = 0;
+
+// 打包上传：目录和小文件的记录先攒在这里，满一块后作为一个 OP_ARCHIVE 帧发出
+static unsigned char archive_buf[CODEC_BLOCK_SIZE];
+static size_t archive_len = 0;
+static int archive_files = 0;                // 本次上传打包的文件数
+static int archive_batches = 0;
+
+// 增量上传的指令输出：相邻的块引用合并为一条 DELTA_COPY，原始字节攒够后作为一条 DELTA_LITERAL
+typedef struct {
+    int sockfd;
+    unsigned char frame[PROTO_MAX_CONTROL];
+    size_t len;
+    uint32_t copy_index;
+    uint32_t copy_count;
+    unsigned char literal[DELTA_LITERAL_MAX];
+    size_t literal_len;
+    uint64_t literal_bytes;      // 发送的原始字节总数
+} delta_out;
 
+// 一条数据连接负责的分段
+typedef struct {
+    int fd;
+    uint64_t offset;
+    uint64_t len;
+    int ok;
+} range_task;
 
 // 错误处理函数
 void handle_error(const char *msg) {
     perror(msg);
     exit(EXIT_FAILURE);
 }
-void create_directory(const char *dir_path) {
-    // 如果目录已经存在，就不报错
-    if (mkdir(dir_path, 0755) < 0) {
-        if (errno != EEXIST) {
-            perror("mkdir failed");
+
+// 发送全部数据
+static int send_all(int sockfd, const void *data, size_t len) {
+    const char *p = data;
+    while (len > 0) {
+        ssize_t n = send(sockfd, p, len, 0);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// 发送一个完整的帧
+int send_frame(int sockfd, uint8_t opcode, const void *payload, size_t len) {
+    unsigned char header[PROTO_HEADER_SIZE];
+    proto_encode_header(header, opcode, next_request_id++, len);
+    if (send_all(sockfd, header, sizeof(header)) < 0) return -1;
+    if (len > 0 && send_all(sockfd, payload, len) < 0) return -1;
+    return 0;
+}
+
+// 发送文件中 [offset, end) 的内容：优先用 sendfile 从页缓存直接发送
+static int send_file_range(int sockfd, int fd, uint64_t offset, uint64_t end) {
+    off_t pos = offset;
+    while ((uint64_t)pos < end) {
+        ssize_t n = sendfile(sockfd, fd, &pos, end - pos);
+        if (n <= 0) {
+            if (n == -1 && errno == EINTR) continue;
+            break;  // 不支持 sendfile 或文件被截断，剩余部分走下面的读写循环
+        }
+    }
+
+    char buffer[CHUNK_SIZE];
+    uint64_t sent = pos;
+    while (sent < end) {
+        size_t want = end - sent < sizeof(buffer) ? end - sent : sizeof(buffer);
+        ssize_t bytes_read = pread(fd, buffer, want, sent);
+        if (bytes_read <= 0) {
+            // 文件在发送过程中被截断，用 0 补齐声明的长度以保持帧边界
+            memset(buffer, 0, want);
+            bytes_read = want;
+        }
+        if (send_all(sockfd, buffer, bytes_read) < 0) return -1;
+        sent += bytes_read;
+    }
+    return 0;
+}
+
+// 接收恰好 len 字节
+static int recv_all(int sockfd, void *data, size_t len) {
+    char *p = data;
+    while (len > 0) {
+        ssize_t n = recv(sockfd, p, len, 0);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// 数据连接：新建连接发送一个 OP_RANGE，跳过欢迎菜单等文本，等待服务器确认这一段已经写入
+static void *send_range(void *arg) {
+    range_task *t = arg;
+    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sockfd == -1) {
+        perror("socket");
+        return NULL;
+    }
+    if (connect(sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1) {
+        perror("connect");
+        close(sockfd);
+        return NULL;
+    }
+
+    unsigned char prefix[PROTO_HEADER_SIZE + PARALLEL_TOKEN_SIZE + 8];
+    uint64_t offset = htobe64(t->offset);
+    proto_encode_header(prefix, OP_RANGE, 0, PARALLEL_TOKEN_SIZE + 8 + t->len);
+    memcpy(prefix + PROTO_HEADER_SIZE, parallel_token, PARALLEL_TOKEN_SIZE);
+    memcpy(prefix + PROTO_HEADER_SIZE + PARALLEL_TOKEN_SIZE, &offset, 8);
+    if (send_all(sockfd, prefix, sizeof(prefix)) < 0 ||
+        send_file_range(sockfd, t->fd, t->offset, t->offset + t->len) < 0) {
+        perror("Failed to send file range");
+        close(sockfd);
+        return NULL;
+    }
+
+    unsigned char payload[PROTO_MAX_CONTROL];
+    frame_header hdr;
+    while (recv_all(sockfd, payload, PROTO_HEADER_SIZE) == 0 && proto_decode_header(payload, &hdr) == 0 &&
+           hdr.length <= PROTO_MAX_CONTROL && recv_all(sockfd, payload, hdr.length) == 0) {
+        if (hdr.opcode == OP_RANGE_DONE) {
+            t->ok = hdr.length == 1 && payload[0] == 1;
+            break;
         }
     }
+    close(sockfd);
+    return NULL;
+}
+
+// 并行连接数：-j 指定，否则按文件大小选择；小文件不并行
+static int parallel_stream_count(uint64_t size) {
+    if (parallel_streams == 1 || size < PARALLEL_MIN_SIZE) return 1;
+    if (parallel_streams > 1) return parallel_streams < PARALLEL_MAX_STREAMS ? parallel_streams : PARALLEL_MAX_STREAMS;
+    uint64_t n = size / PARALLEL_AUTO_RANGE;
+    if (n < 2) n = 2;
+    if (n > PARALLEL_AUTO_STREAMS) n = PARALLEL_AUTO_STREAMS;
+    return (int)n;
+}
+
+// 把文件分成多段，由多条数据连接同时发送；服务器不接受时返回 -1，由调用方改用 OP_FILE 发送
+static int send_parallel(int sockfd, int fd, const char *filepath, const char *remote_path, uint64_t file_size) {
+    int streams = parallel_stream_count(file_size);
+    if (streams < 2) return -1;
+
+    unsigned char begin[2 + PATH_MAX + 8 + 1];
+    size_t len = proto_encode_file_prefix(begin, remote_path, file_size);
+    begin[len++] = streams;
+    parallel_ready = 0;
+    if (send_frame(sockfd, OP_PARALLEL_BEGIN, begin, len) < 0) return -1;
+    while (!parallel_ready) {
+        if (receive_response(sockfd) < 0) return 0;
+    }
+    if (parallel_accepted < 2) return -1;
+
+    // 分段边界按 PARALLEL_ALIGN 对齐，分段数不超过服务器接受的连接数
+    uint64_t per = (file_size / parallel_accepted + PARALLEL_ALIGN - 1) / PARALLEL_ALIGN * PARALLEL_ALIGN;
+    range_task tasks[PARALLEL_MAX_STREAMS];
+    pthread_t threads[PARALLEL_MAX_STREAMS];
+    int n = 0;
+    for (uint64_t off = 0; off < file_size && n < parallel_accepted; off += per, n++) {
+        tasks[n].fd = fd;
+        tasks[n].offset = off;
+        tasks[n].len = file_size - off < per ? file_size - off : per;
+        tasks[n].ok = 0;
+    }
+    tasks[n - 1].len = file_size - tasks[n - 1].offset;
+
+    printf("Sending file: %s (%llu bytes) over %d connections\n", filepath, (unsigned long long)file_size, n);
+    int started = 0;
+    for (; started < n; started++) {
+        if (pthread_create(&threads[started], NULL, send_range, &tasks[started]) != 0) break;
+    }
+    int ok = started == n;
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+        ok = ok && tasks[i].ok;
+    }
+
+    // 服务器检查所有分段都已写入后才提交文件
+    send_frame(sockfd, OP_PARALLEL_END, parallel_token, PARALLEL_TOKEN_SIZE);
+    if (ok) {
+        printf("File sent: %s\n", filepath);
+    } else {
+        fprintf(stderr, "Parallel upload failed: %s\n", filepath);
+    }
+    return 0;
+}
+
+// 按内容分块并计算每块的 SHA-256，把清单项追加到 manifest 中，返回块数；读取失败或块数超过上限时返回 0
+static uint32_t build_manifest(int fd, uint64_t file_size, unsigned char *manifest) {
+    unsigned char *buf = malloc(CDC_READ_SIZE);
+    if (!buf) return 0;
+    size_t have = 0, pos = 0;
+    uint64_t read_off = 0, off = 0;
+    uint32_t count = 0;
+
+    while (off < file_size) {
+        // 缓冲区中剩余的数据不够一个最大块时补充读入
+        if (have - pos < CDC_MAX_SIZE && read_off < file_size) {
+            memmove(buf, buf + pos, have - pos);
+            have -= pos;
+            pos = 0;
+            ssize_t n = pread(fd, buf + have, CDC_READ_SIZE - have, read_off);
+            if (n <= 0) break;  // 文件被截断
+            have += n;
+            read_off += n;
+        }
+        if (count == CDC_MAX_CHUNKS || have == pos) break;
+
+        size_t n = cdc_cut(buf + pos, have - pos);
+        unsigned char *entry = manifest + (size_t)count * CDC_ENTRY_SIZE;
+        uint32_t net_len = htonl((uint32_t)n);
+        SHA256(buf + pos, n, entry);
+        memcpy(entry + CDC_HASH_SIZE, &net_len, 4);
+        pos += n;
+        off += n;
+        count++;
+    }
+    free(buf);
+    return off == file_size ? count : 0;
+}
+
+// 去重上传：先发送清单，只发送服务器块存储中缺少的块；文件太小、太大或服务器不接受时返回 -1
+static int send_chunked(int sockfd, int fd, const char *filepath, const char *remote_path, uint64_t file_size) {
+    if (file_size < CDC_MIN_FILE) return -1;
+    unsigned char *manifest = malloc(CDC_MANIFEST_MAX);
+    if (!manifest) return -1;
+
+    size_t len = proto_encode_file_prefix(manifest, remote_path, file_size);
+    uint32_t count = build_manifest(fd, file_size, manifest + len);
+    if (count == 0) {
+        free(manifest);
+        return -1;
+    }
+    len += (size_t)count * CDC_ENTRY_SIZE;
+
+    chunk_need_ready = 0;
+    if (send_frame(sockfd, OP_MANIFEST, manifest, len) < 0) {
+        free(manifest);
+        return -1;
+    }
+    while (!chunk_need_ready) {
+        if (receive_response(sockfd) < 0) {
+            free(manifest);
+            return 0;
+        }
+    }
+    if (chunk_need_len != (count + 7) / 8) {
+        free(manifest);
+        return -1;
+    }
+
+    // 按清单顺序发送缺少的块，块内容用 sendfile 发送
+    const unsigned char *entries = manifest + len - (size_t)count * CDC_ENTRY_SIZE;
+    uint64_t offset = 0, sent = 0;
+    uint32_t missing = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        const unsigned char *entry = entries + (size_t)i * CDC_ENTRY_SIZE;
+        uint32_t chunk_len;
+        memcpy(&chunk_len, entry + CDC_HASH_SIZE, 4);
+        chunk_len = ntohl(chunk_len);
+        if (chunk_need[i / 8] & (1 << (i % 8))) {
+            unsigned char prefix[PROTO_HEADER_SIZE + CDC_HASH_SIZE];
+            proto_encode_header(prefix, OP_CHUNK, next_request_id++, CDC_HASH_SIZE + chunk_len);
+            memcpy(prefix + PROTO_HEADER_SIZE, entry, CDC_HASH_SIZE);
+            if (send_all(sockfd, prefix, sizeof(prefix)) < 0 ||
+                send_file_range(sockfd, fd, offset, offset + chunk_len) < 0) {
+                perror("Failed to send chunk");
+                free(manifest);
+                return 0;
+            }
+            sent += chunk_len;
+            missing++;
+        }
+        offset += chunk_len;
+    }
+    printf("File sent: %s (%u of %u chunks, %llu of %llu bytes)\n", filepath, missing, count,
+           (unsigned long long)sent, (unsigned long long)file_size);
+    free(manifest);
+    return 0;
+}
+
+static void delta_put(delta_out *d, uint8_t type, uint32_t a, uint32_t b, const void *data, size_t len) {
+    if (d->len + 9 + len > sizeof(d->frame)) {
+        send_frame(d->sockfd, OP_DELTA, d->frame, d->len);
+        d->len = 0;
+    }
+    uint32_t net_a = htonl(a), net_b = htonl(b);
+    d->frame[d->len] = type;
+    memcpy(d->frame + d->len + 1, &net_a, 4);
+    if (type == DELTA_COPY) {
+        memcpy(d->frame + d->len + 5, &net_b, 4);
+        d->len += 9;
+    } else {
+        memcpy(d->frame + d->len + 5, data, len);
+        d->len += 5 + len;
+    }
+}
+
+static void delta_flush_copy(delta_out *d) {
+    if (d->copy_count == 0) return;
+    delta_put(d, DELTA_COPY, d->copy_index, d->copy_count, NULL, 0);
+    d->copy_count = 0;
+}
+
+static void delta_flush_literal(delta_out *d) {
+    if (d->literal_len == 0) return;
+    delta_put(d, DELTA_LITERAL, d->literal_len, 0, d->literal, d->literal_len);
+    d->literal_bytes += d->literal_len;
+    d->literal_len = 0;
+}
+
+static void delta_literal(delta_out *d, unsigned char c) {
+    delta_flush_copy(d);
+    d->literal[d->literal_len++] = c;
+    if (d->literal_len == DELTA_LITERAL_MAX) delta_flush_literal(d);
 }
-void send_file(int sockfd, const char *filepath) {
+
+static void delta_copy(delta_out *d, uint32_t index) {
+    delta_flush_literal(d);
+    if (d->copy_count > 0 && d->copy_index + d->copy_count == index) {
+        d->copy_count++;
+        return;
+    }
+    delta_flush_copy(d);
+    d->copy_index = index;
+    d->copy_count = 1;
+}
+
+// 在签名中查找与 data 开始的 len 字节相同的块，弱校验和命中后再比较强哈希，没有时返回 -1
+static int64_t delta_find(const int32_t *heads, const int32_t *chain, uint32_t mask, uint32_t weak,
+                          const unsigned char *data, size_t len) {
+    unsigned char strong[SHA256_DIGEST_LENGTH];
+    int hashed = 0;
+    for (int32_t i = heads[(weak ^ (weak >> 16)) & mask]; i != -1; i = chain[i]) {
+        uint32_t sig_weak;
+        memcpy(&sig_weak, sigs + (size_t)i * DELTA_SIG_SIZE, 4);
+        if (ntohl(sig_weak) != weak) continue;
+        if ((uint32_t)i == sig_count - 1 ? len != sig_last_len : len != sig_block_size) continue;
+        if (!hashed) {
+            SHA256(data, len, strong);
+            hashed = 1;
+        }
+        if (memcmp(sigs + (size_t)i * DELTA_SIG_SIZE + 4, strong, DELTA_STRONG_SIZE) == 0) return i;
+    }
+    return -1;
+}
+
+// 逐字节滚动弱校验和，把新文件表示为块引用和原始字节；返回 -1 表示读取失败
+static int delta_scan(delta_out *d, int fd, uint64_t file_size) {
+    uint32_t block = sig_block_size;
+    uint32_t mask = 1;
+    while (mask < sig_count * 2) mask <<= 1;
+    int32_t *heads = malloc(mask * sizeof(int32_t));
+    int32_t *chain = malloc(sig_count * sizeof(int32_t));
+    size_t buf_size = 4 * (size_t)block;
+    unsigned char *buf = malloc(buf_size);
+    if (!heads || !chain || !buf) {
+        free(heads);
+        free(chain);
+        free(buf);
+        return -1;
+    }
+    mask--;
+    memset(heads, 0xff, (mask + 1) * sizeof(int32_t));
+    for (uint32_t i = 0; i < sig_count; i++) {
+        uint32_t weak;
+        memcpy(&weak, sigs + (size_t)i * DELTA_SIG_SIZE, 4);
+        weak = ntohl(weak);
+        uint32_t bucket = (weak ^ (weak >> 16)) & mask;
+        chain[i] = heads[bucket];
+        heads[bucket] = i;
+    }
+
+    uint64_t base = 0;  // buf[0] 在文件中的偏移
+    size_t have = 0, pos = 0;
+    uint32_t a = 0, b = 0, weak = 0;
+    int rolling = 0, rc = 0;
+    while (base + pos < file_size) {
+        // 窗口之后至少保留一个字节用于滚动
+        if (have - pos <= block && base + have < file_size) {
+            memmove(buf, buf + pos, have - pos);
+            base += pos;
+            have -= pos;
+            pos = 0;
+            ssize_t n = pread(fd, buf + have, buf_size - have, base + have);
+            if (n <= 0) {
+                rc = -1;  // 文件被截断
+                break;
+            }
+            have += n;
+        }
+
+        size_t remain = have - pos;
+        if (remain >= block) {
+            if (!rolling) {
+                weak = delta_weak(buf + pos, block, &a, &b);
+                rolling = 1;
+            }
+            int64_t index = delta_find(heads, chain, mask, weak, buf + pos, block);
+            if (index >= 0) {
+                delta_copy(d, index);
+                pos += block;
+                rolling = 0;
+                continue;
+            }
+            delta_literal(d, buf[pos]);
+            if (remain > block) {
+                weak = delta_roll(&a, &b, buf[pos], buf[pos + block], block);
+            } else {
+                rolling = 0;
+            }
+            pos++;
+        } else {
+            // 不足一块的结尾只可能与服务器文件的最后一块相同
+            uint32_t tail_a, tail_b;
+            int64_t index = delta_find(heads, chain, mask, delta_weak(buf + pos, remain, &tail_a, &tail_b),
+                                       buf + pos, remain);
+            if (index >= 0) {
+                delta_copy(d, index);
+            } else {
+                for (size_t i = 0; i < remain; i++) delta_literal(d, buf[pos + i]);
+            }
+            pos += remain;
+        }
+    }
+
+    free(heads);
+    free(chain);
+    free(buf);
+    return rc;
+}
+
+// 增量上传：服务器已有这个文件时只发送与它不同的部分；服务器没有这个文件时返回 -1
+static int send_delta(int sockfd, int fd, const char *filepath, const char *remote_path, uint64_t file_size) {
+    if (file_size < DELTA_MIN_FILE) return -1;
+
+    unsigned char begin[2 + PATH_MAX + 8];
+    size_t len = proto_encode_file_prefix(begin, remote_path, file_size);
+    sig_ready = 0;
+    if (send_frame(sockfd, OP_DELTA_BEGIN, begin, len) < 0) return -1;
+    while (!sig_ready) {
+        if (receive_response(sockfd) < 0) return 0;
+    }
+    if (sig_count == 0) return -1;
+
+    delta_out *d = calloc(1, sizeof(*d));
+    if (!d) {
+        send_frame(sockfd, OP_DELTA_END, NULL, 0);  // 服务器放弃这次上传
+        return 0;
+    }
+    d->sockfd = sockfd;
+    int rc = delta_scan(d, fd, file_size);
+    delta_flush_copy(d);
+    delta_flush_literal(d);
+    if (d->len > 0) send_frame(sockfd, OP_DELTA, d->frame, d->len);
+    send_frame(sockfd, OP_DELTA_END, NULL, 0);
+
+    if (rc == 0) {
+        printf("File sent: %s (delta, %llu of %llu bytes literal)\n", filepath,
+               (unsigned long long)d->literal_bytes, (unsigned long long)file_size);
+    } else {
+        fprintf(stderr, "Failed to read file: %s\n", filepath);
+    }
+    free(d);
+    return 0;
+}
+
+// 压缩发送文件中从 start 开始的内容：OP_ZFILE 之后每块压缩成一个 OP_ZDATA 帧
+static int send_compressed(int sockfd, int fd, const char *filepath, const char *remote_path,
+                           uint64_t start, uint64_t file_size) {
+    unsigned char payload[2 + PATH_MAX + 16];
+    size_t len = proto_encode_file_prefix(payload, remote_path, start);
+    uint64_t raw_len = htobe64(file_size - start);
+    memcpy(payload + len, &raw_len, 8);
+    if (send_frame(sockfd, OP_ZFILE, payload, len + 8) < 0) {
+        perror("Failed to send file header");
+        return -1;
+    }
+    if (start > 0) {
+        printf("Resuming file: %s from %llu of %llu bytes\n", filepath,
+               (unsigned long long)start, (unsigned long long)file_size);
+    } else {
+        printf("Sending file: %s (%llu bytes)\n", filepath, (unsigned long long)file_size);
+    }
+
+    static unsigned char raw[CODEC_BLOCK_SIZE];
+    static unsigned char frame[CODEC_FRAME_MAX];
+    uint64_t sent = 0;
+    for (uint64_t off = start; off < file_size;) {
+        size_t want = file_size - off < CODEC_BLOCK_SIZE ? file_size - off : CODEC_BLOCK_SIZE;
+        ssize_t n = pread(fd, raw, want, off);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) {
+            // 文件在发送过程中变短，用 0 补齐以保持帧边界
+            memset(raw, 0, want);
+            n = want;
+        }
+        size_t frame_len = codec_encode_block(transfer_codec, transfer_level, raw, n, frame);
+        if (send_frame(sockfd, OP_ZDATA, frame, frame_len) < 0) {
+            perror("Failed to send file content");
+            return -1;
+        }
+        sent += frame_len;
+        off += n;
+    }
+    printf("File sent: %s (%s, %llu bytes on the wire)\n", filepath, codec_name(transfer_codec),
+           (unsigned long long)sent);
+    return 0;
+}
+
+// 以 OP_FILE 帧发送文件，remote_path 为服务器端的相对路径；服务器有检查点时从检查点继续
+// 服务器已有同名文件时增量上传，否则先尝试去重上传，清单放不下的大文件尝试并行上传
+void send_file(int sockfd, const char *filepath, const char *remote_path) {
     FILE *file = fopen(filepath, "rb");
     if (!file) {
         perror("Failed to open file");
@@ -32,267 +598,1057 @@ void send_file(int sockfd, const char *filepath) {
     }
 
     // 获取文件大小
-    fseek(file, 0, SEEK_END);
-    long file_size = ftell(file);
-    rewind(file);
+    struct stat st;
+    if (fstat(fileno(file), &st) == -1) {
+        perror("Failed to stat file");
+        fclose(file);
+        return;
+    }
+    uint64_t file_size = st.st_size;
+    uint64_t start = proto_find_resume(upload_resume, upload_resume_len, remote_path, file_size, NULL);
+    if (start == 0 && (send_delta(sockfd, fileno(file), filepath, remote_path, file_size) == 0 ||
+                       send_chunked(sockfd, fileno(file), filepath, remote_path, file_size) == 0 ||
+                       send_parallel(sockfd, fileno(file), filepath, remote_path, file_size) == 0)) {
+        fclose(file);
+        return;
+    }
 
-    file_size = htonl(file_size); // 转换为网络字节序
+    if (transfer_codec != CODEC_NONE) {
+        send_compressed(sockfd, fileno(file), filepath, remote_path, start, file_size);
+        fclose(file);
+        return;
+    }
 
-    // 发送文件大小
-    if (send(sockfd, &file_size, sizeof(file_size), 0) == -1) {
-        perror("Failed to send file size");
+    // 帧头、路径和起始偏移，帧长度包含从起始偏移开始的文件内容
+    unsigned char prefix[PROTO_HEADER_SIZE + 2 + PATH_MAX + 8];
+    size_t prefix_len = proto_encode_file_prefix(prefix + PROTO_HEADER_SIZE, remote_path, start);
+    proto_encode_header(prefix, OP_FILE, next_request_id++, prefix_len + file_size - start);
+    if (send_all(sockfd, prefix, PROTO_HEADER_SIZE + prefix_len) < 0) {
+        perror("Failed to send file header");
         fclose(file);
         return;
     }
 
-    printf("Sending file: %s (%ld bytes)\n", filepath, ntohl(file_size));
+    if (start > 0) {
+        printf("Resuming file: %s from %llu of %llu bytes\n", filepath,
+               (unsigned long long)start, (unsigned long long)file_size);
+    } else {
+        printf("Sending file: %s (%llu bytes)\n", filepath, (unsigned long long)file_size);
+    }
 
-    // 发送文件内容
-    char buffer[BUF_SIZE];
-    size_t bytes_read = 0;
-    while ((bytes_read = fread(buffer, 1, sizeof(buffer), file)) > 0) {
-        if (send(sockfd, buffer, bytes_read, 0) == -1) {
-            perror("Failed to send file content");
-            fclose(file);
-            return;
-        }
-        printf("Sent %zu bytes\n", bytes_read);
+    if (send_file_range(sockfd, fileno(file), start, file_size) < 0) {
+        perror("Failed to send file content");
+        fclose(file);
+        return;
     }
 
     printf("File sent: %s\n", filepath);
     fclose(file);
 }
 
+// 发出攒下的记录，有协商的编码时整批压缩
+static int archive_flush(int sockfd) {
+    static unsigned char frame[CODEC_FRAME_MAX];
+    if (archive_len == 0) return 0;
+    size_t len = codec_encode_block(transfer_codec, transfer_level, archive_buf, archive_len, frame);
+    archive_len = 0;
+    archive_batches++;
+    return send_frame(sockfd, OP_ARCHIVE, frame, len);
+}
+
+// 追加一条记录的头部，返回内容应写入的位置；记录放不进一块或发送失败时返回 NULL
+static unsigned char *archive_add(int sockfd, uint8_t type, const char *path, uint64_t size) {
+    size_t path_len = strlen(path);
+    if (size > sizeof(archive_buf) || ARCHIVE_RECORD_HEADER + path_len + size > sizeof(archive_buf)) return NULL;
+    size_t need = ARCHIVE_RECORD_HEADER + path_len + size;
+    if (archive_len + need > sizeof(archive_buf) && archive_flush(sockfd) < 0) return NULL;
+
+    unsigned char *p = archive_buf + archive_len;
+    uint16_t net_len = htons((uint16_t)path_len);
+    uint64_t net_size = htobe64(size);
+    p[0] = type;
+    memcpy(p + 1, &net_len, 2);
+    memcpy(p + 3, path, path_len);
+    memcpy(p + 3 + path_len, &net_size, 8);
+    archive_len += need;
+    return p + ARCHIVE_RECORD_HEADER + path_len;
+}
+
+// 上传项目时的目录遍历：UPLOAD_WALKERS 个线程并行读取目录，把小文件的内容预读进有界队列，
+// 主线程从队列中依次取出发送，磁盘读取和网络发送同时进行
+typedef struct upload_item {
+    int type;                   // ARCHIVE_DIR / ARCHIVE_FILE / ARCHIVE_META / ARCHIVE_DELETE
+    char *rel;                  // 相对于项目根目录的路径
+    uint64_t size;
+    uint64_t mtime;
+    uint64_t hash;
+    unsigned char *data;        // 预读的文件内容，为 NULL 时由发送方单独发送
+    struct upload_item *next;
+} upload_item;
+
+typedef struct dir_task {
+    char *rel;
+    struct dir_task *next;
+} dir_task;
+
+typedef struct {
+    const char *root;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    dir_task *dirs;             // 等待遍历的目录
+    int busy;                   // 正在遍历目录的线程数
+    upload_item *head;          // 等待发送的条目，目录总是排在其中的内容之前
+    upload_item *tail;
+    int queued;
+    size_t queued_bytes;
+    int done;                   // 所有目录都已遍历完
+    int unbounded;              // 没有遍历线程、由发送方自己遍历时队列不设上限
+    int unchanged;              // 与服务器清单一致、不需要发送的文件数
+    int failed;                 // 有目录或文件没能读取，服务器清单中没见到的路径不一定已经删除
+} upload_walk;
+
+static int sync_item_cmp(const void *a, const void *b) {
+    return strcmp(((const sync_item *)a)->path, ((const sync_item *)b)->path);
+}
+
+static void sync_clear(void) {
+    for (size_t i = 0; i < sync_count; i++) free(sync_items[i].path);
+    sync_count = 0;
+    sync_ready = 0;
+}
+
+// 在服务器清单中查找路径，清单收完后只读，遍历线程可以同时查找
+static sync_item *sync_find(const char *path) {
+    sync_item key = {.path = (char *)path};
+    return sync_count ? bsearch(&key, sync_items, sync_count, sizeof(sync_item), sync_item_cmp) : NULL;
+}
+
+// 追加 OP_SYNC_MANIFEST 中的各项，空帧表示清单结束
+static void sync_receive(const unsigned char *payload, size_t len) {
+    if (len == 0) {
+        if (sync_count > 0) qsort(sync_items, sync_count, sizeof(sync_item), sync_item_cmp);
+        sync_ready = 1;
+        return;
+    }
+    size_t off = 0;
+    while (off + SYNC_ENTRY_HEADER <= len) {
+        uint16_t path_len;
+        uint64_t fields[3];
+        memcpy(&path_len, payload + off + 1, 2);
+        path_len = ntohs(path_len);
+        if (off + SYNC_ENTRY_HEADER + path_len > len) break;
+        if (sync_count == sync_cap) {
+            size_t cap = sync_cap ? sync_cap * 2 : 256;
+            sync_item *items = realloc(sync_items, cap * sizeof(sync_item));
+            if (!items) break;
+            sync_items = items;
+            sync_cap = cap;
+        }
+        sync_item *e = &sync_items[sync_count];
+        if (!(e->path = strndup((const char *)payload + off + 3, path_len))) break;
+        memcpy(fields, payload + off + 3 + path_len, sizeof(fields));
+        e->kind = payload[off];
+        e->size = be64toh(fields[0]);
+        e->mtime = be64toh(fields[1]);
+        e->hash = be64toh(fields[2]);
+        e->seen = 0;
+        sync_count++;
+        off += SYNC_ENTRY_HEADER + path_len;
+    }
+}
+
+// 把条目放入队列，队列已满时等待发送方取走
+static void walk_emit(upload_walk *w, upload_item *item) {
+    pthread_mutex_lock(&w->lock);
+    while (w->head && !w->unbounded && (w->queued >= UPLOAD_QUEUE_ITEMS || w->queued_bytes + item->size > UPLOAD_QUEUE_BYTES)) {
+        pthread_cond_wait(&w->cond, &w->lock);
+    }
+    if (w->tail) w->tail->next = item;
+    else w->head = item;
+    w->tail = item;
+    w->queued++;
+    if (item->data) w->queued_bytes += item->size;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+}
+
+// 遍历失败时记下，send_directory 不再发送删除记录
+static void walk_fail(upload_walk *w) {
+    __atomic_store_n(&w->failed, 1, __ATOMIC_RELAXED);
+}
+
+static void walk_push_dir(upload_walk *w, const char *rel) {
+    dir_task *t = malloc(sizeof(dir_task));
+    if (!t || !(t->rel = strdup(rel))) {
+        free(t);
+        walk_fail(w);
+        return;
+    }
+    pthread_mutex_lock(&w->lock);
+    t->next = w->dirs;
+    w->dirs = t;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+}
+
+// 读取小文件的全部内容，失败或文件正在变化时返回 NULL
+static unsigned char *walk_read(int dirfd, const char *name, uint64_t size) {
+    int fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return NULL;
+    unsigned char *data = malloc(size ? size : 1);
+    size_t got = 0;
+    while (data && got < size) {
+        ssize_t n = read(fd, data + got, size - got);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) break;
+        got += n;
+    }
+    close(fd);
+    if (data && got != size) {
+        free(data);
+        data = NULL;
+    }
+    return data;
+}
+
+static upload_item *walk_item(int type, const char *rel) {
+    upload_item *item = calloc(1, sizeof(upload_item));
+    if (item && !(item->rel = strdup(rel))) {
+        free(item);
+        item = NULL;
+    }
+    if (item) item->type = type;
+    return item;
+}
 
-// 发送路径和类型标志（文件或目录）
-void send_path(int sockfd, const char *path, int type) {
-    // 发送文件/目录类型标志
-    send(sockfd, &type, sizeof(type), 0);
-    
-    // 发送路径
-    send(sockfd, path, strlen(path) + 1, 0);
+// 计算文件内容的哈希：小文件读入内存，大文件读一遍后提示内核预读开头，发送时可以直接从页缓存读取
+static void walk_load(upload_item *item, int dirfd, const char *name) {
+    if (ARCHIVE_RECORD_HEADER + strlen(item->rel) + item->size <= CODEC_BLOCK_SIZE) {
+        item->data = walk_read(dirfd, name, item->size);
+        if (item->data) item->hash = xxh64(item->data, item->size);
+        return;
+    }
+    int fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return;
+    xxh64_file(fd, &item->hash);
+    posix_fadvise(fd, 0, UPLOAD_READAHEAD, POSIX_FADV_WILLNEED);
+    close(fd);
 }
 
-// 客户端发送目录
-void send_directory(int sockfd, const char *dirpath) {
-    DIR *dir = opendir(dirpath);
+// 遍历一个目录：子目录先作为条目放入队列，再交给其他线程遍历；与服务器清单一致的路径跳过，
+// 大小相同、修改时间不同的文件比较哈希，内容没变时只发送新的修改时间
+static void walk_dir(upload_walk *w, const char *rel) {
+    char dirpath[PATH_MAX];
+    int n = snprintf(dirpath, sizeof(dirpath), "%s%s%s", w->root, rel[0] ? "/" : "", rel);
+    DIR *dir = n >= 0 && (size_t)n < sizeof(dirpath) ? opendir(dirpath) : NULL;
     if (!dir) {
         perror("Failed to open directory");
+        walk_fail(w);
         return;
     }
 
     struct dirent *entry;
-    while ((entry = readdir(dir)) != NULL) {
+    while ((errno = 0, entry = readdir(dir)) != NULL) {
         // 跳过"."和".."
         if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
             continue;
         }
 
-        char filepath[BUF_SIZE];
-        snprintf(filepath, sizeof(filepath), "%s/%s", dirpath, entry->d_name);
+        char relpath[PATH_MAX];
+        n = snprintf(relpath, sizeof(relpath), "%s%s%s", rel, rel[0] ? "/" : "", entry->d_name);
+        if (n < 0 || (size_t)n >= sizeof(relpath)) {
+            fprintf(stderr, "Path too long: %s/%s\n", dirpath, entry->d_name);
+            walk_fail(w);
+            continue;
+        }
 
         struct stat path_stat;
-        stat(filepath, &path_stat);
+        if (fstatat(dirfd(dir), entry->d_name, &path_stat, 0) == -1) {
+            if (errno != ENOENT) {  // 遍历期间被删除的文件照常从服务器删除
+                perror(relpath);
+                walk_fail(w);
+            }
+            continue;
+        }
+        if (!S_ISDIR(path_stat.st_mode) && !S_ISREG(path_stat.st_mode)) continue;
+        int kind = S_ISDIR(path_stat.st_mode) ? ARCHIVE_DIR : ARCHIVE_FILE;
+
+        sync_item *e = sync_find(relpath);
+        if (e) {
+            e->seen = 1;
+            if (e->kind != kind) {
+                // 类型变了：先删除服务器上的旧路径
+                upload_item *del = walk_item(ARCHIVE_DELETE, relpath);
+                if (del) walk_emit(w, del);
+                e = NULL;
+            }
+        }
 
-        if (S_ISDIR(path_stat.st_mode)) {
-            // 发送目录路径和类型标志：目录（2）
-            send_path(sockfd, filepath, 2);
+        if (kind == ARCHIVE_DIR) {
+            upload_item *item = e ? NULL : walk_item(ARCHIVE_DIR, relpath);
+            if (item) walk_emit(w, item);
+            walk_push_dir(w, relpath);
+            continue;
+        }
 
-            // 递归发送目录中的内容
-            send_directory(sockfd, filepath);
-        } else if (S_ISREG(path_stat.st_mode)) {
-            // 发送文件路径和类型标志：普通文件（1）
-            send_path(sockfd, filepath, 1);
-            printf("Sending file: %s\n", filepath);
-            // 发送文件内容
-            send_file(sockfd, filepath);
+        uint64_t mtime = (uint64_t)path_stat.st_mtim.tv_sec * 1000000000ULL + path_stat.st_mtim.tv_nsec;
+        if (e && e->size == (uint64_t)path_stat.st_size && e->mtime == mtime) {
+            __atomic_add_fetch(&w->unchanged, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+        upload_item *item = walk_item(ARCHIVE_FILE, relpath);
+        if (!item) continue;
+        item->size = path_stat.st_size;
+        item->mtime = mtime;
+        walk_load(item, dirfd(dir), entry->d_name);
+        if (e && e->size == item->size && e->hash == item->hash) {
+            item->type = ARCHIVE_META;
+            free(item->data);
+            item->data = NULL;
+            __atomic_add_fetch(&w->unchanged, 1, __ATOMIC_RELAXED);
         }
+        walk_emit(w, item);
+    }
+    if (errno != 0) {
+        perror("Failed to read directory");
+        walk_fail(w);
     }
 
     closedir(dir);
 }
-void save_file(int server_socket, const char *filepath) {
-    FILE *file = fopen(filepath, "wb");
-    if (file == NULL) {
-        perror("Failed to open file for writing");
+
+static void *walk_thread(void *arg) {
+    upload_walk *w = arg;
+    pthread_mutex_lock(&w->lock);
+    for (;;) {
+        while (!w->dirs && w->busy > 0) pthread_cond_wait(&w->cond, &w->lock);
+        if (!w->dirs) break;  // 没有待遍历的目录，也没有线程还会产生新的目录
+        dir_task *t = w->dirs;
+        w->dirs = t->next;
+        w->busy++;
+        pthread_mutex_unlock(&w->lock);
+
+        walk_dir(w, t->rel);
+        free(t->rel);
+        free(t);
+
+        pthread_mutex_lock(&w->lock);
+        w->busy--;
+        if (!w->dirs && w->busy == 0) w->done = 1;
+        pthread_cond_broadcast(&w->cond);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+// 追加 ARCHIVE_META 记录：服务器把刚提交的文件或内容没变的文件记入清单
+static void archive_meta(int sockfd, const upload_item *item) {
+    unsigned char *dst = archive_add(sockfd, ARCHIVE_META, item->rel, 16);
+    if (!dst) return;
+    uint64_t fields[2] = {htobe64(item->mtime), htobe64(item->hash)};
+    memcpy(dst, fields, sizeof(fields));
+}
+
+// 发送预读好的条目：目录、小文件和清单记录打包进 OP_ARCHIVE，其余文件先发出已打包的记录再单独发送
+static void send_item(int sockfd, const char *root, upload_item *item) {
+    if (item->type == ARCHIVE_DIR) {
+        if (!archive_add(sockfd, ARCHIVE_DIR, item->rel, 0)) {
+            send_frame(sockfd, OP_DIR, item->rel, strlen(item->rel));
+        }
+        return;
+    }
+    if (item->type == ARCHIVE_DELETE) {
+        archive_add(sockfd, ARCHIVE_DELETE, item->rel, 0);
+        return;
+    }
+    if (item->type == ARCHIVE_META) {
+        archive_meta(sockfd, item);
         return;
     }
+    if (item->data) {
+        unsigned char *dst = archive_add(sockfd, ARCHIVE_FILE, item->rel, item->size);
+        if (dst) {
+            memcpy(dst, item->data, item->size);
+            archive_files++;
+            archive_meta(sockfd, item);
+            return;
+        }
+    }
+    char filepath[PATH_MAX];
+    snprintf(filepath, sizeof(filepath), "%s/%s", root, item->rel);
+    archive_flush(sockfd);  // 保持顺序：文件所在的目录必须先创建
+    send_file(sockfd, filepath, item->rel);
+    archive_meta(sockfd, item);
+}
 
-    // 接收文件大小
-    long file_size;
-    char len[8];
-    ssize_t bytes_received = recv(server_socket, len, 8, 0);
-    if (bytes_received <= 0) {
-        perror("Failed to receive file size");
-        fclose(file);
+// 服务器清单中本地已经没有的路径：先删除文件，再从深到浅删除目录
+static int send_deletions(int sockfd) {
+    int deleted = 0;
+    for (size_t i = 0; i < sync_count; i++) {
+        if (!sync_items[i].seen && sync_items[i].kind == ARCHIVE_FILE) {
+            archive_add(sockfd, ARCHIVE_DELETE, sync_items[i].path, 0);
+            deleted++;
+        }
+    }
+    for (size_t i = sync_count; i-- > 0;) {
+        if (!sync_items[i].seen && sync_items[i].kind == ARCHIVE_DIR) {
+            archive_add(sockfd, ARCHIVE_DELETE, sync_items[i].path, 0);
+            deleted++;
+        }
+    }
+    return deleted;
+}
+
+// 客户端发送目录树，root 为项目根目录
+void send_directory(int sockfd, const char *root) {
+    upload_walk w;
+    memset(&w, 0, sizeof(w));
+    w.root = root;
+    pthread_mutex_init(&w.lock, NULL);
+    pthread_cond_init(&w.cond, NULL);
+    walk_push_dir(&w, "");
+
+    pthread_t threads[UPLOAD_WALKERS];
+    int started = 0;
+    while (started < UPLOAD_WALKERS && pthread_create(&threads[started], NULL, walk_thread, &w) == 0) started++;
+    if (started == 0) {
+        w.unbounded = 1;  // 无法创建线程时先在当前线程遍历完，再发送
+        walk_thread(&w);
+    }
+
+    for (;;) {
+        pthread_mutex_lock(&w.lock);
+        while (!w.head && !w.done) pthread_cond_wait(&w.cond, &w.lock);
+        upload_item *item = w.head;
+        if (item) {
+            w.head = item->next;
+            if (!w.head) w.tail = NULL;
+            w.queued--;
+            if (item->data) w.queued_bytes -= item->size;
+            pthread_cond_broadcast(&w.cond);
+        }
+        pthread_mutex_unlock(&w.lock);
+        if (!item) break;
+
+        send_item(sockfd, root, item);
+        free(item->data);
+        free(item->rel);
+        free(item);
+    }
+
+    for (int i = 0; i < started; i++) pthread_join(threads[i], NULL);
+    pthread_mutex_destroy(&w.lock);
+    pthread_cond_destroy(&w.cond);
+
+    // 没能完整遍历本地目录时，清单中没见到的路径可能只是没读到，不能从服务器删除
+    int deleted = 0;
+    if (w.failed) printf("Sync: some local paths could not be read, nothing deleted on the server\n");
+    else deleted = send_deletions(sockfd);
+    if (w.unchanged > 0 || deleted > 0) printf("Sync: %d files unchanged, %d paths deleted\n", w.unchanged, deleted);
+}
+
+// 上传整个项目目录，目录不存在时发送 OP_UPLOAD_END 取消上传
+int send_project(int sockfd, const char *project_path) {
+    char root[PATH_MAX];
+    strncpy(root, project_path, sizeof(root) - 1);
+    root[sizeof(root) - 1] = '\0';
+    size_t len = strlen(root);
+    while (len > 1 && root[len - 1] == '/') root[--len] = '\0';
+
+    struct stat st;
+    if (stat(root, &st) == -1 || !S_ISDIR(st.st_mode)) {
+        fprintf(stderr, "Not a directory: %s\n", root);
+        send_frame(sockfd, OP_UPLOAD_END, NULL, 0);
+        return -1;
+    }
+
+    const char *name = strrchr(root, '/');
+    name = name ? name + 1 : root;
+    sync_clear();
+    send_frame(sockfd, OP_UPLOAD_BEGIN, name, strlen(name));
+
+    // 等待服务器回复该项目的检查点和同步清单，再决定每个文件是否发送、从哪里开始发送
+    upload_resume_received = 0;
+    while (!upload_resume_received || !sync_ready) {
+        if (receive_response(sockfd) < 0) return -1;
+    }
+    archive_files = archive_batches = 0;
+    send_directory(sockfd, root);
+    archive_flush(sockfd);
+    if (archive_files > 0) printf("Packed %d small files into %d batches\n", archive_files, archive_batches);
+    send_frame(sockfd, OP_UPLOAD_END, NULL, 0);
+    return 0;
+}
+
+// 上传单个文件，服务器只使用文件名部分
+static void upload_single_file(int sockfd, const char *filepath) {
+    if (access(filepath, R_OK) != 0) {
+        perror("Failed to open file");
+        send_frame(sockfd, OP_UPLOAD_END, NULL, 0);
         return;
     }
-    file_size = atoi(len);
-    printf("Receiving file: %s, Size: %ld bytes\n", filepath, file_size);
+    const char *name = strrchr(filepath, '/');
+    name = name ? name + 1 : filepath;
+    send_file(sockfd, filepath, name);
+}
 
-    // 接收文件内容
-    char buffer[BUF_SIZE];
-    size_t bytes_received_total = 0;
-    while (bytes_received_total < file_size) {
-        ssize_t bytes = recv(server_socket, buffer, sizeof(buffer), 0);
-        if (bytes <= 0) {
-            perror("Failed to receive file content");
-            break;
+// 处理用户输入的一行
+void send_request(int sockfd, char *line) {
+    line[strcspn(line, "\n")] = '\0';
+
+    // 服务器请求上传时，这一行是本地路径
+    if (pending_upload == UPLOAD_KIND_PROJECT) {
+        pending_upload = -1;
+        if (send_project(sockfd, line) == 0) printf("Project uploaded successfully\n");
+        return;
+    }
+    if (pending_upload == UPLOAD_KIND_FILE) {
+        pending_upload = -1;
+        upload_single_file(sockfd, line);
+        return;
+    }
+
+    if (send_frame(sockfd, OP_INPUT, line, strlen(line)) < 0) handle_error("send");
+}
+
+void create_directory(const char *dir_path) {
+    // 如果目录已经存在，就不报错
+    if (mkdir(dir_path, 0755) < 0) {
+        if (errno != EEXIST) {
+            perror("mkdir failed");
         }
-        fwrite(buffer, 1, bytes, file);
-        bytes_received_total += bytes;
     }
+}
 
-    printf("File received and saved: %s\n", filepath);
-    fclose(file);
+// 未完成下载的检查点，保存在下载目录的 RESUME_INDEX 中，每行为 "大小 偏移 路径"，
+// 路径相对于下载目录；连接建立后整体发送给服务器
+typedef struct {
+    char path[PATH_MAX];
+    uint64_t size;
+    uint64_t offset;
+} checkpoint;
+
+static checkpoint *checkpoints = NULL;
+static int checkpoint_count = 0;
+
+static checkpoint *find_checkpoint(const char *path) {
+    for (int i = 0; i < checkpoint_count; i++) {
+        if (strcmp(checkpoints[i].path, path) == 0) return &checkpoints[i];
+    }
+    return NULL;
 }
 
-// 客户端接收路径和类型标志（文件或目录）
-void recv_path(int server_socket, char *path, int *type) {
-    // 接收文件/目录类型标志
-    recv(server_socket, type, sizeof(int), 0);
-    
-    // 接收路径
-    recv(server_socket, path, BUF_SIZE, 0);
+// 整体重写索引：先写临时文件再改名，中途崩溃也不会留下损坏的索引
+static void save_checkpoints(void) {
+    if (checkpoint_count == 0) {
+        unlink(RESUME_INDEX);
+        return;
+    }
+    FILE *fp = fopen(RESUME_INDEX ".tmp", "w");
+    if (!fp) return;
+    for (int i = 0; i < checkpoint_count; i++) {
+        fprintf(fp, "%llu %llu %s\n", (unsigned long long)checkpoints[i].size,
+                (unsigned long long)checkpoints[i].offset, checkpoints[i].path);
+    }
+    if (fflush(fp) == 0 && fdatasync(fileno(fp)) == 0) {
+        fclose(fp);
+        rename(RESUME_INDEX ".tmp", RESUME_INDEX);
+    } else {
+        fclose(fp);
+        unlink(RESUME_INDEX ".tmp");
+    }
 }
 
-// 客户端接收目录
-void recv_directory(int server_socket) {
-    int type;
-    char filepath[BUF_SIZE];
-    
-    while (1) {
-        recv_path(server_socket, filepath, &type);
-        
-        if (type == 0) {
-            break;  // 结束标志
+static void set_checkpoint(const char *path, uint64_t size, uint64_t offset) {
+    checkpoint *c = find_checkpoint(path);
+    if (!c) {
+        checkpoint *p = realloc(checkpoints, (checkpoint_count + 1) * sizeof(checkpoint));
+        if (!p) return;
+        checkpoints = p;
+        c = &checkpoints[checkpoint_count++];
+        snprintf(c->path, sizeof(c->path), "%s", path);
+    }
+    c->size = size;
+    c->offset = offset;
+    save_checkpoints();
+}
+
+static void drop_checkpoint(const char *path) {
+    checkpoint *c = find_checkpoint(path);
+    if (!c) return;
+    *c = checkpoints[--checkpoint_count];
+    save_checkpoints();
+}
+
+// 读取索引，丢弃 .part 已经不存在或比记录的偏移短的项
+static void load_checkpoints(void) {
+    FILE *fp = fopen(RESUME_INDEX, "r");
+    if (!fp) return;
+
+    unsigned long long size, offset;
+    char path[PATH_MAX];
+    int dropped = 0;
+    while (fscanf(fp, "%llu %llu %4095[^\n]", &size, &offset, path) == 3) {
+        char part[PATH_MAX + 8];
+        struct stat st;
+        snprintf(part, sizeof(part), "%s.part", path);
+        if (!proto_path_is_safe(path) || stat(part, &st) == -1 || (unsigned long long)st.st_size < offset) {
+            dropped = 1;
+            continue;
         }
+        checkpoint *p = realloc(checkpoints, (checkpoint_count + 1) * sizeof(checkpoint));
+        if (!p) break;
+        checkpoints = p;
+        snprintf(checkpoints[checkpoint_count].path, PATH_MAX, "%s", path);
+        checkpoints[checkpoint_count].size = size;
+        checkpoints[checkpoint_count].offset = offset;
+        checkpoint_count++;
+    }
+    fclose(fp);
+    if (dropped) save_checkpoints();
+}
+
+// 把未完成下载的检查点发送给服务器，下载这些文件时服务器从检查点继续发送
+static void send_checkpoints(int sockfd) {
+    unsigned char payload[PROTO_MAX_CONTROL];
+    size_t len = 0;
+    for (int i = 0; i < checkpoint_count; i++) {
+        size_t n = proto_encode_resume(payload + len, sizeof(payload) - len, checkpoints[i].path,
+                                       checkpoints[i].size, checkpoints[i].offset);
+        if (n == 0) break;
+        len += n;
+    }
+    if (len > 0) send_frame(sockfd, OP_RESUME, payload, len);
+}
 
-        printf("Received path: %s, Type: %d\n", filepath, type);
+// 提出压缩传输：按偏好顺序列出本端支持的编码，-z none 时不发送，双方都不压缩
+static void send_codecs(int sockfd) {
+    unsigned char payload[1 + 8];
+    int n;
+    if (codec_request == CODEC_NONE) return;
+    payload[0] = codec_request_level < 0 ? 0 : codec_request_level > 255 ? 255 : codec_request_level;
+    if (codec_request > 0) {
+        payload[1] = codec_request;
+        n = 1;
+    } else {
+        n = codec_list(payload + 1);
+    }
+    if (n > 0) send_frame(sockfd, OP_CODECS, payload, 1 + n);
+}
 
-        if (type == 1) {  // 普通文件
-            printf("It's a regular file: %s\n", filepath);
-            save_file(server_socket, filepath);
-        } else if (type == 2) {  // 目录
-            printf("It's a directory: %s\n", filepath);
-            // 创建目录，假设函数create_directory存在
-            create_directory(filepath);
-        } else {
-            printf("Unknown file type\n");
-            break;
+// 检查点使用相对于下载目录的路径，去掉 download_path 开头的 "./"
+static const char *checkpoint_key(void) {
+    return strncmp(download_path, "./", 2) == 0 ? download_path + 2 : download_path;
+}
+
+// 收到 OP_FILE 的路径部分，打开 .part 文件准备接收从 offset 开始的 len 字节
+static void save_file(const char *rel, uint64_t offset, uint64_t len) {
+    download_fd = -1;
+    if (!proto_path_is_safe(rel)) {
+        fprintf(stderr, "Rejected path: %s\n", rel);
+    } else {
+        char part[PATH_MAX + 8];
+        snprintf(download_path, sizeof(download_path), "%s/%s", download_root, rel);
+        snprintf(part, sizeof(part), "%s.part", download_path);
+        checkpoint *c = find_checkpoint(checkpoint_key());
+        if (offset > 0 && (!c || c->offset != offset || c->size != offset + len)) {
+            fprintf(stderr, "Cannot resume %s, please download it again\n", rel);
+        } else if ((download_fd = open(part, O_WRONLY | O_CREAT | O_CLOEXEC | (offset > 0 ? 0 : O_TRUNC), 0644)) == -1) {
+            perror("Failed to open file for writing");
+        } else if (offset > 0 && (ftruncate(download_fd, offset) == -1 || lseek(download_fd, offset, SEEK_SET) == -1)) {
+            perror("Failed to resume file");
+            close(download_fd);
+            download_fd = -1;
         }
     }
+    download_remaining = len;
+    download_total = offset + len;
+    download_written = download_durable = offset;
+    if (offset > 0) {
+        printf("Resuming file: %s from %llu of %llu bytes\n", rel,
+               (unsigned long long)offset, (unsigned long long)download_total);
+    } else {
+        printf("Receiving file: %s, Size: %llu bytes\n", rel, (unsigned long long)len);
+    }
 }
-// 发送请求的线程函数
-void *send_request(void *sockfd) {
-    char message[BUF_SIZE];
-    while (1) {
-        if (has_input()) {
-            pthread_mutex_lock(&stdin_mutex);  // 加锁
-            fgets(message, BUF_SIZE, stdin);
-            pthread_mutex_unlock(&stdin_mutex);  // 解锁
-            message[strcspn(message, "\n")] = '\0';
-            send(*(int *)sockfd, message, strlen(message), 0);
+
+// 写入已到达的文件内容，返回消耗的字节数
+static size_t save_file_data(const unsigned char *data, size_t len) {
+    size_t n = len < download_remaining ? len : download_remaining;
+    if (download_fd != -1 && n > 0) {
+        if (write(download_fd, data, n) != (ssize_t)n) {
+            perror("Failed to write file content");
+            close(download_fd);
+            download_fd = -1;
+        } else {
+            download_written += n;
+            // 大文件定期同步并记录检查点，连接中断后从这里继续
+            if (download_total > CHECKPOINT_INTERVAL && download_written - download_durable >= CHECKPOINT_INTERVAL &&
+                fdatasync(download_fd) == 0) {
+                set_checkpoint(checkpoint_key(), download_total, download_written);
+                download_durable = download_written;
+            }
         }
-        // 其他逻辑
     }
-    return NULL;
+    download_remaining -= n;
+    if (download_remaining == 0 && download_fd != -1) {
+        char part[PATH_MAX + 16];
+        close(download_fd);
+        download_fd = -1;
+        snprintf(part, sizeof(part), "%s.part", download_path);
+        if (rename(part, download_path) == -1) {
+            perror("Failed to rename file");
+        } else {
+            printf("File received and saved: %s\n", download_path);
+        }
+        drop_checkpoint(checkpoint_key());
+    }
+    return n;
 }
 
-// 接收响应的线程函数
-void *receive_response(void *sockfd) {
-    char buffer[BUF_SIZE];
-    ssize_t len;
-    while (1) {
-        len = recv(*(int *)sockfd, buffer, sizeof(buffer), 0);
-        if (len == -1) {
-            handle_error("recv");
-        } else if (len == 0) {
-            printf("Server closed the connection\n");
+// 处理一个完整的帧，返回 -1 表示服务器结束了会话
+static int handle_frame(const frame_header *hdr, const unsigned char *payload) {
+    switch (hdr->opcode) {
+        case OP_TEXT:
+            fwrite(payload, 1, hdr->length, stdout);
+            fflush(stdout);
+            break;
+        case OP_ERROR:
+            fprintf(stderr, "Server error: %.*s\n", (int)hdr->length, (const char *)payload);
+            break;
+        case OP_UPLOAD_REQ:
+            if (hdr->length >= 1) pending_upload = payload[0];
+            upload_resume_len = 0;
+            upload_resume_received = 0;
+            break;
+        case OP_RESUME:
+            memcpy(upload_resume, payload, hdr->length);
+            upload_resume_len = hdr->length;
+            upload_resume_received = 1;
+            break;
+        case OP_SIGNATURES: {
+            uint32_t header[4];
+            if (hdr->length < DELTA_SIG_HEADER || (hdr->length - DELTA_SIG_HEADER) % DELTA_SIG_SIZE != 0) break;
+            memcpy(header, payload, sizeof(header));
+            uint32_t count = ntohl(header[1]), first = ntohl(header[3]);
+            uint32_t n = (hdr->length - DELTA_SIG_HEADER) / DELTA_SIG_SIZE;
+            if (first == 0) {
+                free(sigs);
+                sigs = count > 0 && count <= DELTA_MAX_BLOCKS ? malloc((size_t)count * DELTA_SIG_SIZE) : NULL;
+                sig_block_size = ntohl(header[0]);
+                sig_count = sigs ? count : 0;
+                sig_last_len = ntohl(header[2]);
+                sig_received = 0;
+            }
+            if (sig_count > 0 && first == sig_received && n <= sig_count - first) {
+                memcpy(sigs + (size_t)first * DELTA_SIG_SIZE, payload + DELTA_SIG_HEADER, (size_t)n * DELTA_SIG_SIZE);
+                sig_received += n;
+            }
+            if (sig_received == sig_count) sig_ready = 1;
             break;
         }
-
-        buffer[len] = '\0';  // 确保字符串结尾是 '\0'
-        printf("%s\n", buffer);
-
-          // 处理上传和下载项目的请求
-          if (strncmp(buffer, "Enter project name to upload: ", 29) == 0) {
-            printf("Prepare to Upload\n");
-            char buf[100];
-            // 使用 fgets 获取用户输入
-            printf("Locking mutex\n");
-            pthread_mutex_lock(&stdin_mutex);  // 加锁
-            printf("Locking mutex\n");
-            fgets(buf, sizeof(buf), stdin);
-            pthread_mutex_unlock(&stdin_mutex);  // 解锁
-            buf[strcspn(buf, "\n")] = '\0';
-                // 发送到服务器
-                send(*(int *)sockfd, buf, strlen(buf), 0);  // 发送去除换行符后的数据
-                printf("You entered: %s\n", buf);
-                // 调用发送项目函数
-                send_directory(*(int *)sockfd, buf);
-                    printf("Project uploaded successfully\n"); 
-     
-        } /* else if (strncmp(buffer, "Enter project name to download: ", 30) == 0) {
-            printf("Enter project name to download: ");
-            pthread_mutex_lock(&stdin_mutex);  // 加锁
-            fgets(buffer, BUF_SIZE, stdin);
-            pthread_mutex_unlock(&stdin_mutex);  // 解锁
-            buffer[strcspn(buffer, "\n")] = '\0';
-            send(*(int *)sockfd, buffer, strlen(buffer), 0);
-            if (receive_project(*(int *)sockfd, buffer) == 0) {
-                printf("Project downloaded successfully\n");
+        case OP_CODECS:
+            if (hdr->length == 2 && (payload[0] == CODEC_NONE || codec_supported(payload[0]))) {
+                transfer_codec = payload[0];
+                transfer_level = payload[1];
+            }
+            if (transfer_codec != CODEC_NONE) printf("Compression: %s\n", codec_name(transfer_codec));
+            break;
+        case OP_ZFILE: {
+            uint16_t path_len;
+            uint64_t offset, raw_len;
+            char rel[PATH_MAX];
+            if (hdr->length < 2) return -1;
+            memcpy(&path_len, payload, 2);
+            path_len = ntohs(path_len);
+            if (path_len >= PATH_MAX || hdr->length != 2u + path_len + 16) return -1;
+            memcpy(rel, payload + 2, path_len);
+            rel[path_len] = '\0';
+            memcpy(&offset, payload + 2 + path_len, 8);
+            memcpy(&raw_len, payload + 10 + path_len, 8);
+            save_file(rel, be64toh(offset), be64toh(raw_len));
+            download_compressed = download_remaining > 0;
+            if (download_remaining == 0) save_file_data(NULL, 0);
+            break;
+        }
+        case OP_ZDATA: {
+            static unsigned char raw[CODEC_BLOCK_SIZE];
+            long n;
+            if (!download_compressed || (n = codec_decode_block(payload, hdr->length, raw)) < 0 ||
+                (uint64_t)n > download_remaining) {
+                fprintf(stderr, "Bad compressed block\n");
+                return -1;
+            }
+            save_file_data(raw, n);
+            if (download_remaining == 0) download_compressed = 0;
+            break;
+        }
+        case OP_SYNC_MANIFEST:
+            sync_receive(payload, hdr->length);
+            break;
+        case OP_SESSION:
+            // 空的 payload 表示凭据已经作废（退出登录或恢复失败）
+            has_session_token = hdr->length == SESSION_TOKEN_SIZE + 4;
+            if (has_session_token) memcpy(session_token, payload, SESSION_TOKEN_SIZE);
+            break;
+        case OP_CHUNK_NEED:
+            memcpy(chunk_need, payload, hdr->length);
+            chunk_need_len = hdr->length;
+            chunk_need_ready = 1;
+            break;
+        case OP_PARALLEL_READY:
+            if (hdr->length == PARALLEL_TOKEN_SIZE + 1) {
+                memcpy(parallel_token, payload, PARALLEL_TOKEN_SIZE);
+                parallel_accepted = payload[PARALLEL_TOKEN_SIZE];
             } else {
-                printf("Failed to download project\n");
+                parallel_accepted = 0;
             }
-        }  */     
+            parallel_ready = 1;
+            break;
+        case OP_DOWNLOAD_BEGIN:
+            // 下载项目时在当前目录下创建同名目录
+            if (hdr->length >= 2 && payload[0] == UPLOAD_KIND_PROJECT) {
+                snprintf(download_root, sizeof(download_root), "%.*s", (int)hdr->length - 1, (const char *)payload + 1);
+                if (!proto_path_is_safe(download_root) || strchr(download_root, '/') != NULL) {
+                    strcpy(download_root, ".");
+                } else {
+                    create_directory(download_root);
+                }
+            } else {
+                strcpy(download_root, ".");
+            }
+            break;
+        case OP_DIR: {
+            char rel[PATH_MAX];
+            char local[PATH_MAX * 2];
+            snprintf(rel, sizeof(rel), "%.*s", (int)hdr->length, (const char *)payload);
+            if (proto_path_is_safe(rel)) {
+                snprintf(local, sizeof(local), "%s/%s", download_root, rel);
+                create_directory(local);
+            }
+            break;
+        }
+        case OP_DOWNLOAD_END:
+            strcpy(download_root, ".");
+            break;
+        case OP_BYE:
+            return -1;
+        default:
+            fprintf(stderr, "Unknown frame opcode %d\n", hdr->opcode);
+            break;
     }
-    return NULL;
+    return 0;
 }
 
-int main(int argc ,char*argv[]) {
-   /*  if (argc < 3) {
-        fprintf(stderr, "Usage: %s <domain> <port>\n", argv[0]);
+// 接收服务器数据并处理其中所有完整的帧，返回 -1 表示连接已结束
+int receive_response(int sockfd) {
+    ssize_t len = recv(sockfd, recv_buf + recv_len, sizeof(recv_buf) - recv_len, 0);
+    if (len == -1) {
+        if (errno == EINTR) return 0;
+        perror("recv");
+        connection_lost = 1;
+        return -1;
+    } else if (len == 0) {
+        printf("Server closed the connection\n");
+        connection_lost = 1;
         return -1;
-    } */
+    }
+    recv_len += len;
+
+    size_t off = 0;
+    while (off < recv_len) {
+        // OP_FILE 的文件内容边收边写，不需要整帧缓存
+        if (download_remaining > 0 && !download_compressed) {
+            off += save_file_data(recv_buf + off, recv_len - off);
+            continue;
+        }
+        if (recv_len - off < PROTO_HEADER_SIZE) break;
+
+        frame_header hdr;
+        if (proto_decode_header(recv_buf + off, &hdr) < 0) {
+            fprintf(stderr, "Protocol error\n");
+            return -1;
+        }
+        if (hdr.opcode == OP_FILE) {
+            uint16_t path_len;
+            uint64_t offset;
+            if (hdr.length < 2 || recv_len - off < PROTO_HEADER_SIZE + 2) {
+                if (hdr.length < 2) return -1;
+                break;
+            }
+            memcpy(&path_len, recv_buf + off + PROTO_HEADER_SIZE, 2);
+            path_len = ntohs(path_len);
+            size_t prefix_len = 2u + path_len + 8;
+            if (path_len >= PATH_MAX || hdr.length < prefix_len) return -1;
+            if (recv_len - off < PROTO_HEADER_SIZE + prefix_len) break;
+
+            char rel[PATH_MAX];
+            memcpy(rel, recv_buf + off + PROTO_HEADER_SIZE + 2, path_len);
+            rel[path_len] = '\0';
+            memcpy(&offset, recv_buf + off + PROTO_HEADER_SIZE + 2 + path_len, 8);
+            off += PROTO_HEADER_SIZE + prefix_len;
+            save_file(rel, be64toh(offset), hdr.length - prefix_len);
+            if (download_remaining == 0) save_file_data(NULL, 0);
+            continue;
+        }
+        if (hdr.length > (hdr.opcode == OP_ZDATA ? CODEC_FRAME_MAX : PROTO_MAX_CONTROL)) {
+            fprintf(stderr, "Protocol error\n");
+            return -1;
+        }
+        if (recv_len - off < PROTO_HEADER_SIZE + hdr.length) break;
+        if (handle_frame(&hdr, recv_buf + off + PROTO_HEADER_SIZE) < 0) return -1;
+        off += PROTO_HEADER_SIZE + hdr.length;
+    }
+    memmove(recv_buf, recv_buf + off, recv_len - off);
+    recv_len -= off;
+    return 0;
+}
+
+// 连接意外断开：重新连接服务器并出示会话凭据，服务器验证后直接回到主菜单；返回新的 socket，失败返回 -1
+static int reconnect_server(void) {
+    // 未完成的下载保留 .part 和检查点，再次下载时从检查点继续
+    if (download_fd != -1) {
+        close(download_fd);
+        download_fd = -1;
+    }
+    download_remaining = 0;
+    download_compressed = 0;
+    recv_len = 0;
+    pending_upload = -1;
+    transfer_codec = CODEC_NONE;  // 新连接重新协商
+    connection_lost = 0;
+
+    printf("Connection lost, reconnecting...\n");
+    for (int attempt = 0, delay = 1; attempt < RECONNECT_ATTEMPTS; attempt++, delay *= 2) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd == -1) handle_error("socket");
+        if (connect(fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) == 0) {
+            send_checkpoints(fd);
+            send_codecs(fd);
+            send_frame(fd, OP_SESSION, session_token, SESSION_TOKEN_SIZE);
+            return fd;
+        }
+        close(fd);
+        sleep(delay);
+    }
+    fprintf(stderr, "Failed to reconnect\n");
+    return -1;
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "j:z:")) != -1) {
+        switch (opt) {
+            case 'j':
+                parallel_streams = atoi(optarg);
+                break;
+            case 'z': {
+                // -z 编码[:级别]，-z none 关闭压缩
+                char *level = strchr(optarg, ':');
+                if (level) *level++ = '\0';
+                if (strcmp(optarg, "none") == 0) {
+                    codec_request = CODEC_NONE;
+                } else if ((codec_request = codec_parse(optarg)) == CODEC_NONE || !codec_supported(codec_request)) {
+                    fprintf(stderr, "Unsupported codec: %s\n", optarg);
+                    return 1;
+                }
+                codec_request_level = level ? atoi(level) : 0;
+                break;
+            }
+            default:
+                fprintf(stderr, "Usage: %s [-j streams] [-z codec[:level]] [host] [port]\n", argv[0]);
+                return 1;
+        }
+    }
+    const char *host = optind < argc ? argv[optind] : SERVER_IP;
+    int port = optind + 1 < argc ? atoi(argv[optind + 1]) : PORT;
 
     int sockfd;
-    struct sockaddr_in server_addr;
     struct hostent *server;
-    
+
     // 获取域名对应的主机信息
-/*     server = gethostbyname(argv[1]);
+    server = gethostbyname(host);
     if (server == NULL) {
         fprintf(stderr, "Error: No such host\n");
         return -1;
-    } */
+    }
 
     // 创建套接字
     sockfd = socket(AF_INET, SOCK_STREAM, 0);
     if (sockfd == -1) handle_error("socket");
 
+    memset(&server_addr, 0, sizeof(server_addr));
     server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(8888/* atoi *//* argv[2] */);  // 使用传入的端口号
-    //memcpy((char *)&server_addr.sin_addr.s_addr, (char *)server->h_addr, server->h_length);
-    server_addr.sin_addr.s_addr = inet_addr("47.109.85.43");
+    server_addr.sin_port = htons(port);
+    memcpy(&server_addr.sin_addr.s_addr, server->h_addr, server->h_length);
     // 连接服务器
     if (connect(sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1) {
         handle_error("connect");
     }
 
-    // 创建发送请求和接收响应的线程
-    pthread_t send_thread, recv_thread;
-    if (pthread_create(&send_thread, NULL, send_request, (void *)&sockfd) != 0) {
-        handle_error("pthread_create send_thread");
-    }
-    if (pthread_create(&recv_thread, NULL, receive_response, (void *)&sockfd) != 0) {
-        handle_error("pthread_create recv_thread");
-    }
+    cdc_init();
+
+    // 先告诉服务器上次中断的下载，之后下载这些文件时从检查点继续
+    load_checkpoints();
+    send_checkpoints(sockfd);
+    send_codecs(sockfd);
 
-    // 等待两个线程结束
-    pthread_detach(send_thread);
-    pthread_detach(recv_thread);
-    while(1);  // 无限循环保持线程活动
+    // 同时等待用户输入和服务器数据：输入的每一行立即作为一个请求帧发出，不等待上一个回复
+    struct pollfd fds[2];
+    fds[0].fd = sockfd;
+    fds[0].events = POLLIN;
+    fds[1].fd = STDIN_FILENO;
+    fds[1].events = POLLIN;
+    int stdin_open = 1;
+    char message[BUF_SIZE];
+    size_t message_len = 0;
+
+    while (1) {
+        if (poll(fds, stdin_open ? 2 : 1, -1) == -1) {
+            if (errno == EINTR) continue;
+            handle_error("poll");
+        }
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            if (receive_response(sockfd) < 0) {
+                // 登录后连接意外断开，并且还有输入要发送：重新连接并恢复登录
+                if (!connection_lost || !stdin_open || !has_session_token) break;
+                close(sockfd);
+                if ((sockfd = reconnect_server()) == -1) return 1;
+                fds[0].fd = sockfd;
+                continue;
+            }
+        }
+        if (stdin_open && (fds[1].revents & (POLLIN | POLLHUP))) {
+            // 直接读取标准输入，一次读到的多行逐行作为请求发出
+            ssize_t n = read(STDIN_FILENO, message + message_len, sizeof(message) - 1 - message_len);
+            if (n <= 0) {
+                if (message_len > 0) {
+                    message[message_len] = '\0';
+                    send_request(sockfd, message);
+                }
+                // 输入结束：关闭发送方向，继续接收剩余的回复
+                stdin_open = 0;
+                shutdown(sockfd, SHUT_WR);
+                continue;
+            }
+            message_len += n;
+
+            char *start = message;
+            char *nl;
+            while ((nl = memchr(start, '\n', message + message_len - start)) != NULL) {
+                *nl = '\0';
+                send_request(sockfd, start);
+                start = nl + 1;
+            }
+            message_len -= start - message;
+            memmove(message, start, message_len);
+            if (message_len == sizeof(message) - 1) {  // 超长的一行直接发出
+                message[message_len] = '\0';
+                send_request(sockfd, message);
+                message_len = 0;
+            }
+        }
+    }
 
     close(sockfd);
     return 0;
@@ -16,28 +16,37 @@
 #include <errno.h>
 #include <signal.h>
 #include <fcntl.h>
-// 文件传输协议相关常量
-#define PROTO_BEGIN "BEGIN"
-#define PROTO_END "END"
-#define PROTO_SIZE "SIZE"
-#define PROTO_DATA "DATA"
-#define PROTO_OK "OK"
-#define PROTO_ERROR "ERROR"
-#define CHUNK_SIZE 4096
+#include <limits.h>
+#include "proto.h"  // 二进制帧协议
+#include "cdc.h"    // 内容定义分块
+#include "delta.h"  // 增量上传的块签名
+#include "codec.h"  // 文件内容的分块压缩
+#include "xxhash.h" // 项目同步清单的内容哈希
 
 #define BUF_SIZE 1024
-#define SERVER_IP "116.205.97.83"
+#define SERVER_IP "47.109.85.43"
 #define PORT 8888
+#define RESUME_INDEX ".panhub_resume"  // 下载目录中的检查点索引
+#define PARALLEL_MIN_SIZE (64LL * 1024 * 1024)    // 不小于这个大小的文件才并行上传
+#define PARALLEL_AUTO_RANGE (32LL * 1024 * 1024)  // 自动选择连接数时每条连接大约负责的长度
+#define PARALLEL_AUTO_STREAMS 8                    // 自动选择时的最大连接数
+#define PARALLEL_ALIGN (1024 * 1024)               // 分段边界按 1MB 对齐
+#define CDC_READ_SIZE (4 * CDC_MAX_SIZE)           // 分块时每次读入的数据
+#define UPLOAD_WALKERS 4                           // 上传项目时并行遍历目录、预读文件的线程数
+#define UPLOAD_QUEUE_BYTES (16 * 1024 * 1024)      // 预读队列中文件内容的上限
+#define UPLOAD_QUEUE_ITEMS 4096                    // 预读队列中的最大条目数
+#define UPLOAD_READAHEAD (4 * 1024 * 1024)         // 单独发送的大文件提前让内核预读的长度
+#define RECONNECT_ATTEMPTS 5                       // 连接断开后重试的次数，间隔从 1 秒开始加倍
 
 // 函数声明
 void handle_error(const char *msg);
-void *send_request(void *sockfd);
-void *receive_response(void *sockfd);
+int send_frame(int sockfd, uint8_t opcode, const void *payload, size_t len);
+void send_request(int sockfd, char *line);
+int receive_response(int sockfd);
 
 // 文件传输相关函数声明
-void receive_file(int sockfd, const char *file_path);
-void send_file(int sockfd, const char *file_path);
-int receive_project(int sockfd, const char *project_name);
-int send_project(int sockfd, const char *project_name);
+void send_file(int sockfd, const char *file_path, const char *remote_path);
+void send_directory(int sockfd, const char *root);
+int send_project(int sockfd, const char *project_path);
 
 #endif
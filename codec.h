@@ -0,0 +1,174 @@
+#ifndef CODEC_H
+#define CODEC_H
+
+// 文件内容的分块压缩：内容按 CODEC_BLOCK_SIZE 分块，每块独立压缩成一个 OP_ZDATA 帧，
+// 收发双方只需要一块大小的缓冲区。压缩后没有变小的块（已经压缩过的文件等）原样发送。
+// 可用的编码在编译时决定：-DHAVE_LZ4 -llz4、-DHAVE_ZSTD -lzstd、-DHAVE_ZLIB -lz。
+
+#include <stdint.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+enum {
+    CODEC_NONE = 0,
+    CODEC_LZ4 = 1,
+    CODEC_ZSTD = 2,
+    CODEC_DEFLATE = 3
+};
+
+#define CODEC_BLOCK_SIZE (64 * 1024)   // 每块压缩前的最大长度
+#define CODEC_BLOCK_HEADER 5           // OP_ZDATA 的头部：[1 字节编码][4 字节原始长度]
+#define CODEC_FRAME_MAX (CODEC_BLOCK_HEADER + CODEC_BLOCK_SIZE)  // OP_ZDATA payload 的上限
+#define CODEC_SEND_LEVEL_MAX 6         // 服务器压缩下载内容时的最高级别：在工作线程上压缩，不让客户端选的高级别拖慢其他会话
+
+static inline const char *codec_name(int codec) {
+    switch (codec) {
+        case CODEC_LZ4: return "lz4";
+        case CODEC_ZSTD: return "zstd";
+        case CODEC_DEFLATE: return "deflate";
+        default: return "none";
+    }
+}
+
+static inline int codec_supported(int codec) {
+    switch (codec) {
+#ifdef HAVE_LZ4
+        case CODEC_LZ4: return 1;
+#endif
+#ifdef HAVE_ZSTD
+        case CODEC_ZSTD: return 1;
+#endif
+#ifdef HAVE_ZLIB
+        case CODEC_DEFLATE: return 1;
+#endif
+        default: return 0;
+    }
+}
+
+// 按名称查找编码，未知的名称返回 CODEC_NONE
+static inline int codec_parse(const char *name) {
+    for (int codec = CODEC_LZ4; codec <= CODEC_DEFLATE; codec++) {
+        if (strcmp(name, codec_name(codec)) == 0) return codec;
+    }
+    return CODEC_NONE;
+}
+
+// 按偏好顺序列出本端支持的编码，返回个数
+static inline int codec_list(uint8_t *out) {
+    static const uint8_t preferred[] = {CODEC_ZSTD, CODEC_LZ4, CODEC_DEFLATE};
+    int n = 0;
+    for (size_t i = 0; i < sizeof(preferred); i++) {
+        if (codec_supported(preferred[i])) out[n++] = preferred[i];
+    }
+    return n;
+}
+
+// 把级别限制在编码支持的范围内，0 表示默认级别；LZ4 没有级别
+static inline int codec_level(int codec, int level) {
+    switch (codec) {
+        case CODEC_ZSTD: return level <= 0 ? 3 : level > 19 ? 19 : level;
+        case CODEC_DEFLATE: return level <= 0 ? 6 : level > 9 ? 9 : level;
+        default: return 0;
+    }
+}
+
+// 服务器自己压缩时使用的级别：客户端选的级别只用于客户端的上传，服务器压缩不超过 CODEC_SEND_LEVEL_MAX
+static inline int codec_send_level(int codec, int level) {
+    level = codec_level(codec, level);
+    return level > CODEC_SEND_LEVEL_MAX ? CODEC_SEND_LEVEL_MAX : level;
+}
+
+// 压缩 len 字节到 dst，结果放不进 cap 字节（没有变小）或出错时返回 0
+static inline size_t codec_compress(int codec, int level, const void *src, size_t len, void *dst, size_t cap) {
+    switch (codec) {
+#ifdef HAVE_LZ4
+        case CODEC_LZ4: {
+            int n = LZ4_compress_default(src, dst, (int)len, (int)cap);
+            return n > 0 ? (size_t)n : 0;
+        }
+#endif
+#ifdef HAVE_ZSTD
+        case CODEC_ZSTD: {
+            static __thread ZSTD_CCtx *cctx;  // 每个线程复用一个压缩上下文
+            if (!cctx && !(cctx = ZSTD_createCCtx())) return 0;
+            size_t n = ZSTD_compressCCtx(cctx, dst, cap, src, len, level);
+            return ZSTD_isError(n) ? 0 : n;
+        }
+#endif
+#ifdef HAVE_ZLIB
+        case CODEC_DEFLATE: {
+            uLongf n = cap;
+            return compress2(dst, &n, src, len, level) == Z_OK ? (size_t)n : 0;
+        }
+#endif
+        default:
+            (void)level; (void)src; (void)len; (void)dst; (void)cap;
+            return 0;
+    }
+}
+
+// 解压一块，结果必须恰好是 raw_len 字节，成功返回 0
+static inline int codec_decompress(int codec, const void *src, size_t len, void *dst, size_t raw_len) {
+    switch (codec) {
+        case CODEC_NONE:
+            if (len != raw_len) return -1;
+            memcpy(dst, src, len);
+            return 0;
+#ifdef HAVE_LZ4
+        case CODEC_LZ4:
+            return LZ4_decompress_safe(src, dst, (int)len, (int)raw_len) == (int)raw_len ? 0 : -1;
+#endif
+#ifdef HAVE_ZSTD
+        case CODEC_ZSTD: {
+            size_t n = ZSTD_decompress(dst, raw_len, src, len);
+            return !ZSTD_isError(n) && n == raw_len ? 0 : -1;
+        }
+#endif
+#ifdef HAVE_ZLIB
+        case CODEC_DEFLATE: {
+            uLongf n = raw_len;
+            return uncompress(dst, &n, src, len) == Z_OK && n == raw_len ? 0 : -1;
+        }
+#endif
+        default:
+            return -1;
+    }
+}
+
+// 把一块内容编码为 OP_ZDATA 的 payload，返回 payload 长度；out 至少要有 CODEC_FRAME_MAX 字节
+static inline size_t codec_encode_block(int codec, int level, const void *src, size_t len, unsigned char *out) {
+    uint32_t raw_len = htonl((uint32_t)len);
+    size_t n = codec != CODEC_NONE && len > 1 ? codec_compress(codec, level, src, len, out + CODEC_BLOCK_HEADER, len - 1) : 0;
+    if (n == 0) {
+        codec = CODEC_NONE;
+        memcpy(out + CODEC_BLOCK_HEADER, src, len);
+        n = len;
+    }
+    out[0] = codec;
+    memcpy(out + 1, &raw_len, 4);
+    return CODEC_BLOCK_HEADER + n;
+}
+
+// 解码一个 OP_ZDATA 的 payload 到 dst（至少 CODEC_BLOCK_SIZE 字节），返回原始长度，格式错误时返回 -1
+static inline long codec_decode_block(const unsigned char *payload, size_t len, unsigned char *dst) {
+    uint32_t raw_len;
+    if (len < CODEC_BLOCK_HEADER) return -1;
+    memcpy(&raw_len, payload + 1, 4);
+    raw_len = ntohl(raw_len);
+    if (raw_len > CODEC_BLOCK_SIZE) return -1;
+    if (payload[0] != CODEC_NONE && !codec_supported(payload[0])) return -1;
+    if (codec_decompress(payload[0], payload + CODEC_BLOCK_HEADER, len - CODEC_BLOCK_HEADER, dst, raw_len) < 0) return -1;
+    return raw_len;
+}
+
+#endif
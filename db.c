@@ -0,0 +1,662 @@
+#include "server.h"
+#include <pthread.h>
+
+// 数据库访问层：users.db 使用 WAL 日志，读和写使用不同的连接。
+// 写入只在写线程的连接上执行：调用方把语句和参数放进队列后等待，写线程把一个很短的窗口内
+// 到达的写入合并成一个事务提交，提交（同步到磁盘）后再唤醒这些调用方，多次写入只需要一次 fsync。
+// 工作线程（db_async_writes）不等待：参数复制到堆上放进队列后立即返回，事件循环不会停在提交窗口
+// 和 fsync 上，失败由写线程记录日志。这些写入是检查点、同步清单和活动记录，提交之前的短暂时间内
+// 查询可能还看不到它们，结果只是多传一次文件或少显示一条记录。积压超过 DB_ASYNC_MAX 时退回到等待提交。
+// 每个线程第一次查询时打开自己的只读连接，WAL 下读取不会被写入阻塞。
+// 每个连接按语句编号缓存预编译的语句，用完后 reset 重复使用。
+
+#define DB_PATH "users.db"
+#define DB_BUSY_TIMEOUT_MS 5000
+#define DB_COMMIT_WINDOW_US 1000  // 写线程收到第一个写入后等待这么久，合并同时到达的写入
+#define DB_ASYNC_MAX 4096         // 队列中最多这么多条还没提交的异步写入
+
+// 预编译语句的编号和 SQL
+enum {
+    SQL_USER_COUNT,
+    SQL_USER_ADD,
+    SQL_USER_PASSWORD,
+    SQL_USER_SET_PASSWORD,
+    SQL_USER_EXISTS,
+    SQL_CHECKPOINT_SAVE,
+    SQL_CHECKPOINT_GET,
+    SQL_CHECKPOINT_DELETE,
+    SQL_CHECKPOINT_LIST,
+    SQL_SYNC_PUT,
+    SQL_SYNC_GET,
+    SQL_SYNC_DELETE,
+    SQL_SYNC_LIST,
+    SQL_ACTIVITY_ADD,
+    SQL_ACTIVITY_USER,
+    SQL_ACTIVITY_PROJECT,
+    SQL_ACTIVITY_FILE,
+    SQL_COUNT
+};
+
+static const char *const sql_text[SQL_COUNT] = {
+    [SQL_USER_COUNT] = "SELECT COUNT(*) FROM users;",
+    [SQL_USER_ADD] = "INSERT INTO users (username, password) VALUES (?, ?);",
+    [SQL_USER_PASSWORD] = "SELECT password FROM users WHERE username = ?;",
+    [SQL_USER_SET_PASSWORD] = "UPDATE users SET password = ? WHERE username = ?;",
+    [SQL_USER_EXISTS] = "SELECT id FROM users WHERE username = ?;",
+    [SQL_CHECKPOINT_SAVE] = "INSERT OR REPLACE INTO transfer_checkpoints (username, project, path, size, offset) "
+                            "VALUES (?, ?, ?, ?, ?);",
+    [SQL_CHECKPOINT_GET] = "SELECT offset FROM transfer_checkpoints "
+                           "WHERE username = ? AND project = ? AND path = ? AND size = ?;",
+    [SQL_CHECKPOINT_DELETE] = "DELETE FROM transfer_checkpoints WHERE username = ? AND project = ? AND path = ?;",
+    [SQL_CHECKPOINT_LIST] = "SELECT path, size, offset FROM transfer_checkpoints WHERE username = ? AND project = ?;",
+    [SQL_SYNC_PUT] = "INSERT OR REPLACE INTO project_files (username, project, path, kind, size, mtime, hash, local_mtime) "
+                     "VALUES (?, ?, ?, ?, ?, ?, ?, ?);",
+    [SQL_SYNC_GET] = "SELECT kind, size, mtime, hash, local_mtime FROM project_files "
+                     "WHERE username = ? AND project = ? AND path = ?;",
+    [SQL_SYNC_DELETE] = "DELETE FROM project_files WHERE username = ? AND project = ? AND path = ?;",
+    [SQL_SYNC_LIST] = "SELECT path, kind, size, mtime, hash, local_mtime FROM project_files "
+                      "WHERE username = ? AND project = ?;",
+    [SQL_ACTIVITY_ADD] = "INSERT INTO activity (time, username, project, file, action) VALUES (?, ?, ?, ?, ?);",
+    // 三个查询分别指定对应的索引（没有统计信息时 SQLite 可能选择只按用户的索引再逐条过滤）；
+    // (time, id) 作为翻页位置，每页都是索引上的一段连续范围
+    [SQL_ACTIVITY_USER] = "SELECT id, time, project, file, action FROM activity INDEXED BY activity_user "
+                          "WHERE username = ?1 AND time >= ?4 AND (time, id) < (?5, ?6) "
+                          "ORDER BY time DESC, id DESC LIMIT ?7;",
+    [SQL_ACTIVITY_PROJECT] = "SELECT id, time, project, file, action FROM activity INDEXED BY activity_project "
+                             "WHERE username = ?1 AND project = ?2 AND time >= ?4 AND (time, id) < (?5, ?6) "
+                             "ORDER BY time DESC, id DESC LIMIT ?7;",
+    [SQL_ACTIVITY_FILE] = "SELECT id, time, project, file, action FROM activity INDEXED BY activity_file "
+                          "WHERE username = ?1 AND project = ?2 AND file = ?3 AND time >= ?4 AND (time, id) < (?5, ?6) "
+                          "ORDER BY time DESC, id DESC LIMIT ?7;",
+};
+
+// 一个数据库连接和它缓存的语句
+typedef struct db_conn {
+    sqlite3 *db;
+    sqlite3_stmt *stmts[SQL_COUNT];
+    struct db_conn *next;
+} db_conn;
+
+// 写入语句的参数：调用方等待写入完成，文本和 BLOB 直接引用调用方的缓冲区
+typedef struct {
+    enum { DB_VAL_TEXT, DB_VAL_INT, DB_VAL_BLOB } type;
+    const void *ptr;
+    long long num;
+    size_t len;
+} db_value;
+
+#define DB_TEXT(s) {DB_VAL_TEXT, (s), 0, 0}
+#define DB_INT(v) {DB_VAL_INT, NULL, (v), 0}
+#define DB_BLOB(p, n) {DB_VAL_BLOB, (p), 0, (n)}
+#define DB_WRITE(id, values) db_write(id, values, sizeof(values) / sizeof(values[0]))
+#define DB_BATCH_WRITE(b, id, values) db_batch_write(b, id, values, sizeof(values) / sizeof(values[0]))
+
+// 写队列中的一次写入，在调用方的栈上；异步写入是 db_job_copy 复制的副本
+typedef struct db_write_job {
+    int id;
+    const db_value *values;
+    int count;
+    int rc;                     // sqlite3_step 的结果，事务提交失败时为 SQLITE_ERROR
+    int done;
+    int async;                  // 调用方不等待，写线程提交后释放
+    struct db_write_job *next;
+} db_write_job;
+
+static db_conn *writer;                                     // 唯一的写连接，只在写线程中使用
+static pthread_t writer_tid;
+static int writer_running;
+static int writer_stop;
+static db_write_job *write_head, *write_tail;               // 等待写线程处理的写入
+static pthread_mutex_t write_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t write_ready = PTHREAD_COND_INITIALIZER;  // 队列中有新的写入
+static pthread_cond_t write_done = PTHREAD_COND_INITIALIZER;   // 一批写入已经提交
+static int async_pending;                                   // 队列中和正在提交的异步写入数
+static __thread int write_async;                            // 本线程的写入不等待提交
+static __thread db_conn *reader;                            // 本线程的只读连接
+static db_conn *readers;                                    // 所有线程打开的只读连接，关闭数据库时释放
+static pthread_mutex_t readers_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// 两种连接都只在一个线程中使用，不需要 SQLite 自己的互斥锁
+static db_conn *db_conn_open(int flags) {
+    db_conn *c = calloc(1, sizeof(db_conn));
+    if (!c) return NULL;
+    if (sqlite3_open_v2(DB_PATH, &c->db, flags | SQLITE_OPEN_NOMUTEX, NULL) != SQLITE_OK) {
+        log_error("Cannot open database: %s", sqlite3_errmsg(c->db));
+        sqlite3_close(c->db);
+        free(c);
+        return NULL;
+    }
+    sqlite3_busy_timeout(c->db, DB_BUSY_TIMEOUT_MS);
+    return c;
+}
+
+static void db_conn_close(db_conn *c) {
+    for (int i = 0; i < SQL_COUNT; i++) {
+        sqlite3_finalize(c->stmts[i]);
+    }
+    sqlite3_close(c->db);
+    free(c);
+}
+
+// 取出缓存的语句，第一次使用时编译
+static sqlite3_stmt *db_stmt(db_conn *c, int id) {
+    if (!c->stmts[id] &&
+        sqlite3_prepare_v3(c->db, sql_text[id], -1, SQLITE_PREPARE_PERSISTENT, &c->stmts[id], NULL) != SQLITE_OK) {
+        log_error("Failed to prepare statement: %s", sqlite3_errmsg(c->db));
+        return NULL;
+    }
+    return c->stmts[id];
+}
+
+// 语句用完后复位，绑定的参数是调用方的缓冲区，不能留到下一次使用
+static void db_stmt_done(sqlite3_stmt *stmt) {
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+}
+
+// 本线程的只读连接
+static db_conn *db_reader(void) {
+    if (reader) return reader;
+    reader = db_conn_open(SQLITE_OPEN_READONLY);
+    if (!reader) return NULL;
+    pthread_mutex_lock(&readers_lock);
+    reader->next = readers;
+    readers = reader;
+    pthread_mutex_unlock(&readers_lock);
+    return reader;
+}
+
+static sqlite3_stmt *db_read_begin(int id) {
+    db_conn *c = db_reader();
+    return c ? db_stmt(c, id) : NULL;
+}
+
+// 在写连接上执行不带参数的 SQL：建表，或者写线程的 BEGIN / COMMIT
+static int db_exec(const char *sql) {
+    char *err_msg = NULL;
+    if (sqlite3_exec(writer->db, sql, 0, 0, &err_msg) != SQLITE_OK) {
+        log_error("SQL error: %s", err_msg);
+        sqlite3_free(err_msg);
+        return -1;
+    }
+    return 0;
+}
+
+static void db_bind(sqlite3_stmt *stmt, const db_value *values, int count) {
+    for (int i = 0; i < count; i++) {
+        const db_value *v = &values[i];
+        if (v->type == DB_VAL_TEXT) sqlite3_bind_text(stmt, i + 1, v->ptr, -1, SQLITE_STATIC);
+        else if (v->type == DB_VAL_INT) sqlite3_bind_int64(stmt, i + 1, v->num);
+        else sqlite3_bind_blob(stmt, i + 1, v->ptr, (int)v->len, SQLITE_STATIC);
+    }
+}
+
+// 在一个事务中执行一批写入；单条语句失败（例如用户名重复）只撤销这一条
+static void db_commit_batch(db_write_job *batch) {
+    int ok = db_exec("BEGIN;") == 0;
+    for (db_write_job *j = batch; j; j = j->next) {
+        sqlite3_stmt *stmt = ok ? db_stmt(writer, j->id) : NULL;
+        if (!stmt) {
+            j->rc = SQLITE_ERROR;
+            continue;
+        }
+        db_bind(stmt, j->values, j->count);
+        j->rc = sqlite3_step(stmt);
+        db_stmt_done(stmt);
+    }
+    if (ok && db_exec("COMMIT;") < 0) {
+        db_exec("ROLLBACK;");
+        ok = 0;
+    }
+    if (!ok) {
+        for (db_write_job *j = batch; j; j = j->next) j->rc = SQLITE_ERROR;
+    }
+}
+
+// 写线程：取出队列中的所有写入一起提交，提交后唤醒等待的调用方
+static void *db_writer_main(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&write_lock);
+    for (;;) {
+        while (!write_head && !writer_stop) pthread_cond_wait(&write_ready, &write_lock);
+        if (!write_head) break;
+
+        // 第一个写入到达后稍等，让同时进行的注册、检查点等写入进入同一个事务
+        pthread_mutex_unlock(&write_lock);
+        struct timespec window = {0, DB_COMMIT_WINDOW_US * 1000};
+        nanosleep(&window, NULL);
+        pthread_mutex_lock(&write_lock);
+
+        db_write_job *batch = write_head;
+        write_head = write_tail = NULL;
+        pthread_mutex_unlock(&write_lock);
+
+        db_commit_batch(batch);
+
+        pthread_mutex_lock(&write_lock);
+        for (db_write_job *j = batch, *next; j; j = next) {
+            next = j->next;  // 设置 done 之后调用方的任务随时可能失效
+            if (!j->async) {
+                j->done = 1;
+                continue;
+            }
+            if (j->rc != SQLITE_DONE) log_warn("Database write failed: %s", sql_text[j->id]);
+            async_pending--;
+            free(j);
+        }
+        pthread_cond_broadcast(&write_done);
+    }
+    pthread_mutex_unlock(&write_lock);
+    return NULL;
+}
+
+// 异步写入的副本：任务、参数和参数引用的文本、BLOB 放在一块内存中
+static db_write_job *db_job_copy(const db_write_job *job) {
+    size_t size = sizeof(db_write_job) + job->count * sizeof(db_value);
+    for (int i = 0; i < job->count; i++) {
+        const db_value *v = &job->values[i];
+        if (v->type == DB_VAL_TEXT) size += strlen(v->ptr) + 1;
+        else if (v->type == DB_VAL_BLOB) size += v->len;
+    }
+    db_write_job *copy = malloc(size);
+    if (!copy) return NULL;
+    db_value *values = (db_value *)(copy + 1);
+    char *data = (char *)(values + job->count);
+    *copy = *job;
+    copy->values = values;
+    copy->async = 1;
+    for (int i = 0; i < job->count; i++) {
+        values[i] = job->values[i];
+        if (values[i].type == DB_VAL_INT) continue;
+        size_t len = values[i].type == DB_VAL_TEXT ? strlen(values[i].ptr) + 1 : values[i].len;
+        memcpy(data, values[i].ptr, len);
+        values[i].ptr = data;
+        data += len;
+    }
+    return copy;
+}
+
+static void db_enqueue(db_write_job *job) {
+    if (write_tail) write_tail->next = job;
+    else write_head = job;
+    write_tail = job;
+    pthread_cond_signal(&write_ready);
+}
+
+// 把一次写入交给写线程，等到它所在的事务提交后返回 sqlite3_step 的结果；
+// 异步写入的线程放进队列后直接返回 SQLITE_DONE
+static int db_write(int id, const db_value *values, int count) {
+    db_write_job job = {id, values, count, SQLITE_ERROR, 0, 0, NULL};
+    db_write_job *copy = write_async ? db_job_copy(&job) : NULL;
+
+    pthread_mutex_lock(&write_lock);
+    if (!writer_running || writer_stop) {
+        pthread_mutex_unlock(&write_lock);
+        free(copy);
+        return SQLITE_ERROR;
+    }
+    if (copy && async_pending < DB_ASYNC_MAX) {
+        async_pending++;
+        db_enqueue(copy);
+        pthread_mutex_unlock(&write_lock);
+        return SQLITE_DONE;
+    }
+    db_enqueue(&job);
+    while (!job.done) pthread_cond_wait(&write_done, &write_lock);
+    pthread_mutex_unlock(&write_lock);
+    free(copy);
+    return job.rc;
+}
+
+void db_batch_init(db_batch *b) {
+    b->head = b->tail = NULL;
+    b->count = 0;
+}
+
+// 把一次写入的副本加到 b 的末尾，b 为 NULL 时直接写入
+static int db_batch_write(db_batch *b, int id, const db_value *values, int count) {
+    if (!b) return db_write(id, values, count);
+    db_write_job job = {id, values, count, SQLITE_ERROR, 0, 0, NULL};
+    db_write_job *copy = db_job_copy(&job);
+    if (!copy) return SQLITE_ERROR;
+    if (b->tail) ((db_write_job *)b->tail)->next = copy;
+    else b->head = copy;
+    b->tail = copy;
+    b->count++;
+    return SQLITE_DONE;
+}
+
+// 整组写入一次放进队列，写线程一次取走整个队列，它们一定在同一个事务中提交
+int db_batch_commit(db_batch *b) {
+    db_write_job *head = b->head, *tail = b->tail;
+    int count = b->count;
+    db_batch_init(b);
+    if (!head) return 0;
+
+    pthread_mutex_lock(&write_lock);
+    int ok = writer_running && !writer_stop;
+    int wait = !write_async || async_pending >= DB_ASYNC_MAX;
+    if (ok) {
+        for (db_write_job *j = head; j; j = j->next) j->async = !wait;
+        if (!wait) async_pending += count;
+        if (write_tail) write_tail->next = head;
+        else write_head = head;
+        write_tail = tail;
+        pthread_cond_signal(&write_ready);
+        if (!wait) {
+            pthread_mutex_unlock(&write_lock);
+            return 0;
+        }
+        while (!tail->done) pthread_cond_wait(&write_done, &write_lock);
+    }
+    pthread_mutex_unlock(&write_lock);
+
+    while (head) {
+        db_write_job *j = head;
+        head = j->next;
+        if (j->rc != SQLITE_DONE) ok = 0;
+        free(j);
+    }
+    return ok ? 0 : -1;
+}
+
+// 本线程之后的写入是否等待提交：工作线程在事件循环开始前打开
+void db_async_writes(int on) {
+    write_async = on;
+}
+
+// 初始化数据库
+int init_database(void) {
+    writer = db_conn_open(SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE);
+    if (!writer) return -1;
+
+    // WAL 下读取不阻塞写入，提交只追加日志；synchronous=FULL 时每次提交都同步 WAL，
+    // 写入返回时已经落盘，同步的次数由写线程的批量提交控制
+    if (db_exec("PRAGMA journal_mode=WAL;") < 0 || db_exec("PRAGMA synchronous=FULL;") < 0) return -1;
+
+    // 创建用户表
+    const char *sql = "CREATE TABLE IF NOT EXISTS users ("
+                     "id INTEGER PRIMARY KEY AUTOINCREMENT,"
+                     "username TEXT UNIQUE NOT NULL,"
+                     "password TEXT NOT NULL,"
+                     "status INTEGER DEFAULT 1"
+                     ");";
+    if (db_exec(sql) < 0) return -1;
+
+    // 断点续传检查点：offset 之前的内容已经同步到 <文件>.part
+    sql = "CREATE TABLE IF NOT EXISTS transfer_checkpoints ("
+          "username TEXT NOT NULL,"
+          "project TEXT NOT NULL,"
+          "path TEXT NOT NULL,"
+          "size INTEGER NOT NULL,"
+          "offset INTEGER NOT NULL,"
+          "PRIMARY KEY (username, project, path)"
+          ");";
+    if (db_exec(sql) < 0) return -1;
+
+    // 去重上传的清单改为作为文件的版本保存（version.c），旧版本留下的表不再使用
+    if (db_exec("DROP TABLE IF EXISTS file_manifests;") < 0) return -1;
+
+    // 项目同步清单：每个用户、项目、路径一条记录
+    sql = "CREATE TABLE IF NOT EXISTS project_files ("
+          "username TEXT NOT NULL,"
+          "project TEXT NOT NULL,"
+          "path TEXT NOT NULL,"
+          "kind INTEGER NOT NULL,"
+          "size INTEGER NOT NULL,"
+          "mtime INTEGER NOT NULL,"
+          "hash INTEGER NOT NULL,"
+          "local_mtime INTEGER NOT NULL,"
+          "PRIMARY KEY (username, project, path)"
+          ");";
+    if (db_exec(sql) < 0) return -1;
+
+    // 活动历史：文件的创建、编辑、上传、恢复、删除，只追加；
+    // 按用户、用户+项目、用户+项目+文件三种条件查询，每种条件一个以时间结尾的索引
+    sql = "CREATE TABLE IF NOT EXISTS activity ("
+          "id INTEGER PRIMARY KEY,"
+          "time INTEGER NOT NULL,"
+          "username TEXT NOT NULL,"
+          "project TEXT NOT NULL,"
+          "file TEXT NOT NULL,"
+          "action TEXT NOT NULL"
+          ");"
+          "CREATE INDEX IF NOT EXISTS activity_user ON activity (username, time);"
+          "CREATE INDEX IF NOT EXISTS activity_project ON activity (username, project, time);"
+          "CREATE INDEX IF NOT EXISTS activity_file ON activity (username, project, file, time);";
+    if (db_exec(sql) < 0) return -1;
+
+    if (pthread_create(&writer_tid, NULL, db_writer_main, NULL) != 0) {
+        perror("pthread_create db writer");
+        return -1;
+    }
+    writer_running = 1;
+
+    // 输出当前数据库中的用户数量
+    int user_count = db_get_user_count();
+    log_info("Database initialized with %d users", user_count);
+    return 0;
+}
+
+// 获取用户数量
+int db_get_user_count(void) {
+    sqlite3_stmt *stmt = db_read_begin(SQL_USER_COUNT);
+    int count = 0;
+    if (!stmt) return 0;
+
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        count = sqlite3_column_int(stmt, 0);
+    }
+    db_stmt_done(stmt);
+    return count;
+}
+
+// 添加用户
+int db_add_user(const char *username, const char *password) {
+    db_value v[] = {DB_TEXT(username), DB_TEXT(password)};
+    return DB_WRITE(SQL_USER_ADD, v) == SQLITE_DONE ? 0 : -1;
+}
+
+// 读取用户保存的密码哈希（旧版本保存的是明文），找到返回 1，没有该用户返回 0
+int db_get_password(const char *username, char *buf, size_t size) {
+    sqlite3_stmt *stmt = db_read_begin(SQL_USER_PASSWORD);
+    if (!stmt) return -1;
+
+    sqlite3_bind_text(stmt, 1, username, -1, SQLITE_STATIC);
+
+    int found = 0;
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        const char *password = (const char *)sqlite3_column_text(stmt, 0);
+        snprintf(buf, size, "%s", password ? password : "");
+        found = 1;
+    }
+    db_stmt_done(stmt);
+    return found;
+}
+
+// 替换用户的密码哈希
+int db_set_password(const char *username, const char *password) {
+    db_value v[] = {DB_TEXT(password), DB_TEXT(username)};
+    return DB_WRITE(SQL_USER_SET_PASSWORD, v) == SQLITE_DONE ? 0 : -1;
+}
+
+// 检查用户是否存在
+int db_user_exists(const char *username) {
+    sqlite3_stmt *stmt = db_read_begin(SQL_USER_EXISTS);
+    if (!stmt) return -1;
+
+    sqlite3_bind_text(stmt, 1, username, -1, SQLITE_STATIC);
+
+    int rc = sqlite3_step(stmt);
+    db_stmt_done(stmt);
+    return (rc == SQLITE_ROW) ? 1 : 0;
+}
+
+// 记录检查点
+int db_checkpoint_save(const char *username, const char *project, const char *path, long long size, long long offset) {
+    db_value v[] = {DB_TEXT(username), DB_TEXT(project), DB_TEXT(path), DB_INT(size), DB_INT(offset)};
+    return DB_WRITE(SQL_CHECKPOINT_SAVE, v) == SQLITE_DONE ? 0 : -1;
+}
+
+// 查询检查点，文件大小不同或没有记录时返回 0
+long long db_checkpoint_get(const char *username, const char *project, const char *path, long long size) {
+    sqlite3_stmt *stmt = db_read_begin(SQL_CHECKPOINT_GET);
+    long long offset = 0;
+    if (!stmt) return 0;
+
+    sqlite3_bind_text(stmt, 1, username, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, project, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 3, path, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 4, size);
+
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        offset = sqlite3_column_int64(stmt, 0);
+    }
+    db_stmt_done(stmt);
+    return offset;
+}
+
+// 删除检查点
+void db_checkpoint_delete(const char *username, const char *project, const char *path) {
+    db_value v[] = {DB_TEXT(username), DB_TEXT(project), DB_TEXT(path)};
+    DB_WRITE(SQL_CHECKPOINT_DELETE, v);
+}
+
+// 把项目的所有检查点编码为 OP_RESUME 的 payload，返回 payload 长度
+size_t db_checkpoint_list(const char *username, const char *project, unsigned char *buf, size_t cap) {
+    sqlite3_stmt *stmt = db_read_begin(SQL_CHECKPOINT_LIST);
+    size_t len = 0;
+    if (!stmt) return 0;
+
+    sqlite3_bind_text(stmt, 1, username, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, project, -1, SQLITE_STATIC);
+
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        const char *path = (const char *)sqlite3_column_text(stmt, 0);
+        size_t n = proto_encode_resume(buf + len, cap - len, path,
+                                       sqlite3_column_int64(stmt, 1), sqlite3_column_int64(stmt, 2));
+        if (n == 0) break;  // 放不下的检查点这次不续传
+        len += n;
+    }
+    db_stmt_done(stmt);
+    return len;
+}
+
+// 记录项目清单中的一项，覆盖之前的记录
+int db_sync_put(db_batch *batch, const char *username, const char *project, const sync_entry *e) {
+    db_value v[] = {DB_TEXT(username), DB_TEXT(project), DB_TEXT(e->path), DB_INT(e->kind),
+                    DB_INT(e->size), DB_INT(e->mtime), DB_INT(e->hash), DB_INT(e->local_mtime)};
+    return DB_BATCH_WRITE(batch, SQL_SYNC_PUT, v) == SQLITE_DONE ? 0 : -1;
+}
+
+// 查找一项，找到时返回 0；e->path 不会被填写
+int db_sync_get(const char *username, const char *project, const char *path, sync_entry *e) {
+    sqlite3_stmt *stmt = db_read_begin(SQL_SYNC_GET);
+    int found = -1;
+    if (!stmt) return -1;
+
+    sqlite3_bind_text(stmt, 1, username, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, project, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 3, path, -1, SQLITE_STATIC);
+
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        e->kind = sqlite3_column_int(stmt, 0);
+        e->size = sqlite3_column_int64(stmt, 1);
+        e->mtime = sqlite3_column_int64(stmt, 2);
+        e->hash = sqlite3_column_int64(stmt, 3);
+        e->local_mtime = sqlite3_column_int64(stmt, 4);
+        found = 0;
+    }
+    db_stmt_done(stmt);
+    return found;
+}
+
+void db_sync_delete(db_batch *batch, const char *username, const char *project, const char *path) {
+    db_value v[] = {DB_TEXT(username), DB_TEXT(project), DB_TEXT(path)};
+    DB_BATCH_WRITE(batch, SQL_SYNC_DELETE, v);
+}
+
+// 对项目清单中的每一项调用 fn；fn 中不能再查询项目清单（同一个缓存的语句）
+void db_sync_list(const char *username, const char *project, void (*fn)(void *arg, const sync_entry *e), void *arg) {
+    sqlite3_stmt *stmt = db_read_begin(SQL_SYNC_LIST);
+    if (!stmt) return;
+
+    sqlite3_bind_text(stmt, 1, username, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, project, -1, SQLITE_STATIC);
+
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        sync_entry e;
+        e.path = (const char *)sqlite3_column_text(stmt, 0);
+        e.kind = sqlite3_column_int(stmt, 1);
+        e.size = sqlite3_column_int64(stmt, 2);
+        e.mtime = sqlite3_column_int64(stmt, 3);
+        e.hash = sqlite3_column_int64(stmt, 4);
+        e.local_mtime = sqlite3_column_int64(stmt, 5);
+        fn(arg, &e);
+    }
+    db_stmt_done(stmt);
+}
+
+// 记录一条活动
+int db_activity_add(long long time, const char *username, const char *project, const char *file,
+                    const char *action) {
+    db_value v[] = {DB_INT(time), DB_TEXT(username), DB_TEXT(project), DB_TEXT(file), DB_TEXT(action)};
+    return DB_WRITE(SQL_ACTIVITY_ADD, v) == SQLITE_DONE ? 0 : -1;
+}
+
+// 按时间从新到旧查询 q->before 之前的最多 limit 条活动，对每一条调用 fn，返回条数。
+// project / file 为空字符串时不按它过滤（file 只在指定了 project 时使用）
+int db_activity_page(const activity_query *q, int limit, void (*fn)(void *arg, const activity_entry *e),
+                     void *arg) {
+    int id = !q->project[0] ? SQL_ACTIVITY_USER : !q->file[0] ? SQL_ACTIVITY_PROJECT : SQL_ACTIVITY_FILE;
+    sqlite3_stmt *stmt = db_read_begin(id);
+    if (!stmt) return -1;
+
+    sqlite3_bind_text(stmt, 1, q->username, -1, SQLITE_STATIC);
+    if (id != SQL_ACTIVITY_USER) sqlite3_bind_text(stmt, 2, q->project, -1, SQLITE_STATIC);
+    if (id == SQL_ACTIVITY_FILE) sqlite3_bind_text(stmt, 3, q->file, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 4, q->since);
+    sqlite3_bind_int64(stmt, 5, q->before_time);
+    sqlite3_bind_int64(stmt, 6, q->before_id);
+    sqlite3_bind_int(stmt, 7, limit);
+
+    int count = 0;
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        activity_entry e;
+        e.id = sqlite3_column_int64(stmt, 0);
+        e.time = sqlite3_column_int64(stmt, 1);
+        e.project = (const char *)sqlite3_column_text(stmt, 2);
+        e.file = (const char *)sqlite3_column_text(stmt, 3);
+        e.action = (const char *)sqlite3_column_text(stmt, 4);
+        fn(arg, &e);
+        count++;
+    }
+    db_stmt_done(stmt);
+    return count;
+}
+
+// 关闭数据库：工作线程退出后调用，等写线程提交完队列中的写入，再关闭所有连接
+void close_database(void) {
+    if (writer_running) {
+        pthread_mutex_lock(&write_lock);
+        writer_stop = 1;
+        pthread_cond_signal(&write_ready);
+        pthread_mutex_unlock(&write_lock);
+        pthread_join(writer_tid, NULL);
+        writer_running = 0;
+    }
+
+    pthread_mutex_lock(&readers_lock);
+    while (readers) {
+        db_conn *c = readers;
+        readers = c->next;
+        db_conn_close(c);
+    }
+    pthread_mutex_unlock(&readers_lock);
+    reader = NULL;
+
+    if (writer) {
+        db_conn_close(writer);  // 最后一个连接关闭时 SQLite 把 WAL 合并回数据库文件
+        writer = NULL;
+    }
+}
@@ -0,0 +1,54 @@
+#ifndef DELTA_H
+#define DELTA_H
+
+// rsync 风格的增量上传：服务器把当前文件按固定长度分块，每块发送弱校验和（可滚动）和强哈希；
+// 客户端在新文件中逐字节滚动弱校验和，命中且强哈希一致的位置发送块引用，其余发送原始字节。
+
+#include <stdint.h>
+#include <stddef.h>
+#include "proto.h"
+
+#define DELTA_MIN_FILE (64 * 1024)   // 不小于这个大小的文件才尝试增量上传
+#define DELTA_MIN_BLOCK 2048         // 块长度的下限
+#define DELTA_MAX_BLOCKS (1 << 20)   // 一个文件最多的块数
+#define DELTA_STRONG_SIZE 16         // 强哈希：SHA-256 的前 16 字节
+#define DELTA_SIG_SIZE 20            // 一块的签名：[4 字节弱校验和][16 字节强哈希]
+#define DELTA_SIG_HEADER 16          // OP_SIGNATURES 的头部：[4 字节块长度][4 字节块数][4 字节最后一块的长度][4 字节第一块的下标]
+#define DELTA_SIGS_PER_FRAME ((PROTO_MAX_CONTROL - DELTA_SIG_HEADER) / DELTA_SIG_SIZE)
+#define DELTA_LITERAL_MAX 8192       // 一条 LITERAL 指令最多携带的字节数
+
+// OP_DELTA 中的指令
+enum {
+    DELTA_COPY = 1,     // [1][4 字节块下标][4 字节连续块数]：复制服务器当前文件中的这些块
+    DELTA_LITERAL = 2   // [2][4 字节长度][原始字节]
+};
+
+// 块长度取文件大小的平方根（按 1KB 取整），块数不超过 DELTA_MAX_BLOCKS
+static inline uint32_t delta_block_size(uint64_t size) {
+    uint64_t block = 0;
+    while ((block + 1024) * (block + 1024) <= size) block += 1024;
+    if (block < size / DELTA_MAX_BLOCKS + 1) block = size / DELTA_MAX_BLOCKS + 1;
+    block = (block + 1023) & ~1023ULL;
+    return block < DELTA_MIN_BLOCK ? DELTA_MIN_BLOCK : (uint32_t)block;
+}
+
+// 弱校验和：a 为字节之和，b 为按位置加权的和，各取低 16 位
+static inline uint32_t delta_weak(const unsigned char *data, size_t len, uint32_t *a, uint32_t *b) {
+    uint32_t s1 = 0, s2 = 0;
+    for (size_t i = 0; i < len; i++) {
+        s1 += data[i];
+        s2 += (uint32_t)(len - i) * data[i];
+    }
+    *a = s1;
+    *b = s2;
+    return (s1 & 0xffff) | (s2 << 16);
+}
+
+// 窗口向后移动一个字节：移出 out，移入 in
+static inline uint32_t delta_roll(uint32_t *a, uint32_t *b, unsigned char out, unsigned char in, size_t len) {
+    *a += in - out;
+    *b += *a - (uint32_t)len * out;
+    return (*a & 0xffff) | (*b << 16);
+}
+
+#endif
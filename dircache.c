@@ -0,0 +1,435 @@
+#include "server.h"
+#include "dircache.h"
+#include "xxhash.h"
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+
+#define DIRCACHE_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE | IN_ATTRIB | \
+                       IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+// 一个目录的缓存。表本身持有一个引用，列出目录和处理事件时各自再持有一个，离开表
+// （目录被删除或移动后监视移除、LRU 淘汰）后最后一个引用释放时才释放结构；items 由 lock 保护
+typedef struct dc_dir {
+    char *path;
+    uint64_t hash;
+    int wd;                 // inotify 监视描述符，-1 表示没有监视
+    int valid;              // items 与磁盘一致，可以直接使用
+    unsigned gen;           // 收到的事件数：重建期间有变化时结果不标记为有效
+    dir_item *items;        // 按名字排序
+    int count;
+    int cap;
+    pthread_rwlock_t lock;
+    int refs;               // 原子操作
+    int linked;             // 还在表中，由 table_lock 保护
+    struct dc_dir *next;
+    struct dc_dir *lru_prev;  // 最近使用的在前，由 lru_lock 保护
+    struct dc_dir *lru_next;
+} dc_dir;
+
+static dc_dir *buckets[DIRCACHE_BUCKETS];
+static dc_dir **by_wd;                      // 监视描述符到目录
+static int by_wd_cap;
+static int dir_count;
+static pthread_rwlock_t table_lock = PTHREAD_RWLOCK_INITIALIZER;  // buckets、by_wd 和 dir_count
+static dc_dir *lru_head, *lru_tail;
+static pthread_mutex_t lru_lock = PTHREAD_MUTEX_INITIALIZER;      // 在 table_lock 之内获取
+static int notify_fd = -1;
+static int stop_fd = -1;
+static pthread_t notify_tid;
+static int notify_running;
+
+static void items_free(dir_item *items, int count) {
+    for (int i = 0; i < count; i++) free(items[i].name);
+    free(items);
+}
+
+static int item_cmp(const void *a, const void *b) {
+    return strcmp(((const dir_item *)a)->name, ((const dir_item *)b)->name);
+}
+
+// 第一个名字大于 name 的位置；found 为名字相同的项是否存在
+static int item_search(const dc_dir *d, const char *name, int *found) {
+    int lo = 0, hi = d->count;
+    *found = 0;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        int c = strcmp(d->items[mid].name, name);
+        if (c == 0) {
+            *found = 1;
+            return mid + 1;
+        }
+        if (c < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+static void item_fill(dir_item *e, const struct stat *st) {
+    e->type = IFTODT(st->st_mode);
+    e->size = st->st_size;
+    e->mtime = st->st_mtime;
+}
+
+static int items_push(dir_item **items, int *count, int *cap, const char *name, const struct stat *st) {
+    if (*count == *cap) {
+        int n = *cap ? *cap * 2 : 64;
+        dir_item *p = realloc(*items, n * sizeof(dir_item));
+        if (!p) return -1;
+        *items = p;
+        *cap = n;
+    }
+    dir_item *e = &(*items)[*count];
+    if (!(e->name = strdup(name))) return -1;
+    item_fill(e, st);
+    (*count)++;
+    return 0;
+}
+
+static void dir_invalidate(dc_dir *d) {
+    pthread_rwlock_wrlock(&d->lock);
+    __atomic_add_fetch(&d->gen, 1, __ATOMIC_RELEASE);
+    d->valid = 0;
+    pthread_rwlock_unlock(&d->lock);
+}
+
+static void dir_free(dc_dir *d) {
+    items_free(d->items, d->count);
+    pthread_rwlock_destroy(&d->lock);
+    free(d->path);
+    free(d);
+}
+
+static void dir_put(dc_dir *d) {
+    if (__atomic_sub_fetch(&d->refs, 1, __ATOMIC_ACQ_REL) == 0) dir_free(d);
+}
+
+// 移到 LRU 的最前面；调用方持有 table_lock（读或写）
+static void lru_touch(dc_dir *d) {
+    pthread_mutex_lock(&lru_lock);
+    if (lru_head != d) {
+        if (d->lru_prev) d->lru_prev->lru_next = d->lru_next;
+        if (d->lru_next) d->lru_next->lru_prev = d->lru_prev;
+        if (lru_tail == d) lru_tail = d->lru_prev;
+        d->lru_prev = NULL;
+        d->lru_next = lru_head;
+        if (lru_head) lru_head->lru_prev = d;
+        lru_head = d;
+        if (!lru_tail) lru_tail = d;
+    }
+    pthread_mutex_unlock(&lru_lock);
+}
+
+// 从表中移除并移除监视，释放表的引用；调用方持有 table_lock 的写锁
+static void dir_unlink(dc_dir *d) {
+    for (dc_dir **pp = &buckets[d->hash % DIRCACHE_BUCKETS]; *pp; pp = &(*pp)->next) {
+        if (*pp == d) {
+            *pp = d->next;
+            break;
+        }
+    }
+    pthread_mutex_lock(&lru_lock);
+    if (d->lru_prev) d->lru_prev->lru_next = d->lru_next;
+    else lru_head = d->lru_next;
+    if (d->lru_next) d->lru_next->lru_prev = d->lru_prev;
+    else lru_tail = d->lru_prev;
+    pthread_mutex_unlock(&lru_lock);
+    if (d->wd != -1) {
+        by_wd[d->wd] = NULL;
+        inotify_rm_watch(notify_fd, d->wd);  // 之后的 IN_IGNORED 找不到目录，直接忽略
+        d->wd = -1;
+    }
+    d->linked = 0;
+    dir_count--;
+    dir_put(d);
+}
+
+// 找到目录的缓存结构并持有一个引用，没有时创建；超过 DIRCACHE_MAX_DIRS 个目录时淘汰最久没有列出的
+static dc_dir *dir_get(const char *path) {
+    uint64_t h = xxh64(path, strlen(path));
+    dc_dir **head = &buckets[h % DIRCACHE_BUCKETS];
+
+    pthread_rwlock_rdlock(&table_lock);
+    dc_dir *d = *head;
+    while (d && (d->hash != h || strcmp(d->path, path) != 0)) d = d->next;
+    if (d) {
+        __atomic_add_fetch(&d->refs, 1, __ATOMIC_RELAXED);
+        lru_touch(d);
+    }
+    pthread_rwlock_unlock(&table_lock);
+    if (d) return d;
+
+    pthread_rwlock_wrlock(&table_lock);
+    for (d = *head; d && (d->hash != h || strcmp(d->path, path) != 0); d = d->next) {
+    }
+    if (!d && (d = calloc(1, sizeof(dc_dir))) != NULL) {
+        if (!(d->path = strdup(path))) {
+            free(d);
+            d = NULL;
+        } else {
+            d->hash = h;
+            d->wd = -1;
+            d->refs = 1;
+            d->linked = 1;
+            pthread_rwlock_init(&d->lock, NULL);
+            d->next = *head;
+            *head = d;
+            dir_count++;
+            while (dir_count > DIRCACHE_MAX_DIRS && lru_tail) dir_unlink(lru_tail);
+        }
+    }
+    if (d) {
+        __atomic_add_fetch(&d->refs, 1, __ATOMIC_RELAXED);
+        lru_touch(d);
+    }
+    pthread_rwlock_unlock(&table_lock);
+    return d;
+}
+
+// 开始监视目录；监视数达到上限等情况下不监视，目录照常列出，只是不缓存
+static void dir_watch(dc_dir *d) {
+    if (notify_fd == -1) return;
+    pthread_rwlock_wrlock(&table_lock);
+    if (d->wd == -1 && d->linked) {  // 已经淘汰的目录这次照常读取，不再监视
+        int wd = inotify_add_watch(notify_fd, d->path, DIRCACHE_MASK);
+        if (wd >= by_wd_cap && wd >= 0) {
+            int n = by_wd_cap ? by_wd_cap : 256;
+            while (n <= wd) n *= 2;
+            dc_dir **p = realloc(by_wd, n * sizeof(dc_dir *));
+            if (p) {
+                memset(p + by_wd_cap, 0, (n - by_wd_cap) * sizeof(dc_dir *));
+                by_wd = p;
+                by_wd_cap = n;
+            } else {
+                inotify_rm_watch(notify_fd, wd);
+                wd = -1;
+            }
+        }
+        if (wd >= 0) {
+            // 同一个目录经由另一个路径已经被监视时内核返回同一个描述符，原来的结构不再收到事件
+            if (by_wd[wd] && by_wd[wd] != d) {
+                by_wd[wd]->wd = -1;
+                dir_invalidate(by_wd[wd]);
+            }
+            by_wd[wd] = d;
+            d->wd = wd;
+        }
+    }
+    pthread_rwlock_unlock(&table_lock);
+}
+
+// 重新读取目录：先开始监视再读取，读取期间发生的变化要么已经读到，要么会增加 gen
+static int dir_build(dc_dir *d) {
+    dir_watch(d);
+    unsigned gen = __atomic_load_n(&d->gen, __ATOMIC_ACQUIRE);
+
+    DIR *dir = opendir(d->path);
+    if (!dir) return -1;
+    dir_item *items = NULL;
+    int count = 0, cap = 0, rc = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+        struct stat st;
+        if (fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1) continue;
+        if (items_push(&items, &count, &cap, entry->d_name, &st) == -1) {
+            rc = -1;
+            break;
+        }
+    }
+    closedir(dir);
+    if (rc == -1) {
+        items_free(items, count);
+        return -1;
+    }
+    qsort(items, count, sizeof(dir_item), item_cmp);
+
+    pthread_rwlock_wrlock(&d->lock);
+    items_free(d->items, d->count);
+    d->items = items;
+    d->count = count;
+    d->cap = cap;
+    d->valid = d->wd != -1 && d->gen == gen;
+    pthread_rwlock_unlock(&d->lock);
+    log_debug("Directory listing loaded: %s (%d entries)", d->path, count);
+    return 0;
+}
+
+int dircache_page(const char *path, const char *after, int type, int max,
+                  void (*fn)(void *arg, const dir_item *e), void *arg) {
+    dc_dir *d = dir_get(path);
+    if (!d) return -1;
+
+    pthread_rwlock_rdlock(&d->lock);
+    if (!d->valid) {
+        pthread_rwlock_unlock(&d->lock);
+        if (dir_build(d) == -1) {
+            dir_put(d);
+            return -1;
+        }
+        pthread_rwlock_rdlock(&d->lock);
+    }
+
+    int found;
+    int i = after[0] ? item_search(d, after, &found) : 0;
+    int n = 0;
+    for (; i < d->count && n < max; i++) {
+        if (type != DT_UNKNOWN && d->items[i].type != type) continue;
+        fn(arg, &d->items[i]);
+        n++;
+    }
+    pthread_rwlock_unlock(&d->lock);
+    dir_put(d);
+    return n;
+}
+
+// 目录中的一项发生变化：重新 lstat，更新、插入或删除
+static void dir_update(dc_dir *d, const char *name) {
+    char path[PATH_MAX];
+    struct stat st;
+    snprintf(path, sizeof(path), "%s/%s", d->path, name);
+    int exists = lstat(path, &st) == 0;
+
+    pthread_rwlock_wrlock(&d->lock);
+    __atomic_add_fetch(&d->gen, 1, __ATOMIC_RELEASE);
+    if (d->valid) {
+        int found;
+        int i = item_search(d, name, &found);
+        if (found && exists) {
+            item_fill(&d->items[i - 1], &st);
+        } else if (found) {
+            free(d->items[i - 1].name);
+            memmove(&d->items[i - 1], &d->items[i], (d->count - i) * sizeof(dir_item));
+            d->count--;
+        } else if (exists) {
+            // 插入到末尾再移到排序的位置
+            int count = d->count;
+            if (items_push(&d->items, &d->count, &d->cap, name, &st) == 0) {
+                dir_item e = d->items[count];
+                memmove(&d->items[i + 1], &d->items[i], (count - i) * sizeof(dir_item));
+                d->items[i] = e;
+            } else {
+                d->valid = 0;
+            }
+        }
+    }
+    pthread_rwlock_unlock(&d->lock);
+}
+
+static void dircache_event(const struct inotify_event *ev) {
+    if (ev->mask & IN_Q_OVERFLOW) {
+        // 丢失了事件，所有列表都要重建
+        pthread_rwlock_rdlock(&table_lock);
+        for (int i = 0; i < DIRCACHE_BUCKETS; i++) {
+            for (dc_dir *d = buckets[i]; d; d = d->next) dir_invalidate(d);
+        }
+        pthread_rwlock_unlock(&table_lock);
+        return;
+    }
+
+    if (ev->mask & IN_IGNORED) {
+        // 监视已经移除（目录被删除、移动或已经淘汰），释放这个目录的缓存，再次列出时重新建立
+        pthread_rwlock_wrlock(&table_lock);
+        dc_dir *d = ev->wd >= 0 && ev->wd < by_wd_cap ? by_wd[ev->wd] : NULL;
+        if (d) {
+            d->wd = -1;
+            by_wd[ev->wd] = NULL;
+            dir_unlink(d);
+        }
+        pthread_rwlock_unlock(&table_lock);
+        return;
+    }
+
+    pthread_rwlock_rdlock(&table_lock);
+    dc_dir *d = ev->wd >= 0 && ev->wd < by_wd_cap ? by_wd[ev->wd] : NULL;
+    if (d) __atomic_add_fetch(&d->refs, 1, __ATOMIC_RELAXED);
+    pthread_rwlock_unlock(&table_lock);
+    if (!d) return;
+
+    if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+        // 移动后监视仍然跟着原来的目录，不再对应这个路径
+        if (ev->mask & IN_MOVE_SELF) inotify_rm_watch(notify_fd, ev->wd);
+        dir_invalidate(d);
+    } else if (ev->len > 0) {
+        dir_update(d, ev->name);
+    }
+    dir_put(d);
+}
+
+static void *dircache_main(void *arg) {
+    (void)arg;
+    char *buf = malloc(DIRCACHE_EVENT_BUF);
+    if (!buf) return NULL;
+    struct pollfd fds[2] = {{notify_fd, POLLIN, 0}, {stop_fd, POLLIN, 0}};
+    for (;;) {
+        if (poll(fds, 2, -1) == -1) {
+            if (errno == EINTR) continue;
+            log_error("Directory cache stopped, poll failed: %s", strerror(errno));
+            break;
+        }
+        if (fds[1].revents) break;
+
+        ssize_t n;
+        while ((n = read(notify_fd, buf, DIRCACHE_EVENT_BUF)) > 0) {
+            for (char *p = buf; p < buf + n;) {
+                const struct inotify_event *ev = (const struct inotify_event *)p;
+                dircache_event(ev);
+                p += sizeof(struct inotify_event) + ev->len;
+            }
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+// inotify 不可用时仍然返回 0，列表每次重新读取
+int dircache_start(void) {
+    notify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (notify_fd == -1) {
+        log_warn("inotify unavailable (%s), directory listings are not cached", strerror(errno));
+        return 0;
+    }
+    stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (stop_fd == -1) {
+        log_warn("Failed to create directory cache eventfd: %s", strerror(errno));
+        close(notify_fd);
+        notify_fd = -1;
+        return 0;
+    }
+    if (pthread_create(&notify_tid, NULL, dircache_main, NULL) != 0) {
+        log_warn("Failed to start directory cache thread");
+        close(stop_fd);
+        close(notify_fd);
+        stop_fd = notify_fd = -1;
+        return 0;
+    }
+    notify_running = 1;
+    return 0;
+}
+
+// 在工作线程退出之后调用
+void dircache_stop(void) {
+    if (notify_running) {
+        uint64_t one = 1;
+        if (write(stop_fd, &one, sizeof(one)) != sizeof(one)) log_warn("Failed to stop directory cache thread: %s", strerror(errno));
+        pthread_join(notify_tid, NULL);
+        notify_running = 0;
+    }
+    if (stop_fd != -1) close(stop_fd);
+    if (notify_fd != -1) close(notify_fd);
+    stop_fd = notify_fd = -1;
+
+    for (int i = 0; i < DIRCACHE_BUCKETS; i++) {
+        while (buckets[i]) {
+            dc_dir *d = buckets[i];
+            buckets[i] = d->next;
+            dir_free(d);
+        }
+    }
+    lru_head = lru_tail = NULL;
+    dir_count = 0;
+    free(by_wd);
+    by_wd = NULL;
+    by_wd_cap = 0;
+}
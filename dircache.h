@@ -0,0 +1,33 @@
+#ifndef DIRCACHE_H
+#define DIRCACHE_H
+
+// 工作空间目录列表的内存缓存：第一次列出一个目录时读取目录项和它们的类型、大小、修改时间，
+// 按名字排序保存，同时用 inotify 监视该目录。后台线程收到事件后只重新 lstat 变化的那一项，
+// 更新或删除缓存中的记录；目录本身被删除、移动或事件队列溢出时整个列表失效，下次列出时重建。
+// 列表按名字分页读取，每页只做一次二分查找，与目录中的文件数无关。
+// 为了避免上传时每次写入都产生事件，只关注 IN_CLOSE_WRITE，不关注 IN_MODIFY：
+// 正在写入的文件的大小在关闭后更新。
+// 目录被删除或移出工作空间后（监视被移除）释放它的缓存；缓存的目录数超过 DIRCACHE_MAX_DIRS 时
+// 淘汰最久没有列出的目录并移除监视，监视数不会无限增长。
+// inotify 不可用或监视数达到上限时，这些目录每次列出都重新读取。
+
+#define DIRCACHE_BUCKETS 1024           // 目录哈希表的桶数
+#define DIRCACHE_EVENT_BUF (64 * 1024)  // 一次读取的 inotify 事件
+#define DIRCACHE_MAX_DIRS 4096          // 最多缓存和监视的目录数
+
+typedef struct {
+    char *name;
+    unsigned char type;     // DT_DIR / DT_REG / ...
+    long long size;
+    long long mtime;        // 秒
+} dir_item;
+
+int dircache_start(void);
+void dircache_stop(void);
+
+// 按名字顺序列出 path 中名字排在 after 之后、类型为 type 的最多 max 项（type 为 DT_UNKNOWN 时不过滤），
+// 对每一项调用 fn（持有目录的读锁，fn 中不能再调用 dircache）；返回项数，目录无法打开时返回 -1
+int dircache_page(const char *path, const char *after, int type, int max,
+                  void (*fn)(void *arg, const dir_item *e), void *arg);
+
+#endif
@@ -0,0 +1,255 @@
+#include "log.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef struct {
+    long long ts;               // CLOCK_REALTIME，纳秒
+    int level;
+    int len;
+    char text[LOG_TEXT_MAX];
+} log_record;
+
+// 一个线程的环形缓冲区：所属线程只移动 head，刷新线程只移动 tail
+typedef struct log_ring {
+    unsigned head;
+    unsigned tail;
+    unsigned limit;             // 刷新线程本轮处理到的位置
+    unsigned long dropped;      // 缓冲区满时丢弃的记录数
+    struct log_ring *next;
+    log_record recs[LOG_RING_SIZE];
+} log_ring;
+
+// 输出的批量缓冲区
+typedef struct {
+    int fd;
+    size_t len;
+    char buf[LOG_BATCH_SIZE];
+} log_batch;
+
+// 格式化时间的缓存，同一秒内的记录只调用一次 localtime_r
+typedef struct {
+    time_t sec;
+    char str[32];
+} log_time_cache;
+
+#define LOG_LINE_MAX (LOG_TEXT_MAX + 64)
+
+static log_ring *rings;           // 所有登记过的缓冲区，只增加，log_stop 时释放
+static __thread log_ring *my_ring;
+static int log_level = LOG_INFO;
+static int log_running;           // 刷新线程运行期间写入环形缓冲区，否则直接输出
+static int flusher_stop;
+static pthread_t flusher_tid;
+static pthread_mutex_t flush_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flush_wake = PTHREAD_COND_INITIALIZER;
+static log_batch server_batch = {.fd = STDOUT_FILENO};
+static log_time_cache flusher_time;
+
+static const char *const level_names[] = {"DEBUG", "INFO", "WARN", "ERROR"};
+
+static long long log_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static const char *log_time(log_time_cache *c, long long ts) {
+    time_t sec = ts / 1000000000LL;
+    if (sec != c->sec || !c->str[0]) {
+        struct tm tm;
+        localtime_r(&sec, &tm);
+        strftime(c->str, sizeof(c->str), "%Y-%m-%d %H:%M:%S", &tm);
+        c->sec = sec;
+    }
+    return c->str;
+}
+
+static int log_format(const log_record *rec, log_time_cache *c, char *out, size_t cap) {
+    int n = snprintf(out, cap, "%s.%03d %-5s %.*s\n", log_time(c, rec->ts), (int)(rec->ts / 1000000 % 1000),
+                     level_names[rec->level], rec->len, rec->text);
+    return n < (int)cap ? n : (int)cap - 1;
+}
+
+static void write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return;  // 日志写不出去时丢弃，不影响服务
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+static void batch_flush(log_batch *b) {
+    if (b->len > 0) write_all(b->fd, b->buf, b->len);
+    b->len = 0;
+}
+
+static void batch_append(const log_record *rec) {
+    log_batch *b = &server_batch;
+    if (b->len + LOG_LINE_MAX > sizeof(b->buf)) batch_flush(b);
+    b->len += log_format(rec, &flusher_time, b->buf + b->len, sizeof(b->buf) - b->len);
+}
+
+// 刷新线程没有运行（启动前或停止后）：直接写出一条记录
+static void log_direct(const log_record *rec) {
+    log_time_cache c = {0};
+    char line[LOG_LINE_MAX];
+    int n = log_format(rec, &c, line, sizeof(line));
+    write_all(STDOUT_FILENO, line, n);
+}
+
+// 当前线程的缓冲区，第一次调用时登记到全局链表
+static log_ring *ring_get(void) {
+    if (my_ring) return my_ring;
+    log_ring *r = calloc(1, sizeof(*r));
+    if (!r) return NULL;
+    r->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&rings, &r->next, r, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+    }
+    my_ring = r;
+    return r;
+}
+
+void log_vwrite(int level, const char *fmt, va_list ap) {
+    if (level < log_level) return;
+
+    log_record direct, *rec = &direct;
+    log_ring *r = __atomic_load_n(&log_running, __ATOMIC_ACQUIRE) ? ring_get() : NULL;
+    unsigned head = 0, tail = 0;
+    if (r) {
+        head = r->head;
+        tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+        if (head - tail >= LOG_RING_SIZE) {
+            __atomic_add_fetch(&r->dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        rec = &r->recs[head & (LOG_RING_SIZE - 1)];
+    }
+
+    rec->ts = log_clock();
+    rec->level = level;
+    int n = vsnprintf(rec->text, sizeof(rec->text), fmt, ap);
+    if (n < 0) n = 0;
+    if (n >= (int)sizeof(rec->text)) n = sizeof(rec->text) - 1;
+    while (n > 0 && rec->text[n - 1] == '\n') n--;
+    rec->len = n;
+
+    if (!r) {
+        log_direct(rec);
+        return;
+    }
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+    // 缓冲区用到一半时提前唤醒刷新线程；唤醒丢失时最迟等到下一个刷新间隔
+    if (head + 1 - tail == LOG_RING_SIZE / 2) pthread_cond_signal(&flush_wake);
+}
+
+void log_write(int level, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    log_vwrite(level, fmt, ap);
+    va_end(ap);
+}
+
+void log_progress(long long *last, const char *fmt, ...) {
+    if (LOG_DEBUG < log_level) return;
+    long long now = log_clock();
+    if (now - *last < LOG_PROGRESS_MS * 1000000LL) return;
+    *last = now;
+
+    va_list ap;
+    va_start(ap, fmt);
+    log_vwrite(LOG_DEBUG, fmt, ap);
+    va_end(ap);
+}
+
+// 取出各线程缓冲区中已有的记录，按时间顺序合并后批量写出
+static void log_drain(void) {
+    log_ring *list = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+    unsigned long dropped = 0;
+    for (log_ring *r = list; r; r = r->next) {
+        r->limit = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        dropped += __atomic_exchange_n(&r->dropped, 0, __ATOMIC_RELAXED);
+    }
+
+    for (;;) {
+        log_ring *best = NULL;
+        const log_record *best_rec = NULL;
+        for (log_ring *r = list; r; r = r->next) {
+            if (r->tail == r->limit) continue;
+            const log_record *rec = &r->recs[r->tail & (LOG_RING_SIZE - 1)];
+            if (!best || rec->ts < best_rec->ts) {
+                best = r;
+                best_rec = rec;
+            }
+        }
+        if (!best) break;
+        batch_append(best_rec);
+        __atomic_store_n(&best->tail, best->tail + 1, __ATOMIC_RELEASE);
+    }
+
+    if (dropped > 0) {
+        log_record rec = {.ts = log_clock(), .level = LOG_WARN};
+        rec.len = snprintf(rec.text, sizeof(rec.text), "%lu log records dropped (ring buffer full)", dropped);
+        batch_append(&rec);
+    }
+    batch_flush(&server_batch);
+}
+
+static void *log_flusher_main(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&flush_lock);
+    while (!flusher_stop) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += LOG_FLUSH_MS * 1000000L;
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&flush_wake, &flush_lock, &ts);
+        pthread_mutex_unlock(&flush_lock);
+        log_drain();
+        pthread_mutex_lock(&flush_lock);
+    }
+    pthread_mutex_unlock(&flush_lock);
+    log_drain();
+    return NULL;
+}
+
+// 在启动其他线程之前调用
+int log_start(int min_level) {
+    log_level = min_level;
+    if (pthread_create(&flusher_tid, NULL, log_flusher_main, NULL) != 0) {
+        perror("pthread_create log flusher");
+        return -1;
+    }
+    __atomic_store_n(&log_running, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// 在其他线程退出之后调用
+void log_stop(void) {
+    if (!__atomic_load_n(&log_running, __ATOMIC_ACQUIRE)) return;
+    __atomic_store_n(&log_running, 0, __ATOMIC_RELEASE);
+
+    pthread_mutex_lock(&flush_lock);
+    flusher_stop = 1;
+    pthread_cond_signal(&flush_wake);
+    pthread_mutex_unlock(&flush_lock);
+    pthread_join(flusher_tid, NULL);
+
+    while (rings) {
+        log_ring *r = rings;
+        rings = r->next;
+        free(r);
+    }
+    my_ring = NULL;
+}
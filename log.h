@@ -0,0 +1,32 @@
+#ifndef LOG_H
+#define LOG_H
+
+// 异步日志：每个线程第一次写日志时登记一个单生产者环形缓冲区，记录格式化后直接写入，
+// 不加锁、不做系统调用；后台刷新线程定期按时间顺序合并各线程的记录，批量追加到输出。
+// 服务器消息写到标准输出；文件的操作记录保存在数据库的活动历史中（log_version）。
+// 环形缓冲区满时丢弃新的记录并计数，由刷新线程报告丢弃的条数。
+
+#include <stdarg.h>
+
+#define LOG_RING_SIZE 1024              // 每个线程的记录数，必须是 2 的幂
+#define LOG_TEXT_MAX 496                // 每条记录的正文长度，超出部分截断
+#define LOG_FLUSH_MS 50                 // 刷新间隔；缓冲区用到一半时提前唤醒
+#define LOG_BATCH_SIZE (64 * 1024)      // 每次追加到输出的批量大小
+#define LOG_PROGRESS_MS 1000            // 传输进度的最小输出间隔
+
+enum { LOG_DEBUG, LOG_INFO, LOG_WARN, LOG_ERROR };
+
+int log_start(int min_level);
+void log_stop(void);  // 输出所有剩余的记录后停止刷新线程
+
+void log_write(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+void log_vwrite(int level, const char *fmt, va_list ap);
+// 传输进度：距离 *last 上次输出不到 LOG_PROGRESS_MS 时直接返回，以 LOG_DEBUG 级别输出
+void log_progress(long long *last, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+#define log_debug(...) log_write(LOG_DEBUG, __VA_ARGS__)
+#define log_info(...) log_write(LOG_INFO, __VA_ARGS__)
+#define log_warn(...) log_write(LOG_WARN, __VA_ARGS__)
+#define log_error(...) log_write(LOG_ERROR, __VA_ARGS__)
+
+#endif
@@ -1,4 +1,8 @@
 #include "server.h"
+#include "worker.h"
+#include "dircache.h"
+#include "trash.h"
+#include "version.h"
 #include <signal.h>
 #include <pthread.h>
 #include <stdlib.h>
@@ -16,41 +20,73 @@ void handle_signal(int sig) {
     }
 }
 
-// 客户端处理函数
-void *client_thread(void *arg1) {
-    int client_fd = *(int *)arg1;
-    free(arg1);
-
-    // 为每个线程创建一个局部的用户信息副本
-    user_info *user = malloc(sizeof(user_info));
-    user_info_init(user);  // 初始化局部用户信息
-
-    const char menu[] = "Welcome to PanHub!\n1. Introduction\n2. Register\n3. Login\n4. Exit\n";
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-w workers] [-u] [-r rate] [-R rate] [-a threads] [-k seconds] [-v]\n"
+                    "  -w N     use N worker threads with per-thread epoll (default: CPU cores)\n"
+                    "  -u       transfer file contents with io_uring (falls back to epoll if unavailable)\n"
+                    "  -r RATE  limit total transfer bandwidth, bytes per second with optional K/M/G suffix\n"
+                    "  -R RATE  limit transfer bandwidth per user (default: unlimited)\n"
+                    "  -a N     hash passwords on N authentication threads (default: %d)\n"
+                    "  -k SEC   keep deleted projects restorable for SEC seconds (default: %d)\n"
+                    "  -v       log debug messages, including per-path events and transfer progress\n",
+            prog, AUTH_THREADS_DEFAULT, TRASH_RETENTION_DEFAULT);
+}
 
-    while (!server_shutdown) {
-        send(client_fd, menu, strlen(menu), 0); // 发送菜单给客户端
-        if (handle_client(client_fd, user) < 0) {
-            printf("Client %d disconnected\n", client_fd);
-            close(client_fd);
-            free(user);  // 释放用户信息
-            break; // 客户端断开连接后退出线程
-        } else {
-            // 更新用户信息
-            user->status = 1;  // 假设修改了状态
-            strncpy(user->username, "new_username", sizeof(user->username) - 1);
+int main(int argc, char *argv[]) {
+    int nworkers = worker_default_count();
+    int use_uring = 0;
+    long long global_rate = 0, user_rate = 0;
+    int auth_threads = AUTH_THREADS_DEFAULT;
+    long long trash_retention = TRASH_RETENTION_DEFAULT;
+    int log_level = LOG_INFO;
+    int opt_ch;
+    while ((opt_ch = getopt(argc, argv, "w:ur:R:a:k:v")) != -1) {
+        switch (opt_ch) {
+            case 'w':
+                nworkers = atoi(optarg);
+                if (nworkers <= 0) nworkers = worker_default_count();
+                break;
+            case 'u':
+                use_uring = 1;
+                break;
+            case 'a':
+                auth_threads = atoi(optarg);
+                if (auth_threads <= 0) auth_threads = AUTH_THREADS_DEFAULT;
+                break;
+            case 'k':
+                trash_retention = atoll(optarg);
+                if (trash_retention < 0) trash_retention = TRASH_RETENTION_DEFAULT;
+                break;
+            case 'v':
+                log_level = LOG_DEBUG;
+                break;
+            case 'r':
+            case 'R': {
+                long long rate = shape_parse_rate(optarg);
+                if (rate < 0) {
+                    usage(argv[0]);
+                    return -1;
+                }
+                if (opt_ch == 'r') global_rate = rate;
+                else user_rate = rate;
+                break;
+            }
+            default:
+                usage(argv[0]);
+                return -1;
         }
-
     }
 
-    return NULL;
-}
+    if (log_start(log_level) < 0) return -1;
 
-int main() {
     // 初始化数据库
-    if (init_database() < 0) {
+    if (auth_init() < 0 || init_database() < 0) {
         fprintf(stderr, "Failed to initialize database\n");
         return -1;
     }
+    dircache_start();
+    if (trash_start(TRASH_THREADS, trash_retention) < 0) return -1;
+    if (version_start(VERSION_THREADS, trash_retention) < 0) return -1;
 
     int sockfd, nfds;
     struct epoll_event ev, events[MAX_EVENTS];
@@ -58,6 +94,8 @@ int main() {
 
     signal(SIGINT, handle_signal);
     signal(SIGTERM, handle_signal);
+    signal(SIGPIPE, SIG_IGN);  // 客户端断开时 send 返回错误而不是终止进程
+    signal(SIGCHLD, SIG_IGN);  // 远程命令退出后由内核回收，不需要 waitpid
 
     sockfd = socket(AF_INET, SOCK_STREAM, 0);
     if (sockfd == -1) handle_error("socket");
@@ -78,9 +116,29 @@ int main() {
     ev.data.fd = sockfd;
     if (epoll_ctl(epfd, EPOLL_CTL_ADD, sockfd, &ev) == -1) handle_error("epoll_ctl");
 
+    shape_init(global_rate, user_rate);
+    if (global_rate > 0 || user_rate > 0) {
+        log_info("Bandwidth limit: %lld B/s total, %lld B/s per user (0 = unlimited)", global_rate, user_rate);
+    }
+    if (worker_pool_start(nworkers, use_uring) < 0) {
+        fprintf(stderr, "Failed to start worker pool\n");
+        return -1;
+    }
+    if (auth_pool_start(auth_threads, worker_auth_done) < 0) {
+        fprintf(stderr, "Failed to start authentication threads\n");
+        return -1;
+    }
+    if (offload_start(OFFLOAD_THREADS, worker_offload_done) < 0) {
+        fprintf(stderr, "Failed to start background file threads\n");
+        return -1;
+    }
+
     while (!server_shutdown) {
-        nfds = epoll_wait(epfd, events, MAX_EVENTS, -1);
-        if (nfds == -1) handle_error("epoll_wait");
+        nfds = epoll_wait(epfd, events, MAX_EVENTS, 1000);  // 信号可能被工作线程接收，定时检查停止标识
+        if (nfds == -1) {
+            if (errno == EINTR) continue;
+            handle_error("epoll_wait");
+        }
 
         for (int i = 0; i < nfds; i++) {
             int client_fd = events[i].data.fd;
@@ -92,31 +150,23 @@ int main() {
                     continue;
                 }
 
-                ev.events = EPOLLIN | EPOLLET;
-                ev.data.fd = new_client_fd;
-                if (epoll_ctl(epfd, EPOLL_CTL_ADD, new_client_fd, &ev) == -1) {
-                    perror("epoll_ctl");
-                    continue;
-                }
-
-                printf("New client connected: %s:%d\n", inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
+                log_info("New client connected: %s:%d", inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
 
-                // 创建新线程处理客户端
-                int *client_fd_ptr = malloc(sizeof(int));
-                *client_fd_ptr = new_client_fd;
-                pthread_t tid;
-                if (pthread_create(&tid, NULL, client_thread, client_fd_ptr) != 0) {
-                    perror("pthread_create");
-                    free(client_fd_ptr);
-                    continue;
-                }
-                pthread_detach(tid); // 分离线程，自动清理资源
+                // 轮询交给某个工作线程，由它的 epoll 驱动该会话的状态机
+                if (worker_pool_dispatch(new_client_fd) < 0) close(new_client_fd);
             }
         }
     }
 
+    auth_pool_stop();  // 先停止认证线程，它们交回任务时工作线程的结构还在
+    offload_stop();    // 同上，队列中的任务执行完（已经收到的文件照常提交）
+    worker_pool_stop();
+    version_stop();  // 工作线程停止后不再有新的任务，处理完队列中的版本
+    dircache_stop();
+    trash_stop();
     close(sockfd);
     close(epfd);
     close_database();
+    log_stop();
     return 0;
 }
@@ -0,0 +1,99 @@
+#include "server.h"  // offload.h、log.h 以及 db_async_writes
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_ready = PTHREAD_COND_INITIALIZER;
+static offload_job *queue_head, *queue_tail;
+static int pool_stopping;
+static pthread_t *pool_tids;
+static int pool_count;              // 为 0 时（未启动或已经停止）在调用方的线程上执行
+static void (*pool_done)(offload_job *job);
+
+static void offload_run(offload_job *job) {
+    job->run(job);
+    job->next = NULL;
+    pool_done(job);
+}
+
+void offload_submit(offload_job *job) {
+    pthread_mutex_lock(&queue_lock);
+    if (pool_count == 0) {
+        pthread_mutex_unlock(&queue_lock);
+        offload_run(job);
+        return;
+    }
+    job->next = NULL;
+    if (queue_tail) queue_tail->next = job;
+    else queue_head = job;
+    queue_tail = job;
+    pthread_cond_signal(&queue_ready);
+    pthread_mutex_unlock(&queue_lock);
+}
+
+static void *offload_main(void *arg) {
+    (void)arg;
+    db_async_writes(1);  // 与工作线程一样，同步清单、检查点和活动记录不等待数据库提交
+    for (;;) {
+        pthread_mutex_lock(&queue_lock);
+        while (!queue_head && !pool_stopping) {
+            pthread_cond_wait(&queue_ready, &queue_lock);
+        }
+        offload_job *job = queue_head;
+        if (!job) {  // 停止时先处理完队列中的任务
+            pthread_mutex_unlock(&queue_lock);
+            break;
+        }
+        queue_head = job->next;
+        if (!queue_head) queue_tail = NULL;
+        pthread_mutex_unlock(&queue_lock);
+
+        offload_run(job);
+    }
+    return NULL;
+}
+
+int offload_start(int nthreads, void (*done)(offload_job *job)) {
+    pool_tids = calloc(nthreads, sizeof(pthread_t));
+    if (!pool_tids) return -1;
+    pool_done = done;
+    pthread_mutex_lock(&queue_lock);
+    for (int i = 0; i < nthreads; i++) {
+        if (pthread_create(&pool_tids[i], NULL, offload_main, NULL) != 0) {
+            pthread_mutex_unlock(&queue_lock);
+            perror("pthread_create offload");
+            return -1;
+        }
+        pool_count++;
+    }
+    pthread_mutex_unlock(&queue_lock);
+    log_info("Started %d background file threads", pool_count);
+    return 0;
+}
+
+void offload_stop(void) {
+    pthread_mutex_lock(&queue_lock);
+    pool_stopping = 1;
+    int n = pool_count;
+    pthread_cond_broadcast(&queue_ready);
+    pthread_mutex_unlock(&queue_lock);
+
+    for (int i = 0; i < n; i++) {
+        pthread_join(pool_tids[i], NULL);
+    }
+    // 线程退出后才放进队列的任务在这里执行
+    pthread_mutex_lock(&queue_lock);
+    pool_count = 0;
+    pool_stopping = 0;
+    offload_job *list = queue_head;
+    queue_head = queue_tail = NULL;
+    pthread_mutex_unlock(&queue_lock);
+    while (list) {
+        offload_job *job = list;
+        list = job->next;
+        offload_run(job);
+    }
+    free(pool_tids);
+    pool_tids = NULL;
+}
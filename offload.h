@@ -0,0 +1,28 @@
+#ifndef OFFLOAD_H
+#define OFFLOAD_H
+
+// 后台文件线程：可能在磁盘上等待很久的操作（同步到磁盘、拼出去重上传的文件、恢复版本、
+// 写入一批项目文件）不在工作线程上执行，一个慢的磁盘操作不会拖住同一线程上的其他连接。
+// 工作线程提交任务后，需要结果的会话进入等待状态、不再处理新的输入；任务完成后通过回调
+// 交回会话所在的工作线程，在那里继续会话的状态机，做法与认证线程相同。
+// 会话先关闭时任务照常执行完（已经收到的文件仍然提交），交回时 owner 为 NULL。
+
+#define OFFLOAD_THREADS 4
+
+typedef struct offload_job offload_job;
+struct offload_job {
+    void (*run)(offload_job *job);                // 在后台文件线程上执行
+    void (*done)(offload_job *job, void *owner);  // 交回工作线程后调用，负责释放任务
+    void *owner;                                  // 提交任务的会话，会话先关闭时置为 NULL
+    void *worker;                                 // 会话所在的工作线程，完成回调据此交回任务
+    offload_job *next;
+};
+
+// 启动 nthreads 个后台文件线程；每个任务执行完后在执行它的线程上调用 done
+int offload_start(int nthreads, void (*done)(offload_job *job));
+// 执行完队列中的任务后返回，之后提交的任务在调用方的线程上执行
+void offload_stop(void);
+// 任务一定会执行并交给 done：队列不设上限，每个会话同时只有很少的任务
+void offload_submit(offload_job *job);
+
+#endif
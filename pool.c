@@ -0,0 +1,76 @@
+#include "pool.h"
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct pool_block {
+    struct pool_block *next;
+} pool_block;
+
+typedef struct {
+    pool_block *free;
+    size_t count;
+} pool_class;
+
+static __thread pool_class pool_classes[POOL_CLASSES];
+
+// 能容纳 size 字节的最小等级，超过最大等级时返回 -1
+static int pool_class_of(size_t size) {
+    if (size > ((size_t)1 << POOL_MAX_SHIFT)) return -1;
+    int c = 0;
+    while (((size_t)1 << (POOL_MIN_SHIFT + c)) < size) c++;
+    return c;
+}
+
+size_t pool_size(size_t size) {
+    int c = pool_class_of(size);
+    return c < 0 ? size : (size_t)1 << (POOL_MIN_SHIFT + c);
+}
+
+void *pool_alloc(size_t size) {
+    int c = pool_class_of(size);
+    if (c < 0) return malloc(size);
+    pool_class *pc = &pool_classes[c];
+    if (pc->free) {
+        pool_block *b = pc->free;
+        pc->free = b->next;
+        pc->count--;
+        return b;
+    }
+    return malloc((size_t)1 << (POOL_MIN_SHIFT + c));
+}
+
+void *pool_calloc(size_t size) {
+    void *p = pool_alloc(size);
+    if (p) memset(p, 0, size);
+    return p;
+}
+
+// 放回本线程的空闲链表；在其他线程分配的缓冲区也可以放回，之后由本线程使用
+void pool_free(void *p, size_t size) {
+    if (!p) return;
+    int c = pool_class_of(size);
+    if (c < 0) {
+        free(p);
+        return;
+    }
+    pool_class *pc = &pool_classes[c];
+    if ((pc->count + 1) << (POOL_MIN_SHIFT + c) > POOL_CACHE_BYTES) {
+        free(p);
+        return;
+    }
+    pool_block *b = p;
+    b->next = pc->free;
+    pc->free = b;
+    pc->count++;
+}
+
+void pool_thread_exit(void) {
+    for (int c = 0; c < POOL_CLASSES; c++) {
+        while (pool_classes[c].free) {
+            pool_block *b = pool_classes[c].free;
+            pool_classes[c].free = b->next;
+            free(b);
+        }
+        pool_classes[c].count = 0;
+    }
+}
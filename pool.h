@@ -0,0 +1,23 @@
+#ifndef POOL_H
+#define POOL_H
+
+// 按大小等级缓存的缓冲区池：4KB 到 1MB 每个 2 的幂一个等级，每个线程有自己的空闲链表，
+// 分配和释放都不加锁。会话对象、收发缓冲区和传输中的临时缓冲区都从这里分配，
+// 同一个工作线程上的会话反复使用同一批缓冲区，不经过 malloc。
+// 释放时必须传入分配时的大小；超过 1MB 的请求直接使用 malloc / free。
+
+#include <stddef.h>
+
+#define POOL_MIN_SHIFT 12                          // 最小等级 4KB
+#define POOL_MAX_SHIFT 20                          // 最大等级 1MB
+#define POOL_CLASSES (POOL_MAX_SHIFT - POOL_MIN_SHIFT + 1)
+#define POOL_CACHE_BYTES (8 * 1024 * 1024)         // 每个线程每个等级最多缓存的空闲字节
+#define IO_BUF_SIZE (256 * 1024)                   // 传输路径中读出再写入时使用的缓冲区
+
+void *pool_alloc(size_t size);
+void *pool_calloc(size_t size);
+void pool_free(void *p, size_t size);
+size_t pool_size(size_t size);   // 实际分配的容量，可以全部使用
+void pool_thread_exit(void);     // 线程退出前释放本线程缓存的缓冲区
+
+#endif
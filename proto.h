@@ -0,0 +1,213 @@
+#ifndef PROTO_H
+#define PROTO_H
+
+// 客户端与服务器共用的二进制帧协议
+//
+// 每个帧由 16 字节的帧头和 payload 组成，帧头字段均为网络字节序：
+//   magic(2) | version(1) | opcode(1) | request_id(4) | length(8)
+// 客户端为每个请求分配递增的 request_id，服务器的回复带上对应请求的 id，
+// 因此客户端可以连续发送多个请求而不必等待每个提示。
+//
+// 断点续传：接收方先写入 <文件>.part，每收到 CHECKPOINT_INTERVAL 字节同步一次并记录
+// 已经落盘的偏移。发送方开始传输前通过 OP_RESUME 得到接收方的检查点，OP_FILE 从该偏移继续。
+//
+// 并行上传：大文件先用 OP_PARALLEL_BEGIN 申请凭据，再由多条新的数据连接各自用 OP_RANGE
+// 发送文件的一段，服务器按偏移写入同一个 .part 文件；控制连接发送 OP_PARALLEL_END 后，
+// 服务器确认所有分段都已写入才提交文件。
+//
+// 去重上传：客户端用内容定义分块（cdc.h）把文件切成块，先用 OP_MANIFEST 发送每块的 SHA-256，
+// 服务器在 OP_CHUNK_NEED 中回复块存储里缺少哪些块，客户端只发送这些块，服务器再按清单拼出文件。
+//
+// 增量上传：服务器已有同名文件时，对 OP_DELTA_BEGIN 回复当前文件的块签名（delta.h），
+// 客户端用 OP_DELTA 发送块引用和原始字节，服务器在 .part 中重建文件后替换原文件。
+//
+// 压缩传输：客户端连接后用 OP_CODECS 提出支持的编码，服务器选出双方都支持的一种。选中编码后
+// 原本用 OP_FILE 发送的内容改为一个 OP_ZFILE 加若干 OP_ZDATA，每块独立压缩，没有变小的块原样发送。
+//
+// 打包上传：上传项目时目录和放得进一块的小文件不再逐个发送，而是连续写入记录，每满一块
+// （CODEC_BLOCK_SIZE）作为一个 OP_ARCHIVE 帧发出，服务器一次解开一批；较大的文件仍然单独发送。
+//
+// 增量同步：服务器为每个项目保存客户端上传时的路径、大小、修改时间和内容哈希，上传项目时先发给
+// 客户端。大小和修改时间都没变的文件不再发送，只有修改时间变了的文件比较哈希；发送过的文件之后
+// 跟一条 ARCHIVE_META 记录更新清单，客户端已经删除的路径以 ARCHIVE_DELETE 记录通知服务器。
+//
+// 恢复登录：登录成功后服务器以 OP_SESSION 发出会话凭据。连接意外断开时客户端重新连接，
+// 在新连接上出示凭据，服务器验证后直接进入主菜单，不再询问用户名和密码。
+
+#include <stdint.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <endian.h>
+
+#define PROTO_MAGIC 0x5048          // "PH"
+#define PROTO_VERSION 2
+#define PROTO_HEADER_SIZE 16
+#define PROTO_MAX_CONTROL 16384     // 除文件内容外，单个帧 payload 的上限
+#define CHUNK_SIZE 4096             // 发送文件内容时每次读取的大小
+#define CHECKPOINT_INTERVAL (16LL * 1024 * 1024)  // 接收方每写入这么多字节记录一次检查点
+#define PARALLEL_TOKEN_SIZE 16      // 并行上传的数据连接凭据长度
+#define PARALLEL_MAX_STREAMS 16     // 并行上传的最大连接数
+#define SESSION_TOKEN_SIZE 16       // 恢复登录的会话凭据长度
+#define CDC_HASH_SIZE 32            // 块的 SHA-256
+#define CDC_ENTRY_SIZE 36           // 清单中的一项：[32 字节 SHA-256][4 字节块长度]
+#define CDC_MAX_SIZE (256 * 1024)   // 块的最大长度
+#define CDC_MANIFEST_MAX (1024 * 1024)  // OP_MANIFEST payload 的上限
+#define CDC_MAX_CHUNKS 28000        // 一个清单最多的块数，更大的文件不去重
+#define CDC_MIN_FILE (1024 * 1024)  // 不小于这个大小的文件才分块上传
+
+// 操作码
+enum {
+    OP_INPUT = 1,          // C->S 一条用户输入（不含换行）
+    OP_TEXT = 2,           // S->C 显示给用户的文本
+    OP_ERROR = 3,          // S->C 协议错误说明
+    OP_BYE = 4,            // S->C 服务器即将关闭连接
+    OP_UPLOAD_REQ = 5,     // S->C 请求客户端上传，payload 为 1 字节类型（UPLOAD_KIND_*）
+    OP_UPLOAD_BEGIN = 6,   // C->S 开始上传项目，payload 为项目名
+    OP_DIR = 7,            // 目录，payload 为相对路径
+    OP_FILE = 8,           // 文件，payload 为 [2 字节路径长度][路径][8 字节起始偏移][从该偏移开始的文件内容]
+    OP_UPLOAD_END = 9,     // C->S 上传结束（未发送 OP_UPLOAD_BEGIN 时表示取消）
+    OP_DOWNLOAD_BEGIN = 10,// S->C 开始下载，payload 为 [1 字节类型][项目名或文件名]
+    OP_DOWNLOAD_END = 11,  // S->C 下载结束
+    OP_RESUME = 12,        // 接收方的检查点列表，每项为 [2 字节路径长度][路径][8 字节文件大小][8 字节已落盘偏移]
+                           // S->C 在 OP_UPLOAD_REQ（上传文件）或 OP_UPLOAD_BEGIN 之后发送，路径相对于项目；
+                           // C->S 在连接建立后发送，路径相对于客户端的下载目录（"项目名/路径" 或 "文件名"）
+    OP_PARALLEL_BEGIN = 13,// C->S 开始并行上传一个文件，payload 为 [2 字节路径长度][路径][8 字节大小][1 字节连接数]
+    OP_PARALLEL_READY = 14,// S->C [16 字节凭据][1 字节接受的连接数]，连接数为 0 表示改用 OP_FILE 发送
+    OP_RANGE = 15,         // C->S 数据连接上的第一个帧：[16 字节凭据][8 字节偏移][这一段的内容]
+    OP_RANGE_DONE = 16,    // S->C 这一段已经写入，payload 为 1 字节结果（1 成功，0 失败）
+    OP_PARALLEL_END = 17,  // C->S 所有数据连接都已收到 OP_RANGE_DONE，payload 为凭据；服务器检查完整后提交文件
+    OP_MANIFEST = 18,      // C->S 去重上传一个文件：[2 字节路径长度][路径][8 字节大小][按顺序的清单项]
+    OP_CHUNK_NEED = 19,    // S->C 缺少的块，第 i 位对应清单第 i 项；payload 为空表示改用 OP_FILE 发送
+    OP_CHUNK = 20,         // C->S 一个缺少的块：[32 字节 SHA-256][块内容]，按清单顺序发送
+    OP_DELTA_BEGIN = 21,   // C->S 增量上传一个文件：[2 字节路径长度][路径][8 字节新文件的大小]
+    OP_SIGNATURES = 22,    // S->C 当前文件的块签名，分多个帧发送：[4 字节块长度][4 字节块数][4 字节最后一块的长度]
+                           // [4 字节这一帧第一块的下标][签名...]
+                           // 块数为 0 表示服务器没有这个文件，客户端改用其他方式上传
+    OP_DELTA = 23,         // C->S 一组 DELTA_COPY / DELTA_LITERAL 指令
+    OP_DELTA_END = 24,     // C->S 指令发送完毕，服务器检查大小后替换原文件
+    OP_CODECS = 25,        // 压缩协商：C->S [1 字节级别][按偏好顺序的编码（codec.h）]，0 级表示默认级别；
+                           // S->C [1 字节选中的编码][1 字节级别]，编码为 CODEC_NONE 表示不压缩
+    OP_ZFILE = 26,         // 压缩传输的文件：[2 字节路径长度][路径][8 字节起始偏移][8 字节从该偏移开始的原始长度]
+    OP_ZDATA = 27,         // OP_ZFILE 之后的内容块：[1 字节编码][4 字节原始长度][数据]，依次覆盖全部原始长度
+    OP_ARCHIVE = 28,       // C->S 上传项目时打包的一批目录和小文件，payload 与 OP_ZDATA 相同，
+                           // 解压后是连续的记录：[1 字节类型（ARCHIVE_*）][2 字节路径长度][路径][8 字节大小][内容]
+    OP_SYNC_MANIFEST = 29, // S->C 在 OP_UPLOAD_BEGIN 的 OP_RESUME 之后发送服务器上的项目清单，分多个帧，
+                           // 每项为 [1 字节类型（ARCHIVE_DIR / ARCHIVE_FILE）][2 字节路径长度][路径]
+                           // [8 字节大小][8 字节修改时间][8 字节哈希]，payload 为空的帧表示清单结束
+    OP_SESSION = 30        // 会话凭据：S->C 登录成功后 [凭据][4 字节有效期（秒）]，payload 为空表示凭据作废；
+                           // C->S 未登录时 [凭据]，恢复之前的登录，服务器以新的 OP_SESSION 和主菜单回复
+};
+
+// OP_ARCHIVE 的记录类型
+#define ARCHIVE_DIR 1
+#define ARCHIVE_FILE 2
+#define ARCHIVE_META 3     // 文件已经发送或内容没有变化：内容为 [8 字节修改时间][8 字节哈希]，大小字段为 16
+#define ARCHIVE_DELETE 4   // 客户端已经没有这个路径，服务器删除文件或空目录
+#define ARCHIVE_RECORD_HEADER 11  // 类型、路径长度和大小
+#define SYNC_ENTRY_HEADER 27      // OP_SYNC_MANIFEST 一项除路径外的长度
+
+// OP_UPLOAD_REQ / OP_DOWNLOAD_BEGIN 的类型
+#define UPLOAD_KIND_PROJECT 0
+#define UPLOAD_KIND_FILE 1
+
+typedef struct {
+    uint16_t magic;
+    uint8_t version;
+    uint8_t opcode;
+    uint32_t request_id;
+    uint64_t length;
+} frame_header;
+
+// 编码帧头
+static inline void proto_encode_header(unsigned char *buf, uint8_t opcode, uint32_t request_id, uint64_t length) {
+    uint16_t magic = htons(PROTO_MAGIC);
+    uint32_t id = htonl(request_id);
+    uint64_t len = htobe64(length);
+    memcpy(buf, &magic, 2);
+    buf[2] = PROTO_VERSION;
+    buf[3] = opcode;
+    memcpy(buf + 4, &id, 4);
+    memcpy(buf + 8, &len, 8);
+}
+
+// 解码帧头，magic 或版本不匹配时返回 -1
+static inline int proto_decode_header(const void *data, frame_header *hdr) {
+    const unsigned char *buf = data;
+    uint16_t magic;
+    uint32_t id;
+    uint64_t len;
+    memcpy(&magic, buf, 2);
+    memcpy(&id, buf + 4, 4);
+    memcpy(&len, buf + 8, 8);
+    hdr->magic = ntohs(magic);
+    hdr->version = buf[2];
+    hdr->opcode = buf[3];
+    hdr->request_id = ntohl(id);
+    hdr->length = be64toh(len);
+    if (hdr->magic != PROTO_MAGIC || hdr->version != PROTO_VERSION) return -1;
+    return 0;
+}
+
+// 检查对端发来的相对路径，拒绝绝对路径和包含 ".." 的路径
+static inline int proto_path_is_safe(const char *rel) {
+    size_t len = strlen(rel);
+    if (len == 0 || rel[0] == '/') return 0;
+    if (strcmp(rel, "..") == 0 || strncmp(rel, "../", 3) == 0 ||
+        strstr(rel, "/../") != NULL || (len >= 3 && strcmp(rel + len - 3, "/..") == 0)) {
+        return 0;
+    }
+    return 1;
+}
+
+// 编码 OP_FILE 的 payload 前缀：[2 字节路径长度][路径][8 字节起始偏移]，返回前缀长度
+static inline size_t proto_encode_file_prefix(unsigned char *buf, const char *path, uint64_t offset) {
+    uint16_t len = (uint16_t)strlen(path);
+    uint16_t net_len = htons(len);
+    uint64_t net_off = htobe64(offset);
+    memcpy(buf, &net_len, 2);
+    memcpy(buf + 2, path, len);
+    memcpy(buf + 2 + len, &net_off, 8);
+    return 2 + len + 8;
+}
+
+// 在 OP_RESUME 的 payload 末尾追加一项，空间不足时返回 0
+static inline size_t proto_encode_resume(unsigned char *buf, size_t avail, const char *path,
+                                         uint64_t size, uint64_t offset) {
+    size_t len = strlen(path);
+    if (len > 0xffff || 2 + len + 16 > avail) return 0;
+    uint16_t net_len = htons((uint16_t)len);
+    uint64_t net_size = htobe64(size);
+    uint64_t net_off = htobe64(offset);
+    memcpy(buf, &net_len, 2);
+    memcpy(buf + 2, path, len);
+    memcpy(buf + 2 + len, &net_size, 8);
+    memcpy(buf + 10 + len, &net_off, 8);
+    return 2 + len + 16;
+}
+
+// 在 OP_RESUME 的 payload 中查找 path 的检查点，返回可以继续的偏移；
+// 没有记录或文件大小已经改变时返回 0。pos 不为 NULL 时返回该项在 payload 中的位置
+static inline uint64_t proto_find_resume(const unsigned char *buf, size_t len, const char *path, uint64_t size,
+                                         size_t *pos) {
+    size_t path_len = strlen(path);
+    size_t off = 0;
+    while (off + 2 <= len) {
+        uint16_t n;
+        uint64_t entry_size, entry_off;
+        memcpy(&n, buf + off, 2);
+        n = ntohs(n);
+        if (off + 2 + n + 16 > len) break;
+        memcpy(&entry_size, buf + off + 2 + n, 8);
+        memcpy(&entry_off, buf + off + 10 + n, 8);
+        entry_size = be64toh(entry_size);
+        entry_off = be64toh(entry_off);
+        if (n == path_len && memcmp(buf + off + 2, path, n) == 0) {
+            if (pos) *pos = off;
+            return entry_size == size && entry_off < size ? entry_off : 0;
+        }
+        off += 2 + n + 16;
+    }
+    return 0;
+}
+
+#endif
@@ -1,5 +1,14 @@
-#include "server.h"
-#include <sqlite3.h>
+#include "session.h"
+#include <pthread.h>
+#include <sys/random.h>
+#include <signal.h>
+#include <spawn.h>
+#include "store.h"
+#include "delta.h"
+#include "version.h"
+#include "dircache.h"
+#include "trash.h"
+#include <openssl/sha.h>
 
 void handle_error(const char *msg) {
     perror(msg);
@@ -16,185 +25,145 @@ void trim_newline(char *str) {
     }
 }
 
-static sqlite3 *db = NULL;
-
-// 初始化数据库
-int init_database(void) {
-    int rc = sqlite3_open("users.db", &db);
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "Cannot open database: %s\n", sqlite3_errmsg(db));
-        return -1;
-    }
-
-    // 创建用户表
-    const char *sql = "CREATE TABLE IF NOT EXISTS users ("
-                     "id INTEGER PRIMARY KEY AUTOINCREMENT,"
-                     "username TEXT UNIQUE NOT NULL,"
-                     "password TEXT NOT NULL,"
-                     "status INTEGER DEFAULT 1"
-                     ");";
-
-    char *err_msg = NULL;
-    rc = sqlite3_exec(db, sql, 0, 0, &err_msg);
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "SQL error: %s\n", err_msg);
-        sqlite3_free(err_msg);
-        return -1;
-    }
-    
-    // 输出当前数据库中的用户数量
-    int user_count = db_get_user_count();
-    printf("Database initialized with %d users\n", user_count);
-    return 0;
+// 发送欢迎菜单，回到未登录状态
+void session_start(session *s) {
+    session_send_str(s, WELCOME_MENU);
+    s->state = ST_WELCOME;
 }
 
-// 添加一个函数来获取用户数量
-int db_get_user_count(void) {
-    const char *sql = "SELECT COUNT(*) FROM users;";
-    sqlite3_stmt *stmt;
-    int count = 0;
-    
-    int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
-    if (rc == SQLITE_OK) {
-        if (sqlite3_step(stmt) == SQLITE_ROW) {
-            count = sqlite3_column_int(stmt, 0);
-        }
-    }
-    sqlite3_finalize(stmt);
-    return count;
+// 发送主菜单
+static void enter_main_menu(session *s) {
+    const char main_menu[] =
+        "Main Menu:\n"
+        "1. List Projects\n"
+        "2. Create New Project\n"
+        "3. Open Project\n"
+        "4. Delete Project\n"
+        "5. Upload Project\n"
+        "6. Download Project\n"
+        "7. Execute Remote Command\n"
+        "8. Logout\n"
+        "9. Activity History\n"
+        "0. Restore Deleted Project\n";
+    session_send_str(s, main_menu);
+    s->state = ST_MAIN_MENU;
 }
 
-// 添加用户
-int db_add_user(const char *username, const char *password) {
-    const char *sql = "INSERT INTO users (username, password) VALUES (?, ?);";
-    sqlite3_stmt *stmt;
-    
-    int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
-    if (rc != SQLITE_OK) {
-        return -1;
-    }
-
-    sqlite3_bind_text(stmt, 1, username, -1, SQLITE_STATIC);
-    sqlite3_bind_text(stmt, 2, password, -1, SQLITE_STATIC);
-
-    rc = sqlite3_step(stmt);
-    sqlite3_finalize(stmt);
-
-    return (rc == SQLITE_DONE) ? 0 : -1;
+// 发送项目菜单
+static void enter_project_menu(session *s) {
+    const char submenu[] =
+        "Project Menu:\n"
+        "a. List Files\n"
+        "b. Create New File\n"
+        "c. Open/Edit File\n"
+        "d. Upload File\n"
+        "e. Download File\n"
+        "f. Return to Main Menu\n"
+        "g. File History\n";
+    session_send_str(s, submenu);
+    s->state = ST_PROJECT_MENU;
 }
 
-// 检查用户登录
-int db_check_user(const char *username, const char *password) {
-    const char *sql = "SELECT id FROM users WHERE username = ? AND password = ?;";
-    sqlite3_stmt *stmt;
-    
-    int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
-    if (rc != SQLITE_OK) {
-        return -1;
+// 用户注册：收到用户名
+static void user_register_username(session *s, const char *username) {
+    // 检查用户是否已存在
+    if (db_user_exists(username) > 0) {
+        session_send_str(s, "Username already exists\n");
+        session_start(s);
+        return;
     }
 
-    sqlite3_bind_text(stmt, 1, username, -1, SQLITE_STATIC);
-    sqlite3_bind_text(stmt, 2, password, -1, SQLITE_STATIC);
-
-    rc = sqlite3_step(stmt);
-    sqlite3_finalize(stmt);
-
-    return (rc == SQLITE_ROW) ? 1 : 0;
+    strncpy(s->pending, username, sizeof(s->pending) - 1);
+    session_send_str(s, "Please enter your password:");
+    s->state = ST_REG_PASSWORD;
 }
 
-// 检查用户是否存在
-int db_user_exists(const char *username) {
-    const char *sql = "SELECT id FROM users WHERE username = ?;";
-    sqlite3_stmt *stmt;
-    
-    int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
-    if (rc != SQLITE_OK) {
-        return -1;
+// 把密码交给认证线程计算哈希，会话等待任务交回（user_auth_done）；认证线程忙不过来时拒绝
+static void user_auth_submit(session *s, int kind, const char *password) {
+    auth_job *job = auth_job_new(kind, s->pending, password);
+    if (job) {
+        job->owner = s;
+        job->worker = s->worker;
     }
-
-    sqlite3_bind_text(stmt, 1, username, -1, SQLITE_STATIC);
-
-    rc = sqlite3_step(stmt);
-    sqlite3_finalize(stmt);
-
-    return (rc == SQLITE_ROW) ? 1 : 0;
-}
-
-// 关闭数据库
-void close_database(void) {
-    if (db) {
-        sqlite3_close(db);
-        db = NULL;
+    if (!job || auth_submit(job) < 0) {
+        auth_job_free(job);
+        session_send_str(s, "Server busy, please try again later\n");
+        session_start(s);
+        return;
     }
+    s->auth_job = job;
+    s->state = ST_AUTH_WAIT;
 }
 
-// 用户注册函数
-int user_register(int client_fd, user_info users[], int user_count) {
-    char username[128], password[128];
-    
-    // 获取用户名
-    send(client_fd, "Please enter your username:", 26, 0);
-    ssize_t len = recv(client_fd, username, sizeof(username) - 1, 0);
-    if (len < 0) {
-        perror("recv");
-        return -1;
-    }
-    username[len] = '\0';
-    trim_newline(username);
+// 用户注册：收到密码，由认证线程计算哈希后添加到数据库
+static void user_register_password(session *s, const char *password) {
+    user_auth_submit(s, AUTH_JOB_REGISTER, password);
+}
 
-    // 检查用户是否已存在
-    if (db_user_exists(username) > 0) {
-        send(client_fd, "Username already exists\n", 24, 0);
-        return -1;
+// 登录成功（密码验证或出示会话凭据）：发出新的会话凭据，进入主菜单
+static void user_login_done(session *s, const char *username) {
+    strncpy(s->user.username, username, sizeof(s->user.username) - 1);
+    s->user.status = 1;
+    s->shape = shape_user(s->user.username);
+    create_workspace(s->user.username);
+
+    unsigned char payload[SESSION_TOKEN_SIZE + 4];
+    uint32_t ttl = htonl(AUTH_TOKEN_TTL);
+    if (auth_token_issue(s->user.username, s->session_token) == 0) {
+        s->has_session_token = 1;
+        memcpy(payload, s->session_token, SESSION_TOKEN_SIZE);
+        memcpy(payload + SESSION_TOKEN_SIZE, &ttl, 4);
+        session_send_frame(s, OP_SESSION, payload, sizeof(payload));
     }
+    enter_main_menu(s);
+}
 
-    // 获取密码
-    send(client_fd, "Please enter your password:", 26, 0);
-    len = recv(client_fd, password, sizeof(password) - 1, 0);
-    if (len < 0) {
-        perror("recv");
-        return -1;
+// 退出登录：作废会话凭据，客户端收到空的 OP_SESSION 后不再用它恢复登录
+static void user_logout(session *s) {
+    if (s->has_session_token) {
+        auth_token_revoke(s->session_token);
+        s->has_session_token = 0;
+        session_send_frame(s, OP_SESSION, NULL, 0);
     }
-    password[len] = '\0';
-    trim_newline(password);
+    user_info_init(&s->user);
+    s->shape = NULL;
+}
 
-    // 添加用户到数据库
-    if (db_add_user(username, password) == 0) {
-        send(client_fd, "Registration successful!\n", 24, 0);
-        return 0;
+// 用户登录：收到密码后验证，最近登录过的用户在凭据缓存中验证，其他的交给认证线程
+static void user_login_password(session *s, const char *password) {
+    if (auth_cache_check(s->pending, password)) {
+        auth_cache_put(s->pending, password);
+        session_send_str(s, "Login successful!\n");
+        user_login_done(s, s->pending);
+        return;
     }
-
-    send(client_fd, "Registration failed\n", 19, 0);
-    return -1;
+    user_auth_submit(s, AUTH_JOB_LOGIN, password);
 }
 
-// 用户登录函数
-int user_login(int client_fd, user_info *user, int max) {
-    char username[128], password[128];
-
-    // 获取用户名和密码
-    send(client_fd, "Please enter your username:", 26, 0);
-    ssize_t len = recv(client_fd, username, sizeof(username) - 1, 0);
-    if (len < 0) return -1;
-    username[len] = '\0';
-    trim_newline(username);
-
-    send(client_fd, "Please enter your password:", 26, 0);
-    len = recv(client_fd, password, sizeof(password) - 1, 0);
-    if (len < 0) return -1;
-    password[len] = '\0';
-    trim_newline(password);
-
-    // 验证用户
-    if (db_check_user(username, password) > 0) {
-        send(client_fd, "Login successful!\n", 18, 0);
-        strncpy(user->username, username, sizeof(user->username) - 1);
-        user->status = 1;
-        return 1;
+// 认证任务交回：在会话所在的工作线程上完成登录或注册
+void user_auth_done(session *s, auth_job *job) {
+    if (job->kind == AUTH_JOB_REGISTER) {
+        session_send_str(s, job->ok ? "Registration successful!\n" : "Registration failed\n");
+        session_start(s);
+    } else if (job->ok) {
+        session_send_str(s, "Login successful!\n");
+        user_login_done(s, job->username);
+    } else {
+        session_send_str(s, "Invalid username or password\n");
+        session_start(s);
     }
+}
 
-    send(client_fd, "Invalid username or password\n", 29, 0);
-    return -1;
+// 把任务交给后台文件线程，会话等待任务交回后由 done 继续；job 是各类任务结构的第一个成员
+static void submit_offload(session *s, offload_job *job, void (*run)(offload_job *),
+                           void (*done)(offload_job *, void *)) {
+    job->run = run;
+    job->done = done;
+    job->owner = s;
+    job->worker = s->worker;
+    s->offload = job;
+    s->state = ST_OFFLOAD_WAIT;
+    offload_submit(job);
 }
 
 // 用户信息初始化
@@ -211,7 +180,7 @@ int create_workspace(const char *username) {
     
     // 先创建 workspaces 根目录（如果不存在）
     if (mkdir("./workspaces", 0755) == -1 && errno != EEXIST) {
-        perror("mkdir workspaces");
+        log_error("Failed to create ./workspaces: %s", strerror(errno));
         return -1;
     }
 
@@ -221,7 +190,7 @@ int create_workspace(const char *username) {
     if (mkdir(dir_path, 0755) == -1) {
         // 如果错误是因为目录已经存在，就忽略错误
         if (errno != EEXIST) {
-            perror("mkdir userdir");
+            log_warn("Failed to create %s: %s", dir_path, strerror(errno));
             return -1;
         }
     }
@@ -229,176 +198,520 @@ int create_workspace(const char *username) {
     return 0;
 }
 
-// 日志记录
-void log_version(const char *username, const char *file_name, const char *action) {
-    FILE *log_fp = fopen("version_log.txt", "a");
-    if (!log_fp) return;
+// 活动记录：写入数据库的活动历史，可以按用户、项目、文件和时间查询
+void log_version(const char *username, const char *project, const char *file_name, const char *action) {
+    if (db_activity_add(time(NULL), username, project, file_name, action) == -1) {
+        log_warn("Failed to record activity: %s %s/%s %s", username, project, file_name, action);
+    }
+    log_debug("User: %s | Project: %s | File: %s | Action: %s", username, project, file_name, action);
+}
+
+// 打开 <filepath>.part 准备接收；offset > 0 时必须与记录的检查点一致，从该偏移继续写入
+static int open_part_file(session *s, const char *filepath, const char *project, const char *rel,
+                          long long offset, long long total) {
+    char part[PATH_MAX + 8];
+    snprintf(part, sizeof(part), "%s.part", filepath);
+
+    struct stat st;
+    if (offset > 0 && (db_checkpoint_get(s->user.username, project, rel, total) != offset ||
+                       stat(part, &st) == -1 || st.st_size < offset)) {
+        session_send_str(s, "Resume rejected, please upload the file again.\n");
+        return -1;
+    }
+
+    int fd = open(part, O_WRONLY | O_CREAT | O_CLOEXEC | (offset > 0 ? 0 : O_TRUNC), 0644);
+    if (fd == -1) {
+        log_warn("Failed to open %s for writing: %s", part, strerror(errno));
+        return -1;
+    }
+    // 检查点之后可能还有没同步的内容，从检查点处重新写
+    if (offset > 0 && ftruncate(fd, offset) == -1) {
+        log_warn("Failed to resume %s: %s", part, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// 保存文件：内容先写入 <filepath>.part，全部收到后再改名，OP_FILE 帧中的文件内容由 ST_FILE_DATA 状态接收
+// project / rel 是检查点的键；filepath 为空时读完内容后丢弃
+static void save_file(session *s, const char *filepath, const char *project, const char *rel,
+                      long long offset, long long len, session_state next_state) {
+    strncpy(s->file_path, filepath, sizeof(s->file_path) - 1);
+    s->file_fd = filepath[0] ? open_part_file(s, filepath, project, rel, offset, offset + len) : -1;
+    s->file_checkpoint = 0;
+    if (s->file_fd != -1) {
+        // 按声明的大小预先分配空间，减少碎片；不改变文件长度，传输中断时文件只包含已收到的部分
+        if (len > 0) fallocate(s->file_fd, FALLOC_FL_KEEP_SIZE, offset, len);
+        // 小文件重传的代价很小，不记录检查点
+        if (offset + len > CHECKPOINT_INTERVAL) {
+            s->file_checkpoint = 1;
+            strncpy(s->ckpt_project, project, sizeof(s->ckpt_project) - 1);
+            strncpy(s->ckpt_path, rel, sizeof(s->ckpt_path) - 1);
+        }
+    }
+    s->file_remaining = len;
+    s->file_total = offset + len;
+    s->file_written = s->file_durable = offset;
+    s->file_seq++;
+    s->file_compressed = 0;
+    s->file_next_state = next_state;
+    s->state = ST_FILE_DATA;
+    if (offset > 0) {
+        log_info("Resuming file: %s at %lld of %lld bytes", filepath, offset, offset + len);
+    } else {
+        log_info("Receiving file: %s, Size: %lld bytes", filepath, len);
+    }
+}
+
+// 检查点：在后台文件线程上同步已经写入的内容，交回后才记录新的偏移
+typedef struct {
+    offload_job job;
+    int fd;                     // 正在接收的文件的副本
+    unsigned seq;               // 提交时的 file_seq
+    long long offset;           // 同步完成后可以记录的偏移
+    int ok;
+} checkpoint_job;
+
+static void checkpoint_run(offload_job *job) {
+    checkpoint_job *c = (checkpoint_job *)job;
+    c->ok = fdatasync(c->fd) == 0;
+    if (!c->ok) log_warn("Failed to sync upload at %lld: %s", c->offset, strerror(errno));
+    close(c->fd);
+}
+
+// 文件已经收完、接收失败或换成了下一个文件时，这次同步的结果不再记录
+static void checkpoint_done(offload_job *job, void *owner) {
+    checkpoint_job *c = (checkpoint_job *)job;
+    session *s = owner;
+    if (s && c->ok && s->file_seq == c->seq && s->file_fd != -1 && c->offset > s->file_durable &&
+        db_checkpoint_save(s->user.username, s->ckpt_project, s->ckpt_path, s->file_total, c->offset) == 0) {
+        s->file_durable = c->offset;
+    }
+    free(c);
+}
+
+// 已经写入的内容距上次检查点超过 CHECKPOINT_INTERVAL 时，交给后台文件线程同步；
+// 上一次同步还没有交回时先不提交，继续接收
+void save_file_checkpoint(session *s) {
+    log_progress(&s->log_progress_at, "Receiving %s: %lld of %lld bytes", s->file_path, s->file_written, s->file_total);
+    if (!s->file_checkpoint || s->file_fd == -1 || s->ckpt_job ||
+        s->file_written - s->file_durable < CHECKPOINT_INTERVAL) {
+        return;
+    }
+    checkpoint_job *c = calloc(1, sizeof(*c));
+    if (!c) return;
+    if ((c->fd = dup(s->file_fd)) == -1) {
+        free(c);
+        return;
+    }
+    c->seq = s->file_seq;
+    c->offset = s->file_written;
+    c->job.run = checkpoint_run;
+    c->job.done = checkpoint_done;
+    c->job.owner = s;
+    c->job.worker = s->worker;
+    s->ckpt_job = &c->job;
+    offload_submit(&c->job);
+}
 
-    time_t now = time(NULL);
-    struct tm *tm_info = localtime(&now);
-    char time_str[64];
-    strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M:%S", tm_info);
+// 并行上传：控制连接持有一个引用，每条数据连接各持有一个引用，最后一个引用释放时关闭文件
+typedef struct parallel_upload {
+    unsigned char token[PARALLEL_TOKEN_SIZE];
+    char path[PATH_MAX];                        // 目标文件，内容先写入 <path>.part
+    int fd;
+    int streams;                                // 接受的数据连接数
+    int attached;                               // 已经加入的数据连接数
+    long long size;
+    long long received;                         // 已经完整写入的分段长度之和
+    long long ranges[PARALLEL_MAX_STREAMS][2];  // 已加入的分段 [起点, 终点)
+    int failed;
+    int refs;
+    shape_bucket *shape;                        // 发起上传的用户的令牌桶，数据连接共用
+    struct parallel_upload *next;
+} parallel_upload;
+
+static parallel_upload *parallel_list;
+static pthread_mutex_t parallel_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// 释放一个引用，调用方持有 parallel_lock
+static void parallel_release(parallel_upload *p) {
+    if (--p->refs > 0) return;
+    close(p->fd);
+    free(p);
+}
+
+// 从登记表中移除，之后到达的数据连接不能再加入；调用方持有 parallel_lock
+static void parallel_unlink(parallel_upload *p) {
+    for (parallel_upload **pp = &parallel_list; *pp; pp = &(*pp)->next) {
+        if (*pp == p) {
+            *pp = p->next;
+            break;
+        }
+    }
+}
+
+// 连接关闭或放弃上传：控制连接删除 .part，数据连接把上传标记为失败
+void parallel_cancel(session *s) {
+    parallel_upload *p = s->parallel;
+    if (!p) return;
+    pthread_mutex_lock(&parallel_lock);
+    if (s->file_next_state == ST_DATA_CONN) {
+        p->failed = 1;
+    } else {
+        char part[PATH_MAX + 8];
+        snprintf(part, sizeof(part), "%s.part", p->path);
+        unlink(part);
+        parallel_unlink(p);
+    }
+    parallel_release(p);
+    pthread_mutex_unlock(&parallel_lock);
+    s->parallel = NULL;
+}
 
-    fprintf(log_fp, "%s | User: %s | File: %s | Action: %s\n", time_str, username, file_name, action);
-    fclose(log_fp);
+// 数据连接上的分段接收完成：计入并行上传，回复结果后关闭连接
+static void parallel_range_done(session *s) {
+    parallel_upload *p = s->parallel;
+    unsigned char ok = s->file_fd != -1;
+    if (s->file_fd != -1) {
+        close(s->file_fd);
+        s->file_fd = -1;
+    }
+    pthread_mutex_lock(&parallel_lock);
+    if (ok) {
+        p->received += s->parallel_len;
+    } else {
+        p->failed = 1;
+    }
+    parallel_release(p);
+    pthread_mutex_unlock(&parallel_lock);
+    s->parallel = NULL;
+    session_send_frame(s, OP_RANGE_DONE, &ok, 1);
+    s->closing = 1;
 }
 
-// 保存文件
+// 提交上传的文件：先把 .part 的内容同步到磁盘，再改名替换目标文件（替换前后各记录一个版本），
+// 改名之后的目标文件不会只有一部分内容。所有上传方式都按这个顺序提交，同步可能要等很久，
+// 在后台文件线程上进行。fd 是写完的 .part，在这里关闭；失败时 .part 留给调用方处理
+static int publish_part(const char *username, int fd, const char *path) {
+    char part[PATH_MAX + 8];
+    snprintf(part, sizeof(part), "%s.part", path);
+    int rc = fdatasync(fd);
+    if (rc == -1) log_error("Failed to sync %s: %s", part, strerror(errno));
+    close(fd);
+    if (rc == 0 && (rc = version_replace(username, part, path)) == -1) {
+        log_error("Failed to save %s: %s", path, strerror(errno));
+    }
+    return rc;
+}
 
-void save_file(int client_socket, const char *filepath) {
-    FILE *file = fopen(filepath, "wb");
-    if (!file) {
-        perror("Failed to open file for writing");
+// 提交一个上传的文件，会话等待提交完成后回到 resume 状态
+typedef struct {
+    offload_job job;
+    char username[128];
+    char path[PATH_MAX];
+    int fd;                     // 写完的 .part
+    int discard;                // 提交失败时删除 .part：只有 OP_FILE 可以续传
+    int ok;                     // 已经提交
+    session_state resume;
+    char project[128];          // 检查点的键，为空时没有检查点
+    char rel[PATH_MAX];
+} publish_job;
+
+static void publish_run(offload_job *job) {
+    publish_job *p = (publish_job *)job;
+    p->ok = publish_part(p->username, p->fd, p->path) == 0;
+    p->fd = -1;
+    if (p->ok) {
+        log_info("File received and saved: %s", p->path);
+        if (p->project[0]) db_checkpoint_delete(p->username, p->project, p->rel);
         return;
     }
+    log_warn("File not saved: %s", p->path);
+    if (p->discard) {
+        char part[PATH_MAX + 8];
+        snprintf(part, sizeof(part), "%s.part", p->path);
+        unlink(part);
+    }
+}
+
+// fd 交给任务；分配失败时关闭 fd 并返回 NULL
+static publish_job *publish_job_new(session *s, const char *path, int fd) {
+    publish_job *p = calloc(1, sizeof(*p));
+    if (!p) {
+        close(fd);
+        return NULL;
+    }
+    snprintf(p->username, sizeof(p->username), "%s", s->user.username);
+    snprintf(p->path, sizeof(p->path), "%s", path);
+    p->fd = fd;
+    p->resume = s->state;
+    return p;
+}
+
+// OP_FILE 接收完成后回到的状态：单个文件上传回到项目菜单，项目上传继续接收下一项
+static void save_file_finish(session *s, session_state next) {
+    if (next == ST_PROJECT_MENU) {
+        log_version(s->user.username, s->project_name, s->filename, "uploaded");
+        session_send_str(s, "File uploaded successfully.\n");
+        enter_project_menu(s);
+    } else {
+        s->state = next;
+    }
+}
 
-    // 接收文件大小
-    int file_size;
-    if (recv(client_socket, &file_size, sizeof(file_size), 0) <= 0) {
-        perror("Failed to receive file size");
-        fclose(file);
+static void save_file_published(offload_job *job, void *owner) {
+    publish_job *p = (publish_job *)job;
+    session *s = owner;
+    if (s) {
+        if (p->ok) strcpy(s->sync_path, p->path);
+        save_file_finish(s, p->resume);
+    }
+    free(p);
+}
+
+// 文件接收完成：.part 交给后台文件线程同步、改名；写入或提交失败时保留 .part 和检查点，之后可以续传
+static void save_file_done(session *s) {
+    s->file_compressed = 0;
+    if (s->file_next_state == ST_DATA_CONN) {
+        parallel_range_done(s);
         return;
     }
+    if (s->file_fd != -1) {
+        publish_job *p = publish_job_new(s, s->file_path, s->file_fd);
+        s->file_fd = -1;
+        if (p) {
+            if (s->file_checkpoint) {
+                snprintf(p->project, sizeof(p->project), "%s", s->ckpt_project);
+                snprintf(p->rel, sizeof(p->rel), "%s", s->ckpt_path);
+            }
+            p->resume = s->file_next_state;
+            submit_offload(s, &p->job, publish_run, save_file_published);
+            return;
+        }
+    }
+    if (s->file_path[0]) log_warn("File not saved: %s", s->file_path);
+    save_file_finish(s, s->file_next_state);
+}
 
-    file_size = ntohl(file_size); // 转换为本地字节序
+// 文件传输：把已经到达的文件内容直接从接收缓冲区写入文件
+static int recv_file_data(session *s) {
+    if (s->file_remaining == 0) {
+        save_file_done(s);
+        return 1;
+    }
 
-    printf("Receiving file: %s, Size: %d bytes\n", filepath, file_size);
+    size_t avail = session_input_avail(s);
+    if (avail == 0) return 0;
 
-    char buffer[BUF_SIZE];
-    int bytes_received = 0;
-    while (bytes_received < file_size) {
-        ssize_t bytes = recv(client_socket, buffer, sizeof(buffer), 0);
-        if (bytes <= 0) {
-            perror("Failed to receive file content");
-            break;
+    size_t n = avail < (size_t)s->file_remaining ? avail : (size_t)s->file_remaining;
+    if (s->file_fd != -1) {
+        if (pwrite(s->file_fd, session_input_ptr(s), n, s->file_written) != (ssize_t)n) {
+            log_error("Failed to write %s: %s", s->file_path, strerror(errno));
+            close(s->file_fd);
+            s->file_fd = -1;
+        } else {
+            s->file_written += n;
+            save_file_checkpoint(s);
         }
-        fwrite(buffer, 1, bytes, file);
-        bytes_received += bytes;
-        printf("Received %d bytes, Total: %d/%d bytes\n", (int)bytes, bytes_received, file_size);
     }
+    session_consume(s, n);
+    s->file_remaining -= n;
 
-    printf("File received and saved: %s\n", filepath);
-    fclose(file);
+    if (s->file_remaining == 0) save_file_done(s);
+    return 1;
 }
 
-
-// 编辑文件
-int edit_file(int client_fd, const char *username, const char *project_name, const char *filename) {
-    char file_path[256];
-    snprintf(file_path, sizeof(file_path), "./workspaces/%s/%s/%s", username, project_name, filename);
+// 编辑文件：确认后开始追加内容
+static void edit_file(session *s) {
+    char file_path[512];
+    snprintf(file_path, sizeof(file_path), "./workspaces/%s/%s/%s", s->user.username, s->project_name, s->filename);
     
     // 检查文件是否存在
     if (access(file_path, F_OK) != 0) {
-        send(client_fd, "File does not exist\n", 19, 0);
-        return -1;
+        session_send_str(s, "File does not exist\n");
+        enter_project_menu(s);
+        return;
     }
     
-    send(client_fd, "Enter file content (end with EOF):\n", 34, 0);
-    
-    FILE *fp = fopen(file_path, "a");
-    if (!fp) return -1;
-    
-    char buffer[1024];
-    while (1) {
-        ssize_t len = recv(client_fd, buffer, sizeof(buffer)-1, 0);
-        if (len <= 0) break;
-        buffer[len] = '\0';
-        
-        // 检查是否收到结束标记
-        if (strstr(buffer, "EOF") != NULL) {
-            break;
-        }
-        
-        fprintf(fp, "%s", buffer);
+    // 追加之前为还没有历史的文件保存原来的内容
+    version_baseline(s->user.username, file_path);
+    s->file_fd = open(file_path, O_WRONLY | O_APPEND);
+    if (s->file_fd == -1) {
+        enter_project_menu(s);
+        return;
     }
-    
-    fclose(fp);
-    log_version(username, filename, "edited");
-    send(client_fd, "File edited successfully\n", 24, 0);
-    return 0;
+
+    session_send_str(s, "Enter file content (end with EOF):\n");
+    s->state = ST_EDIT_CONTENT;
+}
+
+// 编辑文件：每收到一行追加到文件，直到收到结束标记
+static void edit_file_line(session *s, const char *line) {
+    if (strstr(line, "EOF") != NULL) {
+        char file_path[512];
+        snprintf(file_path, sizeof(file_path), "./workspaces/%s/%s/%s", s->user.username, s->project_name, s->filename);
+        close(s->file_fd);
+        s->file_fd = -1;
+        version_commit(s->user.username, file_path);
+        log_version(s->user.username, s->project_name, s->filename, "edited");
+        session_send_str(s, "File edited successfully\n");
+        enter_project_menu(s);
+        return;
+    }
+
+    dprintf(s->file_fd, "%s\n", line);
 }
 
 // 删除文件
-int delete_file(int client_fd, const char *username, const char *filename) {
+int delete_file(session *s, const char *username, const char *filename) {
     char file_path[256];
     snprintf(file_path, sizeof(file_path), "./workspaces/%s/%s", username, filename);
     
     if (remove(file_path) != 0) {
-        send(client_fd, "Failed to delete file\n", 21, 0);
+        session_send_str(s, "Failed to delete file\n");
         return -1;
     }
     
-    log_version(username, filename, "deleted");
-    send(client_fd, "File deleted successfully\n", 25, 0);
+    log_version(username, "", filename, "deleted");
+    session_send_str(s, "File deleted successfully\n");
     return 0;
 }
 
 // 创建项目目录
-int create_project_directory(int client_fd, const char *username, const char *project_name) {
+int create_project_directory(session *s, const char *username, const char *project_name) {
     char dir_path[256];
     snprintf(dir_path, sizeof(dir_path), "./workspaces/%s/%s", username, project_name);
     
     // 检查目录是否已存在
     if (access(dir_path, F_OK) == 0) {
-        send(client_fd, "Project directory already exists\n", 33, 0);
+        session_send_str(s, "Project directory already exists\n");
         return -1;
     }
     
     if (mkdir(dir_path, 0755) == -1) {
-        perror("mkdir projectdir");
-        send(client_fd, "Failed to create project directory\n", 34, 0);
+        log_warn("Failed to create %s: %s", dir_path, strerror(errno));
+        session_send_str(s, "Failed to create project directory\n");
         return -1;
     }
     
-    send(client_fd, "Project directory created successfully\n", 38, 0);
+    session_send_str(s, "Project directory created successfully\n");
     return 0;
 }
 
 // 创建项目文件
-int create_project_file(int client_fd, const char *username, const char *project_name, const char *filename) {
+int create_project_file(session *s, const char *username, const char *project_name, const char *filename) {
     char file_path[256];
     snprintf(file_path, sizeof(file_path), "./workspaces/%s/%s/%s", username, project_name, filename);
     
     // 检查文件是否已存在
     if (access(file_path, F_OK) == 0) {
-        send(client_fd, "File already exists\n", 19, 0);
+        session_send_str(s, "File already exists\n");
         return -1;
     }
     
     FILE *fp = fopen(file_path, "w");
     if (!fp) {
-        send(client_fd, "Failed to create file\n", 21, 0);
+        session_send_str(s, "Failed to create file\n");
         return -1;
     }
     
     fclose(fp);
-    log_version(username, filename, "created");
-    send(client_fd, "File created successfully\n", 25, 0);
+    version_commit(username, file_path);
+    log_version(username, project_name, filename, "created");
+    session_send_str(s, "File created successfully\n");
+    return 0;
+}
+
+// 目录列表的一页：各项的文本先放在 buf 中，buf 满时作为一个 OP_TEXT 帧发送；
+// 多取出的一项说明后面还有下一页
+typedef struct {
+    session *s;
+    int count;
+    size_t len;
+    char buf[LIST_TEXT_MAX];
+} list_page;
+
+static void list_item(void *arg, const dir_item *e) {
+    list_page *page = arg;
+    session *s = page->s;
+    if (page->count++ == LIST_PAGE) return;
+
+    char line[NAME_MAX + 64];
+    int n;
+    if (s->list_type == DT_REG) {
+        char when[32];
+        struct tm tm;
+        time_t t = (time_t)e->mtime;
+        localtime_r(&t, &tm);
+        strftime(when, sizeof(when), "%Y-%m-%d %H:%M", &tm);
+        n = snprintf(line, sizeof(line), "%s  %lld bytes  %s\n", e->name, e->size, when);
+    } else {
+        n = snprintf(line, sizeof(line), "%s\n", e->name);
+    }
+    if (n >= (int)sizeof(line)) n = sizeof(line) - 1;
+    if (page->len + n > sizeof(page->buf)) {
+        session_send_frame(s, OP_TEXT, page->buf, page->len);
+        page->len = 0;
+    }
+    memcpy(page->buf + page->len, line, n);
+    page->len += n;
+    snprintf(s->list_after, sizeof(s->list_after), "%s", e->name);
+}
+
+// 发送下一页（第一页前面加上标题），返回 1 表示列表已经发送完，目录无法打开时返回 -1
+static int list_send_page(session *s, const char *title) {
+    list_page page;
+    page.s = s;
+    page.count = 0;
+    page.len = title ? snprintf(page.buf, sizeof(page.buf), "%s", title) : 0;
+    int n = dircache_page(s->list_dir, s->list_after, s->list_type, LIST_PAGE + 1, list_item, &page);
+    if (n < 0) return -1;
+    if (page.len > 0) session_send_frame(s, OP_TEXT, page.buf, page.len);
+    return n <= LIST_PAGE;
+}
+
+static void list_finish(session *s) {
+    s->on_drain = NULL;
+    if (s->list_done_state == ST_PROJECT_MENU) enter_project_menu(s);
+    else enter_main_menu(s);
+}
+
+// 上一页发送完：继续下一页，全部发送完后回到菜单
+static int list_next(session *s) {
+    if (list_send_page(s, NULL) == 0) return 0;
+    list_finish(s);
+    // 处理发送期间已经到达的请求
+    return session_process(s);
+}
+
+// 开始发送目录列表：第一页直接放进输出队列，其余各页在输出发送完后由 list_next 继续
+static int list_start(session *s, const char *dir_path, int type, const char *title, session_state done_state) {
+    snprintf(s->list_dir, sizeof(s->list_dir), "%s", dir_path);
+    s->list_after[0] = '\0';
+    s->list_type = type;
+    s->list_done_state = done_state;
+
+    int rc = list_send_page(s, title);
+    if (rc == -1) return -1;
+    if (rc == 1) {
+        list_finish(s);
+    } else {
+        s->on_drain = list_next;
+        s->state = ST_LISTING;
+    }
     return 0;
 }
 
-// 列出所有项目
-int list_projects(int client_fd, const char *username) {
+// 列出所有项目，发送完后回到主菜单
+int list_projects(session *s, const char *username) {
     char dir_path[256];
     snprintf(dir_path, sizeof(dir_path), "./workspaces/%s", username);
-    
-    DIR *dir = opendir(dir_path);
-    if (!dir) {
-        send(client_fd, "Failed to open workspace\n", 24, 0);
+    if (list_start(s, dir_path, DT_DIR, "Your projects:\n", ST_MAIN_MENU) == -1) {
+        session_send_str(s, "Failed to open workspace\n");
+        enter_main_menu(s);
         return -1;
     }
-
-    struct dirent *entry;
-    char project_list[1024] = "Your projects:\n";
-    while ((entry = readdir(dir)) != NULL) {
-        if (entry->d_type == DT_DIR && strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
-            strcat(project_list, entry->d_name);
-            strcat(project_list, "\n");
-        }
-    }
-    
-    send(client_fd, project_list, strlen(project_list), 0);
-    closedir(dir);
     return 0;
 }
 // 检查项目是否存在
@@ -409,410 +722,2017 @@ int check_project_exists(const char *username, const char *project_name) {
     return (stat(project_path, &statbuf) == 0 && S_ISDIR(statbuf.st_mode));  // 如果存在并且是目录
 }
 
-// 列举项目中的文件
-void list_files_in_project(int client_fd, const char *username, const char *project_name) {
+// 列举项目中的文件，发送完后回到项目菜单
+void list_files_in_project(session *s, const char *username, const char *project_name) {
     char dir_path[256];
     snprintf(dir_path, sizeof(dir_path), "./workspaces/%s/%s", username, project_name);
-    DIR *dir = opendir(dir_path);
-    if (!dir) {
-        send(client_fd, "Failed to open project directory.\n", 34, 0);
+    if (list_start(s, dir_path, DT_REG, "Files in project:\n", ST_PROJECT_MENU) == -1) {
+        session_send_str(s, "Failed to open project directory.\n");
+        enter_project_menu(s);
+    }
+}
+
+// 打开文件：显示内容并询问是否编辑
+static void open_or_edit_file(session *s, const char *filename) {
+    strncpy(s->filename, filename, sizeof(s->filename) - 1);
+
+    char filepath[512];
+    snprintf(filepath, sizeof(filepath), "./workspaces/%s/%s/%s", s->user.username, s->project_name, filename);
+    
+    // 显示文件内容
+    FILE *fp = fopen(filepath, "r");
+    if (!fp) {
+        session_send_str(s, "Failed to open file.\n");
+        enter_project_menu(s);
         return;
     }
 
-    struct dirent *entry;
-    char file_list[1024] = "Files in project:\n";
-    while ((entry = readdir(dir)) != NULL) {
-        if (entry->d_type == DT_REG) {
-            strcat(file_list, entry->d_name);
-            strcat(file_list, "\n");
-        }
+    char content[4096] = {0};
+    size_t bytes = fread(content, 1, sizeof(content) - 1, fp);
+    fclose(fp);
+    if (bytes > 0) {
+        session_send_str(s, "Current file content:\n");
+        session_send_frame(s, OP_TEXT, content, bytes);
     }
-    closedir(dir);
-    send(client_fd, file_list, strlen(file_list), 0);
+
+    // 询问是否要编辑
+    session_send_str(s, "\nDo you want to edit this file? (yes/no): ");
+    s->state = ST_EDIT_CONFIRM;
 }
 
-// 创建新文件
-void create_new_file(int client_fd, const char *username, const char *project_name) {
-    send(client_fd, "Enter file name: ", 16, 0);
-    char filename[128];
-    ssize_t len = recv(client_fd, filename, sizeof(filename) - 1, 0);
-    if (len > 0) {
-        filename[len] = '\0';
-        trim_newline(filename);
-        create_project_file(client_fd, username, project_name, filename);
+// 上传文件：收到 OP_FILE 后开始接收文件内容，只取路径中的文件名部分
+static void upload_file(session *s, const char *path, long long offset, long long len) {
+    const char *filename = strrchr(path, '/');
+    filename = filename ? filename + 1 : path;
+    if (*filename == '\0' || strcmp(filename, "..") == 0) {
+        session_send_str(s, "Invalid file name\n");
+        save_file(s, "", "", "", offset, len, ST_PROJECT_MENU);
+        return;
     }
+    strncpy(s->filename, filename, sizeof(s->filename) - 1);
+
+    char filepath[512];
+    snprintf(filepath, sizeof(filepath), "./workspaces/%s/%s/%s", s->user.username, s->project_name, filename);
+    save_file(s, filepath, s->project_name, filename, offset, len, ST_PROJECT_MENU);
 }
 
-// 打开或编辑文件
-void open_or_edit_file(int client_fd, const char *username, const char *project_name) {
-    send(client_fd, "Enter file name: ", 16, 0);
-    char filename[128];
-    ssize_t len = recv(client_fd, filename, sizeof(filename) - 1, 0);
-    if (len > 0) {
-        filename[len] = '\0';
-        trim_newline(filename);
-
-        char filepath[512];
-        snprintf(filepath, sizeof(filepath), "./workspaces/%s/%s/%s", username, project_name, filename);
-        
-        // 显示文件内容
-        FILE *fp = fopen(filepath, "r");
-        if (fp) {
-            char content[4096] = {0};
-            size_t bytes = fread(content, 1, sizeof(content) - 1, fp);
-            fclose(fp);
-            if (bytes > 0) {
-                content[bytes] = '\0';
-                send(client_fd, "Current file content:\n", 21, 0);
-                send(client_fd, content, bytes, 0);
-            }
+// 发送项目中未完成上传的检查点，客户端据此决定每个文件从哪里开始发送
+static void send_resume_list(session *s, const char *project) {
+    unsigned char payload[PROTO_MAX_CONTROL];
+    size_t len = project[0] ? db_checkpoint_list(s->user.username, project, payload, sizeof(payload)) : 0;
+    session_send_frame(s, OP_RESUME, payload, len);
+}
 
-            // 询问是否要编辑
-            send(client_fd, "\nDo you want to edit this file? (yes/no): ", 40, 0);
-            char answer[8];
-            len = recv(client_fd, answer, sizeof(answer) - 1, 0);
-            if (len > 0) {
-                answer[len] = '\0';
-                trim_newline(answer);
-                if (strcmp(answer, "yes") == 0) {
-                    edit_file(client_fd, username, project_name, filename);
-                }
-            }
-        } else {
-            send(client_fd, "Failed to open file.\n", 21, 0);
+static void handle_project_menu(session *s, const char *choice) {
+    switch (choice[0]) {
+        case 'a':
+            list_files_in_project(s, s->user.username, s->project_name);
+            break;
+        case 'b':
+        case 'c':
+            session_send_str(s, "Enter file name: ");
+            s->state = choice[0] == 'b' ? ST_NEW_FILE : ST_OPEN_FILE;
+            break;
+        case 'd': {
+            // 由客户端选择本地文件并以 OP_FILE 发送
+            unsigned char kind = UPLOAD_KIND_FILE;
+            session_send_str(s, "Enter file name to upload: ");
+            session_send_frame(s, OP_UPLOAD_REQ, &kind, 1);
+            send_resume_list(s, s->project_name);
+            s->state = ST_UPLOAD_FILE;
+            break;
         }
+        case 'e':
+            session_send_str(s, "Enter file name to download: ");
+            s->state = ST_DOWNLOAD_FILE;
+            break;
+        case 'f':
+            session_send_str(s, "\nReturning to Main Menu...\n");
+            enter_main_menu(s);
+            break;
+        case 'g':
+            session_send_str(s, "Enter file name: ");
+            s->state = ST_HISTORY_FILE;
+            break;
+        default:
+            session_send_str(s, "Invalid option. Please choose a valid option.\n");
+            enter_project_menu(s);
     }
 }
 
-// 上传文件
-void upload_file(int client_fd, const char *username, const char *project_name) {
-    send(client_fd, "Enter file name to upload: ", 26, 0);
-    char filename[128];
-    ssize_t len = recv(client_fd, filename, sizeof(filename) - 1, 0);
-    if (len > 0) {
-        filename[len] = '\0';
-        trim_newline(filename);
-
-        char filepath[512];
-        snprintf(filepath, sizeof(filepath), "./workspaces/%s/%s/%s", username, project_name, filename);
-        printf("UPLOAD_CODE\n");
-        save_file(client_fd, filepath);
-        log_version(username, filename, "uploaded");
-        send(client_fd, "File uploaded successfully.\n", 27, 0);
+// 文件历史：列出文件的版本，等待选择要恢复的版本
+static void show_file_history(session *s, const char *filename) {
+    if (filename[0] == '\0' || filename[0] == '/' || strstr(filename, "..") != NULL) {
+        session_send_str(s, "Invalid file name\n");
+        enter_project_menu(s);
+        return;
     }
-    else {
-        printf("BLOCK\n");
+    char file_path[512];
+    snprintf(file_path, sizeof(file_path), "./workspaces/%s/%s/%s", s->user.username, s->project_name, filename);
+
+    version_info versions[VERSION_KEEP];
+    int n = version_list(s->user.username, file_path, versions, VERSION_KEEP);
+    if (n <= 0) {
+        session_send_str(s, "No versions for this file\n");
+        enter_project_menu(s);
+        return;
     }
-}
-
-int handle_project_menu(int client_fd, const char *username, const char *project_name) {
-    // 首先检查项目是否存在
-    if (!check_project_exists(username, project_name)) {
-        send(client_fd, "Project does not exist.\n", 24, 0);
-        return -1;  // 如果项目不存在，直接返回
-    }
-
-    while (1) {
-        const char submenu[] = 
-            "Project Menu:\n"
-            "a. List Files\n"
-            "b. Create New File\n"
-            "c. Open/Edit File\n"
-            "d. Upload File\n"
-            "e. Download File\n"
-            "f. Return to Main Menu\n";
-        
-        send(client_fd, submenu, strlen(submenu), 0);
-
-        char buffer[BUF_SIZE];
-        ssize_t len = recv(client_fd, buffer, sizeof(buffer), 0);
-        if (len <= 0) return -1;  // 客户端断开连接
-        buffer[len] = '\0';
-        trim_newline(buffer);
-
-        switch (buffer[0]) {
-            case 'a':
-                list_files_in_project(client_fd, username, project_name);
-                break;
-            case 'b':
-                create_new_file(client_fd, username, project_name);
-                break;
-            case 'c':
-                open_or_edit_file(client_fd, username, project_name);
-                break;
-            case 'd':
-                upload_file(client_fd, username, project_name);
-                break;
-            case 'e':
-                //download_file(client_fd, username, project_name);
-                break;
-            case 'f':
-                send(client_fd, "\nReturning to Main Menu...\n", 28, 0);
-                return 0;
-            default:
-                send(client_fd, "Invalid option. Please choose a valid option.\n", 46, 0);
-        }
+    session_printf(s, "Versions of %s:\n", filename);
+    for (int i = 0; i < n; i++) {
+        struct tm tm;
+        char when[32];
+        localtime_r(&versions[i].time, &tm);
+        strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &tm);
+        session_printf(s, "%4d  %s  %lld bytes  (%s)\n", versions[i].number, when, versions[i].size,
+                       versions[i].kind == VERSION_CLONE ? "clone" : "chunks");
     }
-    return 0;
+    strncpy(s->filename, filename, sizeof(s->filename) - 1);
+    s->filename[sizeof(s->filename) - 1] = '\0';
+    session_send_str(s, "Enter version to restore (or 'q' to cancel): ");
+    s->state = ST_HISTORY_RESTORE;
 }
 
+// 恢复版本：拼出旧版本的内容可能要读很多块，在后台文件线程上进行
+typedef struct {
+    offload_job job;
+    char username[128];
+    char project[128];
+    char filename[128];
+    char path[512];
+    int number;
+    int rc;
+} restore_job;
+
+static void restore_run(offload_job *job) {
+    restore_job *r = (restore_job *)job;
+    r->rc = version_restore(r->username, r->path, r->number);
+}
 
+static void restore_done(offload_job *job, void *owner) {
+    restore_job *r = (restore_job *)job;
+    session *s = owner;
+    if (r->rc == 0) log_version(r->username, r->project, r->filename, "restored");
+    if (s) {
+        if (r->rc == -1) session_printf(s, "Failed to restore %s to version %d\n", r->filename, r->number);
+        else session_printf(s, "Restored %s to version %d\n", r->filename, r->number);
+        enter_project_menu(s);
+    }
+    free(r);
+}
 
-
-
-// 删除项目目录及其所有内容
-int delete_project(int client_fd, const char *username, const char *project_name) {
-    char dir_path[256];
-    snprintf(dir_path, sizeof(dir_path), "./workspaces/%s/%s", username, project_name);
-    
-    // 检查项目目录是否存在
-    if (access(dir_path, F_OK) != 0) {
-        send(client_fd, "Project does not exist\n", 22, 0);
-        return -1;
+static void restore_file_version(session *s, const char *line) {
+    int number = atoi(line);
+    if (number <= 0) {
+        session_send_str(s, "Restore cancelled\n");
+        enter_project_menu(s);
+        return;
+    }
+    restore_job *r = calloc(1, sizeof(*r));
+    if (!r) {
+        session_printf(s, "Failed to restore %s to version %d\n", s->filename, number);
+        enter_project_menu(s);
+        return;
     }
+    snprintf(r->username, sizeof(r->username), "%s", s->user.username);
+    snprintf(r->project, sizeof(r->project), "%s", s->project_name);
+    snprintf(r->filename, sizeof(r->filename), "%s", s->filename);
+    snprintf(r->path, sizeof(r->path), "./workspaces/%s/%s/%s", s->user.username, s->project_name, s->filename);
+    r->number = number;
+    submit_offload(s, &r->job, restore_run, restore_done);
+}
 
-    // 遍历删除目录中的所有文件
-    DIR *dir = opendir(dir_path);
-    if (!dir) {
-        send(client_fd, "Failed to open project directory\n", 31, 0);
-        return -1;
+// 打开项目
+static void open_project(session *s, const char *project_name) {
+    // 首先检查项目是否存在
+    if (!check_project_exists(s->user.username, project_name)) {
+        session_send_str(s, "Project does not exist.\n");
+        enter_main_menu(s);
+        return;
     }
 
-    struct dirent *entry;
-    while ((entry = readdir(dir)) != NULL) {
-        // 跳过 . 和 ..
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-            continue;
-        }
+    strncpy(s->project_name, project_name, sizeof(s->project_name) - 1);
+    enter_project_menu(s);
+}
 
-        char file_path[512];
-        snprintf(file_path, sizeof(file_path), "%s/%s", dir_path, entry->d_name);
-        
-        if (remove(file_path) != 0) {
-            closedir(dir);
-            send(client_fd, "Failed to delete project files\n", 30, 0);
-            return -1;
-        }
+// 删除项目：移入回收站，保留期内可以从主菜单恢复
+int delete_project(session *s, const char *username, const char *project_name) {
+    if (*project_name == '\0' || strchr(project_name, '/') != NULL || strcmp(project_name, ".") == 0 ||
+        strcmp(project_name, "..") == 0 || !check_project_exists(username, project_name)) {
+        session_send_str(s, "Project does not exist\n");
+        return -1;
     }
-    closedir(dir);
 
-    // 删除项目目录
-    if (rmdir(dir_path) != 0) {
-        send(client_fd, "Failed to delete project directory\n", 33, 0);
+    // 只是改名到回收站，项目再大也立即返回；目录树由回收线程在保留期过后删除
+    if (trash_move(username, project_name) == -1) {
+        log_warn("Failed to move project %s to trash: %s", project_name, strerror(errno));
+        session_send_str(s, "Failed to delete project directory\n");
         return -1;
     }
 
-    log_version(username, project_name, "project deleted");
-    send(client_fd, "Project deleted successfully\n", 27, 0);
+    log_version(username, project_name, "", "project deleted");
+    session_send_str(s, "Project deleted successfully\n");
     return 0;
 }
 
-// 远程终端命令执行函数
-int execute_remote_command(int client_fd, const char *username) {
-    char command[256];
+// 远程终端：进入命令模式，当前目录为用户工作空间
+static void execute_remote_command(session *s) {
     char user_dir[256];
-    snprintf(user_dir, sizeof(user_dir), "./workspaces/%s", username);
-
-    // 保存当前目录
-    char original_dir[256];
-    if (getcwd(original_dir, sizeof(original_dir)) == NULL) {
-        send(client_fd, "Failed to get current directory\n", 31, 0);
-        return -1;
+    snprintf(user_dir, sizeof(user_dir), "./workspaces/%s", s->user.username);
+    if (realpath(user_dir, s->cwd) == NULL) {
+        session_send_str(s, "Failed to change directory\n");
+        enter_main_menu(s);
+        return;
     }
 
-    // 切换到用户目录
-    if (chdir(user_dir) != 0) {
-        send(client_fd, "Failed to change directory\n", 27, 0);
+    session_send_str(s, "Enter command to execute (or 'exit' to quit): ");
+    s->state = ST_REMOTE_COMMAND;
+}
+
+// 启动远程命令：标准输出接到管道的写端，读端由工作线程的 epoll 监听，
+// 不在工作线程上等待命令结束。命令在自己的进程组中运行，会话关闭时可以连同它启动的进程一起结束
+static int command_spawn(session *s, const char *shell_cmd) {
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) == -1) return -1;
+
+    posix_spawn_file_actions_t fa;
+    posix_spawnattr_t attr;
+    sigset_t def;
+    posix_spawn_file_actions_init(&fa);
+    posix_spawn_file_actions_addopen(&fa, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_adddup2(&fa, fds[1], STDOUT_FILENO);
+    posix_spawnattr_init(&attr);
+    sigemptyset(&def);
+    sigaddset(&def, SIGPIPE);  // 服务器忽略的信号恢复默认处理
+    sigaddset(&def, SIGCHLD);
+    posix_spawnattr_setsigdefault(&attr, &def);
+    posix_spawnattr_setpgroup(&attr, 0);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETPGROUP);
+
+    char *argv[] = {"sh", "-c", (char *)shell_cmd, NULL};
+    pid_t pid;
+    int rc = posix_spawn(&pid, "/bin/sh", &fa, &attr, argv, environ);
+    posix_spawn_file_actions_destroy(&fa);
+    posix_spawnattr_destroy(&attr);
+    close(fds[1]);
+    if (rc != 0) {
+        close(fds[0]);
+        errno = rc;
+        log_warn("Failed to execute command: %s", strerror(errno));
         return -1;
     }
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    s->cmd_fd = fds[0];
+    s->cmd_pid = pid;
+    return 0;
+}
 
-    while (1) {
-        send(client_fd, "Enter command to execute (or 'exit' to quit): ", 45, 0);
-        ssize_t len = recv(client_fd, command, sizeof(command) - 1, 0);
-        if (len <= 0) break;
-        command[len] = '\0';
-        trim_newline(command);
+// 远程终端：执行一条命令
+// 每个会话只记录自己的当前目录，不能调用 chdir，否则会影响同一进程中的其他会话
+static void remote_command_line(session *s, const char *command) {
+    if (strcmp(command, "exit") == 0) {
+        enter_main_menu(s);
+        return;
+    }
 
-        if (strcmp(command, "exit") == 0) {
-            break;
+    // 处理cd命令
+    if (strncmp(command, "cd ", 3) == 0) {
+        const char *path = command + 3;
+        char target[PATH_MAX * 2];
+        char resolved[PATH_MAX];
+        struct stat statbuf;
+        if (path[0] == '/') {
+            snprintf(target, sizeof(target), "%s", path);
+        } else {
+            snprintf(target, sizeof(target), "%s/%s", s->cwd, path);
         }
-
-        // 处理cd命令
-        if (strncmp(command, "cd ", 3) == 0) {
-            const char *path = command + 3;
-            if (chdir(path) != 0) {
-                send(client_fd, "Failed to change directory\n", 27, 0);
-            }
-            continue;
+        if (realpath(target, resolved) == NULL || stat(resolved, &statbuf) != 0 ||
+            !S_ISDIR(statbuf.st_mode) || strchr(resolved, '\'') != NULL) {
+            session_send_str(s, "Failed to change directory\n");
+        } else {
+            strncpy(s->cwd, resolved, sizeof(s->cwd) - 1);
         }
-
-        FILE *fp = popen(command, "r");
-        if (fp == NULL) {
-            send(client_fd, "Failed to execute command\n", 25, 0);
-            continue;
+    } else {
+        char shell_cmd[PATH_MAX + BUF_SIZE + 16];
+        int n = snprintf(shell_cmd, sizeof(shell_cmd), "cd '%s' && %s", s->cwd, command);
+        if (n < 0 || (size_t)n >= sizeof(shell_cmd) || command_spawn(s, shell_cmd) < 0) {
+            session_send_str(s, "Failed to execute command\n");
+        } else {
+            // 输出由工作线程在管道可读时转发，命令退出后再发送提示
+            s->state = ST_COMMAND_RUNNING;
+            return;
         }
+    }
 
-        char result[1024];
-        while (fgets(result, sizeof(result), fp) != NULL) {
-            send(client_fd, result, strlen(result), 0);
-        }
+    session_send_str(s, "Enter command to execute (or 'exit' to quit): ");
+}
 
-        pclose(fp);
+// 把远程命令已经产生的输出放进输出队列，每轮最多读到输出队列的积压上限。
+// 返回 1 表示命令的输出已经结束（回到命令提示），0 表示还在运行
+int command_output(session *s) {
+    char buf[COMMAND_READ_SIZE];
+    while (session_want_command(s)) {
+        ssize_t n = read(s->cmd_fd, buf, sizeof(buf));
+        if (n > 0) {
+            session_send_frame(s, OP_TEXT, buf, n);
+            continue;
+        }
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1 && errno == EAGAIN) return 0;
+
+        // 所有写端都已关闭：子进程由内核回收（SIGCHLD 被忽略）
+        close(s->cmd_fd);
+        s->cmd_fd = -1;
+        s->cmd_watched = 0;
+        session_send_str(s, "Enter command to execute (or 'exit' to quit): ");
+        s->state = ST_REMOTE_COMMAND;
+        return 1;
     }
-
-    chdir(original_dir); // 切换回原目录
     return 0;
 }
+
+// 会话关闭时结束还在运行的命令
+void command_cancel(session *s) {
+    if (s->cmd_fd == -1) return;
+    close(s->cmd_fd);  // 关闭后自动从 epoll 中移除
+    s->cmd_fd = -1;
+    s->cmd_watched = 0;
+    kill(-s->cmd_pid, SIGKILL);
+}
+
 void create_directory(const char *dir_path) {
     // 如果目录已经存在，就不报错
     if (mkdir(dir_path, 0755) < 0) {
         if (errno != EEXIST) {
-            perror("mkdir failed");
-        }
-    }
-}
-// 接收文件或目录
-void recv_directory(int client_socket) {
-    int type;
-    char dir_name[BUF_SIZE];
-        send(client_socket, "Enter project name to upload: ", 30,0);
-    // 接收客户端传送过来的目录名称
-     recv(client_socket, dir_name, sizeof(dir_name), 0);
-    printf("Receiving directory: %s\n", dir_name);
-
-    // 创建客户端传送过来的目录
-    create_directory(dir_name);
-    recv(client_socket, &type, sizeof(type), 0);  // 接收文件类型标志
-
-    char filepath[BUF_SIZE];
-    while(1){
-    size_t received = recv(client_socket, filepath, sizeof(filepath), 0);  // 接收路径
-    if(received<=0){break;}
-    printf("Received path: %s\n", filepath);
-
-    if (type == 1) {  // 普通文件
-        printf("It's a regular file: %s\n", filepath);
-        save_file(client_socket, filepath);
-    } else if (type == 2) {  // 目录
-        printf("It's a directory: %s\n", filepath);
-        create_directory(filepath);
-    } else {
-        printf("Unknown file type\n");
-        break;
-    }
-    }
-}
-int handle_client(int client_fd, user_info *user) {
-    char buffer[BUF_SIZE];
-    ssize_t len = recv(client_fd, buffer, sizeof(buffer),0);
-    printf("%s\n",buffer);
-    if (len <= 0) {
-        return -1; // 客户端断开连接
-    }
-
-    buffer[len] = '\0';
-    trim_newline(buffer);
-    // 原有的处理逻辑保持不变
-    if (strcmp(buffer, "1") == 0) {
-        send(client_fd, "Option 1 selected\n", 18, 0);
-    } else if (strcmp(buffer, "2") == 0) {
-        user_register(client_fd, user, 50);
-    } else if (strcmp(buffer, "3") == 0) {
-        int rev = user_login(client_fd, user, 50);
-        if(rev == 1) {
-            create_workspace(user->username);
-            while(1) {
-            const    char main_menu[] = 
-                    "Main Menu:\n"
-                    "1. List Projects\n"
-                    "2. Create New Project\n"
-                    "3. Open Project\n"
-                    "4. Delete Project\n"
-                    "5. Upload Project\n"
-                    "6. Download Project\n"
-                    "7. Execute Remote Command\n"  // 新增选项
-                    "8. Logout\n";
-                
-                send(client_fd, main_menu, strlen(main_menu), 0);
-                
-                char buffer[BUF_SIZE];
-                ssize_t len = recv(client_fd, buffer, sizeof(buffer), 0);
-                if (len <= 0) break;
-                buffer[len] = '\0';
-                trim_newline(buffer);
-
-                switch(buffer[0]) {
-                    case '1':
-                        list_projects(client_fd, user->username);
-                        break;
-                    case '2': {
-                        send(client_fd, "Enter project name: ", 19, 0);
-                        char project_name[128];
-                        len = recv(client_fd, project_name, sizeof(project_name)-1, 0);
-                        if (len > 0) {
-                            project_name[len] = '\0';
-                            trim_newline(project_name);
-                            create_project_directory(client_fd, user->username, project_name);
-                        }
-                        break;
-                    }
-                    case '3': {
-                        send(client_fd, "Enter project name: ", 19, 0);
-                        char project_name[128];
-                        len = recv(client_fd, project_name, sizeof(project_name)-1, 0);
-                        if (len > 0) {
-                            project_name[len] = '\0';
-                            trim_newline(project_name);
-                            handle_project_menu(client_fd, user->username, project_name);
-
-                        }
-                        break;
-                    }
-                    case '4': {
-                        send(client_fd, "Enter project name to delete: ", 29, 0);
-                        char project_name[128];
-                        len = recv(client_fd, project_name, sizeof(project_name)-1, 0);
-                        if (len > 0) {
-                            project_name[len] = '\0';
-                            trim_newline(project_name);
-                            // 添加确认步骤
-                            send(client_fd, "Are you sure to delete this project? (yes/no): ", 45, 0);
-                            char confirm[8];
-                            len = recv(client_fd, confirm, sizeof(confirm)-1, 0);
-                            if (len > 0) {
-                                confirm[len] = '\0';
-                                trim_newline(confirm);
-                                if (strcmp(confirm, "yes") == 0) {
-                                    delete_project(client_fd, user->username, project_name);
-                                } else {
-                                    send(client_fd, "Project deletion cancelled\n", 25, 0);
-                                }
-                            }
-                        }
-                        break;
-                    }
-                    case '5':
-                        recv_directory(client_fd);
-                        break;
-                    case '6':
-                        //download_project(client_fd, user->username);
-                        break;
-                    case '7':
-                        execute_remote_command(client_fd, user->username);
-                        break;
-                    case '8':
-                        send(client_fd, "Logging out...\n", 14, 0);
-                        return 0;
-                    default:
-                        send(client_fd, "Invalid option\n", 14, 0);
-                }
-            }
+            log_warn("Failed to create %s: %s", dir_path, strerror(errno));
         }
-    } else if (strcmp(buffer, "4") == 0) {
-        send(client_fd, "Goodbye!\n", 9, 0);
-        return -1; // 客户端主动退出
-    } else {
-        send(client_fd, "Invalid option.\n", 17, 0);
     }
-    return 0; // 正常处理完成
+}
+
+// 上传项目：收到 OP_UPLOAD_BEGIN，在工作空间中创建同名目录
+static long long stat_mtime_ns(const struct stat *st) {
+    return (long long)st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+}
+
+// 发送项目同步清单时的缓冲区：攒满一帧发送一次
+typedef struct {
+    session *s;
+    char root[PATH_MAX];
+    unsigned char frame[PROTO_MAX_CONTROL];
+    size_t len;
+    int skipped;
+} sync_list_ctx;
+
+static void sync_list_entry(void *arg, const sync_entry *e) {
+    sync_list_ctx *c = arg;
+    char local[PATH_MAX * 2];
+    struct stat st;
+    // 服务器上的文件已经不在或被修改过（编辑、单独上传），这一项不发给客户端，客户端会重新发送
+    snprintf(local, sizeof(local), "%s/%s", c->root, e->path);
+    if (stat(local, &st) == -1 || (e->kind == ARCHIVE_DIR ? !S_ISDIR(st.st_mode) :
+        !S_ISREG(st.st_mode) || st.st_size != e->size || stat_mtime_ns(&st) != e->local_mtime)) {
+        c->skipped++;
+        return;
+    }
+
+    size_t path_len = strlen(e->path);
+    if (path_len > 0xffff || SYNC_ENTRY_HEADER + path_len > sizeof(c->frame)) return;
+    if (c->len + SYNC_ENTRY_HEADER + path_len > sizeof(c->frame)) {
+        session_send_frame(c->s, OP_SYNC_MANIFEST, c->frame, c->len);
+        c->len = 0;
+    }
+    unsigned char *p = c->frame + c->len;
+    uint16_t net_len = htons((uint16_t)path_len);
+    uint64_t fields[3] = {htobe64(e->size), htobe64(e->mtime), htobe64(e->hash)};
+    p[0] = e->kind;
+    memcpy(p + 1, &net_len, 2);
+    memcpy(p + 3, e->path, path_len);
+    memcpy(p + 3 + path_len, fields, sizeof(fields));
+    c->len += SYNC_ENTRY_HEADER + path_len;
+}
+
+// 发送项目的同步清单，以空帧结束；项目名无效时只发送空帧
+static void send_sync_manifest(session *s, const char *project) {
+    sync_list_ctx *c = pool_calloc(sizeof(sync_list_ctx));
+    if (c && project[0]) {
+        c->s = s;
+        snprintf(c->root, sizeof(c->root), "./workspaces/%s/%s", s->user.username, project);
+        db_sync_list(s->user.username, project, sync_list_entry, c);
+        if (c->len > 0) session_send_frame(s, OP_SYNC_MANIFEST, c->frame, c->len);
+        if (c->skipped > 0) log_info("Sync manifest: %d entries changed on the server", c->skipped);
+    }
+    pool_free(c, sizeof(sync_list_ctx));
+    session_send_frame(s, OP_SYNC_MANIFEST, NULL, 0);
+}
+
+static void recv_directory(session *s, const char *dir_name) {
+    if (*dir_name == '\0' || strchr(dir_name, '/') != NULL ||
+        strcmp(dir_name, ".") == 0 || strcmp(dir_name, "..") == 0) {
+        session_send_str(s, "Invalid project name\n");
+        strcpy(s->pending, "");  // 后续的 OP_DIR / OP_FILE 全部丢弃
+    } else {
+        log_debug("Receiving directory: %s", dir_name);
+        char dir_path[512];
+        snprintf(dir_path, sizeof(dir_path), "./workspaces/%s/%s", s->user.username, dir_name);
+        create_directory(dir_path);
+        strncpy(s->pending, dir_name, sizeof(s->pending) - 1);
+    }
+    send_resume_list(s, s->pending);
+    send_sync_manifest(s, s->pending);
+    s->sync_path[0] = '\0';
+    s->state = ST_UPLOAD_RECORD;
+}
+
+// 把项目内的相对路径映射到工作空间中的项目目录，拒绝越出项目目录的路径
+static int project_local_path(const char *username, const char *project, const char *rel, char *local, size_t size) {
+    if (project[0] == '\0' || !proto_path_is_safe(rel)) return -1;
+    if ((size_t)snprintf(local, size, "./workspaces/%s/%s/%s", username, project, rel) >= size) return -1;
+    return 0;
+}
+
+static int upload_local_path(session *s, const char *rel, char *local, size_t size) {
+    return project_local_path(s->user.username, s->pending, rel, local, size);
+}
+
+// 收到 OP_FILE 帧的路径部分，接下来的 len 字节是文件从 offset 开始的内容
+static void handle_file_frame(session *s, const char *path, long long offset, long long len) {
+    char local[PATH_MAX];
+    switch (s->state) {
+        case ST_UPLOAD_RECORD:
+            log_debug("Received path: %s", path);
+            if (upload_local_path(s, path, local, sizeof(local)) < 0) {
+                log_warn("Rejected path: %s", path);
+                local[0] = '\0';
+            }
+            save_file(s, local, s->pending, path, offset, len, ST_UPLOAD_RECORD);
+            break;
+        case ST_UPLOAD_FILE:
+            upload_file(s, path, offset, len);
+            break;
+        default:
+            session_send_frame(s, OP_ERROR, "Unexpected file", 15);
+            save_file(s, "", "", "", offset, len, s->state);
+            break;
+    }
+}
+
+// OP_CODECS：从客户端按偏好排列的编码中选出第一个本端支持的，回复选中的编码和级别
+static void codecs_select(session *s, const unsigned char *payload, size_t len) {
+    s->codec = CODEC_NONE;
+    for (size_t i = 1; i < len; i++) {
+        if (codec_supported(payload[i])) {
+            s->codec = payload[i];
+            break;
+        }
+    }
+    s->codec_level = codec_level(s->codec, len > 0 ? payload[0] : 0);
+    s->codec_send_level = codec_send_level(s->codec, s->codec_level);
+    unsigned char reply[2] = {s->codec, s->codec_level};
+    session_send_frame(s, OP_CODECS, reply, sizeof(reply));
+    if (s->codec != CODEC_NONE) {
+        log_info("Compression: %s level %d (server sends at level %d)", codec_name(s->codec), s->codec_level,
+                 s->codec_send_level);
+    }
+}
+
+// OP_ZFILE：与 OP_FILE 相同地确定目标文件，之后的内容以 OP_ZDATA 帧到达
+static void zfile_begin(session *s, const char *payload, size_t len) {
+    uint16_t path_len;
+    uint64_t offset, raw_len;
+    char path[PATH_MAX];
+    if (len < 2) return;
+    memcpy(&path_len, payload, 2);
+    path_len = ntohs(path_len);
+    if (path_len >= PATH_MAX || len != 2u + path_len + 16) {
+        session_send_frame(s, OP_ERROR, "Bad compressed file", 19);
+        return;
+    }
+    memcpy(path, payload + 2, path_len);
+    path[path_len] = '\0';
+    memcpy(&offset, payload + 2 + path_len, 8);
+    memcpy(&raw_len, payload + 10 + path_len, 8);
+    offset = be64toh(offset);
+    raw_len = be64toh(raw_len);
+    if (offset > INT64_MAX || raw_len > INT64_MAX - offset) {
+        session_send_frame(s, OP_ERROR, "Bad compressed file", 19);
+        return;
+    }
+    handle_file_frame(s, path, (long long)offset, (long long)raw_len);
+    if (s->state != ST_FILE_DATA) return;
+    s->file_compressed = 1;
+    if (s->file_remaining == 0) save_file_done(s);
+}
+
+// OP_ZDATA：解压一块，按偏移写入正在接收的文件；数据损坏时返回 -1 关闭连接
+static int zdata_recv(session *s, const unsigned char *payload, size_t len) {
+    unsigned char *raw = pool_alloc(CODEC_BLOCK_SIZE);
+    long n;
+    if (!raw || s->state != ST_FILE_DATA || !s->file_compressed ||
+        (n = codec_decode_block(payload, len, raw)) < 0 || n > s->file_remaining) {
+        log_warn("Bad compressed block");
+        pool_free(raw, CODEC_BLOCK_SIZE);
+        return -1;
+    }
+    if (s->file_fd != -1) {
+        if (pwrite(s->file_fd, raw, n, s->file_written) != n) {
+            log_error("Failed to write %s: %s", s->file_path, strerror(errno));
+            close(s->file_fd);
+            s->file_fd = -1;
+        } else {
+            s->file_written += n;
+            save_file_checkpoint(s);
+        }
+    }
+    pool_free(raw, CODEC_BLOCK_SIZE);
+    s->file_remaining -= n;
+    if (s->file_remaining == 0) save_file_done(s);
+    return 0;
+}
+
+// 解压后的一批记录交给后台文件线程写入：每个文件都要同步后才能提交，会话等待整批完成
+typedef struct {
+    offload_job job;
+    char username[128];
+    char project[BUF_SIZE];         // 上传的项目（会话的 pending）
+    char sync_path[PATH_MAX];       // 会话的 sync_path，任务完成后写回
+    unsigned char *batch;
+    long len;
+    FILE *notes;                    // 发给客户端的提示，任务完成后发送
+    char *notes_buf;
+    size_t notes_len;
+    int rc;
+} archive_job;
+
+// 同步清单：记录上传的目录。清单的更新加到 batch 中，整个 OP_ARCHIVE 批次在一个事务中提交
+static void sync_dir(const char *username, const char *project, db_batch *batch, const char *rel,
+                     const char *local) {
+    create_directory(local);
+    sync_entry e = {rel, ARCHIVE_DIR, 0, 0, 0, 0};
+    db_sync_put(batch, username, project, &e);
+}
+
+// ARCHIVE_META：刚刚成功提交的文件直接记入清单；没有重新发送的文件只有在内容哈希相同、
+// 服务器上的文件也没有被修改时才更新修改时间
+static void sync_meta(archive_job *a, db_batch *batch, const char *rel, const char *local, const unsigned char *data) {
+    uint64_t fields[2];
+    struct stat st;
+    memcpy(fields, data, sizeof(fields));
+    sync_entry e = {rel, ARCHIVE_FILE, 0, (long long)be64toh(fields[0]), (long long)be64toh(fields[1]), 0};
+    if (stat(local, &st) == -1 || !S_ISREG(st.st_mode)) return;
+    e.size = st.st_size;
+    e.local_mtime = stat_mtime_ns(&st);
+
+    if (strcmp(local, a->sync_path) == 0) {
+        a->sync_path[0] = '\0';
+        db_sync_put(batch, a->username, a->project, &e);
+        return;
+    }
+    sync_entry old;
+    if (db_sync_get(a->username, a->project, rel, &old) == 0 && old.kind == ARCHIVE_FILE &&
+        old.hash == e.hash && old.size == e.size && old.local_mtime == e.local_mtime) {
+        db_sync_put(batch, a->username, a->project, &e);
+    }
+}
+
+// ARCHIVE_DELETE：只删除清单中记录过的路径，目录不为空时保留，下次同步再删除
+static void sync_delete(archive_job *a, db_batch *batch, const char *rel, const char *local) {
+    sync_entry e;
+    if (db_sync_get(a->username, a->project, rel, &e) < 0) return;
+    int rc = e.kind == ARCHIVE_DIR ? rmdir(local) : unlink(local);
+    if (rc == -1 && errno != ENOENT) {
+        log_warn("Failed to delete %s: %s", local, strerror(errno));
+        return;
+    }
+    log_info("Deleted: %s", local);
+    db_sync_delete(batch, a->username, a->project, rel);
+    db_checkpoint_delete(a->username, a->project, rel);
+}
+
+// 批次中的一条记录
+typedef struct {
+    unsigned char type;
+    char path[PATH_MAX];
+    uint64_t size;
+    const unsigned char *data;
+} archive_record;
+
+// 解析 off 处的一条记录并移到下一条，返回 1；已经到达末尾返回 0，格式错误返回 -1
+static int archive_next(const unsigned char *batch, size_t batch_len, size_t *off, archive_record *r) {
+    uint16_t path_len;
+    size_t pos = *off;
+    if (pos == batch_len) return 0;
+    if (batch_len - pos < ARCHIVE_RECORD_HEADER) return -1;
+    memcpy(&path_len, batch + pos + 1, 2);
+    path_len = ntohs(path_len);
+    if (path_len >= PATH_MAX || batch_len - pos - ARCHIVE_RECORD_HEADER < path_len) return -1;
+    r->type = batch[pos];
+    memcpy(r->path, batch + pos + 3, path_len);
+    r->path[path_len] = '\0';
+    memcpy(&r->size, batch + pos + 3 + path_len, 8);
+    r->size = be64toh(r->size);
+    r->data = batch + pos + ARCHIVE_RECORD_HEADER + path_len;
+    pos += ARCHIVE_RECORD_HEADER + path_len;
+    if (r->type == ARCHIVE_FILE || r->type == ARCHIVE_META) {
+        if (r->size > batch_len - pos || (r->type == ARCHIVE_META && r->size != 16)) return -1;
+        pos += r->size;
+    } else if ((r->type != ARCHIVE_DIR && r->type != ARCHIVE_DELETE) || r->size != 0) {
+        return -1;
+    }
+    *off = pos;
+    return 1;
+}
+
+// 把文件内容写入 <local>.part，返回打开的 fd，失败返回 -1 并删除 .part
+static int archive_write_part(const char *local, const unsigned char *data, uint64_t size) {
+    char part[PATH_MAX + 8];
+    snprintf(part, sizeof(part), "%s.part", local);
+    int fd = open(part, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) return -1;
+    if (size != 0 && write(fd, data, size) != (ssize_t)size) {
+        close(fd);
+        unlink(part);
+        return -1;
+    }
+    return fd;
+}
+
+// 处理解压后的一批记录。整批内容已经在内存中：先创建目录、写出所有文件的 .part 并让内核开始写回，
+// 再按记录的顺序逐个同步、改名提交和更新清单，每个文件的同步只需要等待已经开始的写回。
+// 第一遍写不出的文件（例如同一批中先删除同名文件再建目录）在第二遍按顺序重新写。记录格式错误时 rc 为 -1
+static void archive_run(offload_job *job) {
+    archive_job *a = (archive_job *)job;
+    const unsigned char *batch = a->batch;
+    size_t batch_len = a->len, off = 0;
+    int dirs = 0, files = 0, deleted = 0, rc;
+    archive_record r;
+    char local[PATH_MAX];
+    char part[PATH_MAX + 8];
+    unsigned char *written = calloc(batch_len / ARCHIVE_RECORD_HEADER + 1, 1);  // 按顺序标记已经写好 .part 的文件
+    int nfiles = 0;
+
+    while (written && archive_next(batch, batch_len, &off, &r) > 0) {
+        if (project_local_path(a->username, a->project, r.path, local, sizeof(local)) < 0) continue;
+        if (r.type == ARCHIVE_DIR) {
+            create_directory(local);
+        } else if (r.type == ARCHIVE_FILE) {
+            int fd = archive_write_part(local, r.data, r.size);
+            if (fd != -1) {
+                sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+                close(fd);  // 一批可能有几千个文件，不同时占着 fd
+                written[nfiles] = 1;
+            }
+            nfiles++;
+        }
+    }
+
+    db_batch manifest;
+    db_batch_init(&manifest);
+    off = 0;
+    nfiles = 0;
+    while ((rc = archive_next(batch, batch_len, &off, &r)) > 0) {
+        if (project_local_path(a->username, a->project, r.path, local, sizeof(local)) < 0) {
+            log_warn("Rejected path: %s", r.path);
+            continue;
+        }
+        if (r.type == ARCHIVE_DIR) {
+            sync_dir(a->username, a->project, &manifest, r.path, local);
+            dirs++;
+            continue;
+        }
+        if (r.type == ARCHIVE_META) {
+            sync_meta(a, &manifest, r.path, local, r.data);
+            continue;
+        }
+        if (r.type == ARCHIVE_DELETE) {
+            sync_delete(a, &manifest, r.path, local);
+            deleted++;
+            continue;
+        }
+        // 写入 .part 后改名替换，不原地截断：版本线程可能还在读取原来的文件
+        snprintf(part, sizeof(part), "%s.part", local);
+        int fd = written && written[nfiles] ? open(part, O_WRONLY | O_CLOEXEC) : -1;
+        nfiles++;
+        if (fd == -1 && (fd = archive_write_part(local, r.data, r.size)) == -1) {
+            log_error("Failed to write %s: %s", local, strerror(errno));
+        }
+        if (fd != -1 && publish_part(a->username, fd, local) == 0) {
+            strcpy(a->sync_path, local);
+        } else {
+            if (a->notes) fprintf(a->notes, "File upload incomplete: %s\n", r.path);
+            unlink(part);
+        }
+        files++;
+    }
+    db_batch_commit(&manifest);  // 格式错误之前已经处理的记录照常记入清单
+    free(written);
+    log_info("Unpacked archive batch: %d directories, %d files, %d deletions", dirs, files, deleted);
+    a->rc = rc;
+}
+
+static void archive_done(offload_job *job, void *owner) {
+    archive_job *a = (archive_job *)job;
+    session *s = owner;
+    if (a->notes) fclose(a->notes);
+    if (s) {
+        strcpy(s->sync_path, a->sync_path);
+        // 每个提示一帧
+        for (char *line = a->notes_buf, *end; line && (end = strchr(line, '\n')) != NULL; line = end + 1) {
+            session_send_frame(s, OP_TEXT, line, end + 1 - line);
+        }
+        s->state = ST_UPLOAD_RECORD;
+        if (a->rc < 0) s->closing = 1;
+    }
+    free(a->notes_buf);
+    free(a->batch);
+    free(a);
+}
+
+// OP_ARCHIVE：解压一批目录和小文件的记录，交给后台文件线程写入；数据损坏时返回 -1 关闭连接
+static int archive_unpack(session *s, const unsigned char *payload, size_t len) {
+    archive_job *a = calloc(1, sizeof(*a));
+    unsigned char *batch = a ? malloc(CODEC_BLOCK_SIZE) : NULL;
+    long batch_len = batch ? codec_decode_block(payload, len, batch) : -1;
+    if (batch_len < 0) {
+        log_warn("Bad archive batch");
+        free(batch);
+        free(a);
+        return -1;
+    }
+    if (s->state != ST_UPLOAD_RECORD) {
+        free(batch);
+        free(a);
+        return 0;
+    }
+    snprintf(a->username, sizeof(a->username), "%s", s->user.username);
+    snprintf(a->project, sizeof(a->project), "%s", s->pending);
+    strcpy(a->sync_path, s->sync_path);
+    a->batch = batch;
+    a->len = batch_len;
+    a->notes = open_memstream(&a->notes_buf, &a->notes_len);
+    submit_offload(s, &a->job, archive_run, archive_done);
+    return 0;
+}
+
+// 解析 [2 字节路径长度][路径][8 字节大小]，返回这部分的长度，格式错误时返回 0
+static size_t parse_path_size(const char *payload, size_t len, char *path, uint64_t *size) {
+    uint16_t path_len;
+    if (len < 2) return 0;
+    memcpy(&path_len, payload, 2);
+    path_len = ntohs(path_len);
+    if (path_len >= PATH_MAX || len < 2u + path_len + 8) return 0;
+    memcpy(path, payload + 2, path_len);
+    path[path_len] = '\0';
+    memcpy(size, payload + 2 + path_len, 8);
+    *size = be64toh(*size);
+    if (*size == 0 || *size > INT64_MAX) return 0;
+    return 2u + path_len + 8;
+}
+
+// 不经过 OP_FILE 的上传：按当前状态确定目标文件和检查点 / 清单的键，与 upload_file / handle_file_frame 一致
+static int upload_target(session *s, const char *path, char *local, size_t size,
+                         const char **project, const char **rel) {
+    if (s->state == ST_UPLOAD_FILE) {
+        const char *name = strrchr(path, '/');
+        name = name ? name + 1 : path;
+        if (*name == '\0' || strcmp(name, "..") == 0) return -1;
+        snprintf(local, size, "./workspaces/%s/%s/%s", s->user.username, s->project_name, name);
+        strncpy(s->filename, name, sizeof(s->filename) - 1);
+        *project = s->project_name;
+        *rel = name;
+        return 0;
+    }
+    if (s->state == ST_UPLOAD_RECORD && upload_local_path(s, path, local, size) == 0) {
+        *project = s->pending;
+        *rel = path;
+        return 0;
+    }
+    return -1;
+}
+
+// 不经过 OP_FILE 的上传结束：单个文件上传回到项目菜单，项目上传继续接收下一项
+static void upload_done(session *s, int ok, const char *path) {
+    if (ok) strncpy(s->sync_path, path, sizeof(s->sync_path) - 1);
+    if (s->state == ST_UPLOAD_FILE) {
+        if (ok) {
+            log_version(s->user.username, s->project_name, s->filename, "uploaded");
+            session_send_str(s, "File uploaded successfully.\n");
+        } else {
+            session_send_str(s, "File upload incomplete, please try again.\n");
+        }
+        enter_project_menu(s);
+    } else if (!ok) {
+        session_printf(s, "File upload incomplete: %s\n", strrchr(path, '/') + 1);
+    }
+}
+
+// OP_PARALLEL_BEGIN：登记并行上传，回复凭据和接受的连接数；不接受时连接数为 0，客户端改用 OP_FILE
+static void parallel_begin(session *s, const char *payload, size_t len) {
+    unsigned char reply[PARALLEL_TOKEN_SIZE + 1];
+    char path[PATH_MAX], local[PATH_MAX], part[PATH_MAX + 8];
+    const char *project, *rel;
+    uint64_t size;
+    int streams, fd = -1;
+    parallel_upload *p = NULL;
+
+    parallel_cancel(s);  // 上一次并行上传没有发送 OP_PARALLEL_END
+    memset(reply, 0, sizeof(reply));
+    size_t n = parse_path_size(payload, len, path, &size);
+    if (n == 0 || len != n + 1) goto refuse;
+    streams = (unsigned char)payload[n];
+    if (streams > PARALLEL_MAX_STREAMS) streams = PARALLEL_MAX_STREAMS;
+    if (streams < 2 || upload_target(s, path, local, sizeof(local), &project, &rel) < 0) goto refuse;
+
+    snprintf(part, sizeof(part), "%s.part", local);
+    fd = open(part, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        log_warn("Failed to open %s for writing: %s", part, strerror(errno));
+        goto refuse;
+    }
+    // 各分段按偏移写入，先把文件扩展到完整大小
+    if (fallocate(fd, 0, 0, size) == -1 && ftruncate(fd, size) == -1) {
+        log_warn("Failed to allocate %s: %s", part, strerror(errno));
+        goto refuse;
+    }
+    p = calloc(1, sizeof(*p));
+    if (!p || getrandom(p->token, sizeof(p->token), 0) != sizeof(p->token)) goto refuse;
+    if ((size_t)snprintf(p->path, sizeof(p->path), "%s", local) >= sizeof(p->path)) goto refuse;
+    // 分段不记录检查点，之前的检查点已经随 .part 失效
+    db_checkpoint_delete(s->user.username, project, rel);
+
+    p->fd = fd;
+    p->streams = streams;
+    p->size = size;
+    p->refs = 1;
+    p->shape = s->shape;
+    pthread_mutex_lock(&parallel_lock);
+    p->next = parallel_list;
+    parallel_list = p;
+    pthread_mutex_unlock(&parallel_lock);
+    s->parallel = p;
+
+    log_info("Receiving file in %d streams: %s, Size: %lld bytes", streams, local, (long long)size);
+    memcpy(reply, p->token, sizeof(p->token));
+    reply[PARALLEL_TOKEN_SIZE] = streams;
+    session_send_frame(s, OP_PARALLEL_READY, reply, sizeof(reply));
+    return;
+
+refuse:
+    free(p);
+    if (fd != -1) {
+        close(fd);
+        unlink(part);
+    }
+    session_send_frame(s, OP_PARALLEL_READY, reply, sizeof(reply));
+}
+
+// 不经过 OP_FILE 的上传提交完成
+static void upload_published(offload_job *job, void *owner) {
+    publish_job *p = (publish_job *)job;
+    session *s = owner;
+    if (s) {
+        s->state = p->resume;
+        upload_done(s, p->ok, p->path);
+    }
+    free(p);
+}
+
+// OP_PARALLEL_END：所有分段都已写入时提交文件，否则删除 .part
+static void parallel_end(session *s, const char *payload, size_t len) {
+    parallel_upload *p = s->parallel;
+    if (!p || len != PARALLEL_TOKEN_SIZE || memcmp(p->token, payload, len) != 0) {
+        session_send_frame(s, OP_ERROR, "Unknown transfer", 16);
+        return;
+    }
+
+    pthread_mutex_lock(&parallel_lock);
+    parallel_unlink(p);
+    int ok = !p->failed && p->received == p->size;
+    pthread_mutex_unlock(&parallel_lock);
+
+    // 文件随最后一个引用关闭，提交任务使用自己的 fd
+    char path[PATH_MAX];
+    strcpy(path, p->path);
+    int fd = ok ? dup(p->fd) : -1;
+    pthread_mutex_lock(&parallel_lock);
+    parallel_release(p);
+    pthread_mutex_unlock(&parallel_lock);
+    s->parallel = NULL;
+
+    publish_job *j = fd != -1 ? publish_job_new(s, path, fd) : NULL;
+    if (!j) {
+        char part[PATH_MAX + 8];
+        snprintf(part, sizeof(part), "%s.part", path);
+        log_warn("File not saved: %s", path);
+        unlink(part);
+        upload_done(s, 0, path);
+        return;
+    }
+    j->discard = 1;
+    submit_offload(s, &j->job, publish_run, upload_published);
+}
+
+// 去重上传：清单已经收到，按清单顺序等待缺少的块，全部收到后从块存储拼出文件
+typedef struct {
+    char path[PATH_MAX];         // 目标文件
+    char project[128];           // 清单的键：项目名和项目内的相对路径
+    char rel[PATH_MAX];
+    long long size;
+    uint32_t count;
+    uint32_t next;               // 下一个要检查的清单项
+    uint32_t missing;            // 还没有收到的块数
+    unsigned char *manifest;     // count 个清单项
+    unsigned char *need;         // 缺少的块，第 i 位对应第 i 项
+} chunked_upload;
+
+void chunked_cancel(session *s) {
+    chunked_upload *c = s->chunked;
+    if (!c) return;
+    free(c->manifest);
+    free(c->need);
+    free(c);
+    s->chunked = NULL;
+}
+
+// 所有块都已在块存储中：在后台文件线程上拼出 .part，与其他上传一样同步后改名，再把清单保存为新版本
+typedef struct {
+    offload_job job;
+    char username[128];
+    char path[PATH_MAX];
+    char project[128];
+    char rel[PATH_MAX];
+    unsigned char *manifest;
+    uint32_t count;
+    long long size;
+    session_state resume;
+    int ok;
+} assemble_job;
+
+static void assemble_run(offload_job *job) {
+    assemble_job *c = (assemble_job *)job;
+    char part[PATH_MAX + 8];
+    snprintf(part, sizeof(part), "%s.part", c->path);
+
+    int fd = open(part, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        log_warn("Failed to open %s for writing: %s", part, strerror(errno));
+        log_warn("File not saved: %s", c->path);
+        return;
+    }
+    c->ok = store_assemble(c->username, fd, c->manifest, c->count) == 0;
+    if (c->ok && fdatasync(fd) == -1) {
+        log_error("Failed to sync %s: %s", part, strerror(errno));
+        c->ok = 0;
+    }
+    close(fd);
+    if (c->ok) version_baseline(c->username, c->path);
+    if (c->ok && rename(part, c->path) == -1) {
+        log_error("Failed to save %s: %s", c->path, strerror(errno));
+        c->ok = 0;
+    }
+    if (!c->ok) {
+        unlink(part);
+        log_warn("File not saved: %s", c->path);
+        return;
+    }
+    // 内容已经按清单保存在块存储中，清单直接作为新版本
+    version_commit_manifest(c->username, c->path, c->manifest, c->count, c->size);
+    db_checkpoint_delete(c->username, c->project, c->rel);
+    log_info("File assembled from %u chunks: %s", c->count, c->path);
+}
+
+static void assemble_done(offload_job *job, void *owner) {
+    assemble_job *c = (assemble_job *)job;
+    session *s = owner;
+    if (s) {
+        s->state = c->resume;
+        upload_done(s, c->ok, c->path);
+    }
+    free(c->manifest);
+    free(c);
+}
+
+static void chunked_commit(session *s) {
+    chunked_upload *c = s->chunked;
+    assemble_job *a = calloc(1, sizeof(*a));
+    if (!a) {
+        char path[PATH_MAX];
+        strcpy(path, c->path);
+        log_warn("File not saved: %s", path);
+        chunked_cancel(s);
+        upload_done(s, 0, path);
+        return;
+    }
+    snprintf(a->username, sizeof(a->username), "%s", s->user.username);
+    strcpy(a->path, c->path);
+    strcpy(a->project, c->project);
+    strcpy(a->rel, c->rel);
+    a->manifest = c->manifest;  // 清单交给任务
+    c->manifest = NULL;
+    a->count = c->count;
+    a->size = c->size;
+    a->resume = s->state;
+    chunked_cancel(s);
+    submit_offload(s, &a->job, assemble_run, assemble_done);
+}
+
+// OP_MANIFEST：检查块存储中缺少哪些块并回复位图；不接受时回复空的 OP_CHUNK_NEED，客户端改用 OP_FILE
+static void chunked_begin(session *s, const char *payload, size_t len) {
+    char path[PATH_MAX], local[PATH_MAX];
+    const char *project, *rel;
+    uint64_t size, total = 0;
+    chunked_upload *c = NULL;
+
+    chunked_cancel(s);
+    size_t n = parse_path_size(payload, len, path, &size);
+    if (n == 0 || (len - n) % CDC_ENTRY_SIZE != 0) goto refuse;
+    uint32_t count = (len - n) / CDC_ENTRY_SIZE;
+    if (count == 0 || count > CDC_MAX_CHUNKS) goto refuse;
+    if (upload_target(s, path, local, sizeof(local), &project, &rel) < 0) goto refuse;
+
+    c = calloc(1, sizeof(*c));
+    if (!c || !(c->manifest = malloc(len - n)) || !(c->need = calloc(1, (count + 7) / 8))) goto refuse;
+    memcpy(c->manifest, payload + n, len - n);
+    for (uint32_t i = 0; i < count; i++) {
+        const unsigned char *entry = c->manifest + (size_t)i * CDC_ENTRY_SIZE;
+        uint32_t chunk_len;
+        memcpy(&chunk_len, entry + CDC_HASH_SIZE, 4);
+        chunk_len = ntohl(chunk_len);
+        if (chunk_len == 0 || chunk_len > CDC_MAX_SIZE) goto refuse;
+        total += chunk_len;
+        if (!store_has_chunk(s->user.username, entry, chunk_len)) {
+            c->need[i / 8] |= 1 << (i % 8);
+            c->missing++;
+        }
+    }
+    if (total != size) goto refuse;
+    if ((size_t)snprintf(c->path, sizeof(c->path), "%s", local) >= sizeof(c->path) ||
+        (size_t)snprintf(c->project, sizeof(c->project), "%s", project) >= sizeof(c->project) ||
+        (size_t)snprintf(c->rel, sizeof(c->rel), "%s", rel) >= sizeof(c->rel)) {
+        goto refuse;
+    }
+    c->size = size;
+    c->count = count;
+    s->chunked = c;
+    log_info("Receiving file: %s, Size: %lld bytes, %u of %u chunks missing", local, (long long)size, c->missing, count);
+    session_send_frame(s, OP_CHUNK_NEED, c->need, (count + 7) / 8);
+    if (c->missing == 0) chunked_commit(s);
+    return;
+
+refuse:
+    if (c) {
+        free(c->manifest);
+        free(c->need);
+        free(c);
+    }
+    session_send_frame(s, OP_CHUNK_NEED, NULL, 0);
+}
+
+// OP_CHUNK：必须是清单中下一个缺少的块，校验后写入块存储
+static void chunked_recv(session *s, const char *payload, size_t len) {
+    chunked_upload *c = s->chunked;
+    if (!c || len <= CDC_HASH_SIZE) {
+        session_send_frame(s, OP_ERROR, "Unexpected chunk", 16);
+        return;
+    }
+    while (c->next < c->count && !(c->need[c->next / 8] & (1 << (c->next % 8)))) c->next++;
+    if (c->next == c->count) {
+        session_send_frame(s, OP_ERROR, "Unexpected chunk", 16);
+        return;
+    }
+
+    const unsigned char *entry = c->manifest + (size_t)c->next * CDC_ENTRY_SIZE;
+    uint32_t chunk_len;
+    memcpy(&chunk_len, entry + CDC_HASH_SIZE, 4);
+    chunk_len = ntohl(chunk_len);
+    if (memcmp(entry, payload, CDC_HASH_SIZE) != 0 || len - CDC_HASH_SIZE != chunk_len ||
+        store_put_chunk(s->user.username, entry, payload + CDC_HASH_SIZE, chunk_len) < 0) {
+        // 块不对时放弃这个文件，之后到达的块都会被拒绝
+        log_warn("File not saved: %s", c->path);
+        char path[PATH_MAX];
+        strcpy(path, c->path);
+        chunked_cancel(s);
+        upload_done(s, 0, path);
+        return;
+    }
+    c->next++;
+    log_progress(&s->log_progress_at, "Receiving %s: chunk %u of %u", c->path, c->next, c->count);
+    if (--c->missing == 0) chunked_commit(s);
+}
+
+// 增量上传：以服务器上的当前文件为基准，按客户端的指令在 .part 中重建新文件
+typedef struct {
+    char path[PATH_MAX];         // 目标文件，同时是基准文件
+    int basis;
+    int fd;                      // <path>.part
+    long long basis_size;
+    long long size;              // 新文件的大小
+    long long written;           // 已经重建的长度
+    uint32_t block_size;
+    uint32_t block_count;
+    uint32_t next_sig;           // 下一块要发送签名的块
+    unsigned char *block;        // 计算签名时读入一块的缓冲区
+    int failed;
+} delta_upload;
+
+static int delta_next_signatures(session *s);
+
+void delta_cancel(session *s) {
+    delta_upload *d = s->delta;
+    if (!d) return;
+    if (s->on_drain == delta_next_signatures) s->on_drain = NULL;
+    if (d->fd != -1) {
+        char part[PATH_MAX + 8];
+        snprintf(part, sizeof(part), "%s.part", d->path);
+        close(d->fd);
+        unlink(part);
+    }
+    if (d->basis != -1) close(d->basis);
+    free(d->block);
+    free(d);
+    s->delta = NULL;
+}
+
+// 输出队列发送完后计算并发送下一批块签名，大文件的签名不会一次占用工作线程
+static int delta_next_signatures(session *s) {
+    delta_upload *d = s->delta;
+    unsigned char frame[DELTA_SIG_HEADER + DELTA_SIGS_PER_FRAME * DELTA_SIG_SIZE];
+    uint32_t last_len = d->basis_size - (off_t)(d->block_count - 1) * d->block_size;
+    uint32_t header[4] = {htonl(d->block_size), htonl(d->block_count), htonl(last_len), htonl(d->next_sig)};
+    size_t len = DELTA_SIG_HEADER;
+    memcpy(frame, header, sizeof(header));
+
+    for (int i = 0; i < DELTA_SIGS_PER_FRAME && d->next_sig < d->block_count; i++, d->next_sig++) {
+        off_t off = (off_t)d->next_sig * d->block_size;
+        size_t n = d->basis_size - off < d->block_size ? d->basis_size - off : d->block_size;
+        if (pread(d->basis, d->block, n, off) != (ssize_t)n) {
+            // 基准文件在读取过程中被截断，剩下的块签名填 0，不会被客户端命中
+            memset(frame + len, 0, DELTA_SIG_SIZE);
+            len += DELTA_SIG_SIZE;
+            continue;
+        }
+        uint32_t a, b;
+        uint32_t weak = htonl(delta_weak(d->block, n, &a, &b));
+        unsigned char strong[SHA256_DIGEST_LENGTH];
+        SHA256(d->block, n, strong);
+        memcpy(frame + len, &weak, 4);
+        memcpy(frame + len + 4, strong, DELTA_STRONG_SIZE);
+        len += DELTA_SIG_SIZE;
+    }
+    session_send_frame(s, OP_SIGNATURES, frame, len);
+    if (d->next_sig == d->block_count) {
+        s->on_drain = NULL;
+        free(d->block);
+        d->block = NULL;
+    }
+    return 0;
+}
+
+// OP_DELTA_BEGIN：目标文件已存在时开始发送它的块签名，否则回复块数为 0 的 OP_SIGNATURES
+static void delta_begin(session *s, const char *payload, size_t len) {
+    char path[PATH_MAX], local[PATH_MAX], part[PATH_MAX + 8];
+    const char *project, *rel;
+    uint64_t size;
+    struct stat st;
+    delta_upload *d = NULL;
+
+    delta_cancel(s);
+    size_t n = parse_path_size(payload, len, path, &size);
+    if (n == 0 || len != n || s->on_drain) goto refuse;
+    if (upload_target(s, path, local, sizeof(local), &project, &rel) < 0) goto refuse;
+
+    d = calloc(1, sizeof(*d));
+    if (!d) goto refuse;
+    d->fd = -1;
+    d->basis = open(local, O_RDONLY | O_CLOEXEC);
+    if (d->basis == -1 || fstat(d->basis, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0) goto refuse;
+    d->basis_size = st.st_size;
+    d->block_size = delta_block_size(st.st_size);
+    d->block_count = (st.st_size + d->block_size - 1) / d->block_size;
+    if (!(d->block = malloc(d->block_size))) goto refuse;
+    if ((size_t)snprintf(d->path, sizeof(d->path), "%s", local) >= sizeof(d->path)) goto refuse;
+
+    snprintf(part, sizeof(part), "%s.part", local);
+    d->fd = open(part, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (d->fd == -1) {
+        log_warn("Failed to open %s for writing: %s", part, strerror(errno));
+        goto refuse;
+    }
+    // .part 被重建的内容覆盖，之前的检查点失效
+    db_checkpoint_delete(s->user.username, project, rel);
+
+    d->size = size;
+    s->delta = d;
+    s->on_drain = delta_next_signatures;
+    log_info("Receiving delta: %s, %lld -> %lld bytes, %u blocks of %u bytes",
+           local, d->basis_size, (long long)size, d->block_count, d->block_size);
+    return;
+
+refuse:
+    if (d) {
+        if (d->basis != -1) close(d->basis);
+        free(d->block);
+        free(d);
+    }
+    uint32_t empty[4] = {0, 0, 0, 0};
+    session_send_frame(s, OP_SIGNATURES, empty, sizeof(empty));
+}
+
+// OP_DELTA：依次执行指令，复制基准文件中的块或写入原始字节
+static void delta_apply(session *s, const char *payload, size_t len) {
+    delta_upload *d = s->delta;
+    if (!d || d->next_sig < d->block_count) {
+        session_send_frame(s, OP_ERROR, "Unexpected delta", 16);
+        return;
+    }
+
+    size_t pos = 0;
+    while (!d->failed && pos < len) {
+        uint32_t a, b;
+        if (len - pos < 9) {
+            d->failed = 1;
+            break;
+        }
+        memcpy(&a, payload + pos + 1, 4);
+        memcpy(&b, payload + pos + 5, 4);
+        a = ntohl(a);
+        b = ntohl(b);
+        if (payload[pos] == DELTA_COPY) {
+            // a 为第一块的下标，b 为连续块数；最后一块可能不满
+            if (b == 0 || a >= d->block_count || b > d->block_count - a) {
+                d->failed = 1;
+                break;
+            }
+            off_t from = (off_t)a * d->block_size;
+            off_t to = (off_t)(a + b) * d->block_size;
+            if (to > d->basis_size) to = d->basis_size;
+            if (d->written + (to - from) > d->size ||
+                store_copy_range(d->basis, from, d->fd, d->written, to - from) < 0) {
+                d->failed = 1;
+                break;
+            }
+            d->written += to - from;
+            pos += 9;
+        } else if (payload[pos] == DELTA_LITERAL) {
+            // a 为原始字节的长度
+            if (a > len - pos - 5 || d->written + a > d->size) {
+                d->failed = 1;
+                break;
+            }
+            if (pwrite(d->fd, payload + pos + 5, a, d->written) != (ssize_t)a) {
+                log_error("Failed to write %s.part: %s", d->path, strerror(errno));
+                d->failed = 1;
+                break;
+            }
+            d->written += a;
+            pos += 5 + a;
+        } else {
+            d->failed = 1;
+        }
+    }
+    log_progress(&s->log_progress_at, "Rebuilding %s: %lld of %lld bytes", d->path, (long long)d->written, (long long)d->size);
+}
+
+// OP_DELTA_END：重建的文件大小正确时提交，替换原文件
+static void delta_end(session *s) {
+    delta_upload *d = s->delta;
+    if (!d) {
+        session_send_frame(s, OP_ERROR, "Unexpected delta", 16);
+        return;
+    }
+
+    char path[PATH_MAX];
+    strcpy(path, d->path);
+    publish_job *j = NULL;
+    if (!d->failed && d->written == d->size && d->next_sig == d->block_count) {
+        log_info("File rebuilt from delta: %s", path);
+        j = publish_job_new(s, path, d->fd);
+        d->fd = -1;  // .part 交给提交任务，不再删除
+    }
+    delta_cancel(s);
+    if (!j) {
+        char part[PATH_MAX + 8];
+        snprintf(part, sizeof(part), "%s.part", path);
+        log_warn("File not saved: %s", path);
+        unlink(part);
+        upload_done(s, 0, path);
+        return;
+    }
+    j->discard = 1;
+    submit_offload(s, &j->job, publish_run, upload_published);
+}
+
+// 数据连接的 OP_RANGE：按凭据找到并行上传，这一段内容按偏移写入 .part，与 OP_FILE 一样由 ST_FILE_DATA 接收
+static void parallel_attach(session *s, const unsigned char *token, long long offset, long long len) {
+    parallel_upload *p;
+    pthread_mutex_lock(&parallel_lock);
+    for (p = parallel_list; p; p = p->next) {
+        if (memcmp(p->token, token, PARALLEL_TOKEN_SIZE) == 0) break;
+    }
+    if (p && (len <= 0 || offset > p->size - len || p->attached >= p->streams)) p = NULL;
+    for (int i = 0; p && i < p->attached; i++) {
+        if (offset < p->ranges[i][1] && offset + len > p->ranges[i][0]) p = NULL;  // 与已加入的分段重叠
+    }
+    if (p) {
+        p->ranges[p->attached][0] = offset;
+        p->ranges[p->attached][1] = offset + len;
+        p->attached++;
+        p->refs++;
+    }
+    pthread_mutex_unlock(&parallel_lock);
+
+    s->file_next_state = ST_DATA_CONN;
+    if (!p) {
+        unsigned char ok = 0;
+        session_send_frame(s, OP_RANGE_DONE, &ok, 1);
+        s->closing = 1;
+        return;
+    }
+    s->parallel = p;
+    s->parallel_len = len;
+    s->shape = p->shape;
+    // 内容读出后丢弃，回复失败
+    if ((size_t)snprintf(s->file_path, sizeof(s->file_path), "%s", p->path) >= sizeof(s->file_path)) {
+        log_warn("Path too long: %s", p->path);
+        s->file_fd = -1;
+    } else if ((s->file_fd = fcntl(p->fd, F_DUPFD_CLOEXEC, 0)) == -1) {
+        log_warn("Failed to duplicate file descriptor: %s", strerror(errno));
+    }
+    s->file_checkpoint = 0;
+    s->file_remaining = len;
+    s->file_total = offset + len;
+    s->file_written = s->file_durable = offset;
+    s->state = ST_FILE_DATA;
+}
+
+#define DOWNLOAD_MAX_DEPTH 32            // 下载项目时的最大目录深度
+#define DOWNLOAD_BATCH 8                 // 每批最多排队的文件数，限制同时打开的文件
+#define DOWNLOAD_MAX_PENDING (256 * 1024) // 每批最多积压的帧数据
+
+// 下载项目时的目录遍历状态，每次输出队列发送完后从上次的位置继续
+typedef struct {
+    char name[128];                          // 项目名，客户端检查点的路径以它开头
+    char root[PATH_MAX];                     // 工作空间中的项目目录
+    char rel[PATH_MAX];                      // 当前目录相对于项目目录的路径
+    size_t rel_len[DOWNLOAD_MAX_DEPTH];      // 每一层目录对应的 rel 长度
+    DIR *dirs[DOWNLOAD_MAX_DEPTH];
+    int depth;
+    int files;
+    long long bytes;
+} download_ctx;
+
+void download_cancel(session *s) {
+    download_ctx *d = s->download;
+    if (!d) return;
+    while (d->depth > 0) closedir(d->dirs[--d->depth]);
+    free(d);
+    s->download = NULL;
+    s->on_drain = NULL;
+}
+
+static void send_download_begin(session *s, unsigned char kind, const char *name) {
+    char payload[256];
+    size_t len = strlen(name);
+    if (len > sizeof(payload) - 1) len = sizeof(payload) - 1;
+    payload[0] = kind;
+    memcpy(payload + 1, name, len);
+    session_send_frame(s, OP_DOWNLOAD_BEGIN, payload, len + 1);
+}
+
+// 取出客户端对 key 的检查点；用过即删除，同一会话中再次下载时从头发送
+static long long take_resume(session *s, const char *key, long long size) {
+    size_t pos = s->resume_len;
+    if (!s->resume) return 0;
+    long long offset = (long long)proto_find_resume(s->resume, s->resume_len, key, size, &pos);
+    if (pos < s->resume_len) {
+        size_t n = 2 + strlen(key) + 16;
+        memmove(s->resume + pos, s->resume + pos + n, s->resume_len - pos - n);
+        s->resume_len -= n;
+    }
+    return offset;
+}
+
+// 发送文件：帧头和路径写入输出缓冲区，文件内容由 sendfile 从页缓存直接发送到 socket
+// 客户端有该文件的检查点时从检查点继续，返回实际发送的内容长度
+static long long send_file(session *s, const char *filepath, const char *remote_path) {
+    int fd = open(filepath, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return -1;
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return -1;
+    }
+    download_ctx *d = s->download;
+    char key[PATH_MAX + 128];
+    snprintf(key, sizeof(key), "%s%s%s", d ? d->name : "", d ? "/" : "", remote_path);
+    long long offset = take_resume(s, key, st.st_size);
+    if (offset > 0) log_info("Resuming download: %s at %lld of %lld bytes", filepath, offset, (long long)st.st_size);
+    posix_fadvise(fd, offset, 0, POSIX_FADV_SEQUENTIAL);
+
+    unsigned char prefix[PROTO_HEADER_SIZE + 2 + PATH_MAX + 16];
+    size_t prefix_len = proto_encode_file_prefix(prefix + PROTO_HEADER_SIZE, remote_path, offset);
+    if (s->codec != CODEC_NONE) {
+        // 协商了压缩：OP_ZFILE 只带原始长度，内容由输出队列逐块压缩成 OP_ZDATA
+        uint64_t raw_len = htobe64(st.st_size - offset);
+        memcpy(prefix + PROTO_HEADER_SIZE + prefix_len, &raw_len, 8);
+        prefix_len += 8;
+        proto_encode_header(prefix, OP_ZFILE, s->req_id, prefix_len);
+        session_write(s, prefix, PROTO_HEADER_SIZE + prefix_len);
+        session_send_zfile(s, fd, offset, st.st_size - offset);
+        return st.st_size - offset;
+    }
+    proto_encode_header(prefix, OP_FILE, s->req_id, prefix_len + st.st_size - offset);
+    session_write(s, prefix, PROTO_HEADER_SIZE + prefix_len);
+    session_send_file(s, fd, offset, st.st_size - offset);
+    return st.st_size - offset;
+}
+
+// 下载项目：继续遍历目录，把下一批目录和文件加入输出队列
+static int download_next(session *s) {
+    download_ctx *d = s->download;
+    int queued = 0;
+
+    while (d->depth > 0 && queued < DOWNLOAD_BATCH && s->out_len - s->out_off < DOWNLOAD_MAX_PENDING) {
+        struct dirent *entry = readdir(d->dirs[d->depth - 1]);
+        if (!entry) {
+            closedir(d->dirs[--d->depth]);
+            if (d->depth > 0) d->rel[d->rel_len[d->depth - 1]] = '\0';
+            continue;
+        }
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+
+        char rel[PATH_MAX];
+        char full[PATH_MAX * 2];
+        if ((size_t)snprintf(rel, sizeof(rel), "%s%s%s", d->rel, d->rel[0] ? "/" : "", entry->d_name) >= sizeof(rel)) {
+            continue;
+        }
+        snprintf(full, sizeof(full), "%s/%s", d->root, rel);
+
+        // 不跟随符号链接，避免把工作空间之外的内容发送出去
+        struct stat st;
+        if (lstat(full, &st) == -1) continue;
+
+        if (S_ISDIR(st.st_mode)) {
+            session_send_frame(s, OP_DIR, rel, strlen(rel));
+            if (d->depth == DOWNLOAD_MAX_DEPTH) continue;
+            DIR *sub = opendir(full);
+            if (!sub) continue;
+            strcpy(d->rel, rel);
+            d->rel_len[d->depth] = strlen(rel);
+            d->dirs[d->depth++] = sub;
+        } else if (S_ISREG(st.st_mode)) {
+            long long size = send_file(s, full, rel);
+            if (size < 0) continue;
+            d->files++;
+            d->bytes += size;
+            queued++;
+            log_progress(&s->log_progress_at, "Sending %s: %d files, %lld bytes queued", d->root, d->files, d->bytes);
+        }
+    }
+
+    if (d->depth > 0) return 0;
+
+    // 遍历结束
+    log_info("Project sent: %s (%d files, %lld bytes)", d->root, d->files, d->bytes);
+    download_cancel(s);
+    session_send_frame(s, OP_DOWNLOAD_END, NULL, 0);
+    session_send_str(s, "Project downloaded successfully\n");
+    enter_main_menu(s);
+    // 处理下载期间已经到达的请求
+    return session_process(s);
+}
+
+// 下载项目：收到项目名
+static void download_project(session *s, const char *project_name) {
+    if (*project_name == '\0' || strchr(project_name, '/') != NULL || strcmp(project_name, "..") == 0 ||
+        !check_project_exists(s->user.username, project_name)) {
+        session_send_str(s, "Project does not exist.\n");
+        enter_main_menu(s);
+        return;
+    }
+
+    download_ctx *d = calloc(1, sizeof(download_ctx));
+    if (!d) {
+        enter_main_menu(s);
+        return;
+    }
+    snprintf(d->name, sizeof(d->name), "%s", project_name);
+    snprintf(d->root, sizeof(d->root), "./workspaces/%s/%s", s->user.username, project_name);
+    d->dirs[0] = opendir(d->root);
+    if (!d->dirs[0]) {
+        free(d);
+        session_send_str(s, "Failed to open project directory\n");
+        enter_main_menu(s);
+        return;
+    }
+    d->depth = 1;
+
+    send_download_begin(s, UPLOAD_KIND_PROJECT, project_name);
+    s->download = d;
+    s->on_drain = download_next;
+    s->state = ST_DOWNLOADING;
+}
+
+// 下载文件：收到文件名
+static void download_file(session *s, const char *filename) {
+    char filepath[512];
+    snprintf(filepath, sizeof(filepath), "./workspaces/%s/%s/%s", s->user.username, s->project_name, filename);
+
+    if (*filename == '\0' || strchr(filename, '/') != NULL) {
+        session_send_str(s, "Failed to open file.\n");
+        enter_project_menu(s);
+        return;
+    }
+
+    send_download_begin(s, UPLOAD_KIND_FILE, filename);
+    if (send_file(s, filepath, filename) < 0) {
+        session_send_frame(s, OP_DOWNLOAD_END, NULL, 0);
+        session_send_str(s, "Failed to open file.\n");
+    } else {
+        session_send_frame(s, OP_DOWNLOAD_END, NULL, 0);
+        session_send_str(s, "File downloaded successfully.\n");
+    }
+    enter_project_menu(s);
+}
+
+// 客户端重新连接后出示会话凭据：只在未登录时接受，凭据无效时回复空的 OP_SESSION，停在欢迎菜单。
+// 凭据在检查的同时删除，两个连接同时出示同一个凭据时只有一个能恢复，登录后换发新的凭据
+static void session_resume(session *s, const unsigned char *token, size_t len) {
+    char username[sizeof(s->user.username)];
+    if (s->state != ST_WELCOME || len != SESSION_TOKEN_SIZE ||
+        auth_token_take(token, username, sizeof(username)) < 0) {
+        session_send_frame(s, OP_SESSION, NULL, 0);
+        return;
+    }
+    session_printf(s, "Session resumed as %s\n", username);
+    user_login_done(s, username);
+}
+
+// 欢迎菜单
+static void handle_client(session *s, const char *choice) {
+    if (strcmp(choice, "1") == 0) {
+        session_send_str(s, "Option 1 selected\n");
+        session_start(s);
+    } else if (strcmp(choice, "2") == 0 || strcmp(choice, "3") == 0) {
+        session_send_str(s, "Please enter your username:");
+        s->state = choice[0] == '2' ? ST_REG_USERNAME : ST_LOGIN_USERNAME;
+    } else if (strcmp(choice, "4") == 0) {
+        session_send_str(s, "Goodbye!\n");
+        session_send_frame(s, OP_BYE, NULL, 0);
+        s->closing = 1; // 客户端主动退出
+    } else {
+        session_send_str(s, "Invalid option.\n");
+        session_start(s);
+    }
+}
+
+// 回收站：列出可以恢复的项目，等待输入要恢复的项目名
+static void show_trash(session *s) {
+    trash_info items[64];
+    int n = trash_list(s->user.username, items, 64);
+    if (n == 0) {
+        session_send_str(s, "No deleted projects to restore\n");
+        enter_main_menu(s);
+        return;
+    }
+    session_send_str(s, "Deleted projects:\n");
+    for (int i = 0; i < n; i++) {
+        char deleted[32], expires[32];
+        struct tm tm;
+        localtime_r(&items[i].deleted, &tm);
+        strftime(deleted, sizeof(deleted), "%Y-%m-%d %H:%M:%S", &tm);
+        localtime_r(&items[i].expires, &tm);
+        strftime(expires, sizeof(expires), "%Y-%m-%d %H:%M:%S", &tm);
+        session_printf(s, "%s  deleted %s  (restorable until %s)\n", items[i].project, deleted, expires);
+    }
+    session_send_str(s, "Enter project name to restore (or 'q' to cancel): ");
+    s->state = ST_TRASH_RESTORE;
+}
+
+static void restore_project(session *s, const char *project_name) {
+    if (*project_name == '\0' || strcmp(project_name, "q") == 0) {
+        session_send_str(s, "Restore cancelled\n");
+    } else if (strchr(project_name, '/') != NULL) {
+        session_send_str(s, "Invalid project name\n");
+    } else {
+        int rc = trash_restore(s->user.username, project_name);
+        if (rc == 0) {
+            log_version(s->user.username, project_name, "", "project restored");
+            session_send_str(s, "Project restored successfully\n");
+        } else if (rc == -2) {
+            session_send_str(s, "A project with this name already exists\n");
+        } else {
+            session_send_str(s, "Project not found in trash\n");
+        }
+    }
+    enter_main_menu(s);
+}
+
+// 主菜单
+static void handle_main_menu(session *s, const char *choice) {
+    switch (choice[0]) {
+        case '1':
+            list_projects(s, s->user.username);
+            break;
+        case '2':
+            session_send_str(s, "Enter project name: ");
+            s->state = ST_CREATE_PROJECT;
+            break;
+        case '3':
+            session_send_str(s, "Enter project name: ");
+            s->state = ST_OPEN_PROJECT;
+            break;
+        case '4':
+            session_send_str(s, "Enter project name to delete: ");
+            s->state = ST_DELETE_PROJECT;
+            break;
+        case '5': {
+            // 由客户端选择本地目录，以 OP_UPLOAD_BEGIN ... OP_UPLOAD_END 发送
+            unsigned char kind = UPLOAD_KIND_PROJECT;
+            session_send_str(s, "Enter project name to upload: ");
+            session_send_frame(s, OP_UPLOAD_REQ, &kind, 1);
+            s->state = ST_UPLOAD_PROJECT;
+            break;
+        }
+        case '6':
+            session_send_str(s, "Enter project name to download: ");
+            s->state = ST_DOWNLOAD_PROJECT;
+            break;
+        case '7':
+            execute_remote_command(s);
+            break;
+        case '8':
+            session_send_str(s, "Logging out...\n");
+            user_logout(s);
+            session_start(s);
+            break;
+        case '9':
+            session_send_str(s, "Enter filter: <project|*> [file|*] [days] (empty for all): ");
+            s->state = ST_ACTIVITY_FILTER;
+            break;
+        case '0':
+            show_trash(s);
+            break;
+        default:
+            session_send_str(s, "Invalid option\n");
+            enter_main_menu(s);
+    }
+}
+
+// 活动历史的一页：前 ACTIVITY_PAGE 条输出并移动翻页位置，多查出的一条说明后面还有记录
+typedef struct {
+    session *s;
+    int count;
+} activity_page;
+
+static void send_activity(void *arg, const activity_entry *e) {
+    activity_page *page = arg;
+    session *s = page->s;
+    if (page->count++ == ACTIVITY_PAGE) return;
+
+    char when[32];
+    struct tm tm;
+    time_t t = (time_t)e->time;
+    localtime_r(&t, &tm);
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &tm);
+    session_printf(s, "%s  %s%s%s  %s\n", when, e->project, e->file[0] ? "/" : "", e->file, e->action);
+    s->activity_time = e->time;
+    s->activity_id = e->id;
+}
+
+static void send_activity_page(session *s) {
+    activity_query q = {s->user.username, s->activity_project, s->activity_file,
+                        s->activity_since, s->activity_time, s->activity_id};
+    activity_page page = {s, 0};
+    if (db_activity_page(&q, ACTIVITY_PAGE + 1, send_activity, &page) == -1) {
+        session_send_str(s, "Failed to query activity history\n");
+        enter_main_menu(s);
+        return;
+    }
+    if (page.count > ACTIVITY_PAGE) {
+        session_send_str(s, "Enter 'n' for the next page (anything else to return): ");
+        s->state = ST_ACTIVITY_PAGE;
+        return;
+    }
+    session_send_str(s, page.count == 0 ? "No activity found\n" : "End of activity history\n");
+    enter_main_menu(s);
+}
+
+// 活动历史的查询条件：项目（* 表示所有项目）、项目中的文件、最近多少天，都可以省略
+static void query_activity(session *s, const char *line) {
+    char project[128] = "", file[128] = "";
+    int days = 0;
+    char *words[3] = {0};
+    char buf[BUF_SIZE];
+    snprintf(buf, sizeof(buf), "%s", line);
+    int n = 0;
+    for (char *save, *w = strtok_r(buf, " \t", &save); w; w = strtok_r(NULL, " \t", &save)) {
+        if (n == 3) {
+            n = -1;
+            break;
+        }
+        words[n++] = w;
+    }
+    // 最后一个词全是数字时作为天数
+    if (n > 0 && strspn(words[n - 1], "0123456789") == strlen(words[n - 1])) {
+        days = atoi(words[--n]);
+    }
+    if (n < 0 || n > 2 || (n > 0 && strlen(words[0]) >= sizeof(project)) ||
+        (n > 1 && strlen(words[1]) >= sizeof(file))) {
+        session_send_str(s, "Invalid filter\n");
+        enter_main_menu(s);
+        return;
+    }
+    if (n > 0 && strcmp(words[0], "*") != 0) strcpy(project, words[0]);
+    if (n > 1 && strcmp(words[1], "*") != 0 && project[0]) strcpy(file, words[1]);
+
+    strcpy(s->activity_project, project);
+    strcpy(s->activity_file, file);
+    s->activity_since = days > 0 ? (long long)time(NULL) - days * 86400LL : 0;
+    s->activity_time = LLONG_MAX;
+    s->activity_id = LLONG_MAX;
+    send_activity_page(s);
+}
+
+// 处理一行用户输入
+static void session_handle_line(session *s, const char *line) {
+    switch (s->state) {
+        case ST_WELCOME:
+            handle_client(s, line);
+            break;
+        case ST_REG_USERNAME:
+            user_register_username(s, line);
+            break;
+        case ST_REG_PASSWORD:
+            user_register_password(s, line);
+            break;
+        case ST_LOGIN_USERNAME:
+            strncpy(s->pending, line, sizeof(s->pending) - 1);
+            session_send_str(s, "Please enter your password:");
+            s->state = ST_LOGIN_PASSWORD;
+            break;
+        case ST_LOGIN_PASSWORD:
+            user_login_password(s, line);
+            break;
+        case ST_MAIN_MENU:
+            handle_main_menu(s, line);
+            break;
+        case ST_CREATE_PROJECT:
+            create_project_directory(s, s->user.username, line);
+            enter_main_menu(s);
+            break;
+        case ST_OPEN_PROJECT:
+            open_project(s, line);
+            break;
+        case ST_DELETE_PROJECT:
+            // 添加确认步骤
+            strncpy(s->pending, line, sizeof(s->pending) - 1);
+            session_send_str(s, "Are you sure to delete this project? (yes/no): ");
+            s->state = ST_DELETE_CONFIRM;
+            break;
+        case ST_DELETE_CONFIRM:
+            if (strcmp(line, "yes") == 0) {
+                delete_project(s, s->user.username, s->pending);
+            } else {
+                session_send_str(s, "Project deletion cancelled\n");
+            }
+            enter_main_menu(s);
+            break;
+        case ST_UPLOAD_PROJECT:
+            // 客户端没有开始上传（例如本地目录不存在）
+            session_send_str(s, "Upload cancelled\n");
+            enter_main_menu(s);
+            break;
+        case ST_REMOTE_COMMAND:
+            remote_command_line(s, line);
+            break;
+        case ST_PROJECT_MENU:
+            handle_project_menu(s, line);
+            break;
+        case ST_NEW_FILE:
+            create_project_file(s, s->user.username, s->project_name, line);
+            enter_project_menu(s);
+            break;
+        case ST_OPEN_FILE:
+            open_or_edit_file(s, line);
+            break;
+        case ST_EDIT_CONFIRM:
+            if (strcmp(line, "yes") == 0) {
+                edit_file(s);
+            } else {
+                enter_project_menu(s);
+            }
+            break;
+        case ST_EDIT_CONTENT:
+            edit_file_line(s, line);
+            break;
+        case ST_UPLOAD_FILE:
+            session_send_str(s, "Upload cancelled\n");
+            enter_project_menu(s);
+            break;
+        case ST_DOWNLOAD_PROJECT:
+            download_project(s, line);
+            break;
+        case ST_DOWNLOAD_FILE:
+            download_file(s, line);
+            break;
+        case ST_HISTORY_FILE:
+            show_file_history(s, line);
+            break;
+        case ST_HISTORY_RESTORE:
+            restore_file_version(s, line);
+            break;
+        case ST_ACTIVITY_FILTER:
+            query_activity(s, line);
+            break;
+        case ST_TRASH_RESTORE:
+            restore_project(s, line);
+            break;
+        case ST_ACTIVITY_PAGE:
+            if (strcmp(line, "n") == 0) {
+                send_activity_page(s);
+            } else {
+                enter_main_menu(s);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+// 处理一个完整的控制帧
+static int session_handle_frame(session *s, uint8_t opcode, const char *payload, size_t len) {
+    // 二进制 payload 不需要复制成字符串，也不受文本长度的限制
+    switch (opcode) {
+        case OP_RESUME:
+            // 客户端连接后发送的下载检查点，之后的下载从这些位置继续
+            free(s->resume);
+            s->resume = NULL;
+            s->resume_len = 0;
+            if (len > 0 && (s->resume = malloc(len)) != NULL) {
+                memcpy(s->resume, payload, len);
+                s->resume_len = len;
+            }
+            return 0;
+        case OP_PARALLEL_BEGIN:
+            parallel_begin(s, payload, len);
+            return 0;
+        case OP_PARALLEL_END:
+            parallel_end(s, payload, len);
+            return 0;
+        case OP_MANIFEST:
+            chunked_begin(s, payload, len);
+            return 0;
+        case OP_CHUNK:
+            chunked_recv(s, payload, len);
+            return 0;
+        case OP_DELTA_BEGIN:
+            delta_begin(s, payload, len);
+            return 0;
+        case OP_DELTA:
+            delta_apply(s, payload, len);
+            return 0;
+        case OP_DELTA_END:
+            delta_end(s);
+            return 0;
+        case OP_CODECS:
+            codecs_select(s, (const unsigned char *)payload, len);
+            return 0;
+        case OP_ZFILE:
+            zfile_begin(s, payload, len);
+            return 0;
+        case OP_ZDATA:
+            return zdata_recv(s, (const unsigned char *)payload, len);
+        case OP_ARCHIVE:
+            return archive_unpack(s, (const unsigned char *)payload, len);
+        case OP_SESSION:
+            session_resume(s, (const unsigned char *)payload, len);
+            return 0;
+    }
+
+    char text[BUF_SIZE];
+    if (len >= sizeof(text)) {
+        session_send_frame(s, OP_ERROR, "Payload too large", 17);
+        return 0;
+    }
+    memcpy(text, payload, len);
+    text[len] = '\0';
+
+    switch (opcode) {
+        case OP_INPUT:
+            trim_newline(text);
+            session_handle_line(s, text);
+            break;
+        case OP_UPLOAD_BEGIN:
+            if (s->state == ST_UPLOAD_PROJECT) recv_directory(s, text);
+            break;
+        case OP_DIR:
+            if (s->state == ST_UPLOAD_RECORD) {
+                char local[PATH_MAX];
+                if (upload_local_path(s, text, local, sizeof(local)) == 0) {
+                    log_debug("It's a directory: %s", local);
+                    sync_dir(s->user.username, s->pending, NULL, text, local);
+                } else {
+                    log_warn("Rejected path: %s", text);
+                }
+            }
+            break;
+        case OP_UPLOAD_END:
+            if (s->state == ST_UPLOAD_RECORD) {
+                if (s->pending[0]) log_version(s->user.username, s->pending, "", "project uploaded");
+                session_send_str(s, "Project uploaded successfully\n");
+                enter_main_menu(s);
+            } else if (s->state == ST_UPLOAD_PROJECT) {
+                session_send_str(s, "Upload cancelled\n");
+                enter_main_menu(s);
+            } else if (s->state == ST_UPLOAD_FILE) {
+                session_send_str(s, "Upload cancelled\n");
+                enter_project_menu(s);
+            }
+            break;
+        default:
+            session_send_frame(s, OP_ERROR, "Unknown opcode", 14);
+            break;
+    }
+    return 0;
+}
+
+// 从输入缓冲区中逐个解析帧并处理，返回 -1 表示需要关闭连接
+// 客户端可以连续发送多个请求，已经到达的完整帧会在一轮中全部处理
+int session_process(session *s) {
+    while (!s->closing && s->state != ST_DOWNLOADING && s->state != ST_LISTING && s->state != ST_AUTH_WAIT &&
+           s->state != ST_OFFLOAD_WAIT && s->state != ST_COMMAND_RUNNING) {
+        if (s->state == ST_FILE_DATA && !s->file_compressed) {
+            if (recv_file_data(s) == 0) break;
+            continue;
+        }
+
+        size_t avail = session_input_avail(s);
+        const char *p = session_input_ptr(s);
+        if (avail < PROTO_HEADER_SIZE) break;
+
+        frame_header hdr;
+        if (proto_decode_header(p, &hdr) < 0) {
+            session_send_frame(s, OP_ERROR, "Bad frame header", 16);
+            s->closing = 1;
+            return 0;
+        }
+
+        if (hdr.opcode == OP_FILE) {
+            // 文件内容不需要完整缓存：解析出路径和起始偏移后直接从接收缓冲区写入文件
+            uint16_t path_len;
+            uint64_t offset;
+            if (hdr.length < 2) return -1;
+            if (avail < PROTO_HEADER_SIZE + 2) break;
+            memcpy(&path_len, p + PROTO_HEADER_SIZE, 2);
+            path_len = ntohs(path_len);
+            size_t prefix_len = 2u + path_len + 8;
+            if (path_len >= PATH_MAX || hdr.length < prefix_len) return -1;
+            if (avail < PROTO_HEADER_SIZE + prefix_len) break;
+
+            char path[PATH_MAX];
+            memcpy(path, p + PROTO_HEADER_SIZE + 2, path_len);
+            path[path_len] = '\0';
+            memcpy(&offset, p + PROTO_HEADER_SIZE + 2 + path_len, 8);
+            offset = be64toh(offset);
+            if (offset > INT64_MAX - (hdr.length - prefix_len)) return -1;
+            s->req_id = hdr.request_id;
+            session_consume(s, PROTO_HEADER_SIZE + prefix_len);
+            handle_file_frame(s, path, (long long)offset, (long long)(hdr.length - prefix_len));
+            continue;
+        }
+
+        if (hdr.opcode == OP_RANGE) {
+            // 并行上传的数据连接：只能是新连接上的第一个帧，凭据和偏移之后的内容直接写入文件
+            size_t prefix_len = PARALLEL_TOKEN_SIZE + 8;
+            unsigned char token[PARALLEL_TOKEN_SIZE];
+            uint64_t offset;
+            if (s->state != ST_WELCOME || hdr.length <= prefix_len) return -1;
+            if (avail < PROTO_HEADER_SIZE + prefix_len) break;
+            memcpy(token, p + PROTO_HEADER_SIZE, PARALLEL_TOKEN_SIZE);
+            memcpy(&offset, p + PROTO_HEADER_SIZE + PARALLEL_TOKEN_SIZE, 8);
+            offset = be64toh(offset);
+            if (offset > INT64_MAX - (hdr.length - prefix_len)) return -1;
+            s->req_id = hdr.request_id;
+            session_consume(s, PROTO_HEADER_SIZE + prefix_len);
+            parallel_attach(s, token, (long long)offset, (long long)(hdr.length - prefix_len));
+            continue;
+        }
+
+        // 压缩的文件内容之间只能是 OP_ZDATA
+        if (s->state == ST_FILE_DATA && hdr.opcode != OP_ZDATA) return -1;
+
+        size_t limit = hdr.opcode == OP_MANIFEST ? CDC_MANIFEST_MAX :
+                       hdr.opcode == OP_CHUNK ? CDC_HASH_SIZE + CDC_MAX_SIZE :
+                       hdr.opcode == OP_ZDATA || hdr.opcode == OP_ARCHIVE ? CODEC_FRAME_MAX : PROTO_MAX_CONTROL;
+        if (hdr.length > limit) return -1;
+        if (avail < PROTO_HEADER_SIZE + hdr.length) break;  // 等待完整的帧
+
+        s->req_id = hdr.request_id;
+        int rc = session_handle_frame(s, hdr.opcode, p + PROTO_HEADER_SIZE, hdr.length);
+        session_consume(s, PROTO_HEADER_SIZE + hdr.length);
+        if (rc < 0) return -1;
+    }
+    return 0;
 }
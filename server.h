@@ -1,6 +1,10 @@
 #ifndef SERVER_H
 #define SERVER_H
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -17,6 +21,13 @@
 #include <sys/types.h>  // 基本系统数据类型
 #include <limits.h>     // 用于 PATH_MAX 等常量
 #include <sqlite3.h>  // 添加SQLite3头文件
+#include "proto.h"    // 二进制帧协议
+#include "codec.h"    // 文件内容的分块压缩
+#include "pool.h"     // 按大小等级缓存的缓冲区池
+#include "shape.h"    // 令牌桶限速
+#include "auth.h"     // 凭据缓存、会话凭据和认证线程
+#include "log.h"      // 异步日志
+#include "offload.h"  // 后台文件线程
 
 // 如果 DT_REG 未定义，手动定义它
 #ifndef DT_REG
@@ -26,16 +37,15 @@
 #define PORT 8888
 #define MAX_EVENTS 50
 #define BUF_SIZE 1024
+#define ACTIVITY_PAGE 20         // 活动历史每页的条数
+#define LIST_PAGE 256            // 目录列表每次放进输出队列的条数
+#define LIST_TEXT_MAX 8192       // 目录列表一个 OP_TEXT 帧的最大长度
+#define COMMAND_READ_SIZE 4096   // 远程命令的输出每次读取、发送的最大长度
+#define COMMAND_OUTPUT_MAX (256 * 1024)  // 输出队列积压超过这个长度时暂停读取命令的输出
 #define SERVER_IP " 127.0.0.1"
 
-// 文件传输协议相关常量
-#define PROTO_BEGIN "BEGIN"
-#define PROTO_END "END"
-#define PROTO_SIZE "SIZE"
-#define PROTO_DATA "DATA"
-#define PROTO_OK "OK"
-#define PROTO_ERROR "ERROR"
-#define CHUNK_SIZE 4096
+#define WELCOME_MENU "Welcome to PanHub!\n1. Introduction\n2. Register\n3. Login\n4. Exit\n"
+
 
 // 用户信息结构体
 typedef struct {
@@ -45,42 +55,104 @@ typedef struct {
     int menu_flag; // 用于控制菜单状态
 } user_info;
 
+typedef struct session session;
+
 //用户相关函数声明
 void handle_error(const char *msg);
 int create_workspace(const char *username);
-void log_version(const char *username, const char *file_name, const char *action);
-int user_register(int client_fd, user_info users[], int user_count);
-int user_login(int client_fd, user_info *user,int max);
+void log_version(const char *username, const char *project, const char *file_name, const char *action);
 int user_info_init(user_info *user);
-int handle_client(int client_fd, user_info *user);
 void trim_newline(char *str);
 
+// 会话状态机（每个连接一个 session，由工作线程在 epoll 就绪时推进）
+void session_start(session *s);
+int session_process(session *s);
+void user_auth_done(session *s, auth_job *job);
+void download_cancel(session *s);
+void save_file_checkpoint(session *s);
+void parallel_cancel(session *s);
+void chunked_cancel(session *s);
+void delta_cancel(session *s);
+int command_output(session *s);
+void command_cancel(session *s);
+
 // 文件相关函数声明
-int list_workspace_files(int client_fd, const char *username);
-int create_file(int client_fd, const char *username, const char *filename);
-int delete_file(int client_fd, const char *username, const char *filename);
-int edit_file(int client_fd, const char *username, const char *project_name, const char *filename);
-int create_project_file(int client_fd, const char *username, const char *project_name, const char *filename);
-void send_file(int client_fd, const char *file_path);
-int receive_file(int client_fd, const char *file_path);
+int delete_file(session *s, const char *username, const char *filename);
+int create_project_file(session *s, const char *username, const char *project_name, const char *filename);
+void create_directory(const char *dir_path);
 
 // 项目相关函数声明
-int list_projects(int client_fd, const char *username);
-int create_project_directory(int client_fd, const char *username, const char *project_name);
-int create_project(int client_fd, const char *username);
-int open_project(int client_fd, const char *username);
-int upload_project(int client_fd, const char *username);
-int download_project(int client_fd, const char *username);
-int handle_project_menu(int client_fd, const char *username, const char *project_name);
-int delete_project(int client_fd, const char *username, const char *project_name);
-int receive_project(int client_fd, const char *username, const char *project_name);
-int send_project(int client_fd, const char *username, const char *project_name);
-
-// 数据库相关函数声明
+int list_projects(session *s, const char *username);
+int check_project_exists(const char *username, const char *project_name);
+void list_files_in_project(session *s, const char *username, const char *project_name);
+int create_project_directory(session *s, const char *username, const char *project_name);
+int delete_project(session *s, const char *username, const char *project_name);
+
+// 数据库相关函数声明（db.c）
 int init_database(void);
 int db_add_user(const char *username, const char *password);
-int db_check_user(const char *username, const char *password);
+int db_get_password(const char *username, char *buf, size_t size);
+int db_set_password(const char *username, const char *password);
 int db_user_exists(const char *username);
+int db_get_user_count(void);
 void close_database(void);
+void db_async_writes(int on);  // 本线程的写入放进写队列后立即返回，不等待提交
+
+// 断点续传检查点：每个用户、项目、路径一条记录
+int db_checkpoint_save(const char *username, const char *project, const char *path, long long size, long long offset);
+long long db_checkpoint_get(const char *username, const char *project, const char *path, long long size);
+void db_checkpoint_delete(const char *username, const char *project, const char *path);
+size_t db_checkpoint_list(const char *username, const char *project, unsigned char *buf, size_t cap);
+
+
+// 项目同步清单：客户端上传时的大小、修改时间和内容哈希，以及服务器上文件的修改时间
+typedef struct {
+    const char *path;
+    int kind;                 // ARCHIVE_DIR / ARCHIVE_FILE
+    long long size;
+    long long mtime;          // 客户端文件的修改时间（纳秒）
+    long long hash;           // XXH64
+    long long local_mtime;    // 服务器上文件的修改时间，不一致说明文件在服务器上被修改过
+} sync_entry;
+
+// 一组在同一个事务中提交的写入：一个 OP_ARCHIVE 批次中的所有清单更新
+typedef struct {
+    void *head;
+    void *tail;
+    int count;
+} db_batch;
+
+void db_batch_init(db_batch *b);
+int db_batch_commit(db_batch *b);  // 工作线程不等待提交；其他线程等待提交，有写入失败时返回 -1
+
+// batch 为 NULL 时单独写入
+int db_sync_put(db_batch *batch, const char *username, const char *project, const sync_entry *e);
+int db_sync_get(const char *username, const char *project, const char *path, sync_entry *e);
+void db_sync_delete(db_batch *batch, const char *username, const char *project, const char *path);
+void db_sync_list(const char *username, const char *project, void (*fn)(void *arg, const sync_entry *e), void *arg);
+
+// 活动历史：文件和项目的操作记录，按时间倒序分页查询
+typedef struct {
+    long long id;
+    long long time;
+    const char *project;
+    const char *file;
+    const char *action;
+} activity_entry;
+
+// 查询条件和翻页位置：返回 (before_time, before_id) 之前、since 之后的记录
+typedef struct {
+    const char *username;
+    const char *project;      // 空字符串表示所有项目
+    const char *file;         // 空字符串表示项目中的所有文件
+    long long since;
+    long long before_time;
+    long long before_id;
+} activity_query;
+
+int db_activity_add(long long time, const char *username, const char *project, const char *file,
+                    const char *action);
+int db_activity_page(const activity_query *q, int limit, void (*fn)(void *arg, const activity_entry *e),
+                     void *arg);
 
 #endif
@@ -0,0 +1,793 @@
+#include "session.h"
+#include <stdarg.h>
+#include <poll.h>
+#include <sys/sendfile.h>
+
+#define SESSION_BUF_INIT 4096
+#define SESSION_RECV_SIZE (64 * 1024)  // 每次 recv 至少预留的空间
+#define SESSION_IN_MAX (PROTO_HEADER_SIZE + CDC_MANIFEST_MAX)  // 输入缓冲区上限（最大的帧是 OP_MANIFEST），防止客户端无限制地堆积数据
+#define SPLICE_CHUNK (1024 * 1024)  // 单次 sendfile / splice 的最大字节数
+#define ZBUF_SIZE (PROTO_HEADER_SIZE + CODEC_FRAME_MAX)  // 压缩发送时的一个 OP_ZDATA 帧
+
+static int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags == -1) return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+// 保证缓冲区至少能再容纳 extra 字节：从缓冲区池换一个更大等级的缓冲区，容量按等级取整
+static int buf_reserve(char **buf, size_t *cap, size_t used, size_t extra) {
+    if (used + extra <= *cap) return 0;
+    size_t new_cap = *cap ? *cap : SESSION_BUF_INIT;
+    while (new_cap < used + extra) new_cap *= 2;
+    new_cap = pool_size(new_cap);
+    char *p = pool_alloc(new_cap);
+    if (!p) return -1;
+    if (used > 0) memcpy(p, *buf, used);
+    pool_free(*buf, *cap);
+    *buf = p;
+    *cap = new_cap;
+    return 0;
+}
+
+// 缓冲区已经清空时放回缓冲区池，空闲的连接不占用缓冲区，同一线程上的其他会话可以继续使用
+static void buf_release(char **buf, size_t *cap) {
+    pool_free(*buf, *cap);
+    *buf = NULL;
+    *cap = 0;
+}
+
+session *session_create(int fd) {
+    if (set_nonblocking(fd) == -1) return NULL;
+
+    session *s = pool_calloc(sizeof(session));
+    if (!s) return NULL;
+    s->fd = fd;
+    s->file_fd = -1;
+    s->cmd_fd = -1;
+    s->pipe_fds[0] = s->pipe_fds[1] = -1;
+    s->in_pipe[0] = s->in_pipe[1] = -1;
+    s->ring_sock = s->ring_file = s->ring_recv = -1;
+    s->ring_io[0].buf = s->ring_io[1].buf = -1;
+    s->state = ST_WELCOME;
+    user_info_init(&s->user);
+    return s;
+}
+
+void session_destroy(session *s) {
+    if (s->auth_job) {
+        s->auth_job->owner = NULL;  // 任务交回时由工作线程释放
+        s->auth_job = NULL;
+    }
+    if (s->offload) {
+        s->offload->owner = NULL;  // 任务照常执行完，交回时由完成回调释放
+        s->offload = NULL;
+    }
+    if (s->ckpt_job) {
+        s->ckpt_job->owner = NULL;
+        s->ckpt_job = NULL;
+    }
+    command_cancel(s);
+    if (s->ring_inflight > 0) {
+        // 内核还在使用会话的缓冲区，关闭 socket 让这些请求尽快结束，最后一个完成时再释放
+        shutdown(s->fd, SHUT_RDWR);
+        s->ring_zombie = 1;
+        return;
+    }
+
+    download_cancel(s);
+    parallel_cancel(s);
+    chunked_cancel(s);
+    delta_cancel(s);
+    while (s->out_files) {
+        out_file *f = s->out_files;
+        s->out_files = f->next;
+        if (s->ring) uring_file_unregister(s->ring, f->ring_slot);
+        close(f->fd);
+        pool_free(f->zbuf, ZBUF_SIZE);
+        free(f);
+    }
+    if (s->ring) {
+        uring_buf_free(s->ring, s->ring_io[0].buf);
+        uring_buf_free(s->ring, s->ring_io[1].buf);
+        uring_file_unregister(s->ring, s->ring_file);
+        uring_file_unregister(s->ring, s->ring_sock);
+    }
+    if (s->pipe_fds[0] != -1) {
+        close(s->pipe_fds[0]);
+        close(s->pipe_fds[1]);
+    }
+    if (s->in_pipe[0] != -1) {
+        close(s->in_pipe[0]);
+        close(s->in_pipe[1]);
+    }
+    if (s->file_fd != -1) close(s->file_fd);
+    close(s->fd);
+    pool_free(s->in_buf, s->in_cap);
+    pool_free(s->out_buf, s->out_cap);
+    free(s->resume);
+    pool_free(s, sizeof(session));
+}
+
+// 追加数据到输出缓冲区，处理完本轮输入后统一发送，多个回复帧合并为一次 send
+void session_write(session *s, const void *data, size_t len) {
+    if (buf_reserve(&s->out_buf, &s->out_cap, s->out_len, len) < 0) {
+        s->closing = 1;
+        return;
+    }
+    memcpy(s->out_buf + s->out_len, data, len);
+    s->out_len += len;
+}
+
+// 发送一个完整的帧，回复带上当前请求的 id
+void session_send_frame(session *s, uint8_t opcode, const void *payload, size_t len) {
+    unsigned char header[PROTO_HEADER_SIZE];
+    proto_encode_header(header, opcode, s->req_id, len);
+    session_write(s, header, sizeof(header));
+    if (len > 0) session_write(s, payload, len);
+}
+
+// 把文件的一段加入输出队列，紧跟在目前已写入的数据之后发送；fd 由会话负责关闭
+static out_file *queue_file(session *s, int fd, off_t offset, long long len) {
+    out_file *f = calloc(1, sizeof(out_file));
+    if (!f) {
+        close(fd);
+        s->closing = 1;
+        return NULL;
+    }
+    f->pos = s->out_len;
+    f->fd = fd;
+    f->offset = offset;
+    f->remaining = len;
+    f->ring_slot = -1;
+    if (s->out_files_tail) s->out_files_tail->next = f;
+    else s->out_files = f;
+    s->out_files_tail = f;
+    return f;
+}
+
+void session_send_file(session *s, int fd, off_t offset, long long len) {
+    queue_file(s, fd, offset, len);
+}
+
+// 同 session_send_file，但内容按会话协商的编码逐块压缩，作为 OP_ZDATA 帧发送
+void session_send_zfile(session *s, int fd, off_t offset, long long len) {
+    out_file *f = queue_file(s, fd, offset, len);
+    if (!f) return;
+    f->codec = s->codec;
+    f->req_id = s->req_id;
+}
+
+// 发送显示给用户的文本
+void session_send_str(session *s, const char *str) {
+    session_send_frame(s, OP_TEXT, str, strlen(str));
+}
+
+void session_printf(session *s, const char *fmt, ...) {
+    char buf[BUF_SIZE];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    if (n < 0) return;
+    if ((size_t)n >= sizeof(buf)) n = sizeof(buf) - 1;
+    session_send_frame(s, OP_TEXT, buf, n);
+}
+
+// 正在分批发送项目、等待认证线程、后台文件线程或远程命令时不读取新的输入，后续请求留在内核缓冲区中等待
+// io_uring 请求未完成时由完成事件推进，不关注 epoll 事件；限速暂停期间由工作线程到时间后推进
+int session_want_read(const session *s) {
+    return !s->closing && s->state != ST_DOWNLOADING && s->state != ST_LISTING && s->state != ST_AUTH_WAIT &&
+           s->state != ST_OFFLOAD_WAIT && s->state != ST_COMMAND_RUNNING &&
+           s->ring_inflight == 0 &&
+           s->throttle_until == 0;
+}
+
+int session_want_write(const session *s) {
+    if (s->ring_inflight > 0 || s->throttle_until != 0) return 0;
+    return s->out_off < s->out_len || s->out_files != NULL || s->pipe_pending > 0;
+}
+
+// 远程命令的输出：输出队列积压到上限时暂停读取，客户端接收得慢时命令写满管道后阻塞
+int session_want_command(const session *s) {
+    return s->cmd_fd != -1 && s->out_len - s->out_off < COMMAND_OUTPUT_MAX;
+}
+
+// 正在收发文件内容或项目数据：这类会话的读写受限速约束，工作线程先处理其他会话的事件
+int session_is_bulk(const session *s) {
+    switch (s->state) {
+        case ST_UPLOAD_PROJECT:
+        case ST_UPLOAD_RECORD:
+        case ST_UPLOAD_FILE:
+        case ST_FILE_DATA:
+        case ST_DOWNLOADING:
+        case ST_DATA_CONN:
+            return 1;
+        default:
+            return s->out_files != NULL || s->chunked != NULL || s->delta != NULL || s->parallel != NULL;
+    }
+}
+
+// 批量传输这一次可以收发的字节数；额度用完时记下恢复的时间并返回 0，调用方按 socket 暂时不可用处理
+static size_t session_quota(session *s, size_t want) {
+    long long wait;
+    size_t n = shape_quota(s->shape, want, &wait);
+    if (n == 0) s->throttle_until = shape_now() + wait;
+    return n;
+}
+
+// sendfile 不可用时的回退路径：文件 -> 管道 -> socket，数据同样不经过用户空间
+static ssize_t splice_file(session *s, out_file *f) {
+    if (s->pipe_fds[0] == -1 && pipe2(s->pipe_fds, O_NONBLOCK | O_CLOEXEC) == -1) return -1;
+
+    if (s->pipe_pending == 0) {
+        size_t want = f->remaining < SPLICE_CHUNK ? (size_t)f->remaining : SPLICE_CHUNK;
+        if ((want = session_quota(s, want)) == 0) {
+            errno = EAGAIN;
+            return -1;
+        }
+        ssize_t n = splice(f->fd, &f->offset, s->pipe_fds[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n <= 0) return n;
+        s->pipe_pending = n;
+        f->remaining -= n;
+    }
+
+    ssize_t n = splice(s->pipe_fds[0], NULL, s->fd, NULL, s->pipe_pending,
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK | SPLICE_F_MORE);
+    if (n > 0) {
+        s->pipe_pending -= n;
+        shape_charge(s->shape, n);
+    }
+    return n;
+}
+
+// 发送队首文件片段，返回 1 表示发送完毕，0 表示 socket 已满，-1 表示出错
+static int send_file_item(session *s, out_file *f) {
+    static const char zeros[CHUNK_SIZE];
+
+    while (f->remaining > 0 || s->pipe_pending > 0) {
+        ssize_t n;
+        if (f->zero_fill) {
+            size_t want = f->remaining < (long long)sizeof(zeros) ? (size_t)f->remaining : sizeof(zeros);
+            if ((want = session_quota(s, want)) == 0) return 0;
+            n = send(s->fd, zeros, want, MSG_DONTWAIT);
+            if (n > 0) {
+                f->remaining -= n;
+                shape_charge(s->shape, n);
+            }
+        } else if (s->pipe_fds[0] != -1 || s->pipe_pending > 0) {
+            n = splice_file(s, f);
+        } else {
+            size_t want = f->remaining < SPLICE_CHUNK ? (size_t)f->remaining : SPLICE_CHUNK;
+            if ((want = session_quota(s, want)) == 0) return 0;
+            n = sendfile(s->fd, f->fd, &f->offset, want);
+            if (n > 0) {
+                f->remaining -= n;
+                shape_charge(s->shape, n);
+            }
+            if (n == -1 && (errno == EINVAL || errno == ENOSYS)) {
+                n = splice_file(s, f);  // 该文件系统不支持 sendfile，改用 splice
+            }
+        }
+
+        if (n == 0 && f->remaining > 0 && s->pipe_pending == 0) {
+            log_warn("File shrank during transfer, padding %lld bytes", f->remaining);
+            f->zero_fill = 1;
+            continue;
+        }
+        if (n == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            if (errno == EINTR) continue;
+            return -1;
+        }
+    }
+    return 1;
+}
+
+// 压缩发送队首文件片段：读出一块，编码成完整的 OP_ZDATA 帧后发送；返回值同 send_file_item
+static int send_zfile_item(session *s, out_file *f) {
+    if (!f->zbuf && !(f->zbuf = pool_alloc(ZBUF_SIZE))) return -1;
+
+    for (;;) {
+        if (f->zoff < f->zlen) {
+            ssize_t n = send(s->fd, f->zbuf + f->zoff, f->zlen - f->zoff, MSG_DONTWAIT);
+            if (n == -1) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+                if (errno == EINTR) continue;
+                return -1;
+            }
+            f->zoff += n;
+            shape_charge(s->shape, n);
+            continue;
+        }
+        if (f->remaining == 0) return 1;
+
+        // 按压缩后实际发送的字节扣除令牌，这里只确认有额度，整块读出以免降低压缩率
+        size_t want = f->remaining < CODEC_BLOCK_SIZE ? (size_t)f->remaining : CODEC_BLOCK_SIZE;
+        if (session_quota(s, want) == 0) return 0;
+        unsigned char *raw = pool_alloc(CODEC_BLOCK_SIZE);
+        if (!raw) return -1;
+        ssize_t n;
+        if (f->zero_fill) {
+            memset(raw, 0, want);
+            n = want;
+        } else if ((n = pread(f->fd, raw, want, f->offset)) <= 0) {
+            pool_free(raw, CODEC_BLOCK_SIZE);
+            if (n == -1 && errno == EINTR) continue;
+            if (n == -1) return -1;
+            log_warn("File shrank during transfer, padding %lld bytes", f->remaining);
+            f->zero_fill = 1;
+            continue;
+        }
+        size_t len = codec_encode_block(f->codec, s->codec_send_level, raw, n, f->zbuf + PROTO_HEADER_SIZE);
+        pool_free(raw, CODEC_BLOCK_SIZE);
+        proto_encode_header(f->zbuf, OP_ZDATA, f->req_id, len);
+        f->offset += n;
+        f->remaining -= n;
+        f->zoff = 0;
+        f->zlen = PROTO_HEADER_SIZE + len;
+    }
+}
+
+static uint64_t ring_data(session *s, int op, int idx) {
+    return (uint64_t)(uintptr_t)s | (uint64_t)op | ((uint64_t)idx << 3);
+}
+
+// socket 在注册文件表中的槽位，第一次使用 io_uring 传输时注册
+static int ring_sock_slot(session *s) {
+    if (s->ring_sock == -1) s->ring_sock = uring_file_register(s->ring, s->fd);
+    return s->ring_sock;
+}
+
+// 等待 socket 就绪后再收发：POLL_ADD 链接到后面的请求上
+static int ring_queue_poll(session *s, short events) {
+    struct io_uring_sqe *sqe = uring_get_sqe(s->ring);
+    if (!sqe) return -1;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = s->ring_sock;
+    sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+    sqe->poll_events = events;
+    sqe->user_data = ring_data(s, RING_POLL, 0);
+    s->ring_inflight++;
+    return 0;
+}
+
+static int ring_queue_send(session *s, ring_io *io) {
+    struct io_uring_sqe *sqe = uring_get_sqe(s->ring);
+    if (!sqe) return -1;
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = s->ring_sock;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->addr = (uint64_t)(uintptr_t)(uring_buf(s->ring, io->buf) + io->done);
+    sqe->len = io->len - io->done;
+    sqe->msg_flags = MSG_DONTWAIT;
+    sqe->user_data = ring_data(s, RING_SEND, 0);
+    s->ring_inflight++;
+    return 0;
+}
+
+// 用 io_uring 发送队首文件片段：READ_FIXED 读入注册缓冲区，链接的 SEND 紧接着发出，
+// 两个请求一次提交；返回值同 send_file_item，0 表示等待完成事件
+static int ring_send_file_item(session *s, out_file *f) {
+    ring_io *io = &s->ring_io[0];
+    if (s->ring_inflight > 0) return 0;
+
+    if (io->buf != -1) {
+        if (io->done < io->len) {
+            // 上次只发送了一部分或 socket 已满：等待可写后发送剩余部分
+            if (ring_queue_poll(s, POLLOUT) < 0 || ring_queue_send(s, io) < 0) return -1;
+            return 0;
+        }
+        f->offset += io->len;
+        f->remaining -= io->len;
+        uring_buf_free(s->ring, io->buf);
+        io->buf = -1;
+    }
+
+    if (f->remaining == 0 || f->zero_fill) {
+        uring_file_unregister(s->ring, f->ring_slot);
+        f->ring_slot = -1;
+        if (f->remaining == 0) return 1;
+        return send_file_item(s, f);
+    }
+
+    size_t want = f->remaining < URING_BUF_SIZE ? (size_t)f->remaining : URING_BUF_SIZE;
+    if ((want = session_quota(s, want)) == 0) return 0;
+    if (f->ring_slot == -1) f->ring_slot = uring_file_register(s->ring, f->fd);
+    if (f->ring_slot == -1 || ring_sock_slot(s) == -1 || (io->buf = uring_buf_alloc(s->ring)) == -1) {
+        return send_file_item(s, f);  // 注册文件表或缓冲区用完，这一段改用 sendfile
+    }
+
+    struct io_uring_sqe *sqe = uring_get_sqe(s->ring);
+    if (!sqe) return -1;
+    io->offset = f->offset;
+    io->len = want;
+    io->done = 0;
+    sqe->opcode = IORING_OP_READ_FIXED;
+    sqe->fd = f->ring_slot;
+    sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+    sqe->addr = (uint64_t)(uintptr_t)uring_buf(s->ring, io->buf);
+    sqe->len = io->len;
+    sqe->off = io->offset;
+    sqe->buf_index = io->buf;
+    sqe->user_data = ring_data(s, RING_READ, 0);
+    s->ring_inflight++;
+    if (ring_queue_send(s, io) < 0) return -1;
+    return 0;
+}
+
+// 按顺序发送输出缓冲区中的数据和文件片段，返回 1 表示全部发送完毕
+static int session_flush(session *s) {
+    for (;;) {
+        out_file *f = s->out_files;
+        size_t limit = f ? f->pos : s->out_len;
+
+        if (s->out_off < limit) {
+            int flags = MSG_DONTWAIT | (f ? MSG_MORE : 0);  // 帧头和紧随其后的文件内容合并成满的报文段
+            ssize_t n = send(s->fd, s->out_buf + s->out_off, limit - s->out_off, flags);
+            if (n == -1) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+                if (errno == EINTR) continue;
+                return -1;
+            }
+            s->out_off += n;
+            continue;
+        }
+
+        if (!f) break;
+        // 压缩的内容需要经过用户空间，不走 io_uring 的固定缓冲区
+        int rc = f->codec ? send_zfile_item(s, f) : s->ring ? ring_send_file_item(s, f) : send_file_item(s, f);
+        if (rc <= 0) return rc;
+        s->out_files = f->next;
+        if (!s->out_files) s->out_files_tail = NULL;
+        close(f->fd);
+        pool_free(f->zbuf, ZBUF_SIZE);
+        free(f);
+    }
+
+    s->out_off = s->out_len = 0;
+    buf_release(&s->out_buf, &s->out_cap);
+    return 1;
+}
+
+// 发送输出队列，直到发送完毕或内核缓冲区已满
+int session_on_writable(session *s) {
+    for (;;) {
+        int rc = session_flush(s);
+        if (rc <= 0) return rc;
+        if (!s->on_drain) break;
+        // 分批生成的下载内容：上一批发送完后再生成下一批
+        if (s->on_drain(s) < 0) return -1;
+        if (!session_want_write(s) && !s->on_drain) break;
+    }
+    return s->closing ? -1 : 0;
+}
+
+size_t session_input_avail(const session *s) {
+    return s->in_len - s->in_off;
+}
+
+const char *session_input_ptr(const session *s) {
+    return s->in_buf + s->in_off;
+}
+
+void session_consume(session *s, size_t n) {
+    s->in_off += n;
+    if (s->in_off == s->in_len) s->in_off = s->in_len = 0;
+}
+
+// 把管道中的数据写入文件的 file_written 处；文件系统不支持 splice 时读出后再写入
+// 按偏移写入而不使用文件位置，并行上传的多个连接可以共用同一个文件
+static int drain_in_pipe(session *s) {
+    char *buf = NULL;
+    while (s->in_pipe_pending > 0) {
+        ssize_t n = -1;
+        if (!s->splice_in_disabled && s->file_fd != -1) {
+            loff_t off = s->file_written;
+            n = splice(s->in_pipe[0], NULL, s->file_fd, &off, s->in_pipe_pending, SPLICE_F_MOVE);
+            if (n == -1 && errno == EINVAL) {
+                s->splice_in_disabled = 1;
+                continue;
+            }
+            if (n > 0) s->file_written += n;
+        } else {
+            if (!buf && !(buf = pool_alloc(IO_BUF_SIZE))) return -1;
+            size_t want = s->in_pipe_pending < IO_BUF_SIZE ? s->in_pipe_pending : IO_BUF_SIZE;
+            n = read(s->in_pipe[0], buf, want);
+            if (n > 0 && s->file_fd != -1) {
+                if (pwrite(s->file_fd, buf, n, s->file_written) != n) {
+                    log_error("Failed to write %s: %s", s->file_path, strerror(errno));
+                    close(s->file_fd);
+                    s->file_fd = -1;  // 剩余内容读出后丢弃
+                } else {
+                    s->file_written += n;
+                }
+            }
+        }
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) {
+            if (s->file_fd == -1) {
+                pool_free(buf, IO_BUF_SIZE);
+                return -1;
+            }
+            log_error("Failed to write %s: %s", s->file_path, strerror(errno));
+            close(s->file_fd);
+            s->file_fd = -1;
+            continue;
+        }
+        s->in_pipe_pending -= n;
+    }
+    pool_free(buf, IO_BUF_SIZE);
+    save_file_checkpoint(s);
+    return 0;
+}
+
+// 上传的文件内容：socket -> 管道 -> 文件，不经过用户空间的缓冲区
+// 返回 1 表示文件内容已经全部收到，0 表示 socket 暂时没有数据，-1 表示连接出错
+static int splice_upload(session *s) {
+    if (s->in_pipe[0] == -1) {
+        if (pipe2(s->in_pipe, O_NONBLOCK | O_CLOEXEC) == -1) return -1;
+        fcntl(s->in_pipe[1], F_SETPIPE_SZ, SPLICE_CHUNK);  // 失败时保留默认大小
+    }
+
+    while (s->file_remaining > 0 || s->in_pipe_pending > 0) {
+        if (s->in_pipe_pending == 0) {
+            size_t want = s->file_remaining < SPLICE_CHUNK ? (size_t)s->file_remaining : SPLICE_CHUNK;
+            if ((want = session_quota(s, want)) == 0) return 0;
+            ssize_t n = splice(s->fd, NULL, s->in_pipe[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n == 0) return -1;  // 客户端在文件传完前断开
+            if (n == -1) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+                if (errno == EINTR) continue;
+                return -1;
+            }
+            s->in_pipe_pending = n;
+            s->file_remaining -= n;
+            shape_charge(s->shape, n);
+        }
+        if (drain_in_pipe(s) < 0) return -1;
+    }
+    return 1;
+}
+
+static int ring_queue_recv(session *s, ring_io *io, size_t want) {
+    struct io_uring_sqe *sqe = uring_get_sqe(s->ring);
+    if (!sqe) return -1;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = s->ring_sock;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->addr = (uint64_t)(uintptr_t)uring_buf(s->ring, io->buf);
+    sqe->len = want;
+    sqe->msg_flags = MSG_DONTWAIT;
+    sqe->user_data = ring_data(s, RING_RECV, io - s->ring_io);
+    io->busy = 1;
+    s->ring_recv = io - s->ring_io;
+    s->ring_inflight++;
+    return 0;
+}
+
+static int ring_queue_write(session *s, ring_io *io) {
+    struct io_uring_sqe *sqe = uring_get_sqe(s->ring);
+    if (!sqe) return -1;
+    sqe->opcode = IORING_OP_WRITE_FIXED;
+    sqe->fd = s->ring_file;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->addr = (uint64_t)(uintptr_t)(uring_buf(s->ring, io->buf) + io->done);
+    sqe->len = io->len - io->done;
+    sqe->off = io->offset + io->done;
+    sqe->buf_index = io->buf;
+    sqe->user_data = ring_data(s, RING_WRITE, io - s->ring_io);
+    io->busy = 1;
+    s->ring_inflight++;
+    return 0;
+}
+
+// io_uring 资源不足时剩余内容改用 splice 接收，从已接收的末尾继续写入
+static int ring_upload_fallback(session *s) {
+    if (s->ring_file != -1) {
+        uring_file_unregister(s->ring, s->ring_file);
+        s->ring_file = -1;
+        if (s->ring_write_failed) {
+            close(s->file_fd);
+            s->file_fd = -1;
+        } else {
+            s->file_written = s->ring_off;
+        }
+    }
+    return splice_upload(s);
+}
+
+// 两块缓冲区的写入可能乱序完成，检查点只能记录到第一个还没有写完的位置
+static void ring_upload_progress(session *s) {
+    long long written = s->ring_off;
+    for (int i = 0; i < 2; i++) {
+        ring_io *io = &s->ring_io[i];
+        if (io->buf != -1 && io->done < io->len && io->offset + (long long)io->done < written) {
+            written = io->offset + io->done;
+        }
+    }
+    s->file_written = written;
+    save_file_checkpoint(s);
+}
+
+// 上传的文件内容：用两个注册缓冲区交替接收，一块写入文件的同时接收下一块
+// 返回值同 splice_upload，0 表示等待完成事件
+static int ring_upload(session *s) {
+    if (s->ring_file == -1) {
+        if (ring_sock_slot(s) == -1 || (s->ring_file = uring_file_register(s->ring, s->file_fd)) == -1) {
+            return ring_upload_fallback(s);  // 注册文件表已满
+        }
+        s->ring_off = s->file_written;  // 输入缓冲区中的内容已经写入文件
+        s->ring_write_failed = 0;
+    }
+
+    for (int i = 0; i < 2; i++) {
+        ring_io *io = &s->ring_io[i];
+        if (io->buf == -1 || io->busy) continue;
+        if (io->done < io->len && !s->ring_write_failed) {
+            if (ring_queue_write(s, io) < 0) return -1;
+        } else {
+            uring_buf_free(s->ring, io->buf);
+            io->buf = -1;
+        }
+    }
+
+    if (s->ring_recv == -1 && s->file_remaining > 0) {
+        ring_io *io = s->ring_io[0].buf == -1 ? &s->ring_io[0] : &s->ring_io[1];
+        size_t want = s->file_remaining < URING_BUF_SIZE ? (size_t)s->file_remaining : URING_BUF_SIZE;
+        if ((want = session_quota(s, want)) == 0) return 0;  // 正在写入的缓冲区完成后或恢复时间到了再接收
+        if (io->buf == -1 && (io->buf = uring_buf_alloc(s->ring)) != -1) {
+            io->len = io->done = 0;
+            if (ring_queue_poll(s, POLLIN) < 0 || ring_queue_recv(s, io, want) < 0) return -1;
+        } else if (s->ring_inflight == 0) {
+            return ring_upload_fallback(s);  // 没有空闲的注册缓冲区
+        }
+    }
+
+    if (s->ring_inflight > 0) return 0;
+
+    uring_file_unregister(s->ring, s->ring_file);
+    s->ring_file = -1;
+    if (s->ring_write_failed) {
+        log_error("Failed to write %s: %s", s->file_path, strerror(errno));
+        close(s->file_fd);
+        s->file_fd = -1;
+    }
+    return 1;
+}
+
+// 处理 io_uring 完成事件，返回 -1 表示需要关闭连接；已经关闭的会话由工作线程处理，不会调用到这里
+int session_on_uring(session *s, uint64_t user_data, int res) {
+    int op = RING_OP(user_data);
+    ring_io *io = &s->ring_io[RING_IDX(user_data)];
+    s->ring_inflight--;
+
+    switch (op) {
+        case RING_POLL:
+            return 0;  // 链接的请求随后完成
+        case RING_READ:
+            if (res < 0) {
+                errno = -res;
+                log_warn("Failed to read file: %s", strerror(errno));
+                return -1;
+            }
+            io->len = res;  // 文件变短时 SEND 被取消，按实际读到的长度重新发送
+            if (res == 0) {
+                log_warn("File shrank during transfer, padding %lld bytes", s->out_files->remaining);
+                s->out_files->zero_fill = 1;
+            }
+            return 0;
+        case RING_SEND:
+            if (res > 0) {
+                io->done += res;
+                shape_charge(s->shape, res);
+            }
+            else if (res != -EAGAIN && res != -ECANCELED && res != -EINTR) return -1;
+            if (s->ring_inflight > 0) return 0;
+            return session_on_writable(s);
+        case RING_RECV:
+            io->busy = 0;
+            s->ring_recv = -1;
+            if (res == 0) return -1;  // 客户端在文件传完前断开
+            if (res > 0) {
+                io->offset = s->ring_off;
+                io->len = res;
+                s->ring_off += res;
+                s->file_remaining -= res;
+                shape_charge(s->shape, res);
+            } else if (res != -EAGAIN && res != -ECANCELED && res != -EINTR) {
+                return -1;
+            }
+            break;
+        case RING_WRITE:
+            io->busy = 0;
+            if (res > 0) io->done += res;
+            else if (res != -EINTR && res != -EAGAIN) s->ring_write_failed = 1;
+            if (!s->ring_write_failed) ring_upload_progress(s);
+            break;
+    }
+
+    int rc = ring_upload(s);
+    if (rc <= 0) return rc;
+    if (session_process(s) < 0) return -1;
+    return session_on_readable(s);
+}
+
+// 认证任务交回后继续登录或注册，再处理等待期间已经收到的输入
+int session_on_auth(session *s, auth_job *job) {
+    s->auth_job = NULL;
+    user_auth_done(s, job);
+    if (session_process(s) < 0) return -1;
+    return session_on_readable(s);
+}
+
+// 会话已经关闭、还没有释放时交回的任务：解除会话对它的引用，由调用方交给完成回调
+void session_offload_forget(session *s, offload_job *job) {
+    if (s->offload == job) s->offload = NULL;
+    if (s->ckpt_job == job) s->ckpt_job = NULL;
+}
+
+// 后台文件任务交回后交给完成回调；会话在等待这个任务时由回调推进状态机，再处理等待期间已经收到的输入
+int session_on_offload(session *s, offload_job *job) {
+    int waited = s->offload == job;
+    session_offload_forget(s, job);
+    job->done(job, s);
+    if (!waited) return 0;
+    if (session_process(s) < 0) return -1;
+    return session_on_readable(s);
+}
+
+// 远程命令有输出或已经退出：输出放进输出队列；命令结束后回到命令提示，再处理等待期间收到的输入
+int session_on_command(session *s) {
+    if (command_output(s) == 0) return session_on_writable(s);
+    if (session_process(s) < 0) return -1;
+    return session_on_readable(s);
+}
+
+// 读取所有可读数据并推进状态机
+int session_on_readable(session *s) {
+    while (session_want_read(s)) {
+        // 输入缓冲区中的文件内容处理完后，剩余部分直接从 socket splice 到文件
+        if (s->state == ST_FILE_DATA && !s->file_compressed && s->file_fd != -1 && s->file_remaining > 0 &&
+            session_input_avail(s) == 0) {
+            int rc = s->ring ? ring_upload(s) : splice_upload(s);
+            if (rc < 0) return -1;
+            if (rc == 0) break;
+            if (session_process(s) < 0) return -1;
+            continue;
+        }
+
+        // 把尚未处理的数据移到缓冲区开头
+        if (s->in_off > 0) {
+            memmove(s->in_buf, s->in_buf + s->in_off, s->in_len - s->in_off);
+            s->in_len -= s->in_off;
+            s->in_off = 0;
+        }
+        if (s->in_len >= SESSION_IN_MAX) return -1;
+        if (buf_reserve(&s->in_buf, &s->in_cap, s->in_len, SESSION_RECV_SIZE) < 0) return -1;
+
+        // 批量上传的帧数据按额度接收，菜单输入不限速
+        int bulk = session_is_bulk(s);
+        size_t room = s->in_cap - s->in_len;
+        if (bulk && (room = session_quota(s, room)) == 0) break;
+        ssize_t n = recv(s->fd, s->in_buf + s->in_len, room, 0);
+        if (n == 0) {  // 客户端关闭了发送方向，发送完已有的回复后关闭连接
+            s->closing = 1;
+            break;
+        }
+        if (n == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                if (s->in_len == 0) buf_release(&s->in_buf, &s->in_cap);  // 等待下一批数据时不占用缓冲区
+                break;
+            }
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        s->in_len += n;
+        if (bulk) shape_charge(s->shape, n);
+
+        if (session_process(s) < 0) return -1;
+        if (s->closing) break;
+    }
+    return session_on_writable(s);
+}
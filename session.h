@@ -0,0 +1,213 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include "server.h"
+#include "uring.h"
+
+// 会话状态：每个状态表示服务器正在等待客户端的哪一种输入
+typedef enum {
+    ST_WELCOME,             // 欢迎菜单选项
+    ST_REG_USERNAME,        // 注册：用户名
+    ST_REG_PASSWORD,        // 注册：密码
+    ST_LOGIN_USERNAME,      // 登录：用户名
+    ST_LOGIN_PASSWORD,      // 登录：密码
+    ST_AUTH_WAIT,           // 认证线程正在验证密码或注册，期间不处理新的输入
+    ST_MAIN_MENU,           // 主菜单选项
+    ST_CREATE_PROJECT,      // 新建项目：项目名
+    ST_OPEN_PROJECT,        // 打开项目：项目名
+    ST_DELETE_PROJECT,      // 删除项目：项目名
+    ST_DELETE_CONFIRM,      // 删除项目：确认
+    ST_UPLOAD_PROJECT,      // 上传项目：等待 OP_UPLOAD_BEGIN
+    ST_UPLOAD_RECORD,       // 上传项目：OP_DIR / OP_FILE，直到 OP_UPLOAD_END
+    ST_REMOTE_COMMAND,      // 远程命令
+    ST_COMMAND_RUNNING,     // 远程命令正在执行，输出转发完、命令退出后回到 ST_REMOTE_COMMAND
+    ST_PROJECT_MENU,        // 项目菜单选项
+    ST_NEW_FILE,            // 新建文件：文件名
+    ST_OPEN_FILE,           // 打开文件：文件名
+    ST_EDIT_CONFIRM,        // 是否编辑文件
+    ST_EDIT_CONTENT,        // 编辑内容，直到 EOF 行
+    ST_UPLOAD_FILE,         // 上传文件：等待 OP_FILE
+    ST_FILE_DATA,           // 文件传输：OP_FILE 帧中的文件内容
+    ST_DOWNLOAD_PROJECT,    // 下载项目：项目名
+    ST_DOWNLOAD_FILE,       // 下载文件：文件名
+    ST_HISTORY_FILE,        // 文件历史：文件名
+    ST_HISTORY_RESTORE,     // 文件历史：要恢复的版本号
+    ST_ACTIVITY_FILTER,     // 活动历史：查询条件
+    ST_ACTIVITY_PAGE,       // 活动历史：是否显示下一页
+    ST_LISTING,             // 正在分页发送目录列表，输出发送完后继续下一页
+    ST_TRASH_RESTORE,       // 回收站：要恢复的项目名
+    ST_DOWNLOADING,         // 正在发送项目，输出发送完后继续生成下一批文件
+    ST_OFFLOAD_WAIT,        // 后台文件线程正在执行会话提交的任务，期间不处理新的输入
+    ST_DATA_CONN            // 并行上传的数据连接：一段内容接收完后回复 OP_RANGE_DONE 并关闭
+} session_state;
+
+// 输出队列中的文件片段：out_buf 中 pos 之前的数据发送完后，用 sendfile 发送这段文件
+typedef struct out_file {
+    size_t pos;
+    int fd;
+    off_t offset;
+    long long remaining;
+    int zero_fill;          // 文件在发送过程中被截断，剩余部分用 0 补齐以保持帧边界
+    int ring_slot;          // io_uring 注册文件表中的槽位，-1 表示未注册
+    int codec;              // 不为 CODEC_NONE 时逐块读出、压缩后作为 OP_ZDATA 帧发送
+    uint32_t req_id;        // OP_ZDATA 帧头使用的请求 id
+    unsigned char *zbuf;    // 正在发送的 OP_ZDATA 帧
+    size_t zoff;
+    size_t zlen;
+    struct out_file *next;
+} out_file;
+
+// io_uring 传输中的一块数据：占用一个注册缓冲区
+typedef struct {
+    int buf;                // 注册缓冲区下标，-1 表示空闲
+    int busy;               // 有请求正在使用该缓冲区
+    off_t offset;           // 这块数据在文件中的位置
+    size_t len;             // 缓冲区中的有效数据
+    size_t done;            // 已经发送到 socket / 写入文件的字节数
+} ring_io;
+
+// io_uring 请求的 user_data：会话指针的低 4 位用来区分请求类型和 ring_io 下标
+// （calloc 返回的地址至少按 16 字节对齐）
+enum { RING_READ = 1, RING_SEND, RING_POLL, RING_RECV, RING_WRITE };
+#define RING_TAG_MASK 0xfULL
+#define RING_OP(data) ((int)((data) & 0x7))
+#define RING_IDX(data) ((int)(((data) >> 3) & 0x1))
+
+// 每个连接的会话状态和收发缓冲区
+struct session {
+    int fd;
+    session_state state;
+    user_info user;
+    unsigned char session_token[SESSION_TOKEN_SIZE];  // 本次登录发出的会话凭据
+    int has_session_token;
+    auth_job *auth_job;       // 已提交、尚未交回的认证任务
+    offload_job *offload;     // 已提交、会话正在等待的后台文件任务
+    struct worker *worker;    // 会话所在的工作线程
+    uint32_t req_id;          // 正在处理的请求 id，回复帧带上该 id
+
+    char project_name[128];   // 当前打开的项目
+    char filename[128];       // 当前操作的文件
+    char pending[BUF_SIZE];   // 跨状态暂存：注册的用户名、待删除的项目名、上传的根目录
+    char cwd[PATH_MAX];       // 远程命令的当前目录
+    int cmd_fd;               // 正在执行的远程命令的输出管道（非阻塞），-1 表示没有
+    pid_t cmd_pid;            // 命令所在的进程组
+    int cmd_watched;          // 输出管道已经加入工作线程的 epoll
+
+    // 活动历史的查询条件和翻页位置：下一页从 (activity_time, activity_id) 之前开始
+    char activity_project[128];
+    char activity_file[128];
+    long long activity_since;
+    long long activity_time;
+    long long activity_id;
+
+    // 正在发送的目录列表：下一页从名字排在 list_after 之后的一项开始，发送完后回到 list_done_state
+    char list_dir[PATH_MAX];
+    char list_after[NAME_MAX + 1];
+    int list_type;
+    session_state list_done_state;
+
+    // 输入缓冲区：[in_off, in_len) 为尚未处理的数据
+    char *in_buf;
+    size_t in_off;
+    size_t in_len;
+    size_t in_cap;
+
+    // 输出缓冲区：[out_off, out_len) 为尚未发送的数据
+    char *out_buf;
+    size_t out_off;
+    size_t out_len;
+    size_t out_cap;
+
+    // 零拷贝发送的文件片段，按 pos 排序
+    out_file *out_files;
+    out_file *out_files_tail;
+    int pipe_fds[2];          // sendfile 不可用时 splice 使用的管道
+    size_t pipe_pending;      // 已经进入管道、尚未发送到 socket 的字节数
+
+    // 输出队列发送完毕时调用，用于分批生成下载内容；返回 -1 表示需要关闭连接
+    int (*on_drain)(session *s);
+    void *download;           // 下载项目时的目录遍历状态
+    unsigned char *resume;    // 客户端未完成下载的检查点（OP_RESUME 的 payload），每项只使用一次
+    size_t resume_len;
+
+    // 正在接收的文件
+    char file_path[PATH_MAX];
+    int file_fd;
+    long long file_remaining;       // 还未从 socket 读出的文件内容
+    long long file_total;           // 文件的完整大小
+    long long file_written;         // 已经连续写入文件的末尾偏移
+    long long file_durable;         // 最近一次检查点记录的偏移
+    int file_checkpoint;            // 是否为该文件记录检查点
+    unsigned file_seq;              // 每接收一个文件加一，交回的检查点据此判断是否还属于这个文件
+    offload_job *ckpt_job;          // 正在后台同步的检查点，同一时间最多一个
+    char ckpt_project[128];         // 检查点的键：项目名和项目内的相对路径
+    char ckpt_path[PATH_MAX];
+    session_state file_next_state;  // 文件接收完成后回到的状态
+    int in_pipe[2];                 // 上传时 splice 使用的管道：socket -> 管道 -> 文件
+    size_t in_pipe_pending;         // 已经进入管道、尚未写入文件的字节数
+    int splice_in_disabled;         // 目标文件系统不支持 splice 写入
+    void *parallel;                 // 控制连接上发起的、或数据连接正在写入的并行上传
+    long long parallel_len;         // 数据连接负责的分段长度
+    void *chunked;                  // 正在进行的去重上传：等待 OP_CHUNK
+    void *delta;                    // 正在进行的增量上传：发送签名，等待 OP_DELTA
+    int file_compressed;            // 文件内容以 OP_ZDATA 帧到达，由 session_process 逐帧解压写入
+    char sync_path[PATH_MAX];       // 最近一个成功提交、还没有收到 ARCHIVE_META 的文件
+    long long log_progress_at;      // 上一次输出传输进度的时间，限制进度日志的频率
+
+    // 压缩传输：OP_CODECS 协商出的编码和级别，CODEC_NONE 表示不压缩
+    int codec;
+    int codec_level;
+    int codec_send_level;     // 服务器压缩时的级别，不超过 CODEC_SEND_LEVEL_MAX
+
+    // io_uring 传输：工作线程启用 io_uring 时设置，NULL 表示使用 sendfile / splice
+    uring_t *ring;
+    int ring_inflight;        // 已提交、尚未完成的请求数，期间不关注 epoll 事件
+    int ring_sock;            // socket 在注册文件表中的槽位
+    int ring_file;            // 正在接收的文件在注册文件表中的槽位
+    int ring_recv;            // 正在接收数据的 ring_io 下标，-1 表示没有
+    int ring_write_failed;    // 写入文件失败，剩余内容读出后丢弃
+    off_t ring_off;           // 下一块接收的数据在文件中的位置
+    ring_io ring_io[2];       // 下载只用第一块；上传时一块接收、一块写入
+    int ring_zombie;          // 连接已关闭，等待请求完成后释放
+
+    // 限速：额度用完时暂停到 throttle_until（shape_now 的时间），期间不关注读写事件
+    shape_bucket *shape;            // 登录用户的令牌桶，NULL 表示只受全局限速
+    long long throttle_until;       // 0 表示没有暂停
+    int throttle_listed;            // 已经在工作线程的暂停列表中
+    struct session *throttle_next;
+
+    int closing;  // 输出发送完毕后关闭连接
+    int detached; // 工作线程已经关闭该连接，本轮事件处理完后释放，之前不再处理它的事件
+
+    struct session *prev;
+    struct session *next;
+};
+
+session *session_create(int fd);
+void session_destroy(session *s);
+int session_on_readable(session *s);
+int session_on_writable(session *s);
+int session_want_read(const session *s);
+int session_want_write(const session *s);
+int session_want_command(const session *s);
+int session_is_bulk(const session *s);
+int session_on_uring(session *s, uint64_t user_data, int res);
+int session_on_auth(session *s, auth_job *job);
+int session_on_offload(session *s, offload_job *job);
+void session_offload_forget(session *s, offload_job *job);
+int session_on_command(session *s);
+
+// 输出
+void session_write(session *s, const void *data, size_t len);
+void session_send_frame(session *s, uint8_t opcode, const void *payload, size_t len);
+void session_send_file(session *s, int fd, off_t offset, long long len);
+void session_send_zfile(session *s, int fd, off_t offset, long long len);
+void session_send_str(session *s, const char *str);
+void session_printf(session *s, const char *fmt, ...);
+
+// 输入
+size_t session_input_avail(const session *s);
+const char *session_input_ptr(const session *s);
+void session_consume(session *s, size_t n);
+
+#endif
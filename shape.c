@@ -0,0 +1,121 @@
+#include "shape.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+struct shape_bucket {
+    pthread_mutex_t lock;
+    long long rate;             // 每秒补充的字节数，0 表示不限速
+    long long burst;            // 桶容量
+    double tokens;              // 当前令牌数，透支时为负
+    long long last;             // 上次补充令牌的时间
+    char username[128];
+    struct shape_bucket *next;
+};
+
+static shape_bucket global_bucket;
+static long long user_rate;
+static shape_bucket *user_buckets;  // 用户登录时创建，进程退出前不释放，会话可以一直持有指针
+static pthread_mutex_t user_lock = PTHREAD_MUTEX_INITIALIZER;
+
+long long shape_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+long long shape_parse_rate(const char *str) {
+    char *end;
+    double v = strtod(str, &end);
+    if (end == str || v < 0) return -1;
+    switch (*end) {
+        case 'k': case 'K': v *= 1024; end++; break;
+        case 'm': case 'M': v *= 1024 * 1024; end++; break;
+        case 'g': case 'G': v *= 1024.0 * 1024 * 1024; end++; break;
+    }
+    if (*end) return -1;
+    return (long long)v;
+}
+
+static void bucket_init(shape_bucket *b, long long rate) {
+    pthread_mutex_init(&b->lock, NULL);
+    b->rate = rate;
+    b->burst = rate * SHAPE_BURST_MS / 1000;
+    if (b->burst < SHAPE_MIN_BURST) b->burst = SHAPE_MIN_BURST;
+    b->tokens = b->burst;
+    b->last = shape_now();
+}
+
+// 在启动工作线程之前调用
+void shape_init(long long global_rate, long long per_user_rate) {
+    if (global_rate > 0) bucket_init(&global_bucket, global_rate);
+    user_rate = per_user_rate > 0 ? per_user_rate : 0;
+}
+
+// 同一用户的所有连接（包括并行上传的数据连接）共用一个桶
+shape_bucket *shape_user(const char *username) {
+    if (user_rate == 0 || !username[0]) return NULL;
+
+    pthread_mutex_lock(&user_lock);
+    shape_bucket *b;
+    for (b = user_buckets; b; b = b->next) {
+        if (strcmp(b->username, username) == 0) break;
+    }
+    if (!b && (b = calloc(1, sizeof(*b)))) {
+        bucket_init(b, user_rate);
+        strncpy(b->username, username, sizeof(b->username) - 1);
+        b->next = user_buckets;
+        user_buckets = b;
+    }
+    pthread_mutex_unlock(&user_lock);
+    return b;  // 内存不足时返回 NULL，该用户只受全局限速
+}
+
+// 补充令牌后返回可用的令牌数；不足以开始这次收发时返回 0，并把需要等待的时间计入 *wait_ns
+static double bucket_available(shape_bucket *b, long long now, size_t want, long long *wait_ns) {
+    pthread_mutex_lock(&b->lock);
+    if (now > b->last) {
+        b->tokens += (double)(now - b->last) * b->rate / 1e9;
+        if (b->tokens > b->burst) b->tokens = b->burst;
+        b->last = now;
+    }
+    double tokens = b->tokens;
+    pthread_mutex_unlock(&b->lock);
+
+    double need = want < SHAPE_MIN_QUOTA ? (double)want : SHAPE_MIN_QUOTA;
+    if (tokens >= need) return tokens;
+    long long wait = (long long)((need - tokens) * 1e9 / b->rate) + 1;
+    if (wait > *wait_ns) *wait_ns = wait;
+    return 0;
+}
+
+size_t shape_quota(shape_bucket *user, size_t want, long long *wait_ns) {
+    *wait_ns = 0;
+    if (global_bucket.rate == 0 && !user) return want;
+
+    long long now = shape_now();
+    double avail = want;
+    if (global_bucket.rate > 0) {
+        double t = bucket_available(&global_bucket, now, want, wait_ns);
+        if (t < avail) avail = t;
+    }
+    if (user) {
+        double t = bucket_available(user, now, want, wait_ns);
+        if (t < avail) avail = t;
+    }
+    if (*wait_ns > 0) return 0;
+    return (size_t)avail;
+}
+
+static void bucket_charge(shape_bucket *b, size_t n) {
+    pthread_mutex_lock(&b->lock);
+    b->tokens -= n;
+    pthread_mutex_unlock(&b->lock);
+}
+
+void shape_charge(shape_bucket *user, size_t n) {
+    if (n == 0) return;
+    if (global_bucket.rate > 0) bucket_charge(&global_bucket, n);
+    if (user) bucket_charge(user, n);
+}
@@ -0,0 +1,28 @@
+#ifndef SHAPE_H
+#define SHAPE_H
+
+// 传输限速：令牌桶按每秒字节数补充令牌，全局一个桶，每个用户另有一个桶。
+// 文件内容的收发（sendfile / splice / io_uring / 压缩帧 / 上传的帧数据）每次先取额度，
+// 完成后按实际字节数扣除；额度用完的会话暂停到令牌补充后再继续。
+// 菜单和命令的输出不经过令牌桶，不会排在限速的批量传输后面。
+// 速率为 0 表示不限速。
+
+#include <stddef.h>
+
+#define SHAPE_BURST_MS 100             // 桶容量：相当于多少毫秒的速率
+#define SHAPE_MIN_BURST (64 * 1024)    // 桶容量的下限
+#define SHAPE_MIN_QUOTA (16 * 1024)    // 令牌少于这个数（且少于请求的字节数）时等待，避免很小的收发
+
+typedef struct shape_bucket shape_bucket;
+
+long long shape_parse_rate(const char *str);  // "10M"、"512K"、"1G" 或字节数，失败返回 -1
+void shape_init(long long global_rate, long long user_rate);
+shape_bucket *shape_user(const char *username);  // 该用户的桶，没有设置每用户速率时返回 NULL
+long long shape_now(void);                        // 单调时钟，纳秒
+
+// 本次最多可以收发的字节数；返回 0 时 *wait_ns 为需要等待的时间
+size_t shape_quota(shape_bucket *user, size_t want, long long *wait_ns);
+// 扣除实际收发的字节数，允许暂时透支，之后的额度相应推迟
+void shape_charge(shape_bucket *user, size_t n);
+
+#endif
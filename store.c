@@ -0,0 +1,213 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "store.h"
+#include "pool.h"
+#include "log.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <openssl/sha.h>
+
+// 块在存储中的路径；dir 不为 NULL 时同时返回所在目录
+static void chunk_path(char *path, size_t size, char *dir, size_t dir_size,
+                       const char *username, const unsigned char *hash) {
+    char hex[CDC_HASH_SIZE * 2 + 1];
+    for (int i = 0; i < CDC_HASH_SIZE; i++) sprintf(hex + i * 2, "%02x", hash[i]);
+    snprintf(path, size, "%s/%s/%.2s/%s", STORE_ROOT, username, hex, hex);
+    if (dir) snprintf(dir, dir_size, "%s/%s/%.2s", STORE_ROOT, username, hex);
+}
+
+// 已有的块被再次用到时更新修改时间，清理时不会删除正在上传或记录版本中用到的块
+int store_has_chunk(const char *username, const unsigned char *hash, uint32_t len) {
+    char path[PATH_MAX];
+    struct stat st;
+    chunk_path(path, sizeof(path), NULL, 0, username, hash);
+    if (stat(path, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size != len) return 0;
+    if (st.st_mtime < time(NULL) - STORE_TOUCH_AGE) utimensat(AT_FDCWD, path, NULL, 0);
+    return 1;
+}
+
+// 逐级创建目录
+static int make_dirs(const char *dir) {
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s", dir);
+    for (char *p = tmp + 1; *p; p++) {
+        if (*p != '/') continue;
+        *p = '\0';
+        if (mkdir(tmp, 0755) == -1 && errno != EEXIST) return -1;
+        *p = '/';
+    }
+    return mkdir(tmp, 0755) == -1 && errno != EEXIST ? -1 : 0;
+}
+
+// 写入已经算好哈希的块，已有时直接返回
+static int chunk_write(const char *username, const unsigned char *hash, const void *data, uint32_t len) {
+    if (store_has_chunk(username, hash, len)) return 0;
+
+    char path[PATH_MAX], dir[PATH_MAX], tmp[PATH_MAX + 32];
+    chunk_path(path, sizeof(path), dir, sizeof(dir), username, hash);
+    if (make_dirs(dir) == -1) {
+        log_warn("Failed to create chunk directory %s: %s", dir, strerror(errno));
+        return -1;
+    }
+
+    // 先写临时文件再改名，其他会话同时写入同一个块时不会看到不完整的内容
+    snprintf(tmp, sizeof(tmp), "%s.%lx.tmp", path, (unsigned long)gettid());
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        log_warn("Failed to create chunk %s: %s", tmp, strerror(errno));
+        return -1;
+    }
+    if (write(fd, data, len) != (ssize_t)len) {
+        log_warn("Failed to write chunk %s: %s", tmp, strerror(errno));
+        close(fd);
+        unlink(tmp);
+        return -1;
+    }
+    close(fd);
+    if (rename(tmp, path) == -1) {
+        log_warn("Failed to rename chunk %s: %s", path, strerror(errno));
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+int store_put_chunk(const char *username, const unsigned char *hash, const void *data, uint32_t len) {
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    SHA256(data, len, digest);
+    if (memcmp(digest, hash, CDC_HASH_SIZE) != 0) {
+        log_warn("Chunk hash mismatch from %s", username);
+        return -1;
+    }
+    return chunk_write(username, hash, data, len);
+}
+
+int store_add_chunk(const char *username, const void *data, uint32_t len, unsigned char *hash) {
+    SHA256(data, len, hash);
+    return chunk_write(username, hash, data, len);
+}
+
+int store_copy_range(int in, off_t in_off, int out, off_t out_off, uint64_t len) {
+    loff_t src = in_off, dst = out_off;
+    while (len > 0) {
+        ssize_t n = copy_file_range(in, &src, out, &dst, len, 0);
+        if (n > 0) {
+            len -= n;
+            continue;
+        }
+        if (n == -1 && errno == EINTR) continue;
+        if (n == 0) return -1;  // 源文件比预期的短
+        break;                  // 跨文件系统或不支持时改为读出再写入
+    }
+
+    char *buf = pool_alloc(IO_BUF_SIZE);
+    if (!buf) return -1;
+    while (len > 0) {
+        ssize_t n = pread(in, buf, len < IO_BUF_SIZE ? len : IO_BUF_SIZE, src);
+        if (n <= 0 || pwrite(out, buf, n, dst) != n) {
+            pool_free(buf, IO_BUF_SIZE);
+            return -1;
+        }
+        src += n;
+        dst += n;
+        len -= n;
+    }
+    pool_free(buf, IO_BUF_SIZE);
+    return 0;
+}
+
+int store_assemble(const char *username, int fd, const unsigned char *manifest, uint32_t count) {
+    off_t offset = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        const unsigned char *entry = manifest + (size_t)i * CDC_ENTRY_SIZE;
+        uint32_t len;
+        memcpy(&len, entry + CDC_HASH_SIZE, 4);
+        len = ntohl(len);
+
+        char path[PATH_MAX];
+        chunk_path(path, sizeof(path), NULL, 0, username, entry);
+        int in = open(path, O_RDONLY | O_CLOEXEC);
+        if (in == -1) {
+            log_warn("Failed to open chunk %s: %s", path, strerror(errno));
+            return -1;
+        }
+        int rc = store_copy_range(in, 0, fd, offset, len);
+        close(in);
+        if (rc == -1) {
+            log_warn("Failed to copy chunk %s: %s", path, strerror(errno));
+            return -1;
+        }
+        offset += len;
+    }
+    return 0;
+}
+
+// 块文件名是哈希的十六进制，解析失败返回 -1
+static int chunk_name_hash(const char *name, unsigned char *hash) {
+    if (strlen(name) != CDC_HASH_SIZE * 2) return -1;
+    for (int i = 0; i < CDC_HASH_SIZE * 2; i++) {
+        char c = name[i];
+        int v = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+        if (v < 0) return -1;
+        if (i % 2 == 0) hash[i / 2] = v << 4;
+        else hash[i / 2] |= v;
+    }
+    return 0;
+}
+
+// 清理一个前缀目录，返回删除的个数
+static int sweep_dir(int dfd, const char *dir, int (*referenced)(void *arg, const unsigned char *hash),
+                     void *arg, time_t before) {
+    DIR *d = fdopendir(dfd);
+    if (!d) {
+        close(dfd);
+        return 0;
+    }
+    int removed = 0;
+    struct dirent *ent;
+    while ((ent = readdir(d)) != NULL) {
+        if (ent->d_name[0] == '.') continue;
+        struct stat st;
+        if (fstatat(dfd, ent->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1 || !S_ISREG(st.st_mode)) continue;
+        if (st.st_mtime >= before) continue;
+
+        // 中断的写入留下的临时文件，以及没有被任何清单引用的块
+        size_t len = strlen(ent->d_name);
+        unsigned char hash[CDC_HASH_SIZE];
+        int stale = len > 4 && strcmp(ent->d_name + len - 4, ".tmp") == 0;
+        if (!stale && (chunk_name_hash(ent->d_name, hash) == -1 || referenced(arg, hash))) continue;
+        if (unlinkat(dfd, ent->d_name, 0) == 0) removed++;
+        else log_warn("Failed to remove chunk %s/%s: %s", dir, ent->d_name, strerror(errno));
+    }
+    closedir(d);
+    return removed;
+}
+
+int store_sweep(const char *username, int (*referenced)(void *arg, const unsigned char *hash), void *arg,
+                time_t grace) {
+    char root[PATH_MAX];
+    if ((size_t)snprintf(root, sizeof(root), "%s/%s", STORE_ROOT, username) >= sizeof(root)) return -1;
+    DIR *d = opendir(root);
+    if (!d) return errno == ENOENT ? 0 : -1;
+
+    time_t before = time(NULL) - grace;
+    int removed = 0;
+    struct dirent *ent;
+    while ((ent = readdir(d)) != NULL) {
+        if (ent->d_name[0] == '.') continue;
+        int dfd = openat(dirfd(d), ent->d_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dfd == -1) continue;
+        removed += sweep_dir(dfd, ent->d_name, referenced, arg, before);
+    }
+    closedir(d);
+    return removed;
+}
@@ -0,0 +1,39 @@
+#ifndef STORE_H
+#define STORE_H
+
+// 内容寻址的块存储：每个用户的块按 SHA-256 保存在 ./chunks/<用户>/<前两位>/<哈希> 中，
+// 相同内容只保存一份。工作空间中的文件仍然是普通文件，按清单从块存储拼出：支持 reflink 时
+// 与块共享数据块，不支持时是一份完整的副本，去重上传的文件在磁盘上同时占用两份空间。
+// 块不记录引用计数：版本被删除后由 store_sweep 按标记清除回收，块文件的修改时间表示最近一次
+// 写入或用到它的时间，宽限期内的块不删除，正在上传或记录版本的清单引用的块不会被清除。
+
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+#include "proto.h"
+
+#define STORE_ROOT "./chunks"
+#define STORE_TOUCH_AGE 3600        // 修改时间超过这么多秒的块被用到时更新修改时间，小于清理的宽限期
+
+// 块存储中是否已有这个块（按长度检查，内容在写入时已经校验）
+int store_has_chunk(const char *username, const unsigned char *hash, uint32_t len);
+
+// 校验内容的 SHA-256 后写入块存储，成功返回 0
+int store_put_chunk(const char *username, const unsigned char *hash, const void *data, uint32_t len);
+
+// 服务器自己切出的块：计算 SHA-256 写入 hash（CDC_HASH_SIZE 字节）后写入块存储，成功返回 0
+int store_add_chunk(const char *username, const void *data, uint32_t len, unsigned char *hash);
+
+// 按清单（count 个 CDC_ENTRY_SIZE 字节的项）把块依次写入 fd，成功返回 0
+int store_assemble(const char *username, int fd, const unsigned char *manifest, uint32_t count);
+
+// 把 in 中 [in_off, in_off + len) 复制到 out 的 out_off 处：copy_file_range 在内核中完成，
+// 支持 reflink 的文件系统上共享数据块；不支持时读出再写入。成功返回 0
+int store_copy_range(int in, off_t in_off, int out, off_t out_off, uint64_t len);
+
+// 删除用户的块存储中 referenced 返回 0、并且超过 grace 秒没有写入或用到的块，以及中断的写入留下的
+// 临时文件。返回删除的个数，无法读取块存储时返回 -1
+int store_sweep(const char *username, int (*referenced)(void *arg, const unsigned char *hash), void *arg,
+                time_t grace);
+
+#endif
@@ -0,0 +1,340 @@
+#include "server.h"
+#include "trash.h"
+#include <pthread.h>
+#include <stdarg.h>
+#include <sys/syscall.h>
+
+// glibc 没有 ioprio_set 的封装和常量
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_WHO_PROCESS 1
+
+#define TRASH_RECLAIM_PREFIX ".reclaim-"
+#define TRASH_FAILED_PREFIX ".failed-"     // 删除失败的目录改成这个名字，不再重试，留给管理员处理
+#define TRASH_DEEP_PREFIX ".deep-"         // 超过 TRASH_MAX_DEPTH 层的子目录移到要删除的目录下时使用的名字
+
+static long long retention = TRASH_RETENTION_DEFAULT;
+static pthread_t trash_tids[16];
+static int trash_nthreads;
+static int trash_stopping;
+static unsigned trash_seq;
+// 选择要删除的项目和撤销删除都在这把锁下进行，正在删除的目录记录在 reclaiming 中
+static pthread_mutex_t trash_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t trash_wake = PTHREAD_COND_INITIALIZER;
+static char reclaiming[16][PATH_MAX];
+
+// 格式化路径，放不下时返回 -1 并设置 errno，调用方跳过这一项，不使用截断的路径
+static int trash_path(char *buf, size_t size, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(buf, size, fmt, ap);
+    va_end(ap);
+    if (n < 0 || (size_t)n >= size) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    return 0;
+}
+
+// 回收站中一项的名字：<删除时间>-<序号>-<项目名>
+static int parse_entry(const char *name, trash_info *info) {
+    char *end;
+    long long deleted = strtoll(name, &end, 10);
+    if (end == name || *end != '-') return -1;
+    end = strchr(end + 1, '-');
+    if (!end || end[1] == '\0' || strlen(end + 1) >= sizeof(info->project)) return -1;
+    strcpy(info->project, end + 1);
+    info->deleted = (time_t)deleted;
+    info->expires = (time_t)(deleted + retention);
+    return 0;
+}
+
+int trash_move(const char *username, const char *project) {
+    char src[PATH_MAX], dir[PATH_MAX], dst[PATH_MAX];
+    if (trash_path(src, sizeof(src), "./workspaces/%s/%s", username, project) < 0 ||
+        trash_path(dir, sizeof(dir), "%s/%s", TRASH_ROOT, username) < 0) {
+        return -1;
+    }
+    if ((mkdir(TRASH_ROOT, 0755) == -1 && errno != EEXIST) || (mkdir(dir, 0755) == -1 && errno != EEXIST)) {
+        return -1;
+    }
+
+    // 同一秒内删除同名项目时序号不同；服务器重启后序号可能重复，不覆盖已有的项
+    for (int i = 0; i < 16; i++) {
+        unsigned seq = __atomic_fetch_add(&trash_seq, 1, __ATOMIC_RELAXED);
+        if (trash_path(dst, sizeof(dst), "%s/%lld-%u-%s", dir, (long long)time(NULL), seq, project) < 0) return -1;
+        if (renameat2(AT_FDCWD, src, AT_FDCWD, dst, RENAME_NOREPLACE) == 0) {
+            pthread_cond_signal(&trash_wake);
+            return 0;
+        }
+        if (errno != EEXIST) return -1;
+    }
+    return -1;
+}
+
+static int info_cmp(const void *a, const void *b) {
+    const trash_info *x = a, *y = b;
+    return (x->deleted < y->deleted) - (x->deleted > y->deleted);
+}
+
+int trash_list(const char *username, trash_info *out, int max) {
+    char dir[PATH_MAX];
+    if (trash_path(dir, sizeof(dir), "%s/%s", TRASH_ROOT, username) < 0) return 0;
+    DIR *d = opendir(dir);
+    if (!d) return 0;
+    int n = 0;
+    time_t now = time(NULL);
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL && n < max) {
+        if (e->d_name[0] == '.' || parse_entry(e->d_name, &out[n]) == -1) continue;
+        if (out[n].expires > now) n++;
+    }
+    closedir(d);
+    qsort(out, n, sizeof(trash_info), info_cmp);
+    return n;
+}
+
+int trash_restore(const char *username, const char *project) {
+    char dir[PATH_MAX], src[PATH_MAX], dst[PATH_MAX];
+    if (trash_path(dir, sizeof(dir), "%s/%s", TRASH_ROOT, username) < 0 ||
+        trash_path(dst, sizeof(dst), "./workspaces/%s/%s", username, project) < 0) {
+        return -1;
+    }
+
+    // 持有锁时回收线程不会选中这个项目，改名回去之前它不会开始删除
+    pthread_mutex_lock(&trash_lock);
+    DIR *d = opendir(dir);
+    char best[NAME_MAX + 1] = "";
+    time_t best_time = 0, now = time(NULL);
+    struct dirent *e;
+    while (d && (e = readdir(d)) != NULL) {
+        trash_info info;
+        if (e->d_name[0] == '.' || parse_entry(e->d_name, &info) == -1) continue;
+        if (strcmp(info.project, project) != 0 || info.expires <= now) continue;
+        if (!best[0] || info.deleted >= best_time) {
+            snprintf(best, sizeof(best), "%s", e->d_name);
+            best_time = info.deleted;
+        }
+    }
+    if (d) closedir(d);
+
+    int rc = -1;
+    if (best[0] && trash_path(src, sizeof(src), "%s/%s", dir, best) == 0) {
+        if (renameat2(AT_FDCWD, src, AT_FDCWD, dst, RENAME_NOREPLACE) == 0) {
+            rc = 0;
+        } else if (errno == EEXIST || errno == ENOTEMPTY) {
+            rc = -2;
+        } else {
+            log_warn("Failed to restore project %s: %s", src, strerror(errno));
+        }
+    }
+    pthread_mutex_unlock(&trash_lock);
+    return rc;
+}
+
+// 删除目录树时栈上的一层：打开的目录和它在上一层中的名字
+typedef struct {
+    DIR *d;
+    char name[NAME_MAX + 1];
+    int failed;  // 有没能删除的内容，这个目录也不删除
+} remove_frame;
+
+static void remove_counted(long *removed) {
+    if (++*removed % TRASH_BATCH == 0) {
+        struct timespec pause = {0, TRASH_PAUSE_US * 1000};
+        nanosleep(&pause, NULL);
+    }
+}
+
+// 删除目录树 path；返回 -1 表示有没能删除的内容，-2 表示服务器正在停止，下次启动后继续。
+// 用显式的栈代替递归，同时最多打开 TRASH_MAX_DEPTH 层目录；更深的子目录整个改名移到 path 下，
+// 当前这一遍读完 path 后从头再读一遍，任意深度的目录树都能删除
+static int remove_tree(const char *path, long *removed) {
+    remove_frame stack[TRASH_MAX_DEPTH];
+    int depth = 0, moved = 0, rc = 0;
+    unsigned deep_seq = 0;
+
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd == -1) return -1;
+    if (!(stack[0].d = fdopendir(fd))) {
+        close(fd);
+        return -1;
+    }
+    stack[0].failed = 0;
+
+    while (depth >= 0) {
+        remove_frame *f = &stack[depth];
+        if (__atomic_load_n(&trash_stopping, __ATOMIC_RELAXED)) {
+            rc = -2;
+            break;
+        }
+        struct dirent *e = readdir(f->d);
+        if (!e) {
+            if (depth == 0 && moved) {
+                moved = 0;
+                rewinddir(f->d);
+                continue;
+            }
+            // 这一层读完：关闭后在上一层中删除它
+            int failed = f->failed;
+            closedir(f->d);
+            if (depth-- == 0) {
+                if (failed || rmdir(path) == -1) rc = -1;
+                else ++*removed;
+            } else if (failed || unlinkat(dirfd(stack[depth].d), f->name, AT_REMOVEDIR) == -1) {
+                stack[depth].failed = 1;
+            } else {
+                remove_counted(removed);
+            }
+            continue;
+        }
+        if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0) continue;
+
+        int dfd = dirfd(f->d);
+        if (e->d_type != DT_DIR) {
+            if (unlinkat(dfd, e->d_name, 0) == 0) {
+                remove_counted(removed);
+                continue;
+            }
+            // d_type 不可用的文件系统上可能是目录
+            if (errno != EISDIR) {
+                f->failed = 1;
+                continue;
+            }
+        }
+
+        if (depth + 1 == TRASH_MAX_DEPTH) {
+            char deep[32];
+            int r;
+            do {
+                snprintf(deep, sizeof(deep), "%s%u", TRASH_DEEP_PREFIX, deep_seq++);
+                r = renameat2(dfd, e->d_name, dirfd(stack[0].d), deep, RENAME_NOREPLACE);
+            } while (r == -1 && errno == EEXIST);
+            if (r == 0) moved = 1;
+            else f->failed = 1;
+            continue;
+        }
+        int cfd = openat(dfd, e->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        DIR *cd = cfd == -1 ? NULL : fdopendir(cfd);
+        if (!cd) {
+            if (cfd != -1) close(cfd);
+            f->failed = 1;
+            continue;
+        }
+        f = &stack[++depth];
+        f->d = cd;
+        strcpy(f->name, e->d_name);
+        f->failed = 0;
+    }
+    while (depth >= 0) closedir(stack[depth--].d);  // 服务器正在停止
+    return rc;
+}
+
+static int is_reclaiming(const char *path) {
+    for (size_t i = 0; i < sizeof(reclaiming) / sizeof(reclaiming[0]); i++) {
+        if (strcmp(reclaiming[i], path) == 0) return 1;
+    }
+    return 0;
+}
+
+// 找到一个要删除的项目：上次没删完的 .reclaim-*，或者超过保留期的项目（先改名，不能再恢复）。
+// 调用时持有 trash_lock
+static int trash_claim(char *path, size_t size) {
+    DIR *root = opendir(TRASH_ROOT);
+    if (!root) return 0;
+    time_t now = time(NULL);
+    int found = 0;
+    struct dirent *u;
+    while (!found && (u = readdir(root)) != NULL) {
+        if (u->d_name[0] == '.') continue;
+        char dir[PATH_MAX];
+        if (trash_path(dir, sizeof(dir), "%s/%s", TRASH_ROOT, u->d_name) < 0) continue;
+        DIR *d = opendir(dir);
+        if (!d) continue;
+        struct dirent *e;
+        while (!found && (e = readdir(d)) != NULL) {
+            trash_info info;
+            if (strncmp(e->d_name, TRASH_RECLAIM_PREFIX, strlen(TRASH_RECLAIM_PREFIX)) == 0) {
+                found = trash_path(path, size, "%s/%s", dir, e->d_name) == 0 && !is_reclaiming(path);
+            } else if (e->d_name[0] != '.' && parse_entry(e->d_name, &info) == 0 && info.expires <= now) {
+                // 加上前缀后放不下的项留在原处，不改名
+                char src[PATH_MAX];
+                found = trash_path(src, sizeof(src), "%s/%s", dir, e->d_name) == 0 &&
+                        trash_path(path, size, "%s/%s%s", dir, TRASH_RECLAIM_PREFIX, e->d_name) == 0 &&
+                        rename(src, path) == 0;
+            }
+        }
+        closedir(d);
+    }
+    closedir(root);
+    return found;
+}
+
+static void *trash_main(void *arg) {
+    int slot = (int)(long)arg;
+    // 只在磁盘空闲时执行删除的 I/O
+    if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) == -1) {
+        log_warn("Failed to lower I/O priority of trash reclaimer: %s", strerror(errno));
+    }
+
+    pthread_mutex_lock(&trash_lock);
+    while (!trash_stopping) {
+        char path[PATH_MAX];
+        if (trash_claim(path, sizeof(path))) {
+            strcpy(reclaiming[slot], path);
+            pthread_mutex_unlock(&trash_lock);
+
+            long removed = 0;
+            int rc = remove_tree(path, &removed);
+            if (rc == 0) {
+                log_info("Reclaimed %s (%ld entries)", path, removed);
+            } else if (rc == -1) {
+                // 删不掉的目录改名，避免每次扫描都先选中它
+                char failed[PATH_MAX + 16];
+                char *base = strrchr(path, '/') + 1;
+                snprintf(failed, sizeof(failed), "%.*s%s%s", (int)(base - path), path, TRASH_FAILED_PREFIX,
+                         base + strlen(TRASH_RECLAIM_PREFIX));
+                rename(path, failed);
+                log_warn("Failed to reclaim %s, left as %s", path, failed);
+            }
+
+            pthread_mutex_lock(&trash_lock);
+            reclaiming[slot][0] = '\0';
+            continue;
+        }
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += TRASH_SCAN_MS / 1000;
+        ts.tv_nsec += (TRASH_SCAN_MS % 1000) * 1000000L;
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&trash_wake, &trash_lock, &ts);
+    }
+    pthread_mutex_unlock(&trash_lock);
+    return NULL;
+}
+
+int trash_start(int threads, long long retention_sec) {
+    retention = retention_sec;
+    if (threads > (int)(sizeof(trash_tids) / sizeof(trash_tids[0]))) threads = sizeof(trash_tids) / sizeof(trash_tids[0]);
+    for (int i = 0; i < threads; i++) {
+        if (pthread_create(&trash_tids[i], NULL, trash_main, (void *)(long)i) != 0) {
+            perror("pthread_create trash");
+            trash_stop();
+            return -1;
+        }
+        trash_nthreads++;
+    }
+    return 0;
+}
+
+void trash_stop(void) {
+    pthread_mutex_lock(&trash_lock);
+    __atomic_store_n(&trash_stopping, 1, __ATOMIC_RELAXED);
+    pthread_cond_broadcast(&trash_wake);
+    pthread_mutex_unlock(&trash_lock);
+    for (int i = 0; i < trash_nthreads; i++) pthread_join(trash_tids[i], NULL);
+    trash_nthreads = 0;
+}
@@ -0,0 +1,36 @@
+#ifndef TRASH_H
+#define TRASH_H
+
+// 项目回收站：删除项目只是把项目目录原子地改名到 ./trash/<用户>/<删除时间>-<序号>-<项目名>，
+// 会话立即返回；保留期内可以改名回工作空间撤销删除。
+// 后台回收线程定期找出超过保留期的项目，先改名为 .reclaim-<原名>（之后不能再恢复，
+// 服务器中途退出时下次启动继续删除），再删除整个目录树（显式的栈，不限深度）。回收线程使用 idle I/O 优先级，
+// 每删除一批文件暂停一下，不与用户的传输争抢磁盘；多个回收线程同时删除不同的项目。
+
+#include <time.h>
+
+#define TRASH_ROOT "./trash"
+#define TRASH_RETENTION_DEFAULT (24 * 3600)  // 默认保留期（秒）
+#define TRASH_THREADS 2                      // 回收线程数
+#define TRASH_SCAN_MS 10000                  // 检查过期项目的间隔
+#define TRASH_BATCH 256                      // 每删除这么多项暂停一次
+#define TRASH_PAUSE_US 2000
+#define TRASH_MAX_DEPTH 32                   // 删除时同时打开的目录层数，更深的子目录移到上层再删除
+
+typedef struct {
+    char project[128];
+    time_t deleted;
+    time_t expires;
+} trash_info;
+
+int trash_start(int threads, long long retention);
+void trash_stop(void);  // 正在删除的项目留到下次启动后继续
+
+// 把项目移入回收站，成功返回 0，失败返回 -1 并设置 errno
+int trash_move(const char *username, const char *project);
+// 按删除时间从新到旧列出最多 max 个可以恢复的项目，返回个数
+int trash_list(const char *username, trash_info *out, int max);
+// 恢复最近一次删除的同名项目：成功返回 0，回收站中没有返回 -1，工作空间中已有同名项目返回 -2
+int trash_restore(const char *username, const char *project);
+
+#endif
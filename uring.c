@@ -0,0 +1,210 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "uring.h"
+#include "log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, const void *arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+// 创建 io_uring 实例；内核不支持时返回 -1，调用方回退到 epoll
+int uring_init(uring_t *r) {
+    struct io_uring_params p;
+    memset(r, 0, sizeof(*r));
+    memset(&p, 0, sizeof(p));
+    r->ring_fd = r->event_fd = -1;
+
+    r->ring_fd = sys_io_uring_setup(URING_ENTRIES, &p);
+    if (r->ring_fd < 0) return -1;
+
+    r->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_size > r->sq_size) r->sq_size = r->cq_size;
+        r->cq_size = r->sq_size;
+    }
+
+    r->sq_ptr = mmap(NULL, r->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     r->ring_fd, IORING_OFF_SQ_RING);
+    if (r->sq_ptr == MAP_FAILED) goto fail;
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_ptr = r->sq_ptr;
+    } else {
+        r->cq_ptr = mmap(NULL, r->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         r->ring_fd, IORING_OFF_CQ_RING);
+        if (r->cq_ptr == MAP_FAILED) goto fail;
+    }
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   r->ring_fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) goto fail;
+
+    r->sq_head = (unsigned *)((char *)r->sq_ptr + p.sq_off.head);
+    r->sq_tail = (unsigned *)((char *)r->sq_ptr + p.sq_off.tail);
+    r->sq_mask = (unsigned *)((char *)r->sq_ptr + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)((char *)r->sq_ptr + p.sq_off.array);
+    r->sq_entries = p.sq_entries;
+    r->cq_head = (unsigned *)((char *)r->cq_ptr + p.cq_off.head);
+    r->cq_tail = (unsigned *)((char *)r->cq_ptr + p.cq_off.tail);
+    r->cq_mask = (unsigned *)((char *)r->cq_ptr + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)((char *)r->cq_ptr + p.cq_off.cqes);
+
+    // 注册缓冲区：READ_FIXED / WRITE_FIXED 不需要每次重新映射用户内存
+    r->bufs = mmap(NULL, (size_t)URING_BUF_COUNT * URING_BUF_SIZE, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (r->bufs == MAP_FAILED) {
+        r->bufs = NULL;
+        goto fail;
+    }
+    struct iovec iov[URING_BUF_COUNT];
+    for (int i = 0; i < URING_BUF_COUNT; i++) {
+        iov[i].iov_base = r->bufs + (size_t)i * URING_BUF_SIZE;
+        iov[i].iov_len = URING_BUF_SIZE;
+        r->buf_free[r->buf_free_count++] = URING_BUF_COUNT - 1 - i;
+    }
+    if (sys_io_uring_register(r->ring_fd, IORING_REGISTER_BUFFERS, iov, URING_BUF_COUNT) < 0) goto fail;
+
+    // 稀疏的注册文件表，传输开始时填入 socket 和文件
+    int fds[URING_FILE_COUNT];
+    for (int i = 0; i < URING_FILE_COUNT; i++) {
+        fds[i] = -1;
+        r->file_free[r->file_free_count++] = URING_FILE_COUNT - 1 - i;
+    }
+    if (sys_io_uring_register(r->ring_fd, IORING_REGISTER_FILES, fds, URING_FILE_COUNT) < 0) goto fail;
+
+    r->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (r->event_fd < 0) goto fail;
+    if (sys_io_uring_register(r->ring_fd, IORING_REGISTER_EVENTFD, &r->event_fd, 1) < 0) goto fail;
+
+    return 0;
+
+fail:
+    {
+        int saved = errno;
+        uring_exit(r);
+        errno = saved;
+    }
+    return -1;
+}
+
+void uring_exit(uring_t *r) {
+    if (r->sqes && r->sqes != MAP_FAILED) munmap(r->sqes, r->sqes_size);
+    if (r->cq_ptr && r->cq_ptr != MAP_FAILED && r->cq_ptr != r->sq_ptr) munmap(r->cq_ptr, r->cq_size);
+    if (r->sq_ptr && r->sq_ptr != MAP_FAILED) munmap(r->sq_ptr, r->sq_size);
+    if (r->bufs) munmap(r->bufs, (size_t)URING_BUF_COUNT * URING_BUF_SIZE);
+    if (r->event_fd >= 0) close(r->event_fd);
+    if (r->ring_fd >= 0) close(r->ring_fd);
+    memset(r, 0, sizeof(*r));
+    r->ring_fd = r->event_fd = -1;
+}
+
+// 取一个空闲的 sqe，提交队列已满时先把已填写的提交给内核
+struct io_uring_sqe *uring_get_sqe(uring_t *r) {
+    unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    if (r->sqe_tail - head >= r->sq_entries) {
+        uring_submit(r);
+        head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+        if (r->sqe_tail - head >= r->sq_entries) return NULL;
+    }
+    struct io_uring_sqe *sqe = &r->sqes[r->sqe_tail & *r->sq_mask];
+    r->sqe_tail++;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+unsigned uring_pending(const uring_t *r) {
+    return r->sqe_tail - r->sqe_head;
+}
+
+// 一次系统调用提交所有已填写的 sqe
+int uring_submit(uring_t *r) {
+    unsigned to_submit = r->sqe_tail - r->sqe_head;
+    if (to_submit == 0) return 0;
+
+    unsigned tail = *r->sq_tail;
+    unsigned mask = *r->sq_mask;
+    while (r->sqe_head != r->sqe_tail) {
+        r->sq_array[tail & mask] = r->sqe_head & mask;
+        tail++;
+        r->sqe_head++;
+    }
+    __atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+
+    int ret;
+    do {
+        ret = sys_io_uring_enter(r->ring_fd, to_submit, 0, 0);
+    } while (ret < 0 && errno == EINTR);
+    if (ret < 0) log_warn("io_uring_enter failed: %s", strerror(errno));
+    return ret;
+}
+
+void uring_for_each_cqe(uring_t *r, void (*fn)(uring_t *r, struct io_uring_cqe *cqe, void *arg), void *arg) {
+    eventfd_t value;
+    eventfd_read(r->event_fd, &value);
+
+    unsigned head = *r->cq_head;
+    for (;;) {
+        unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+        if (head == tail) break;
+        struct io_uring_cqe cqe = r->cqes[head & *r->cq_mask];
+        head++;
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+        fn(r, &cqe, arg);
+    }
+}
+
+int uring_buf_alloc(uring_t *r) {
+    if (r->buf_free_count == 0) return -1;
+    return r->buf_free[--r->buf_free_count];
+}
+
+void uring_buf_free(uring_t *r, int idx) {
+    if (idx >= 0) r->buf_free[r->buf_free_count++] = idx;
+}
+
+char *uring_buf(uring_t *r, int idx) {
+    return r->bufs + (size_t)idx * URING_BUF_SIZE;
+}
+
+static int uring_files_update(uring_t *r, int slot, int fd) {
+    struct io_uring_files_update up;
+    memset(&up, 0, sizeof(up));
+    up.offset = slot;
+    up.fds = (unsigned long)&fd;
+    return sys_io_uring_register(r->ring_fd, IORING_REGISTER_FILES_UPDATE, &up, 1);
+}
+
+int uring_file_register(uring_t *r, int fd) {
+    if (r->file_free_count == 0) return -1;
+    int slot = r->file_free[--r->file_free_count];
+    if (uring_files_update(r, slot, fd) < 0) {
+        r->file_free[r->file_free_count++] = slot;
+        return -1;
+    }
+    return slot;
+}
+
+void uring_file_unregister(uring_t *r, int slot) {
+    if (slot < 0) return;
+    uring_files_update(r, slot, -1);
+    r->file_free[r->file_free_count++] = slot;
+}
@@ -0,0 +1,69 @@
+#ifndef URING_H
+#define URING_H
+
+// 基于原始系统调用的最小 io_uring 封装：提交/完成队列、注册缓冲区、注册文件表
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+
+#define URING_ENTRIES 256          // 提交队列长度
+#define URING_BUF_COUNT 16         // 每个工作线程注册的缓冲区个数
+#define URING_BUF_SIZE (256 * 1024) // 每个注册缓冲区的大小
+#define URING_FILE_COUNT 256       // 注册文件表的大小
+
+typedef struct {
+    int ring_fd;
+    int event_fd;              // 有完成事件时可读，注册到工作线程的 epoll 中
+
+    // 提交队列
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    struct io_uring_sqe *sqes;
+    unsigned sqe_head;         // 已经交给内核的 sqe
+    unsigned sqe_tail;         // 已经填写的 sqe
+
+    // 完成队列
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ptr;
+    size_t sq_size;
+    void *cq_ptr;
+    size_t cq_size;
+    size_t sqes_size;
+
+    // 注册缓冲区
+    char *bufs;
+    int buf_free[URING_BUF_COUNT];
+    int buf_free_count;
+
+    // 注册文件表
+    int file_free[URING_FILE_COUNT];
+    int file_free_count;
+} uring_t;
+
+int uring_init(uring_t *r);
+void uring_exit(uring_t *r);
+
+struct io_uring_sqe *uring_get_sqe(uring_t *r);
+int uring_submit(uring_t *r);
+unsigned uring_pending(const uring_t *r);
+
+// 依次处理已完成的请求
+void uring_for_each_cqe(uring_t *r, void (*fn)(uring_t *r, struct io_uring_cqe *cqe, void *arg), void *arg);
+
+// 注册缓冲区：返回下标，没有空闲缓冲区时返回 -1
+int uring_buf_alloc(uring_t *r);
+void uring_buf_free(uring_t *r, int idx);
+char *uring_buf(uring_t *r, int idx);
+
+// 注册文件表：返回槽位，表已满时返回 -1
+int uring_file_register(uring_t *r, int fd);
+void uring_file_unregister(uring_t *r, int slot);
+
+#endif
@@ -0,0 +1,815 @@
+#include "server.h"
+#include "version.h"
+#include "store.h"
+#include "cdc.h"
+#include "xxhash.h"
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+#define VERSION_MANIFEST_SUFFIX ".m"
+#define VERSION_HEADER_SIZE 8       // 清单文件开头：8 字节文件大小（网络字节序），之后是清单项
+#define VERSION_READ_SIZE (2 * CDC_MAX_SIZE)
+#define VERSION_PATH_FILE ".path"   // 版本目录中记录文件在工作空间中的路径
+#define VERSION_GONE_FILE ".gone"   // 发现文件已经不在工作空间时创建，修改时间即发现的时间
+
+static int clone_supported = 1;     // 第一次 FICLONE 失败后不再尝试，直接使用分块
+static pthread_once_t cdc_once = PTHREAD_ONCE_INIT;
+
+// 版本线程的任务。文件在调用方的线程上打开：之后文件被改名替换时任务仍然读取原来的内容，
+// 原地追加时只读取 size 之前的部分，与提交任务时的内容一致
+enum { VERSION_JOB_BASELINE, VERSION_JOB_COMMIT, VERSION_JOB_MANIFEST };
+
+typedef struct version_job {
+    int kind;
+    char username[128];
+    char path[PATH_MAX];
+    int fd;                         // BASELINE / COMMIT：要记录的文件
+    long long size;                 // 文件的长度：BASELINE / COMMIT 只记录这之前的内容
+    unsigned char *manifest;        // MANIFEST：清单的副本
+    uint32_t count;
+    struct version_job *next;
+} version_job;
+
+// 同一个文件的任务按路径哈希交给同一个线程，按提交的顺序执行
+typedef struct {
+    pthread_t tid;
+    version_job *head;
+    version_job *tail;
+} version_worker;
+
+static version_worker version_workers[VERSION_THREADS_MAX];
+static int version_nthreads;        // 为 0 时（未启动或已经停止）在调用方的线程上执行
+static int version_stopping;
+static int version_queued;
+static pthread_mutex_t version_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t version_wake = PTHREAD_COND_INITIALIZER;   // 有新的任务或正在停止
+static pthread_cond_t version_space = PTHREAD_COND_INITIALIZER;  // 队列中有了空位
+static int version_dropping;        // 正在因为队列已满放弃工作线程的任务，只记录一次警告
+static __thread int version_nowait; // 本线程（工作线程）提交任务时不等待
+static long long version_orphan_age; // 文件离开工作空间多久之后删除它的历史
+
+// 版本目录：./versions/<用户>/<路径的 XXH64>
+static void version_dir(char *dir, size_t size, const char *username, const char *path) {
+    snprintf(dir, size, "%s/%s/%016llx", VERSION_ROOT, username,
+             (unsigned long long)xxh64(path, strlen(path)));
+}
+
+static int make_dirs(const char *dir) {
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s", dir);
+    for (char *p = tmp + 1; *p; p++) {
+        if (*p != '/') continue;
+        *p = '\0';
+        if (mkdir(tmp, 0755) == -1 && errno != EEXIST) return -1;
+        *p = '/';
+    }
+    return mkdir(tmp, 0755) == -1 && errno != EEXIST ? -1 : 0;
+}
+
+// 版本文件名中的编号，不是版本文件时返回 0
+static int entry_number(const char *name, int *kind) {
+    char *end;
+    long n = strtol(name, &end, 10);
+    if (end == name || n <= 0 || n > INT32_MAX) return 0;
+    if (*end == '\0') {
+        *kind = VERSION_CLONE;
+    } else if (strcmp(end, VERSION_MANIFEST_SUFFIX) == 0) {
+        *kind = VERSION_CHUNKS;
+    } else {
+        return 0;
+    }
+    return (int)n;
+}
+
+// 统计目录中的版本：最大编号、最小编号和个数
+static int version_scan(const char *dir, int *max, int *min) {
+    *max = 0;
+    *min = 0;
+    DIR *d = opendir(dir);
+    if (!d) return 0;
+    int count = 0, kind;
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL) {
+        int n = entry_number(e->d_name, &kind);
+        if (n == 0) continue;
+        count++;
+        if (n > *max) *max = n;
+        if (*min == 0 || n < *min) *min = n;
+    }
+    closedir(d);
+    return count;
+}
+
+// 版本文件的路径，放不下时返回 -1，调用方不使用截断的路径
+static int entry_path(char *out, size_t size, const char *dir, int number, int kind) {
+    int n = snprintf(out, size, "%s/%d%s", dir, number, kind == VERSION_CHUNKS ? VERSION_MANIFEST_SUFFIX : "");
+    return n >= 0 && (size_t)n < size ? 0 : -1;
+}
+
+// 保留最新的 VERSION_KEEP 个版本，返回删除的清单版本数；块存储中的块可能被其他版本引用，
+// 由 version_gc 统一回收
+static int version_prune(const char *dir) {
+    int max, min, manifests = 0;
+    int count = version_scan(dir, &max, &min);
+    for (int n = min; count > VERSION_KEEP && n <= max; n++) {
+        char path[PATH_MAX];
+        if (entry_path(path, sizeof(path), dir, n, VERSION_CLONE) < 0) break;
+        if (unlink(path) == 0) {
+            count--;
+            continue;
+        }
+        if (entry_path(path, sizeof(path), dir, n, VERSION_CHUNKS) == 0 && unlink(path) == 0) {
+            count--;
+            manifests++;
+        }
+    }
+    return manifests;
+}
+
+// 以 O_EXCL 创建下一个编号的版本文件，同时写入同一个文件的其他会话取到不同的编号
+static int version_create(const char *dir, int kind, int *number, char *path, size_t size) {
+    int max, min;
+    version_scan(dir, &max, &min);
+    for (int n = max + 1; n < max + 64; n++) {
+        if (entry_path(path, size, dir, n, kind) < 0) {
+            errno = ENAMETOOLONG;
+            break;
+        }
+        int fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0444);
+        if (fd != -1) {
+            *number = n;
+            return fd;
+        }
+        if (errno != EEXIST) break;
+    }
+    log_warn("Failed to create version in %s: %s", dir, strerror(errno));
+    return -1;
+}
+
+// 最新的版本是内容相同的清单时返回它的编号，重复上传同样的内容不增加版本
+static int latest_same(const char *dir, const unsigned char *manifest, size_t len, uint64_t be_size) {
+    char path[PATH_MAX];
+    int max, min;
+    if (version_scan(dir, &max, &min) == 0) return 0;
+    if (entry_path(path, sizeof(path), dir, max, VERSION_CHUNKS) < 0) return 0;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return 0;
+    struct stat st;
+    int same = fstat(fd, &st) == 0 && (size_t)st.st_size == VERSION_HEADER_SIZE + len;
+    if (same) {
+        unsigned char *old = malloc(st.st_size);
+        same = old && pread(fd, old, st.st_size, 0) == st.st_size &&
+               memcmp(old, &be_size, VERSION_HEADER_SIZE) == 0 &&
+               memcmp(old + VERSION_HEADER_SIZE, manifest, len) == 0;
+        free(old);
+    }
+    close(fd);
+    return same ? max : 0;
+}
+
+// 写入清单版本：[8 字节文件大小][清单项]
+static int write_manifest(const char *dir, const unsigned char *manifest, uint32_t count, long long size) {
+    char path[PATH_MAX];
+    int number;
+    uint64_t be_size = htobe64((uint64_t)size);
+    size_t len = (size_t)count * CDC_ENTRY_SIZE;
+    int latest = latest_same(dir, manifest, len, be_size);
+    if (latest > 0) return latest;
+
+    int fd = version_create(dir, VERSION_CHUNKS, &number, path, sizeof(path));
+    if (fd == -1) return -1;
+
+    if (write(fd, &be_size, sizeof(be_size)) != sizeof(be_size) ||
+        (len > 0 && write(fd, manifest, len) != (ssize_t)len)) {
+        log_warn("Failed to write version in %s: %s", dir, strerror(errno));
+        close(fd);
+        unlink(path);
+        return -1;
+    }
+    close(fd);
+    return number;
+}
+
+// 用 FICLONE 克隆出新版本，截断到 size（之后追加的内容不属于这个版本）；
+// 文件系统不支持时返回 -2，由调用方改用分块
+static int commit_clone(const char *dir, int src, long long size) {
+    char path[PATH_MAX];
+    int number;
+    int fd = version_create(dir, VERSION_CLONE, &number, path, sizeof(path));
+    if (fd == -1) return -1;
+    if (ioctl(fd, FICLONE, src) == 0) {
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > size && ftruncate(fd, size) == -1) {
+            log_warn("Failed to truncate version %s: %s", path, strerror(errno));
+            close(fd);
+            unlink(path);
+            return -1;
+        }
+        close(fd);
+        return number;
+    }
+    int err = errno;
+    close(fd);
+    unlink(path);
+    if (err == EOPNOTSUPP || err == ENOTTY || err == EINVAL || err == EXDEV || err == EPERM) {
+        __atomic_store_n(&clone_supported, 0, __ATOMIC_RELAXED);
+        log_info("Reflink not supported (%s), versions are stored as chunk manifests", strerror(err));
+        return -2;
+    }
+    log_warn("Failed to clone version %s: %s", path, strerror(err));
+    return -1;
+}
+
+// 按内容定义分块切开文件的前 limit 字节，块写入块存储，清单作为新版本。用 pread 读取而不是 mmap：
+// 其他会话同时截断文件时只会读到较短的内容，不会收到 SIGBUS
+static int commit_chunks(const char *username, const char *dir, int src, long long limit) {
+    unsigned char *buf = pool_alloc(VERSION_READ_SIZE);
+    if (!buf) return -1;
+    pthread_once(&cdc_once, cdc_init);
+
+    uint32_t count = 0, cap = 0;
+    unsigned char *manifest = NULL;
+    size_t have = 0;
+    long long size = 0;
+    int eof = 0, rc = 0;
+    while (rc == 0) {
+        // 缓冲区中不足一个最大块时先补充，切点与一次读入整个文件时一致
+        if (!eof && have < CDC_MAX_SIZE) {
+            long long left = limit - size - (long long)have;
+            size_t want = VERSION_READ_SIZE - have;
+            if (left < (long long)want) want = left > 0 ? (size_t)left : 0;
+            ssize_t n = want > 0 ? pread(src, buf + have, want, size + have) : 0;
+            if (n == -1 && errno == EINTR) continue;
+            if (n == -1) {
+                log_warn("Failed to read file for version in %s: %s", dir, strerror(errno));
+                rc = -1;
+            }
+            if (n <= 0) eof = 1;
+            else have += n;
+            continue;
+        }
+        if (have == 0) break;
+
+        size_t len = cdc_cut(buf, have);
+        if (count == cap) {
+            cap = cap ? cap * 2 : 64;
+            unsigned char *m = realloc(manifest, (size_t)cap * CDC_ENTRY_SIZE);
+            if (!m) {
+                rc = -1;
+                break;
+            }
+            manifest = m;
+        }
+        unsigned char *entry = manifest + (size_t)count * CDC_ENTRY_SIZE;
+        uint32_t be_len = htonl((uint32_t)len);
+        memcpy(entry + CDC_HASH_SIZE, &be_len, 4);
+        rc = store_add_chunk(username, buf, len, entry);
+        count++;
+        size += len;
+        have -= len;
+        memmove(buf, buf + len, have);
+    }
+    pool_free(buf, VERSION_READ_SIZE);
+
+    int number = rc == 0 ? write_manifest(dir, manifest, count, size) : -1;
+    free(manifest);
+    return number;
+}
+
+// 读出清单版本中的清单项
+static unsigned char *read_manifest(int in, uint32_t *count, long long *size) {
+    struct stat st;
+    uint64_t be_size;
+    if (fstat(in, &st) == -1 || st.st_size < VERSION_HEADER_SIZE ||
+        (st.st_size - VERSION_HEADER_SIZE) % CDC_ENTRY_SIZE != 0 ||
+        pread(in, &be_size, sizeof(be_size), 0) != sizeof(be_size)) {
+        return NULL;
+    }
+    size_t len = st.st_size - VERSION_HEADER_SIZE;
+    unsigned char *manifest = malloc(len ? len : 1);
+    if (manifest && pread(in, manifest, len, VERSION_HEADER_SIZE) != (ssize_t)len) {
+        free(manifest);
+        return NULL;
+    }
+    *count = len / CDC_ENTRY_SIZE;
+    *size = (long long)be64toh(be_size);
+    return manifest;
+}
+
+// 版本清单引用的块的集合：开放寻址的哈希表，槽为全 0 时表示空
+typedef struct {
+    unsigned char *slots;           // cap 个 CDC_HASH_SIZE 字节的槽
+    size_t cap;
+    size_t count;
+} chunk_set;
+
+static const unsigned char empty_slot[CDC_HASH_SIZE];
+
+static size_t chunk_slot(const chunk_set *set, const unsigned char *hash) {
+    uint64_t h;
+    memcpy(&h, hash, sizeof(h));    // SHA-256 本身分布均匀
+    size_t i = h & (set->cap - 1);
+    for (;;) {
+        const unsigned char *slot = set->slots + i * CDC_HASH_SIZE;
+        if (memcmp(slot, hash, CDC_HASH_SIZE) == 0 || memcmp(slot, empty_slot, CDC_HASH_SIZE) == 0) return i;
+        i = (i + 1) & (set->cap - 1);
+    }
+}
+
+static int chunk_set_add(chunk_set *set, const unsigned char *hash) {
+    if ((set->count + 1) * 2 > set->cap) {
+        chunk_set grown = {NULL, set->cap ? set->cap * 2 : 4096, set->count};
+        if (!(grown.slots = calloc(grown.cap, CDC_HASH_SIZE))) return -1;
+        for (size_t i = 0; i < set->cap; i++) {
+            const unsigned char *slot = set->slots + i * CDC_HASH_SIZE;
+            if (memcmp(slot, empty_slot, CDC_HASH_SIZE) == 0) continue;
+            memcpy(grown.slots + chunk_slot(&grown, slot) * CDC_HASH_SIZE, slot, CDC_HASH_SIZE);
+        }
+        free(set->slots);
+        *set = grown;
+    }
+    unsigned char *slot = set->slots + chunk_slot(set, hash) * CDC_HASH_SIZE;
+    if (memcmp(slot, hash, CDC_HASH_SIZE) != 0) {
+        memcpy(slot, hash, CDC_HASH_SIZE);
+        set->count++;
+    }
+    return 0;
+}
+
+static int chunk_set_has(void *arg, const unsigned char *hash) {
+    chunk_set *set = arg;
+    if (set->cap == 0) return 0;
+    return memcmp(set->slots + chunk_slot(set, hash) * CDC_HASH_SIZE, hash, CDC_HASH_SIZE) == 0;
+}
+
+// 标记：把一个版本目录中所有清单引用的块加入集合。读不出的清单让整次回收放弃，宁可不删
+static int mark_dir(chunk_set *set, int dfd) {
+    DIR *d = fdopendir(dfd);
+    if (!d) {
+        close(dfd);
+        return -1;
+    }
+    int rc = 0;
+    struct dirent *ent;
+    while (rc == 0 && (ent = readdir(d)) != NULL) {
+        int kind;
+        if (entry_number(ent->d_name, &kind) <= 0 || kind != VERSION_CHUNKS) continue;
+        int in = openat(dirfd(d), ent->d_name, O_RDONLY | O_CLOEXEC);
+        if (in == -1) {
+            if (errno != ENOENT) rc = -1;  // 同时被删除的版本不需要标记
+            continue;
+        }
+        uint32_t count;
+        long long size;
+        unsigned char *manifest = read_manifest(in, &count, &size);
+        close(in);
+        if (!manifest) {
+            rc = -1;
+            break;
+        }
+        for (uint32_t i = 0; rc == 0 && i < count; i++) rc = chunk_set_add(set, manifest + (size_t)i * CDC_ENTRY_SIZE);
+        free(manifest);
+    }
+    closedir(d);
+    return rc;
+}
+
+// 回收用户的块存储中不再被任何版本引用的块。同一时间只有一个线程回收，
+// 每个用户最多每 VERSION_GC_INTERVAL 秒一次，上次回收的时间记录在块存储中的时间戳文件上
+static pthread_mutex_t gc_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void version_gc(const char *username) {
+    char root[PATH_MAX], stamp[PATH_MAX];
+    struct stat st;
+    if ((size_t)snprintf(root, sizeof(root), "%s/%s", VERSION_ROOT, username) >= sizeof(root) ||
+        (size_t)snprintf(stamp, sizeof(stamp), "%s/%s/.swept", STORE_ROOT, username) >= sizeof(stamp)) {
+        return;
+    }
+    if (stat(stamp, &st) == 0 && st.st_mtime > time(NULL) - VERSION_GC_INTERVAL) return;
+    if (pthread_mutex_trylock(&gc_lock) != 0) return;  // 另一个线程正在回收，下次再说
+
+    chunk_set set = {NULL, 0, 0};
+    int rc = 0;
+    DIR *d = opendir(root);
+    if (!d) rc = -1;
+    struct dirent *ent;
+    while (rc == 0 && (ent = readdir(d)) != NULL) {
+        if (ent->d_name[0] == '.') continue;
+        int dfd = openat(dirfd(d), ent->d_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dfd == -1) {
+            if (errno != ENOENT) rc = -1;
+            continue;
+        }
+        rc = mark_dir(&set, dfd);
+    }
+    if (d) closedir(d);
+
+    if (rc == 0) {
+        int removed = store_sweep(username, chunk_set_has, &set, VERSION_GC_GRACE);
+        if (removed > 0) log_info("Reclaimed %d unreferenced chunks of %s", removed, username);
+        int fd = open(stamp, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+        if (fd != -1) {
+            futimens(fd, NULL);
+            close(fd);
+        }
+    } else {
+        log_warn("Chunk reclaim skipped for %s: failed to read versions in %s", username, root);
+    }
+    free(set.slots);
+    pthread_mutex_unlock(&gc_lock);
+}
+
+// 版本目录中记下它属于哪个路径（目录名只是哈希），清理时据此判断文件是否还在工作空间中
+static void record_path(const char *dir, const char *path) {
+    char file[PATH_MAX];
+    if ((size_t)snprintf(file, sizeof(file), "%s/%s", dir, VERSION_PATH_FILE) >= sizeof(file)) return;
+    int fd = open(file, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd == -1) return;  // 已经记下（EEXIST）
+    size_t len = strlen(path);
+    if (write(fd, path, len) != (ssize_t)len) unlinkat(AT_FDCWD, file, 0);  // 不完整的记录不如没有
+    close(fd);
+}
+
+// 删除版本目录中的所有文件和目录本身
+static int remove_dir(int parent, const char *name) {
+    int dfd = openat(parent, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dfd == -1) return -1;
+    DIR *d = fdopendir(dfd);
+    if (!d) {
+        close(dfd);
+        return -1;
+    }
+    struct dirent *ent;
+    while ((ent = readdir(d)) != NULL) {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) continue;
+        unlinkat(dirfd(d), ent->d_name, 0);
+    }
+    closedir(d);
+    return unlinkat(parent, name, AT_REMOVEDIR);
+}
+
+// 检查一个版本目录的文件是否还在工作空间中：第一次发现不在时创建 .gone 标记，
+// 文件又出现时（从回收站恢复、重新上传）删除标记；标记存在超过 version_orphan_age 秒后删除
+// 整个目录。没有 .path 的目录（记录路径之前创建的）无法判断，保留。删除目录返回 1
+static int check_orphan(int root, const char *name) {
+    char sub[PATH_MAX], path[PATH_MAX];
+    snprintf(sub, sizeof(sub), "%s/%s", name, VERSION_PATH_FILE);
+    int fd = openat(root, sub, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return 0;
+    ssize_t n = read(fd, path, sizeof(path) - 1);
+    close(fd);
+    if (n <= 0) return 0;
+    path[n] = '\0';
+
+    struct stat st;
+    snprintf(sub, sizeof(sub), "%s/%s", name, VERSION_GONE_FILE);
+    if (stat(path, &st) == 0) {
+        unlinkat(root, sub, 0);
+        return 0;
+    }
+    if (errno != ENOENT && errno != ENOTDIR) return 0;
+    if (fstatat(root, sub, &st, 0) == -1) {
+        fd = openat(root, sub, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+        if (fd != -1) close(fd);
+        return 0;
+    }
+    if (st.st_mtime > time(NULL) - version_orphan_age) return 0;
+    if (access(path, F_OK) == 0) return 0;  // 刚好重新出现
+    if (remove_dir(root, name) == -1) {
+        log_warn("Failed to remove history of %s: %s", path, strerror(errno));
+        return 0;
+    }
+    log_info("Removed history of %s, gone from the workspace", path);
+    return 1;
+}
+
+// 删除用户已经不存在的文件的历史，之后立即回收它们的清单引用的块
+static void version_orphans(const char *username) {
+    char root[PATH_MAX], stamp[PATH_MAX];
+    if ((size_t)snprintf(root, sizeof(root), "%s/%s", VERSION_ROOT, username) >= sizeof(root) ||
+        (size_t)snprintf(stamp, sizeof(stamp), "%s/%s/.swept", STORE_ROOT, username) >= sizeof(stamp)) {
+        return;
+    }
+    DIR *d = opendir(root);
+    if (!d) return;
+    int removed = 0;
+    struct dirent *ent;
+    while ((ent = readdir(d)) != NULL) {
+        if (ent->d_name[0] != '.') removed += check_orphan(dirfd(d), ent->d_name);
+    }
+    closedir(d);
+    // 删除了目录就不等回收的间隔；上次因为另一个线程正在回收而没有执行时，时间戳仍然不存在
+    if (removed > 0) unlink(stamp);
+    if (access(stamp, F_OK) == -1 && errno == ENOENT) version_gc(username);
+}
+
+// 对所有用户执行 version_orphans，由第一个版本线程每 VERSION_ORPHAN_SCAN 秒执行一次
+static void version_orphans_all(void) {
+    DIR *d = opendir(VERSION_ROOT);
+    if (!d) return;
+    struct dirent *ent;
+    while ((ent = readdir(d)) != NULL) {
+        if (ent->d_name[0] != '.' && ent->d_type != DT_REG) version_orphans(ent->d_name);
+    }
+    closedir(d);
+}
+
+// 记录 src 的前 size 字节为新版本，返回版本号，失败返回 -1
+static int commit_fd(const char *username, const char *dir, int src, long long size) {
+    int number = -2;
+    if (__atomic_load_n(&clone_supported, __ATOMIC_RELAXED)) number = commit_clone(dir, src, size);
+    if (number == -2) number = commit_chunks(username, dir, src, size);
+    return number;
+}
+
+// 在版本线程上执行一个任务；BASELINE 在执行时检查，已经有历史的文件不再记录
+static void version_run(version_job *job) {
+    char dir[PATH_MAX];
+    int max, min;
+    version_dir(dir, sizeof(dir), job->username, job->path);
+    if (job->kind == VERSION_JOB_BASELINE && version_scan(dir, &max, &min) > 0) return;
+    if (make_dirs(dir) == -1) {
+        log_warn("Failed to create version directory %s: %s", dir, strerror(errno));
+        return;
+    }
+    record_path(dir, job->path);
+    int number = job->kind == VERSION_JOB_MANIFEST ? write_manifest(dir, job->manifest, job->count, job->size)
+                                                    : commit_fd(job->username, dir, job->fd, job->size);
+    if (number <= 0) log_warn("Failed to record version of %s", job->path);
+    else if (version_prune(dir) > 0) version_gc(job->username);
+}
+
+static void version_job_free(version_job *job) {
+    if (job->fd != -1) close(job->fd);
+    free(job->manifest);
+    free(job);
+}
+
+static void *version_main(void *arg) {
+    version_worker *vw = arg;
+    int scanner = vw == &version_workers[0];  // 第一个线程同时负责定期清理
+    time_t next_scan = time(NULL) + VERSION_ORPHAN_SCAN;
+    pthread_mutex_lock(&version_lock);
+    for (;;) {
+        while (!vw->head && !version_stopping) {
+            if (!scanner) {
+                pthread_cond_wait(&version_wake, &version_lock);
+                continue;
+            }
+            struct timespec ts = {next_scan, 0};
+            if (pthread_cond_timedwait(&version_wake, &version_lock, &ts) != ETIMEDOUT) continue;
+            pthread_mutex_unlock(&version_lock);
+            version_orphans_all();
+            next_scan = time(NULL) + VERSION_ORPHAN_SCAN;
+            pthread_mutex_lock(&version_lock);
+        }
+        if (!vw->head) break;  // 停止时先处理完自己队列中的任务
+        version_job *job = vw->head;
+        vw->head = job->next;
+        if (!vw->head) vw->tail = NULL;
+        version_queued--;
+        pthread_cond_broadcast(&version_space);
+        pthread_mutex_unlock(&version_lock);
+
+        version_run(job);
+        version_job_free(job);
+
+        pthread_mutex_lock(&version_lock);
+    }
+    pthread_mutex_unlock(&version_lock);
+    return NULL;
+}
+
+void version_no_wait(int on) {
+    version_nowait = on;
+}
+
+// 把任务交给负责这个路径的版本线程，没有版本线程时直接执行；积压到 VERSION_QUEUE_MAX 时
+// 其他线程等待，工作线程的事件循环不能停下，放弃这个版本
+static void version_submit(version_job *job) {
+    pthread_mutex_lock(&version_lock);
+    if (version_nowait && version_nthreads > 0 && version_queued >= VERSION_QUEUE_MAX) {
+        int first = !version_dropping;
+        version_dropping = 1;
+        pthread_mutex_unlock(&version_lock);
+        if (first) log_warn("Version queue full, skipping new versions until it drains (first: %s)", job->path);
+        version_job_free(job);
+        return;
+    }
+    while (version_nthreads > 0 && version_queued >= VERSION_QUEUE_MAX) {
+        pthread_cond_wait(&version_space, &version_lock);
+    }
+    version_dropping = 0;
+    if (version_nthreads == 0) {
+        pthread_mutex_unlock(&version_lock);
+        version_run(job);
+        version_job_free(job);
+        return;
+    }
+    version_worker *vw = &version_workers[xxh64(job->path, strlen(job->path)) % version_nthreads];
+    if (vw->tail) vw->tail->next = job;
+    else vw->head = job;
+    vw->tail = job;
+    version_queued++;
+    pthread_cond_broadcast(&version_wake);
+    pthread_mutex_unlock(&version_lock);
+}
+
+static version_job *version_job_new(int kind, const char *username, const char *path) {
+    version_job *job = calloc(1, sizeof(*job));
+    if (!job) return NULL;
+    if (snprintf(job->username, sizeof(job->username), "%s", username) >= (int)sizeof(job->username) ||
+        snprintf(job->path, sizeof(job->path), "%s", path) >= (int)sizeof(job->path)) {
+        free(job);
+        return NULL;
+    }
+    job->kind = kind;
+    job->fd = -1;
+    return job;
+}
+
+// 提交记录 fd 当前内容的任务，fd 交给任务关闭
+static void version_submit_fd(int kind, const char *username, const char *path, int fd) {
+    struct stat st;
+    version_job *job = NULL;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) job = version_job_new(kind, username, path);
+    if (!job) {
+        close(fd);
+        return;
+    }
+    job->fd = fd;
+    job->size = st.st_size;
+    version_submit(job);
+}
+
+void version_commit(const char *username, const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd != -1) version_submit_fd(VERSION_JOB_COMMIT, username, path, fd);
+}
+
+void version_commit_manifest(const char *username, const char *path, const unsigned char *manifest,
+                             uint32_t count, long long size) {
+    version_job *job = version_job_new(VERSION_JOB_MANIFEST, username, path);
+    if (!job) return;
+    size_t len = (size_t)count * CDC_ENTRY_SIZE;
+    if (!(job->manifest = malloc(len ? len : 1))) {
+        free(job);
+        return;
+    }
+    memcpy(job->manifest, manifest, len);
+    job->count = count;
+    job->size = size;
+    version_submit(job);
+}
+
+void version_baseline(const char *username, const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd != -1) version_submit_fd(VERSION_JOB_BASELINE, username, path, fd);
+}
+
+// 改名之前打开原来的文件，改名后它的内容仍然可以作为基线版本读取
+int version_replace(const char *username, const char *part, const char *path) {
+    int old = open(path, O_RDONLY | O_CLOEXEC);
+    if (rename(part, path) == -1) {
+        int err = errno;
+        if (old != -1) close(old);
+        errno = err;
+        return -1;
+    }
+    if (old != -1) version_submit_fd(VERSION_JOB_BASELINE, username, path, old);
+    version_commit(username, path);
+    return 0;
+}
+
+int version_start(int threads, long long trash_retention) {
+    if (threads > VERSION_THREADS_MAX) threads = VERSION_THREADS_MAX;
+    version_orphan_age = trash_retention + VERSION_ORPHAN_GRACE;
+    pthread_mutex_lock(&version_lock);
+    for (int i = 0; i < threads; i++) {
+        if (pthread_create(&version_workers[i].tid, NULL, version_main, &version_workers[i]) != 0) {
+            pthread_mutex_unlock(&version_lock);
+            perror("pthread_create version");
+            version_stop();
+            return -1;
+        }
+        version_nthreads++;
+    }
+    pthread_mutex_unlock(&version_lock);
+    return 0;
+}
+
+void version_stop(void) {
+    pthread_mutex_lock(&version_lock);
+    version_stopping = 1;
+    int n = version_nthreads;
+    pthread_cond_broadcast(&version_wake);
+    pthread_mutex_unlock(&version_lock);
+    for (int i = 0; i < n; i++) pthread_join(version_workers[i].tid, NULL);
+
+    pthread_mutex_lock(&version_lock);
+    version_nthreads = 0;
+    version_stopping = 0;
+    pthread_cond_broadcast(&version_space);
+    pthread_mutex_unlock(&version_lock);
+}
+
+static int info_cmp(const void *a, const void *b) {
+    return ((const version_info *)b)->number - ((const version_info *)a)->number;
+}
+
+int version_list(const char *username, const char *path, version_info *out, int max) {
+    char dir[PATH_MAX];
+    version_dir(dir, sizeof(dir), username, path);
+    DIR *d = opendir(dir);
+    if (!d) return 0;
+
+    // 先收集所有编号，排序后只取最新的 max 个
+    version_info all[VERSION_KEEP * 2];
+    int count = 0;
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL && count < (int)(sizeof(all) / sizeof(all[0]))) {
+        int kind;
+        int n = entry_number(e->d_name, &kind);
+        if (n == 0) continue;
+        all[count].number = n;
+        all[count].kind = kind;
+        count++;
+    }
+    closedir(d);
+    qsort(all, count, sizeof(all[0]), info_cmp);
+    if (count > max) count = max;
+
+    int filled = 0;
+    for (int i = 0; i < count; i++) {
+        char entry[PATH_MAX];
+        struct stat st;
+        if (entry_path(entry, sizeof(entry), dir, all[i].number, all[i].kind) < 0) continue;
+        int fd = open(entry, O_RDONLY | O_CLOEXEC);
+        if (fd == -1) continue;
+        if (fstat(fd, &st) == 0) {
+            version_info *v = &out[filled];
+            *v = all[i];
+            v->time = st.st_mtime;
+            v->size = st.st_size;
+            uint64_t be_size;
+            if (v->kind == VERSION_CHUNKS) {
+                v->size = pread(fd, &be_size, sizeof(be_size), 0) == sizeof(be_size) ? (long long)be64toh(be_size) : -1;
+            }
+            if (v->size >= 0) filled++;
+        }
+        close(fd);
+    }
+    return filled;
+}
+
+int version_restore(const char *username, const char *path, int number) {
+    char dir[PATH_MAX], entry[PATH_MAX], part[PATH_MAX + 8];
+    version_dir(dir, sizeof(dir), username, path);
+
+    int kind = VERSION_CLONE;
+    if (entry_path(entry, sizeof(entry), dir, number, kind) < 0) return -1;
+    int in = open(entry, O_RDONLY | O_CLOEXEC);
+    if (in == -1) {
+        kind = VERSION_CHUNKS;
+        if (entry_path(entry, sizeof(entry), dir, number, kind) < 0) return -1;
+        in = open(entry, O_RDONLY | O_CLOEXEC);
+    }
+    if (in == -1) return -1;
+
+    snprintf(part, sizeof(part), "%s.part", path);
+    int fd = open(part, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        log_warn("Failed to open %s: %s", part, strerror(errno));
+        close(in);
+        return -1;
+    }
+
+    int rc = -1;
+    unsigned char *manifest = NULL;
+    uint32_t count = 0;
+    long long size = 0;
+    struct stat st;
+    if (kind == VERSION_CHUNKS) {
+        manifest = read_manifest(in, &count, &size);
+        if (manifest) rc = store_assemble(username, fd, manifest, count);
+    } else if (ioctl(fd, FICLONE, in) == 0) {
+        rc = 0;
+    } else if (fstat(in, &st) == 0) {
+        rc = store_copy_range(in, 0, fd, 0, st.st_size);
+    }
+    close(in);
+    close(fd);
+    if (rc < 0 || rename(part, path) == -1) {
+        log_warn("Failed to restore version %d of %s: %s", number, path, strerror(errno));
+        unlink(part);
+        free(manifest);
+        return -1;
+    }
+
+    // 恢复出的内容记录为新版本：清单版本直接复用清单，克隆版本再克隆一次
+    if (manifest) version_commit_manifest(username, path, manifest, count, size);
+    else version_commit(username, path);
+    free(manifest);
+    return 0;
+}
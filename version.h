@@ -0,0 +1,62 @@
+#ifndef VERSION_H
+#define VERSION_H
+
+// 文件版本历史：工作空间中的文件每次写入完成后记录一个不可修改的版本，
+// 保存在 ./versions/<用户>/<路径哈希>/ 中，编号从 1 递增：
+// - 文件系统支持 reflink 时版本 <n> 是用 FICLONE 克隆出的文件，只复制元数据，与原文件共享数据块；
+// - 不支持时版本 <n>.m 是内容定义分块的清单，块写入块存储（store.c），没有变化的块已经存在，
+//   只有修改过的部分占用新的空间。
+// 写入之前还没有历史的文件先为原来的内容记录一个版本，第一次修改也可以撤销。
+// 恢复时把选中的版本写回工作空间，并作为一个新版本记录，历史只增加不改写。
+// 克隆、分块和计算哈希在后台的版本线程上进行：调用方只打开文件、把任务放进队列，
+// 同一个文件的任务由同一个线程按提交的顺序执行，版本列表在任务完成后出现新的版本。
+// 删除的清单版本引用的块由版本线程按标记清除回收：标记所有清单引用的块，清除块存储中其余的块。
+// 文件被删除（同步删除、回收站过了保留期）后它的历史不会再被查看：版本线程定期检查，文件离开
+// 工作空间超过回收站保留期加 VERSION_ORPHAN_GRACE 后删除整个版本目录，并回收它引用的块。
+
+#include <stdint.h>
+#include <time.h>
+
+#define VERSION_ROOT "./versions"
+#define VERSION_KEEP 64             // 每个文件最多保留的版本数，超过时删除最旧的版本
+#define VERSION_THREADS 2           // 版本线程数
+#define VERSION_THREADS_MAX 16
+#define VERSION_QUEUE_MAX 1024      // 队列中最多的任务数（每个任务占用一个打开的文件），满时调用方等待，
+                                    // 工作线程不等待、放弃这个版本
+#define VERSION_GC_INTERVAL 3600    // 删除旧的清单版本后回收块存储，每个用户最多每小时一次
+#define VERSION_GC_GRACE (24 * 3600) // 修改时间在这之内的块不回收（可能属于正在上传的文件）
+#define VERSION_ORPHAN_SCAN 3600   // 检查版本目录的文件是否还在工作空间中的间隔
+#define VERSION_ORPHAN_GRACE (24 * 3600) // 文件离开工作空间、回收站保留期过后，历史再保留这么久
+
+enum { VERSION_CLONE, VERSION_CHUNKS };
+
+typedef struct {
+    int number;
+    int kind;                       // VERSION_CLONE / VERSION_CHUNKS
+    long long size;
+    time_t time;
+} version_info;
+
+// trash_retention 为回收站的保留期：回收站中的文件恢复后仍然有完整的历史
+int version_start(int threads, long long trash_retention);
+void version_stop(void);  // 处理完队列中的任务后返回，之后的任务在调用方的线程上执行
+void version_no_wait(int on);  // 本线程提交任务时队列已满就放弃，不等待（工作线程的事件循环）
+
+// path 为工作空间中的文件路径（./workspaces/<用户>/<项目>/<相对路径>），同时是版本历史的键
+
+// 文件存在但还没有历史时，为当前内容记录一个版本
+void version_baseline(const char *username, const char *path);
+// 为当前内容记录一个新版本
+void version_commit(const char *username, const char *path);
+// 内容已经按清单保存在块存储中（去重上传）：直接把清单（复制一份）记录为新版本，不再读取文件
+void version_commit_manifest(const char *username, const char *path, const unsigned char *manifest,
+                             uint32_t count, long long size);
+// 用 part 替换 path，替换前后各记录一个版本；返回 rename 的结果
+int version_replace(const char *username, const char *part, const char *path);
+
+// 按版本号从新到旧列出最多 max 个版本，返回个数
+int version_list(const char *username, const char *path, version_info *out, int max);
+// 把版本 number 写回 path 并记录为新版本，成功返回 0，失败返回 -1
+int version_restore(const char *username, const char *path, int number);
+
+#endif
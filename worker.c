@@ -0,0 +1,454 @@
+#include "worker.h"
+#include "version.h"
+#include <sys/eventfd.h>
+
+static worker_t *workers = NULL;
+static int worker_count = 0;
+static unsigned int next_worker = 0;  // 轮询分发游标
+
+#define WORKER_RING_EVENT ((void *)1)  // epoll 中 io_uring 完成通知的标记
+#define WORKER_DONE_EVENT ((void *)2)  // epoll 中认证任务、后台文件任务完成通知的标记
+#define WORKER_CMD_TAG ((uintptr_t)1)  // 会话指针的最低位置 1：远程命令输出管道的事件
+
+// 默认工作线程数：CPU 核数
+int worker_default_count(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+}
+
+// 根据输出缓冲区是否有待发送数据，调整关注的事件
+static void worker_update_events(worker_t *w, session *s) {
+    struct epoll_event ev;
+    ev.events = session_want_read(s) ? EPOLLIN | EPOLLRDHUP : 0;  // 正在关闭或下载的会话只等待输出发送完毕
+    if (session_want_write(s)) ev.events |= EPOLLOUT;
+    ev.data.ptr = s;
+    epoll_ctl(w->epfd, EPOLL_CTL_MOD, s->fd, &ev);
+
+    // 远程命令的输出管道：输出队列积压时移出 epoll（命令退出后管道的 EPOLLHUP 总会报告），发送出去后再加入
+    if (s->cmd_fd != -1) {
+        int want = session_want_command(s);
+        if (want && !s->cmd_watched) {
+            struct epoll_event cev;
+            cev.events = EPOLLIN;
+            cev.data.ptr = (void *)((uintptr_t)s | WORKER_CMD_TAG);
+            if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, s->cmd_fd, &cev) == 0) s->cmd_watched = 1;
+            else log_warn("Failed to watch command output: %s", strerror(errno));
+        } else if (!want && s->cmd_watched) {
+            epoll_ctl(w->epfd, EPOLL_CTL_DEL, s->cmd_fd, NULL);
+            s->cmd_watched = 0;
+        }
+    }
+
+    // 限速暂停的会话不关注读写事件，放进暂停列表，到恢复时间后由 worker_run_throttled 推进
+    if (s->throttle_until != 0 && !s->throttle_listed) {
+        s->throttle_listed = 1;
+        s->throttle_next = w->throttled;
+        w->throttled = s;
+    }
+}
+
+// 关闭连接：从 epoll 和各个列表中移除，放进 dead 列表，等这一批事件处理完后由 worker_release_dead 释放。
+// 同一批事件中排在后面的该会话的事件（EPOLLHUP / EPOLLERR 在不关注任何事件时也会报告）
+// 和 io_uring 完成事件看到 detached 后跳过
+static void worker_close_conn(worker_t *w, session *s) {
+    if (s->detached) return;
+    log_info("Client %d disconnected (worker %d)", s->fd, w->id);
+    epoll_ctl(w->epfd, EPOLL_CTL_DEL, s->fd, NULL);
+
+    if (s->prev) s->prev->next = s->next;
+    else w->conns = s->next;
+    if (s->next) s->next->prev = s->prev;
+    w->conn_count--;
+    if (s->throttle_listed) {
+        for (session **pp = &w->throttled; *pp; pp = &(*pp)->throttle_next) {
+            if (*pp == s) {
+                *pp = s->throttle_next;
+                break;
+            }
+        }
+    }
+    s->detached = 1;
+    s->next = w->dead;
+    w->dead = s;
+}
+
+// 释放本轮关闭的会话；还有 io_uring 请求未完成的会话先关闭 socket，移到 zombies 列表等待完成
+static void worker_release_dead(worker_t *w) {
+    while (w->dead) {
+        session *s = w->dead;
+        w->dead = s->next;
+        if (s->ring_inflight == 0) {
+            session_destroy(s);
+            continue;
+        }
+        session_destroy(s);
+        s->prev = NULL;
+        s->next = w->zombies;
+        if (w->zombies) w->zombies->prev = s;
+        w->zombies = s;
+    }
+}
+
+// 接管主线程投递过来的连接
+static void worker_add_conn(worker_t *w, int client_fd) {
+    session *s = session_create(client_fd);
+    if (!s) {
+        close(client_fd);
+        return;
+    }
+    s->ring = w->ring;
+    s->worker = w;
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    ev.data.ptr = s;
+    if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, client_fd, &ev) == -1) {
+        log_warn("Failed to watch client %d: %s", client_fd, strerror(errno));
+        session_destroy(s);
+        return;
+    }
+
+    s->prev = NULL;
+    s->next = w->conns;
+    if (w->conns) w->conns->prev = s;
+    w->conns = s;
+    w->conn_count++;
+
+    session_start(s);
+    if (session_on_writable(s) < 0) {
+        worker_close_conn(w, s);
+        return;
+    }
+    worker_update_events(w, s);
+}
+
+// 读取管道中投递的所有新连接
+static void worker_drain_pipe(worker_t *w) {
+    int fds[64];
+    ssize_t n;
+    while ((n = read(w->pipe_fds[0], fds, sizeof(fds))) > 0) {
+        for (int i = 0; i < n / (ssize_t)sizeof(int); i++) {
+            worker_add_conn(w, fds[i]);
+        }
+    }
+}
+
+// 处理一个 io_uring 完成事件
+static void worker_on_cqe(uring_t *r, struct io_uring_cqe *cqe, void *arg) {
+    worker_t *w = arg;
+    (void)r;
+    session *s = (session *)(uintptr_t)(cqe->user_data & ~RING_TAG_MASK);
+    if (s->ring_zombie) {
+        // 之前关闭的会话：最后一个请求完成时释放。它已经不在 epoll 中，这一批事件里没有它的事件
+        if (--s->ring_inflight > 0) return;
+        if (s->prev) s->prev->next = s->next;
+        else w->zombies = s->next;
+        if (s->next) s->next->prev = s->prev;
+        session_destroy(s);
+        return;
+    }
+    if (s->detached) {
+        s->ring_inflight--;  // 本轮刚关闭，由 worker_release_dead 释放
+        return;
+    }
+    int rc = session_on_uring(s, cqe->user_data, cqe->res);
+    if (rc < 0) {
+        worker_close_conn(w, s);
+    } else if (s->ring_inflight == 0) {
+        worker_update_events(w, s);
+    }
+}
+
+static void worker_wake(worker_t *w) {
+    uint64_t one = 1;
+    if (write(w->done_fd, &one, sizeof(one)) != sizeof(one)) log_warn("Failed to wake worker %d: %s", w->id, strerror(errno));
+}
+
+// 认证线程调用：把完成的任务交回提交它的会话所在的工作线程
+void worker_auth_done(auth_job *job) {
+    worker_t *w = job->worker;
+    pthread_mutex_lock(&w->done_lock);
+    job->next = w->auth_done;
+    w->auth_done = job;
+    pthread_mutex_unlock(&w->done_lock);
+    worker_wake(w);
+}
+
+// 后台文件线程调用，同上
+void worker_offload_done(offload_job *job) {
+    worker_t *w = job->worker;
+    pthread_mutex_lock(&w->done_lock);
+    job->next = w->offload_done;
+    w->offload_done = job;
+    pthread_mutex_unlock(&w->done_lock);
+    worker_wake(w);
+}
+
+// 取出交回的任务：继续对应会话的登录或注册，或交给后台文件任务的完成回调
+static void worker_on_done(worker_t *w) {
+    uint64_t n;
+    if (read(w->done_fd, &n, sizeof(n)) != sizeof(n)) return;
+    pthread_mutex_lock(&w->done_lock);
+    auth_job *list = w->auth_done;
+    offload_job *jobs = w->offload_done;
+    w->auth_done = NULL;
+    w->offload_done = NULL;
+    pthread_mutex_unlock(&w->done_lock);
+
+    while (list) {
+        auth_job *job = list;
+        list = job->next;
+        session *s = job->owner;
+        if (s && s->detached) {
+            s->auth_job = NULL;  // 本轮已经关闭，任务在这里释放
+        } else if (s) {
+            if (session_on_auth(s, job) < 0) worker_close_conn(w, s);
+            else worker_update_events(w, s);
+        }
+        auth_job_free(job);
+    }
+    while (jobs) {
+        offload_job *job = jobs;
+        jobs = job->next;
+        session *s = job->owner;
+        if (s && s->detached) {
+            session_offload_forget(s, job);
+            s = NULL;
+        }
+        if (!s) {
+            job->done(job, NULL);
+        } else if (session_on_offload(s, job) < 0) {
+            worker_close_conn(w, s);
+        } else {
+            worker_update_events(w, s);
+        }
+    }
+}
+
+// 推进到达恢复时间的限速会话，返回距离下一个恢复时间的毫秒数，没有暂停的会话时返回 timeout
+static int worker_run_throttled(worker_t *w, int timeout) {
+    session *list = w->throttled;
+    w->throttled = NULL;
+    long long now = shape_now();
+
+    while (list) {
+        session *s = list;
+        list = s->throttle_next;
+        if (s->throttle_until > now) {
+            s->throttle_next = w->throttled;
+            w->throttled = s;
+            int ms = (int)((s->throttle_until - now + 999999) / 1000000);
+            if (ms < timeout) timeout = ms;
+            continue;
+        }
+
+        s->throttle_listed = 0;
+        s->throttle_until = 0;
+        if (session_on_readable(s) < 0) {  // 先接收，最后发送输出队列
+            worker_close_conn(w, s);
+            continue;
+        }
+        if (s->ring_inflight == 0) worker_update_events(w, s);
+        if (s->throttle_listed && s->throttle_until - now < (long long)timeout * 1000000) {
+            timeout = (int)((s->throttle_until - now + 999999) / 1000000);
+        }
+    }
+    return timeout;
+}
+
+// 远程命令的输出管道可读或命令已经退出
+static void worker_on_command(worker_t *w, session *s) {
+    if (session_on_command(s) < 0) worker_close_conn(w, s);
+    else worker_update_events(w, s);
+}
+
+static void worker_handle_event(worker_t *w, session *s, uint32_t e) {
+    int rc = 0;
+    if (e & EPOLLOUT) rc = session_on_writable(s);
+    if (rc == 0 && (e & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP))) rc = session_on_readable(s);
+    if (rc < 0) {
+        worker_close_conn(w, s);
+    } else {
+        worker_update_events(w, s);
+    }
+}
+
+static void *worker_main(void *arg) {
+    worker_t *w = arg;
+    struct epoll_event events[MAX_EVENTS];
+    db_async_writes(1);  // 事件循环中的检查点、同步清单和活动记录不等待数据库提交
+    version_no_wait(1);  // 版本队列满时也不等待
+
+    while (!server_shutdown) {
+        int timeout = worker_run_throttled(w, 1000);
+
+        // 本轮事件处理中产生的 io_uring 请求在这里一次提交
+        if (w->ring) uring_submit(w->ring);
+
+        int nfds = epoll_wait(w->epfd, events, MAX_EVENTS, timeout);
+        if (nfds == -1) {
+            if (errno == EINTR) continue;
+            log_error("epoll_wait failed on worker %d: %s", w->id, strerror(errno));
+            break;
+        }
+
+        // 先处理菜单等交互会话的事件，再处理批量传输和 io_uring 完成事件，
+        // 交互请求的回复不排在同一轮的大块收发后面
+        for (int i = 0; i < nfds; i++) {
+            void *p = events[i].data.ptr;
+            if (p == NULL) {
+                worker_drain_pipe(w);
+            } else if (p == WORKER_DONE_EVENT) {
+                worker_on_done(w);
+            } else if (p == WORKER_RING_EVENT) {
+                continue;
+            } else if ((uintptr_t)p & WORKER_CMD_TAG) {
+                session *s = (session *)((uintptr_t)p & ~WORKER_CMD_TAG);
+                if (!s->detached) worker_on_command(w, s);
+            } else if (!((session *)p)->detached && session_is_bulk(p)) {
+                continue;
+            } else if (!((session *)p)->detached) {
+                worker_handle_event(w, p, events[i].events);
+            }
+            events[i].data.ptr = NULL;
+            events[i].events = 0;
+        }
+        for (int i = 0; i < nfds; i++) {
+            void *p = events[i].data.ptr;
+            if (p == WORKER_RING_EVENT) {
+                uring_for_each_cqe(w->ring, worker_on_cqe, w);
+            } else if (events[i].events != 0 && !((session *)p)->detached) {
+                worker_handle_event(w, p, events[i].events);
+            }
+        }
+        worker_release_dead(w);
+    }
+
+    while (w->conns) {
+        worker_close_conn(w, w->conns);
+    }
+    worker_release_dead(w);
+    // 不会再处理完成事件：请求只使用 io_uring 自己的注册缓冲区，会话的内存可以直接释放，
+    // 注册缓冲区和文件表随 worker_pool_stop 中的 uring_exit 一起释放
+    while (w->zombies) {
+        session *s = w->zombies;
+        w->zombies = s->next;
+        s->ring_inflight = 0;
+        session_destroy(s);
+    }
+    pool_thread_exit();
+    return NULL;
+}
+
+// 为工作线程创建 io_uring，完成通知通过 eventfd 进入该线程的 epoll
+static void worker_ring_start(worker_t *w) {
+    uring_t *r = calloc(1, sizeof(uring_t));
+    if (!r) return;
+    if (uring_init(r) < 0) {
+        if (w->id == 0) log_warn("io_uring unavailable (%s), falling back to epoll", strerror(errno));
+        free(r);
+        return;
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = WORKER_RING_EVENT;
+    if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, r->event_fd, &ev) == -1) {
+        log_warn("Failed to watch io_uring completions: %s", strerror(errno));
+        uring_exit(r);
+        free(r);
+        return;
+    }
+    w->ring = r;
+}
+
+// 启动工作线程池；use_uring 为真时每个线程另外创建 io_uring 传输引擎，失败时回退到 epoll
+int worker_pool_start(int nworkers, int use_uring) {
+    workers = calloc(nworkers, sizeof(worker_t));
+    if (!workers) return -1;
+
+    for (int i = 0; i < nworkers; i++) {
+        worker_t *w = &workers[i];
+        w->id = i;
+        w->epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (w->epfd == -1) {
+            perror("epoll_create1");
+            return -1;
+        }
+        if (pipe2(w->pipe_fds, O_NONBLOCK | O_CLOEXEC) == -1) {
+            perror("pipe2");
+            return -1;
+        }
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;  // NULL 表示投递管道
+        if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->pipe_fds[0], &ev) == -1) {
+            perror("epoll_ctl");
+            return -1;
+        }
+        w->done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (w->done_fd == -1) {
+            perror("eventfd");
+            return -1;
+        }
+        pthread_mutex_init(&w->done_lock, NULL);
+        ev.events = EPOLLIN;
+        ev.data.ptr = WORKER_DONE_EVENT;
+        if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->done_fd, &ev) == -1) {
+            perror("epoll_ctl");
+            return -1;
+        }
+        if (use_uring) worker_ring_start(w);
+
+        if (pthread_create(&w->tid, NULL, worker_main, w) != 0) {
+            perror("pthread_create worker");
+            return -1;
+        }
+        worker_count++;
+    }
+
+    log_info("Started %d worker threads (%s)", worker_count,
+           workers[0].ring ? "io_uring transfers" : "epoll");
+    return 0;
+}
+
+// 轮询地把新连接交给某个工作线程
+int worker_pool_dispatch(int client_fd) {
+    if (worker_count == 0) return -1;
+    worker_t *w = &workers[next_worker++ % worker_count];
+    if (write(w->pipe_fds[1], &client_fd, sizeof(client_fd)) != sizeof(client_fd)) {
+        perror("dispatch");
+        return -1;
+    }
+    return 0;
+}
+
+// 等待所有工作线程退出并释放资源
+void worker_pool_stop(void) {
+    for (int i = 0; i < worker_count; i++) {
+        pthread_join(workers[i].tid, NULL);
+        close(workers[i].epfd);
+        close(workers[i].pipe_fds[0]);
+        close(workers[i].pipe_fds[1]);
+        close(workers[i].done_fd);
+        // 工作线程退出前没有取走的任务，对应的会话已经关闭
+        while (workers[i].auth_done) {
+            auth_job *job = workers[i].auth_done;
+            workers[i].auth_done = job->next;
+            auth_job_free(job);
+        }
+        while (workers[i].offload_done) {
+            offload_job *job = workers[i].offload_done;
+            workers[i].offload_done = job->next;
+            job->done(job, NULL);
+        }
+        if (workers[i].ring) {
+            uring_exit(workers[i].ring);
+            free(workers[i].ring);
+        }
+    }
+    free(workers);
+    workers = NULL;
+    worker_count = 0;
+}
@@ -0,0 +1,35 @@
+#ifndef WORKER_H
+#define WORKER_H
+
+#include "session.h"
+#include <pthread.h>
+#include <signal.h>
+
+extern volatile sig_atomic_t server_shutdown;
+
+// 工作线程：每个线程拥有独立的 epoll 实例
+typedef struct worker {
+    int id;
+    int epfd;
+    int pipe_fds[2];      // 主线程通过管道投递新连接的 fd
+    pthread_t tid;
+    int conn_count;
+    session *conns;       // 本线程管理的会话链表
+    session *throttled;   // 限速暂停、等待恢复时间的会话
+    session *dead;        // 本轮关闭的会话：同一批事件中可能还有它们的事件，处理完这一批后再释放
+    session *zombies;     // 已经关闭、还有 io_uring 请求未完成的会话，最后一个请求完成时释放
+    uring_t *ring;        // 启用 io_uring 时的传输引擎，NULL 表示只用 epoll
+    int done_fd;          // eventfd：认证线程或后台文件线程交回了完成的任务
+    pthread_mutex_t done_lock;
+    auth_job *auth_done;  // 已完成、等待交回会话的认证任务
+    offload_job *offload_done;  // 已完成、等待交回会话的后台文件任务
+} worker_t;
+
+int worker_default_count(void);
+int worker_pool_start(int nworkers, int use_uring);
+int worker_pool_dispatch(int client_fd);
+void worker_auth_done(auth_job *job);
+void worker_offload_done(offload_job *job);
+void worker_pool_stop(void);
+
+#endif
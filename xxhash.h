@@ -0,0 +1,138 @@
+#ifndef XXHASH_H
+#define XXHASH_H
+
+// XXH64：项目同步清单中的快速内容哈希，只用于判断文件是否变化，不用于校验完整性
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#define XXH_P1 0x9E3779B185EBCA87ULL
+#define XXH_P2 0xC2B2AE3D27D4EB4FULL
+#define XXH_P3 0x165667B19E3779F9ULL
+#define XXH_P4 0x85EBCA77C2B2AE63ULL
+#define XXH_P5 0x27D4EB2F165667C5ULL
+
+typedef struct {
+    uint64_t total;
+    uint64_t v[4];
+    unsigned char mem[32];  // 不足 32 字节的尾部
+    size_t mem_len;
+} xxh64_state;
+
+static inline uint64_t xxh_rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t xxh_read64(const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;  // 按小端解释，与参考实现在 x86 / ARM 上的结果一致
+}
+
+static inline uint64_t xxh_round(uint64_t acc, uint64_t input) {
+    acc += input * XXH_P2;
+    acc = xxh_rotl(acc, 31);
+    return acc * XXH_P1;
+}
+
+static inline uint64_t xxh_merge(uint64_t acc, uint64_t val) {
+    acc ^= xxh_round(0, val);
+    return acc * XXH_P1 + XXH_P4;
+}
+
+static inline void xxh64_init(xxh64_state *st) {
+    memset(st, 0, sizeof(*st));
+    st->v[0] = XXH_P1 + XXH_P2;
+    st->v[1] = XXH_P2;
+    st->v[2] = 0;
+    st->v[3] = -XXH_P1;
+}
+
+static inline void xxh64_update(xxh64_state *st, const void *data, size_t len) {
+    const unsigned char *p = data;
+    st->total += len;
+    if (st->mem_len + len < 32) {
+        memcpy(st->mem + st->mem_len, p, len);
+        st->mem_len += len;
+        return;
+    }
+    if (st->mem_len > 0) {
+        size_t fill = 32 - st->mem_len;
+        memcpy(st->mem + st->mem_len, p, fill);
+        for (int i = 0; i < 4; i++) st->v[i] = xxh_round(st->v[i], xxh_read64(st->mem + 8 * i));
+        p += fill;
+        len -= fill;
+        st->mem_len = 0;
+    }
+    while (len >= 32) {
+        for (int i = 0; i < 4; i++) st->v[i] = xxh_round(st->v[i], xxh_read64(p + 8 * i));
+        p += 32;
+        len -= 32;
+    }
+    memcpy(st->mem, p, len);
+    st->mem_len = len;
+}
+
+static inline uint64_t xxh64_digest(const xxh64_state *st) {
+    uint64_t h;
+    if (st->total >= 32) {
+        h = xxh_rotl(st->v[0], 1) + xxh_rotl(st->v[1], 7) + xxh_rotl(st->v[2], 12) + xxh_rotl(st->v[3], 18);
+        for (int i = 0; i < 4; i++) h = xxh_merge(h, st->v[i]);
+    } else {
+        h = st->v[2] + XXH_P5;
+    }
+    h += st->total;
+
+    const unsigned char *p = st->mem;
+    size_t len = st->mem_len;
+    for (; len >= 8; p += 8, len -= 8) {
+        h ^= xxh_round(0, xxh_read64(p));
+        h = xxh_rotl(h, 27) * XXH_P1 + XXH_P4;
+    }
+    if (len >= 4) {
+        uint32_t k;
+        memcpy(&k, p, 4);
+        h ^= (uint64_t)k * XXH_P1;
+        h = xxh_rotl(h, 23) * XXH_P2 + XXH_P3;
+        p += 4;
+        len -= 4;
+    }
+    for (; len > 0; p++, len--) {
+        h ^= *p * XXH_P5;
+        h = xxh_rotl(h, 11) * XXH_P1;
+    }
+
+    h ^= h >> 33;
+    h *= XXH_P2;
+    h ^= h >> 29;
+    h *= XXH_P3;
+    h ^= h >> 32;
+    return h;
+}
+
+static inline uint64_t xxh64(const void *data, size_t len) {
+    xxh64_state st;
+    xxh64_init(&st);
+    xxh64_update(&st, data, len);
+    return xxh64_digest(&st);
+}
+
+// 计算整个文件的哈希，读取失败时返回 -1
+static inline int xxh64_file(int fd, uint64_t *hash) {
+    unsigned char buf[64 * 1024];
+    xxh64_state st;
+    off_t off = 0;
+    xxh64_init(&st);
+    for (;;) {
+        ssize_t n = pread(fd, buf, sizeof(buf), off);
+        if (n == 0) break;
+        if (n < 0) return -1;
+        xxh64_update(&st, buf, n);
+        off += n;
+    }
+    *hash = xxh64_digest(&st);
+    return 0;
+}
+
+#endif